@@ -0,0 +1,42 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef BENCHMARK_BENCHMARKS_HPP
+#define BENCHMARK_BENCHMARKS_HPP
+
+namespace benchmark {
+
+// each benchmark gets arguments following its name on the command line.
+// returns process exit code
+
+// parks many coroutines on a channel, reports RSS. Args: [COROUTINES] [fixed|lazy]
+int parked(int argc, char** argv);
+
+// spawns many trivial coroutines in batches, reports heap allocations and time per go(). Args: [COROUTINES] [BATCH]
+int spawn(int argc, char** argv);
+
+// fork-join tree of cpu-bound tasks run on 1..N threads, reports time and speedup. Args: [MAX_THREADS] [DEPTH] [ITERATIONS]
+int scaling(int argc, char** argv);
+
+// many reader/writer pairs exchanging messages, like test_muchos_coros. Reports wakeups per message and idle spinning.
+// Args: [PAIRS] [MSGS] [THREADS] [CAPACITY]
+int messages(int argc, char** argv);
+
+// two coroutines exchanging a message over capacity-1 channels, reports round trip latency. Args: [ROUNDTRIPS] [THREADS]
+int pingpong(int argc, char** argv);
+
+// SPSC, MPSC and MPMC transfer through locking_channel and lock_free_channel. Args: [MSGS] [THREADS] [CAPACITY]
+int channels(int argc, char** argv);
+
+// timer wheel operations, sleep_for lateness and the cost of a timeout on channel get. Args: [TIMERS] [COROUTINES] [THREADS]
+int timers(int argc, char** argv);
+
+// keep-alive HTTP server on coroutines_io, loaded by blocking client threads. Reports requests/s and latency.
+// Args: [CONNECTIONS] [SECONDS] [THREADS] [SHARDS] [epoll|uring]
+int http(int argc, char** argv);
+
+// large file served over loopback, copied through user memory vs send_file. Reports MB/s.
+// Args: [FILE_MB] [SECONDS] [CONNECTIONS] [THREADS] [epoll|uring]
+int files(int argc, char** argv);
+
+}
+
+#endif
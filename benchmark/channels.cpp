@@ -0,0 +1,93 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+// 'producers' coroutines put 'msgs' messages in total through a single channel, 'consumers' coroutines take them out.
+// Returns time in ms
+template<typename channel_type>
+static double transfer(unsigned producers, unsigned consumers, unsigned msgs, unsigned threads, unsigned capacity)
+{
+    typedef channel_pair<int, channel_type> pair_type;
+
+    scheduler sched(threads);
+    set_scheduler(&sched);
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        pair_type pair = make_channel<int, channel_type>(capacity, "benchmark");
+
+        unsigned per_producer = msgs / producers;
+        for(unsigned i = 0; i < producers; i++)
+        {
+            go("producer", [per_producer](typename pair_type::writer_type writer)
+            {
+                for(unsigned i = 0; i < per_producer; i++)
+                    writer.put(i);
+            }, pair.writer);
+        }
+
+        for(unsigned i = 0; i < consumers; i++)
+        {
+            go("consumer", [](typename pair_type::reader_type reader)
+            {
+                try
+                {
+                    for(;;)
+                        reader.get();
+                }
+                catch(const channel_closed&)
+                {
+                }
+            }, pair.reader);
+        }
+    }
+
+    sched.wait();
+    auto wall = std::chrono::steady_clock::now() - start;
+
+    set_scheduler(nullptr);
+
+    return wall / std::chrono::microseconds(1) / 1000.0;
+}
+
+int channels(int argc, char** argv)
+{
+    unsigned msgs = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1000000;
+    unsigned threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    unsigned capacity = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+
+    std::cout << msgs << " messages, " << threads << " threads, channel capacity " << capacity << std::endl;
+    std::cout << "         locking [ms]  lock-free [ms]  speedup" << std::endl;
+
+    struct { const char* name; unsigned producers; unsigned consumers; } cases[] = {
+        { "SPSC", 1, 1 },
+        { "MPSC", 4, 1 },
+        { "MPMC", 4, 4 },
+    };
+
+    for(auto& c : cases)
+    {
+        double locking = transfer<locking_channel<int>>(c.producers, c.consumers, msgs, threads, capacity);
+        double lock_free = transfer<lock_free_channel<int>>(c.producers, c.consumers, msgs, threads, capacity);
+
+        std::cout << std::setw(4) << c.name << " "
+            << std::setw(16) << locking << " "
+            << std::setw(15) << lock_free << " "
+            << std::setw(8) << locking / lock_free << std::endl;
+    }
+
+    return 0;
+}
+
+}
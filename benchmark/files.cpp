@@ -0,0 +1,193 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/tcp_acceptor.hpp"
+#include "coroutines_io/file.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+static const unsigned short PORT = 22447;
+
+// every byte received from the client is a request for the whole file
+static void serve_file(tcp_socket& sock, file& f, std::size_t size, bool zero_copy)
+{
+    std::vector<char> buf(64*1024);
+    try
+    {
+        for(;;)
+        {
+            char request;
+            if (sock.read_some(&request, 1) == 0)
+                return;
+
+            if (zero_copy)
+            {
+                sock.send_file(f, 0, size);
+            }
+            else
+            {
+                for(std::size_t offset = 0; offset < size;)
+                {
+                    std::size_t r = f.pread(buf.data(), std::min(buf.size(), size - offset), offset);
+                    if (r == 0)
+                        break;
+                    sock.write(buf.data(), r);
+                    offset += r;
+                }
+            }
+        }
+    }
+    catch(const std::exception&)
+    {
+    }
+}
+
+// blocking client, one file in flight
+static void download(unsigned seconds, std::size_t size, std::atomic<std::uint64_t>& bytes)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "connect: " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return;
+    }
+
+    std::vector<char> buf(256*1024);
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while(std::chrono::steady_clock::now() < end)
+    {
+        if (::write(fd, "G", 1) != 1)
+            break;
+        std::size_t received = 0;
+        while(received < size)
+        {
+            ssize_t r = ::read(fd, buf.data(), buf.size());
+            if (r <= 0)
+                break;
+            received += r;
+        }
+        bytes.fetch_add(received, std::memory_order_relaxed);
+        if (received < size)
+            break;
+    }
+    ::close(fd);
+}
+
+static double run(const std::string& path, std::size_t size, unsigned seconds, unsigned connections, unsigned threads, io_backend backend, bool zero_copy)
+{
+    scheduler sched(threads);
+    io_scheduler io_sched(sched, 1, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::atomic<bool> listening(false);
+    go("acceptor", [&]()
+    {
+        file f;
+        f.open_for_reading(path);
+
+        tcp_acceptor acceptor;
+        acceptor.listen(tcp_acceptor::endpoint_type(boost::asio::ip::address_v4::loopback(), PORT));
+        listening = true;
+
+        // the file outlives the connections, they're waited for here
+        auto done = make_channel<int>(connections);
+        for(unsigned i = 0; i < connections; i++)
+        {
+            go("connection", [&f, size, zero_copy](tcp_socket& s, channel_writer<int>& done)
+            {
+                serve_file(s, f, size, zero_copy);
+                done.put(0);
+            }, acceptor.accept(), done.writer);
+        }
+        for(unsigned i = 0; i < connections; i++)
+            done.reader.get();
+    });
+
+    // clients are plain threads, outside of the scheduler
+    std::atomic<std::uint64_t> bytes(0);
+    std::vector<std::thread> clients;
+    while(!listening)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < connections; i++)
+    {
+        clients.emplace_back(download, seconds, size, std::ref(bytes));
+    }
+    for(std::thread& t : clients)
+    {
+        t.join();
+    }
+    auto wall = std::chrono::steady_clock::now() - start;
+
+    sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+
+    return bytes.load() / (1024.0*1024.0) / (double(wall / std::chrono::milliseconds(1)) / 1000);
+}
+
+int files(int argc, char** argv)
+{
+    unsigned megabytes = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    unsigned seconds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 3;
+    unsigned connections = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+    unsigned threads = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+    io_backend backend = argc > 4 && std::string(argv[4]) == "uring" ? io_backend::uring : io_backend::epoll;
+
+    std::cout << megabytes << " MB file, " << seconds << " s, " << connections << " connections, " << threads << " threads, "
+        << (backend == io_backend::uring ? "io_uring" : "epoll") << std::endl;
+
+    // in the page cache after being written, the disk is not measured
+    std::string path = "/tmp/coroutines_benchmark_file_" + std::to_string(::getpid());
+    std::size_t size = std::size_t(megabytes) * 1024 * 1024;
+    {
+        std::ofstream out(path, std::ios::binary);
+        std::vector<char> block(1024*1024);
+        for(std::size_t i = 0; i < block.size(); i++)
+            block[i] = char(i * 7);
+        for(unsigned i = 0; i < megabytes; i++)
+            out.write(block.data(), block.size());
+    }
+
+    double copy = run(path, size, seconds, connections, threads, backend, false);
+    std::cout << "   pread+write: " << copy << " MB/s" << std::endl;
+    double zero_copy = run(path, size, seconds, connections, threads, backend, true);
+    std::cout << "     send_file: " << zero_copy << " MB/s" << std::endl;
+
+    ::unlink(path.c_str());
+    return 0;
+}
+
+}
@@ -0,0 +1,193 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/tcp_acceptor.hpp"
+#include "coroutines_io/buffer_chain.hpp"
+#include "coroutines_io/input_buffer.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+static const unsigned short PORT = 22446;
+
+static const std::string REQUEST =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// what http_test's handler sends
+static const std::string RESPONSE =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 14\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n"
+    "hello, world!\n";
+
+// keep-alive connection: answers every request (terminated by an empty line) with the fixed response
+static void serve(tcp_socket& sock)
+{
+    static const std::string END = "\r\n\r\n";
+    coroutines_io::input_buffer requests;
+    coroutines_io::buffer_chain responses;
+    try
+    {
+        while(requests.fill(sock) > 0)
+        {
+            // responses to pipelined requests leave together
+            for(std::size_t found; (found = requests.find(END)) != coroutines_io::input_buffer::npos; requests.consume(found + END.size()))
+            {
+                responses.append(RESPONSE);
+            }
+            if (!responses.empty())
+            {
+                sock.write_v(responses);
+                responses.clear();
+            }
+        }
+    }
+    catch(const std::exception&)
+    {
+    }
+}
+
+// blocking client, one request in flight
+static void load(unsigned seconds, std::atomic<std::uint64_t>& requests, std::vector<std::uint32_t>& latencies_us)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "connect: " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return;
+    }
+
+    char buf[4096];
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    for(auto now = std::chrono::steady_clock::now(); now < end;)
+    {
+        if (::write(fd, REQUEST.data(), REQUEST.size()) != ssize_t(REQUEST.size()))
+            break;
+        std::size_t received = 0;
+        while(received < RESPONSE.size())
+        {
+            ssize_t r = ::read(fd, buf, sizeof(buf));
+            if (r <= 0)
+                break;
+            received += r;
+        }
+        if (received < RESPONSE.size())
+            break;
+
+        auto done = std::chrono::steady_clock::now();
+        latencies_us.push_back((done - now) / std::chrono::microseconds(1));
+        requests.fetch_add(1, std::memory_order_relaxed);
+        now = done;
+    }
+    ::close(fd);
+}
+
+int http(int argc, char** argv)
+{
+    unsigned connections = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 16;
+    unsigned seconds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 5;
+    unsigned threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+    unsigned shards = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1;
+    io_backend backend = argc > 4 && std::string(argv[4]) == "uring" ? io_backend::uring : io_backend::epoll;
+
+    std::cout << connections << " keep-alive connections, " << seconds << " s, " << threads << " threads, ";
+    if (backend == io_backend::uring)
+        std::cout << "io_uring" << std::endl;
+    else
+        std::cout << shards << " epoll shards" << std::endl;
+
+    scheduler sched(threads);
+    io_scheduler io_sched(sched, shards, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::atomic<bool> listening(false);
+    go("acceptor", [connections, &listening]()
+    {
+        tcp_acceptor acceptor;
+        acceptor.listen(tcp_acceptor::endpoint_type(boost::asio::ip::address_v4::loopback(), PORT));
+        listening = true;
+
+        for(unsigned i = 0; i < connections; i++)
+        {
+            go("connection", [](tcp_socket& s) { serve(s); }, acceptor.accept());
+        }
+    });
+
+    // load generator runs on plain threads, outside of the scheduler
+    std::atomic<std::uint64_t> requests(0);
+    std::vector<std::vector<std::uint32_t>> latencies(connections);
+    std::vector<std::thread> clients;
+    while(!listening)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < connections; i++)
+    {
+        clients.emplace_back(load, seconds, std::ref(requests), std::ref(latencies[i]));
+    }
+    for(std::thread& t : clients)
+    {
+        t.join();
+    }
+    auto wall = std::chrono::steady_clock::now() - start;
+
+    sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+
+    std::vector<std::uint32_t> all;
+    for(const std::vector<std::uint32_t>& l : latencies)
+    {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all.empty() ? 0 : all[std::size_t(p * (all.size() - 1))]; };
+
+    std::cout << "  requests: " << requests.load() << std::endl;
+    std::cout << "      rate: " << requests.load() / (double(wall / std::chrono::milliseconds(1)) / 1000) << " req/s" << std::endl;
+    std::cout << "       p50: " << percentile(0.5) << " us" << std::endl;
+    std::cout << "       p99: " << percentile(0.99) << " us" << std::endl;
+    std::cout << "      p999: " << percentile(0.999) << " us" << std::endl;
+
+    return 0;
+}
+
+}
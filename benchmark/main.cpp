@@ -0,0 +1,49 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include <iostream>
+#include <cstring>
+
+struct benchmark_entry
+{
+    const char* name;
+    const char* args;
+    int (*function)(int argc, char** argv);
+};
+
+static const benchmark_entry BENCHMARKS[] = {
+    { "parked", "[COROUTINES] [fixed|lazy]", benchmark::parked },
+    { "spawn", "[COROUTINES] [BATCH]", benchmark::spawn },
+    { "scaling", "[MAX_THREADS] [DEPTH] [ITERATIONS]", benchmark::scaling },
+    { "messages", "[PAIRS] [MSGS] [THREADS] [CAPACITY]", benchmark::messages },
+    { "pingpong", "[ROUNDTRIPS] [THREADS]", benchmark::pingpong },
+    { "channels", "[MSGS] [THREADS] [CAPACITY]", benchmark::channels },
+    { "timers", "[TIMERS] [COROUTINES] [THREADS]", benchmark::timers },
+    { "http", "[CONNECTIONS] [SECONDS] [THREADS] [SHARDS] [epoll|uring]", benchmark::http },
+    { "files", "[FILE_MB] [SECONDS] [CONNECTIONS] [THREADS] [epoll|uring]", benchmark::files },
+};
+
+// benchmark runner
+// invocation: benchmark NAME [ARGS...]
+int main(int argc, char** argv)
+{
+    if (argc >= 2)
+    {
+        for(const benchmark_entry& b : BENCHMARKS)
+        {
+            if (std::strcmp(argv[1], b.name) == 0)
+            {
+                return b.function(argc - 2, argv + 2);
+            }
+        }
+    }
+
+    std::cerr << "Invocation: benchmark NAME [ARGS...]" << std::endl;
+    std::cerr << "Available benchmarks:" << std::endl;
+    for(const benchmark_entry& b : BENCHMARKS)
+    {
+        std::cerr << "  " << b.name << " " << b.args << std::endl;
+    }
+    return 2;
+}
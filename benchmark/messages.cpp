@@ -0,0 +1,83 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+static std::chrono::microseconds cpu_time()
+{
+    rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// same as test_muchos_coros: many reader/writer pairs, each pair with its own channel
+int messages(int argc, char** argv)
+{
+    unsigned pairs = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1000;
+    unsigned msgs = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    unsigned threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+    unsigned capacity = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 10;
+
+    std::cout << pairs << " reader/writer pairs, " << msgs << " messages each, channel capacity "
+        << capacity << ", " << threads << " threads" << std::endl;
+
+    scheduler sched(threads);
+    set_scheduler(&sched);
+
+    auto cpu_start = cpu_time();
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned i = 0; i < pairs; i++)
+    {
+        channel_pair<int> pair = make_channel<int>(capacity);
+
+        go("reader", [msgs](channel_reader<int>& r)
+        {
+            for(unsigned i = 0; i < msgs; i++)
+                r.get();
+        }, std::move(pair.reader));
+
+        go("writer", [msgs](channel_writer<int>& w)
+        {
+            for(unsigned i = 0; i < msgs; i++)
+                w.put(i);
+        }, std::move(pair.writer));
+    }
+
+    sched.wait();
+
+    auto wall = std::chrono::steady_clock::now() - start;
+    auto cpu = cpu_time() - cpu_start;
+    idle_stats idle = sched.get_idle_stats();
+
+    set_scheduler(nullptr);
+
+    double total = double(pairs) * msgs;
+    double wall_ns = wall / std::chrono::nanoseconds(1);
+
+    std::cout << "              time: " << wall / std::chrono::milliseconds(1) << " ms, "
+        << total / (wall_ns / 1e9) / 1e6 << " M msgs/s" << std::endl;
+    std::cout << "   wakeups per msg: " << idle.wakeups / total << " (" << idle.wakeups << " wake syscalls)" << std::endl;
+    std::cout << "     parks per msg: " << idle.parks / total << " (" << idle.parks << " parks)" << std::endl;
+    std::cout << "    spins that hit: " << idle.spin_hits << " of " << idle.spins << std::endl;
+    std::cout << "     idle-spin cpu: " << 100.0 * idle.spin_ns / (wall_ns * threads) << "% of thread time, "
+        << idle.spin_ns / 1000000 << " ms total" << std::endl;
+    std::cout << "       process cpu: " << 100.0 * (cpu / std::chrono::nanoseconds(1)) / wall_ns << "% of one core" << std::endl;
+
+    return 0;
+}
+
+}
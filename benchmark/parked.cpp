@@ -0,0 +1,135 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+
+#include <unistd.h>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+static std::size_t rss_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size = 0;
+    std::size_t resident = 0;
+    statm >> size >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+static std::size_t max_map_count()
+{
+    std::ifstream file("/proc/sys/vm/max_map_count");
+    std::size_t count = 0;
+    file >> count;
+    return count;
+}
+
+// uses some stack and returns, leaving the pages committed but unused. Like parsing a request would.
+static __attribute__((noinline)) void touch_stack()
+{
+    volatile char buf[16*1024];
+    for(std::size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = 1;
+}
+
+static void parked_coroutine(std::atomic<std::size_t>& parked, channel_reader<int>& reader)
+{
+    touch_stack();
+    parked++;
+    reader.get(); // will throw channel_closed
+}
+
+static double mb(std::size_t bytes)
+{
+    return bytes / (1024.0*1024.0);
+}
+
+int parked(int argc, char** argv)
+{
+    std::size_t coroutines = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1000000;
+    bool lazy = !(argc > 1 && std::strcmp(argv[1], "fixed") == 0);
+
+    // every stack is two mappings: guard page and the stack itself
+    static const std::size_t OTHER_MAPPINGS = 1000;
+    std::size_t map_limit = max_map_count();
+    if (map_limit > OTHER_MAPPINGS && coroutines*2 + OTHER_MAPPINGS > map_limit)
+    {
+        std::size_t possible = (map_limit - OTHER_MAPPINGS) / 2;
+        std::cerr << "vm.max_map_count=" << map_limit << " allows only ~" << possible << " stacks, "
+            << "raise it with sysctl to park " << coroutines << " coroutines" << std::endl;
+        coroutines = possible;
+    }
+
+    std::cout << "parking " << coroutines << " coroutines, " << (lazy ? "lazy" : "fixed") << " stacks" << std::endl;
+
+    scheduler sched(4);
+    set_scheduler(&sched);
+    if (lazy)
+    {
+        sched.set_stack_mode(stack_mode::lazy, DEFAULT_LAZY_STACK_SIZE);
+    }
+
+    std::size_t rss_start = rss_bytes();
+    auto start = std::chrono::steady_clock::now();
+
+    std::size_t rss_parked = 0;
+    std::size_t rss_trimmed = 0;
+    std::size_t released = 0;
+    std::chrono::steady_clock::duration spawn_time;
+    std::chrono::steady_clock::duration trim_time;
+    {
+        channel_pair<int> pair = make_channel<int>(1, "parking lot");
+        std::atomic<std::size_t> parked(0);
+
+        for(std::size_t i = 0; i < coroutines; i++)
+        {
+            go("parked", parked_coroutine, std::ref(parked), pair.reader);
+        }
+
+        while(parked < coroutines)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // let the last ones reach the channel
+        spawn_time = std::chrono::steady_clock::now() - start;
+
+        rss_parked = rss_bytes();
+
+        auto trim_start = std::chrono::steady_clock::now();
+        released = sched.trim_parked_stacks(std::chrono::seconds(0));
+        trim_time = std::chrono::steady_clock::now() - trim_start;
+
+        rss_trimmed = rss_bytes();
+
+        pair.writer.close();
+        pair.reader.close();
+    }
+
+    sched.wait();
+    set_scheduler(nullptr);
+
+    std::cout << "spawn and park time: " << spawn_time / std::chrono::milliseconds(1) << " ms" << std::endl;
+    std::cout << "         RSS before: " << mb(rss_start) << " MB" << std::endl;
+    std::cout << "   RSS while parked: " << mb(rss_parked) << " MB, "
+        << double(rss_parked - rss_start) / coroutines << " bytes per coroutine" << std::endl;
+    // 'released' is the madvised range, most of it was never touched. RSS difference is what actually went back
+    std::cout << "          trim time: " << trim_time / std::chrono::milliseconds(1) << " ms, "
+        << mb(released) << " MB of address space advised, " << mb(rss_parked - rss_trimmed) << " MB returned" << std::endl;
+    std::cout << " RSS after trimming: " << mb(rss_trimmed) << " MB, "
+        << double(rss_trimmed - rss_start) / coroutines << " bytes per coroutine" << std::endl;
+
+    return 0;
+}
+
+}
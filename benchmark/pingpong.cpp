@@ -0,0 +1,84 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+// two coroutines bouncing a message over a pair of capacity-1 channels. Measures latency of a round trip
+int pingpong(int argc, char** argv)
+{
+    unsigned roundtrips = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1000000;
+    unsigned threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+
+    std::cout << roundtrips << " round trips, " << threads << " threads" << std::endl;
+
+    scheduler sched(threads);
+    set_scheduler(&sched);
+
+    std::vector<std::chrono::steady_clock::duration> latencies(roundtrips);
+    auto start = std::chrono::steady_clock::now();
+    {
+        channel_pair<int> ping = make_channel<int>(1, "ping");
+        channel_pair<int> pong = make_channel<int>(1, "pong");
+
+        go("pong", [](channel_reader<int>& in, channel_writer<int>& out)
+        {
+            try
+            {
+                for(;;)
+                    out.put(in.get());
+            }
+            catch(const channel_closed&)
+            {
+            }
+        }, std::move(ping.reader), std::move(pong.writer));
+
+        go("ping", [roundtrips, &latencies](channel_writer<int>& out, channel_reader<int>& in)
+        {
+            for(unsigned i = 0; i < roundtrips; i++)
+            {
+                auto sent = std::chrono::steady_clock::now();
+                out.put(i);
+                in.get();
+                latencies[i] = std::chrono::steady_clock::now() - sent;
+            }
+            out.close();
+        }, std::move(ping.writer), std::move(pong.reader));
+    }
+
+    sched.wait();
+    auto wall = std::chrono::steady_clock::now() - start;
+    idle_stats idle = sched.get_idle_stats();
+    histogram run_delay = sched.get_metrics().run_delay;
+
+    set_scheduler(nullptr);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p)
+    {
+        return latencies[std::size_t(p * (latencies.size() - 1))] / std::chrono::nanoseconds(1);
+    };
+
+    std::cout << "      time: " << wall / std::chrono::milliseconds(1) << " ms" << std::endl;
+    std::cout << "round trip: " << (wall / std::chrono::nanoseconds(1)) / double(roundtrips) << " ns average" << std::endl;
+    std::cout << "       p50: " << percentile(0.5) << " ns" << std::endl;
+    std::cout << "       p99: " << percentile(0.99) << " ns" << std::endl;
+    std::cout << "      p999: " << percentile(0.999) << " ns" << std::endl;
+    std::cout << "   wakeups: " << idle.wakeups << std::endl;
+    std::cout << " run delay: p50 " << run_delay.percentile(0.5) << " ns, p99 " << run_delay.percentile(0.99)
+        << " ns, p999 " << run_delay.percentile(0.999) << " ns (" << run_delay.count() << " sampled)" << std::endl;
+
+    return 0;
+}
+
+}
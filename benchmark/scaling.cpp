@@ -0,0 +1,93 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+// some cpu-bound work that can't be optimized away
+static double leaf_work(unsigned seed, unsigned iterations)
+{
+    double x = seed;
+    for(unsigned i = 0; i < iterations; i++)
+    {
+        x = x * 1.0000001 + 0.5;
+    }
+    return x;
+}
+
+// fork-join tree, each node spawns two children and waits for their results
+static void tree(unsigned depth, unsigned seed, unsigned iterations, channel_writer<double>& out)
+{
+    if (depth == 0)
+    {
+        out.put(leaf_work(seed, iterations));
+        return;
+    }
+
+    channel_pair<double> results = make_channel<double>(2);
+    go("tree node", tree, depth-1, seed*2, iterations, results.writer);
+    go("tree node", tree, depth-1, seed*2+1, iterations, results.writer);
+
+    out.put(results.reader.get() + results.reader.get());
+}
+
+static std::chrono::steady_clock::duration run(unsigned threads, unsigned depth, unsigned iterations)
+{
+    scheduler sched(threads);
+    set_scheduler(&sched);
+
+    auto start = std::chrono::steady_clock::now();
+
+    channel_pair<double> result = make_channel<double>(1);
+    go("tree root", tree, depth, 1, iterations, result.writer);
+    go("collector", [&result]()
+    {
+        result.reader.get();
+    });
+    sched.wait();
+
+    auto time = std::chrono::steady_clock::now() - start;
+
+    set_scheduler(nullptr);
+    return time;
+}
+
+int scaling(int argc, char** argv)
+{
+    unsigned max_threads = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : std::thread::hardware_concurrency();
+    unsigned depth = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 14;
+    unsigned iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000;
+
+    std::cout << "fork-join tree, " << (1u << depth) << " leaves, " << iterations << " iterations each" << std::endl;
+    std::cout << "threads    time [ms]  speedup" << std::endl;
+
+    run(1, depth, iterations); // warm-up
+
+    double single = 0;
+    for(unsigned threads = 1; threads <= max_threads; threads++)
+    {
+        double ms = double(run(threads, depth, iterations) / std::chrono::microseconds(1)) / 1000.0;
+        if (threads == 1)
+            single = ms;
+
+        std::cout.width(7);
+        std::cout << threads;
+        std::cout.width(13);
+        std::cout << ms;
+        std::cout.width(9);
+        std::cout << single / ms << std::endl;
+    }
+
+    return 0;
+}
+
+}
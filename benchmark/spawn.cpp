@@ -0,0 +1,132 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+
+using namespace coroutines;
+
+// counts heap allocations made by each thread. Replaces operator new for the whole benchmark executable
+static thread_local std::size_t __allocations = 0;
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    __allocations++;
+    void* p = std::malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+namespace benchmark {
+
+struct spawn_result
+{
+    std::size_t allocations = 0;
+    std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration::zero();
+
+    spawn_result& operator+=(const spawn_result& o)
+    {
+        allocations += o.allocations;
+        time += o.time;
+        return *this;
+    }
+};
+
+static void noop()
+{
+}
+
+static void child(channel_writer<int>& done)
+{
+    done.put(1);
+}
+
+// spawns 'count' children. Measures only the go() calls, on the calling thread
+template<typename... Args>
+static spawn_result spawn(std::size_t count, Args&&... args)
+{
+    spawn_result result;
+
+    std::size_t allocations_before = __allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    for(std::size_t i = 0; i < count; i++)
+    {
+        go("child", args...);
+    }
+
+    result.time = std::chrono::steady_clock::now() - start;
+    result.allocations = __allocations - allocations_before;
+
+    return result;
+}
+
+static void print(const char* what, const spawn_result& r, std::size_t count)
+{
+    std::cout << what << ": " << double(r.allocations) / count << " allocations per go(), "
+        << double(r.time / std::chrono::nanoseconds(1)) / count << " ns per go()" << std::endl;
+}
+
+int spawn(int argc, char** argv)
+{
+    std::size_t coroutines = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 100000;
+    std::size_t batch = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    const int ROUNDS = 3; // first round warms up stack pools and containers
+
+    std::size_t batches = coroutines / batch;
+
+    std::cout << "spawning " << batches << " batches of " << batch << " coroutines" << std::endl;
+
+    scheduler sched(4);
+    set_scheduler(&sched);
+
+    channel_pair<int> done = make_channel<int>(batch, "done");
+
+    for(int round = 0; round < ROUNDS; round++)
+    {
+        // from a thread outside the scheduler
+        spawn_result from_thread;
+        for(std::size_t b = 0; b < batches; b++)
+        {
+            from_thread += spawn(batch, noop);
+            sched.wait();
+        }
+
+        // from a coroutine, fan-out/fan-in like a parallel algorithm would
+        spawn_result from_coroutine;
+        go("spawner", [&]()
+        {
+            for(std::size_t b = 0; b < batches; b++)
+            {
+                from_coroutine += spawn(batch, child, std::ref(done.writer));
+                for(std::size_t i = 0; i < batch; i++)
+                    done.reader.get();
+            }
+        });
+        sched.wait();
+
+        std::cout << "round " << round << (round == 0 ? " (warm-up)" : "") << std::endl;
+        print("  from thread   ", from_thread, batches * batch);
+        print("  from coroutine", from_coroutine, batches * batch);
+    }
+
+    stack_pool_stats stacks = sched.get_stack_stats();
+    std::cout << "stack pool hits: " << stacks.hits << ", misses: " << stacks.misses << std::endl;
+
+    set_scheduler(nullptr);
+
+    return 0;
+}
+
+}
@@ -0,0 +1,157 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+
+#include "benchmarks.hpp"
+
+#include "coroutines/globals.hpp"
+#include "coroutines/timer_wheel.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+using namespace coroutines;
+
+namespace benchmark {
+
+static double ns_per(std::chrono::steady_clock::duration d, std::size_t count)
+{
+    return (d / std::chrono::nanoseconds(1)) / double(count);
+}
+
+// the wheel alone: timeouts spread over a minute, half of them cancelled, like keep-alives
+static void wheel_operations(unsigned count)
+{
+    std::minstd_rand generator(1);
+    std::vector<timer> timers(count);
+    timer_wheel wheel(0);
+
+    auto start = std::chrono::steady_clock::now();
+    for(timer& t : timers)
+    {
+        t.expiry = generator() % 60000;
+        wheel.add(t);
+    }
+    auto added = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < count; i += 2)
+    {
+        wheel.remove(timers[i]);
+    }
+    auto removed = std::chrono::steady_clock::now();
+    std::size_t expired = 0;
+    for(std::uint64_t tick = 0; wheel.size() > 0; tick++)
+    {
+        wheel.advance(tick, [&](timer&) { expired++; });
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::cout << "wheel, " << count << " timers over 60000 ticks" << std::endl;
+    std::cout << "       add: " << ns_per(added - start, count) << " ns" << std::endl;
+    std::cout << "    cancel: " << ns_per(removed - added, count / 2) << " ns" << std::endl;
+    std::cout << "    expire: " << ns_per(end - removed, expired) << " ns, ticking included" << std::endl;
+}
+
+// coroutines sleeping for random periods, how late they wake up
+static void sleepers(unsigned coroutines, unsigned threads)
+{
+    static const unsigned ROUNDS = 10;
+
+    scheduler sched(threads);
+    set_scheduler(&sched);
+
+    std::vector<std::chrono::steady_clock::duration> lateness(coroutines * ROUNDS);
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < coroutines; i++)
+    {
+        go("sleeper", [i, &lateness]()
+        {
+            std::minstd_rand generator(i + 1);
+            for(unsigned r = 0; r < ROUNDS; r++)
+            {
+                auto duration = std::chrono::milliseconds(1 + generator() % 100);
+                auto deadline = std::chrono::steady_clock::now() + duration;
+                sleep_until(deadline);
+                lateness[i*ROUNDS + r] = std::chrono::steady_clock::now() - deadline;
+            }
+        });
+    }
+    sched.wait();
+    auto wall = std::chrono::steady_clock::now() - start;
+    idle_stats idle = sched.get_idle_stats();
+    set_scheduler(nullptr);
+
+    std::sort(lateness.begin(), lateness.end());
+    auto percentile = [&](double p)
+    {
+        return lateness[std::size_t(p * (lateness.size() - 1))] / std::chrono::microseconds(1);
+    };
+
+    std::cout << "sleep_for, " << coroutines << " coroutines x " << ROUNDS << " sleeps of 1-100 ms, " << threads << " threads" << std::endl;
+    std::cout << "      time: " << wall / std::chrono::milliseconds(1) << " ms" << std::endl;
+    std::cout << "  late p50: " << percentile(0.5) << " us" << std::endl;
+    std::cout << "  late p99: " << percentile(0.99) << " us" << std::endl;
+    std::cout << " late p999: " << percentile(0.999) << " us" << std::endl;
+    std::cout << "     parks: " << idle.parks << std::endl;
+}
+
+// message passing with and without a timeout that never expires: the cost of arming and disarming a timer
+static void timed_get(unsigned messages, unsigned threads)
+{
+    for(bool timed : { false, true })
+    {
+        scheduler sched(threads);
+        set_scheduler(&sched);
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            channel_pair<unsigned> pair = make_channel<unsigned>(1, "timed");
+            go("writer", [messages](channel_writer<unsigned>& out)
+            {
+                for(unsigned i = 0; i < messages; i++)
+                    out.put(i);
+            }, std::move(pair.writer));
+
+            go("reader", [timed](channel_reader<unsigned>& in)
+            {
+                try
+                {
+                    unsigned v;
+                    for(;;)
+                    {
+                        if (timed)
+                            in.get_for(v, std::chrono::seconds(10));
+                        else
+                            v = in.get();
+                    }
+                }
+                catch(const channel_closed&)
+                {
+                }
+            }, std::move(pair.reader));
+        }
+        sched.wait();
+        auto wall = std::chrono::steady_clock::now() - start;
+        set_scheduler(nullptr);
+
+        std::cout << (timed ? "   get_for: " : "       get: ") << ns_per(wall, messages) << " ns per message" << std::endl;
+    }
+}
+
+int timers(int argc, char** argv)
+{
+    unsigned count = argc > 0 ? std::strtoul(argv[0], nullptr, 10) : 1000000;
+    unsigned coroutines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    unsigned threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+
+    wheel_operations(count);
+    sleepers(coroutines, threads);
+    std::cout << count << " messages, capacity 1, " << threads << " threads" << std::endl;
+    timed_get(count, threads);
+
+    return 0;
+}
+
+}
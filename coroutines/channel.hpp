@@ -7,9 +7,11 @@
 
 #include <memory>
 #include <utility>
+#include <chrono>
 
 namespace coroutines {
 
+class selector;
 
 // writer enppoint to a channel
 template<typename T, typename implementation_type=typename locking_channel<T>::writer>
@@ -50,6 +52,15 @@ public:
             throw channel_closed();
     }
 
+    // gives up after the timeout, returns false then. The value is lost
+    bool put_for(T val, std::chrono::steady_clock::duration timeout)
+    {
+        if (_impl)
+            return _impl->put_for(std::move(val), timeout);
+        else
+            throw channel_closed();
+    }
+
     // does not throw when channel is closed
     void put_nothrow(T val)
     {
@@ -68,8 +79,15 @@ public:
         _impl.reset();
     }
 
+    bool is_closed() const noexcept
+    {
+        return !_impl;
+    }
+
 private:
 
+    friend class selector;
+
     std::shared_ptr<implementation_type> _impl;
 };
 
@@ -120,6 +138,15 @@ public:
             throw channel_closed();
     }
 
+    // gives up after the timeout, returns false then
+    bool get_for(T& b, std::chrono::steady_clock::duration timeout)
+    {
+        if (_impl)
+            return _impl->get_for(b, timeout);
+        else
+            throw channel_closed();
+    }
+
     void close()
     {
         _impl.reset();
@@ -132,6 +159,8 @@ public:
 
 private:
 
+    friend class selector;
+
     std::shared_ptr<implementation_type> _impl;
 };
 
@@ -4,6 +4,9 @@
 
 #include "monitor.hpp"
 
+#include <condition_variable>
+#include <chrono>
+
 namespace coroutines {
 
 // coroutine version of condition variables.
@@ -26,6 +29,17 @@ public:
         _monitor.wake_one();
     }
 
+    // for selector. add() must be called with the lock held, like wait()
+    void add_waiter(select_waiter& waiter)
+    {
+        _monitor.add(waiter);
+    }
+
+    void remove_waiter(select_waiter& waiter)
+    {
+        _monitor.remove(waiter);
+    }
+
     // Unlocks the lock and waits in an atomic way.
     template<typename Lock>
     void wait(const std::string& checkpoint_name, Lock& lock);
@@ -37,6 +51,34 @@ public:
             wait(checkpoint_name, lock);
     }
 
+    // as above, giving up at the deadline
+    template<typename Lock>
+    std::cv_status wait_until(const std::string& checkpoint_name, Lock& lock, std::chrono::steady_clock::time_point deadline);
+
+    // returns pred() at the time of giving up
+    template<typename Lock, typename Predicate>
+    bool wait_until(const std::string& checkpoint_name, Lock& lock, std::chrono::steady_clock::time_point deadline, Predicate pred)
+    {
+        while(!pred())
+        {
+            if (wait_until(checkpoint_name, lock, deadline) == std::cv_status::timeout)
+                return pred();
+        }
+        return true;
+    }
+
+    template<typename Lock>
+    std::cv_status wait_for(const std::string& checkpoint_name, Lock& lock, std::chrono::steady_clock::duration timeout)
+    {
+        return wait_until(checkpoint_name, lock, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Lock, typename Predicate>
+    bool wait_for(const std::string& checkpoint_name, Lock& lock, std::chrono::steady_clock::duration timeout, Predicate pred)
+    {
+        return wait_until(checkpoint_name, lock, std::chrono::steady_clock::now() + timeout, pred);
+    }
+
 private:
 
     monitor _monitor;
@@ -54,6 +96,17 @@ void condition_variable::wait(const std::string& checkpoint_name, Lock& lock)
     lock.lock();
 }
 
+template<typename Lock>
+std::cv_status condition_variable::wait_until(const std::string& checkpoint_name, Lock& lock, std::chrono::steady_clock::time_point deadline)
+{
+    bool notified = _monitor.wait_until(checkpoint_name, deadline, [&lock]()
+    {
+        lock.unlock();
+    });
+    lock.lock();
+    return notified ? std::cv_status::no_timeout : std::cv_status::timeout;
+}
+
 }
 
 #endif // CONDITION_VARIABLE_HPP
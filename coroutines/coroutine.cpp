@@ -9,30 +9,31 @@
 #include "profiling/profiling.hpp"
 
 #include <utility>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 
 namespace coroutines {
 
-static const unsigned DEFAULT_STACK_SIZE = 64*1024; // 64kb should be enough for anyone :)
 static thread_local coroutine* __current_coroutine = nullptr;
 
-coroutine::coroutine(scheduler& parent, std::string name, function_type&& fun)
-    : _function(std::move(fun))
-    , _stack(new char[DEFAULT_STACK_SIZE])
+// returns address just below the caller's frame
+static __attribute__((noinline)) const char* current_stack_pointer()
+{
+    return static_cast<const char*>(__builtin_frame_address(0));
+}
+
+coroutine::coroutine(scheduler& parent, const char* name, stack&& stk)
+    : _stack(std::move(stk))
+    , _stack_top(static_cast<char*>(static_cast<void*>(this)))
 #ifdef COROUTINES_SPINLOCKS_PROFILING
-    , _run_mutex(std::string("coro " + name + " run mutex").c_str())
+    , _run_mutex((std::string("coro ") + (name ? name : "") + " run mutex").c_str())
 #endif
     , _parent(parent)
-    , _name(std::move(name))
+    , _name(name ? name : "")
 {
-    CORO_PROF("coroutine", this, "created", _name.c_str());
-
-    _new_context = boost::context::make_fcontext(
-                _stack + DEFAULT_STACK_SIZE,
-                DEFAULT_STACK_SIZE,
-                &coroutine::static_context_function);
-
+    set_checkpoint("just created");
 }
 
 coroutine::~coroutine()
@@ -44,7 +45,79 @@ coroutine::~coroutine()
         std::cerr<< "FATAL: coroutine '" << _name << "' destroyed before completed. Last checkpoint: " << _last_checkpoint << std::endl;
     }
     assert(!_new_context);
-    delete[] _stack;
+    destroy_function();
+}
+
+void coroutine::destroy(coroutine* coro)
+{
+    // the coroutine lives in the stack, so the stack has to be moved out first
+    scheduler& parent = coro->_parent;
+    stack stk(std::move(coro->_stack));
+    coro->~coroutine();
+    parent.release_stack(std::move(stk));
+}
+
+void* coroutine::placement(const stack& stk)
+{
+    std::uintptr_t top = reinterpret_cast<std::uintptr_t>(stk.top());
+    std::uintptr_t addr = top - sizeof(coroutine);
+    return reinterpret_cast<void*>(addr - addr % alignof(coroutine));
+}
+
+void* coroutine::reserve(std::size_t size, std::size_t alignment)
+{
+    // leave at least one page for execution
+    std::uintptr_t bottom = reinterpret_cast<std::uintptr_t>(_stack.top() - _stack.size()) + stack::page_size();
+    std::uintptr_t top = reinterpret_cast<std::uintptr_t>(_stack_top);
+
+    if (size > top - bottom)
+        throw std::bad_alloc();
+
+    std::uintptr_t addr = top - size;
+    addr -= addr % alignment;
+    if (addr < bottom)
+        throw std::bad_alloc();
+
+    _stack_top = reinterpret_cast<char*>(addr);
+    return _stack_top;
+}
+
+void coroutine::copy_name(const std::string& name)
+{
+    char* copy = static_cast<char*>(reserve(name.size() + 1, 1));
+    std::memcpy(copy, name.c_str(), name.size() + 1);
+    _name = copy;
+}
+
+void coroutine::destroy_function()
+{
+    if (_function)
+    {
+        _destroy(_function);
+        _function = nullptr;
+    }
+}
+
+void coroutine::make_context()
+{
+    CORO_PROF("coroutine", this, "created", _name);
+
+    static const std::uintptr_t ALIGNMENT = 16; // required by the ABI
+
+    std::uintptr_t top = reinterpret_cast<std::uintptr_t>(_stack_top);
+    top -= top % ALIGNMENT;
+    char* bottom = _stack.top() - _stack.size();
+    _new_context = boost::context::make_fcontext(
+                reinterpret_cast<char*>(top),
+                reinterpret_cast<char*>(top) - bottom,
+                &coroutine::static_context_function);
+}
+
+void coroutine::set_checkpoint(const char* cp)
+{
+    std::size_t len = std::min(std::strlen(cp), sizeof(_last_checkpoint) - 1);
+    std::memcpy(_last_checkpoint, cp, len);
+    _last_checkpoint[len] = 0;
 }
 
 void coroutine::run()
@@ -55,6 +128,9 @@ void coroutine::run()
         CORO_LOG("CORO starting or resuming '", _name, "'");
         assert(_new_context);
 
+        _parked_sp = nullptr;
+        _trimmed = false;
+
         coroutine* previous = __current_coroutine;
         __current_coroutine = this;
 
@@ -89,12 +165,34 @@ void coroutine::yield(const std::string& checkpoint_name, epilogue_type epilogue
 {
     assert(__current_coroutine == this);
 
-    _last_checkpoint = checkpoint_name;
+    set_checkpoint(checkpoint_name);
+
+    if (_stack.mode() == stack_mode::lazy)
+    {
+        _parked_sp = current_stack_pointer();
+        _parked_since = std::chrono::steady_clock::now();
+    }
 
     _epilogue = std::move(epilogue);
     boost::context::jump_fcontext(_new_context, &_caller_context, 0);
 }
 
+std::size_t coroutine::trim_stack(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration min_parked)
+{
+    // if the coroutine is running now, it's not parked
+    if (_stack.mode() != stack_mode::lazy || !_run_mutex.try_lock())
+        return 0;
+
+    std::lock_guard<mutex> lock(_run_mutex, std::adopt_lock);
+
+    if (_parked_sp && !_trimmed && now - _parked_since >= min_parked)
+    {
+        _trimmed = true;
+        return _stack.trim(_parked_sp);
+    }
+    return 0;
+}
+
 void coroutine::static_context_function(intptr_t param)
 {
     coroutine* _this = reinterpret_cast<coroutine*>(param);
@@ -106,23 +204,32 @@ void coroutine::context_function()
     CORO_LOG("CORO: starting '", _name, "'");
     try
     {
-        _last_checkpoint = "started";
-        _function();
-        _last_checkpoint = "finished cleanly";
+        set_checkpoint("started");
+        try
+        {
+            _invoke(_function);
+        }
+        catch(...)
+        {
+            destroy_function();
+            throw;
+        }
+        destroy_function(); // here, so that whatever the callable holds is released before the coroutine is finished
+        set_checkpoint("finished cleanly");
     }
     catch(const channel_closed&)
     {
-        _last_checkpoint = "finished after channel close";
+        set_checkpoint("finished after channel close");
     }
     catch(const std::exception& e)
     {
-        _last_checkpoint = std::string("uncaught exception: ") + e.what();
+        set_checkpoint(std::string("uncaught exception: ") + e.what());
         std::cerr << "Uncaught exception in " << _name << " : " << e.what() << std::endl;
         std::terminate();
     }
     catch(...)
     {
-        _last_checkpoint = "uncaught exception";
+        set_checkpoint("uncaught exception");
         std::cerr << "Uncaught exception in " << _name << std::endl;
         std::terminate();
     }
@@ -3,27 +3,56 @@
 #define COROUTINES_COROUTINE_HPP
 
 #include "coroutines/mutex.hpp"
+#include "coroutines/stack_allocator.hpp"
 
 #include <boost/context/all.hpp>
 
 #include <functional>
+#include <chrono>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
 
 namespace coroutines {
 
 class scheduler;
+class coroutine;
 
+// links coroutine into coroutine_registry
+struct registry_hook
+{
+    registry_hook* prev = nullptr;
+    registry_hook* next = nullptr;
+    coroutine* coro = nullptr; // null for hooks that are not coroutines
+    unsigned shard = 0;
+};
+
+// Coroutine lives at the top of its own stack, together with the callable and the name, so starting one
+// costs no heap allocations once the stack pool is warm.
+// Created with create(), destroyed with destroy()
 class coroutine
 {
 public:
-    typedef std::function<void()> function_type;
     typedef std::function<void(coroutine*)> epilogue_type;
 
-    coroutine(scheduler& parent, std::string name, function_type&& fun);
-    ~coroutine();
+    static const std::size_t CALLABLE_BUFFER_SIZE = 64; // callables up to this size are stored in the control block
+    static const std::size_t CHECKPOINT_SIZE = 64; // longer checkpoint names are truncated
+
+    // creates coroutine inside the stack. The name is not copied, must outlive the coroutine (string literal) or be null.
+    // Throws std::bad_alloc if the callable doesn't fit in the stack
+    template<typename Callable>
+    static coroutine* create(scheduler& parent, const char* name, stack&& stk, Callable&& c);
+
+    // as above, the name is copied into the stack
+    template<typename Callable>
+    static coroutine* create(scheduler& parent, const std::string& name, stack&& stk, Callable&& c);
+
+    // destroys the coroutine and returns the stack to the scheduler
+    static void destroy(coroutine* coro);
 
     coroutine(const coroutine&) = delete;
     coroutine(coroutine&&) = delete;
@@ -35,72 +64,146 @@ public:
 
     void yield(const std::string& checkpoint_name, epilogue_type epilogue = epilogue_type());
 
-    std::string name() const { return _name; }
-    std::string last_checkpoint() const { return _last_checkpoint; }
-    void set_checkpoint(const std::string& cp) { _last_checkpoint = cp; }
+    const char* name() const { return _name; }
+    scheduler& get_scheduler() const { return _parent; }
+    const char* last_checkpoint() const { return _last_checkpoint; }
+    void set_checkpoint(const char* cp);
+    void set_checkpoint(const std::string& cp) { set_checkpoint(cp.c_str()); }
+
+    // returns the unused part of lazy stack to the OS, if the coroutine has been parked for at least min_parked.
+    // Can be called from any thread. Returns number of bytes released
+    std::size_t trim_stack(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration min_parked);
+
+    registry_hook& hook() { return _hook; }
+
+    // when the coroutine became runnable (metrics_now()), for the run delay histogram. 0 if not sampled.
+    // Set by whoever schedules it, kept if it was runnable already, taken by the processor about to run it
+    void set_runnable(std::uint64_t now) { if (!_runnable_since) _runnable_since = now; }
+    std::uint64_t take_runnable_since() { std::uint64_t t = _runnable_since; _runnable_since = 0; return t; }
 
 private:
 
+    coroutine(scheduler& parent, const char* name, stack&& stk);
+    ~coroutine();
+
+    // where the coroutine is placed in the stack
+    static void* placement(const stack& stk);
+
+    // takes memory from the top of the stack, below the coroutine and everything reserved before
+    void* reserve(std::size_t size, std::size_t alignment);
+
+    void copy_name(const std::string& name);
+
+    template<typename Callable>
+    void set_function(Callable&& c);
+
+    template<typename Callable>
+    static void invoke_function(void* c) { (*static_cast<Callable*>(c))(); }
+
+    template<typename Callable>
+    static void destroy_function(void* c) { static_cast<Callable*>(c)->~Callable(); }
+
+    void destroy_function();
+
+    void make_context();
 
     static void static_context_function(intptr_t param);
     void context_function();
 
-    std::function<void()> _function;
+    // type-erased callable, in _function_buffer or reserved in stack
+    void* _function = nullptr;
+    void (*_invoke)(void*) = nullptr;
+    void (*_destroy)(void*) = nullptr;
 
     boost::context::fcontext_t _caller_context;
     boost::context::fcontext_t* _new_context = nullptr;
 
-    char* _stack = nullptr;
+    stack _stack;
+    char* _stack_top; // top of the part available for execution
+    const char* _parked_sp = nullptr; // stack pointer when yielded, set only for lazy stacks
+    std::chrono::steady_clock::time_point _parked_since;
+    bool _trimmed = false;
+    std::uint64_t _runnable_since = 0;
     epilogue_type _epilogue;
     mutex _run_mutex;
     scheduler& _parent;
-    std::string _name;
-    std::string _last_checkpoint = "just created";
+    const char* _name;
+    char _last_checkpoint[CHECKPOINT_SIZE];
+    registry_hook _hook;
+
+    alignas(std::max_align_t) char _function_buffer[CALLABLE_BUFFER_SIZE];
 };
 
-template <typename Callable>
-class callable_wrapper
+struct coroutine_deleter
 {
-public:
-    callable_wrapper(Callable&& c)
-    : _callable(std::move(c))
+    void operator()(coroutine* coro) const { coroutine::destroy(coro); }
+};
+
+typedef std::unique_ptr<coroutine, coroutine_deleter> coroutine_ptr;
+typedef coroutine* coroutine_weak_ptr; // this couldbe made smarter later on
+
+template<typename Callable>
+coroutine* coroutine::create(scheduler& parent, const char* name, stack&& stk, Callable&& c)
+{
+    coroutine* coro = new(placement(stk)) coroutine(parent, name, std::move(stk));
+    try
     {
+        coro->set_function(std::forward<Callable>(c));
     }
+    catch(...)
+    {
+        destroy(coro);
+        throw;
+    }
+    return coro;
+}
 
-    void operator()()
+template<typename Callable>
+coroutine* coroutine::create(scheduler& parent, const std::string& name, stack&& stk, Callable&& c)
+{
+    coroutine* coro = new(placement(stk)) coroutine(parent, nullptr, std::move(stk));
+    try
+    {
+        coro->copy_name(name);
+        coro->set_function(std::forward<Callable>(c));
+    }
+    catch(...)
     {
-        _callable();
+        destroy(coro);
+        throw;
     }
+    return coro;
+}
 
-private:
+template<typename Callable>
+void coroutine::set_function(Callable&& c)
+{
+    typedef typename std::decay<Callable>::type callable_type;
 
-    Callable _callable;
-};
+    void* mem;
+    if (sizeof(callable_type) <= CALLABLE_BUFFER_SIZE && alignof(callable_type) <= alignof(std::max_align_t))
+        mem = _function_buffer;
+    else
+        mem = reserve(sizeof(callable_type), alignof(callable_type));
 
-typedef std::unique_ptr<coroutine> coroutine_ptr;
-typedef coroutine* coroutine_weak_ptr; // this couldbe made smarter later on
+    _function = new(mem) callable_type(std::forward<Callable>(c));
+    _invoke = &invoke_function<callable_type>;
+    _destroy = &destroy_function<callable_type>;
+
+    make_context();
+}
 
 template<typename Callable>
-coroutine_ptr make_coroutine(scheduler& parent, std::string name, Callable&& c)
+coroutine_ptr make_coroutine(scheduler& parent, const char* name, stack&& stk, Callable&& c)
 {
-    callable_wrapper<Callable>* wrapper = new callable_wrapper<Callable>(std::move(c));
-
-    return coroutine_ptr(new coroutine(parent, std::move(name), [wrapper]()
-    {
-        try
-        {
-            (*wrapper)();
-            delete wrapper;
-        }
-        catch(...)
-        {
-            delete wrapper;
-            throw;
-        }
-
-    }));
+    return coroutine_ptr(coroutine::create(parent, name, std::move(stk), std::forward<Callable>(c)));
 }
 
+template<typename Callable>
+coroutine_ptr make_coroutine(scheduler& parent, const std::string& name, stack&& stk, Callable&& c)
+{
+    return coroutine_ptr(coroutine::create(parent, name, std::move(stk), std::forward<Callable>(c)));
+}
 
 }
 
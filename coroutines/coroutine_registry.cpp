@@ -0,0 +1,100 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/coroutine_registry.hpp"
+
+#include <cassert>
+
+namespace coroutines {
+
+// threads are spread over shards in order of first use
+static std::atomic<unsigned> __next_shard(0);
+static thread_local unsigned __shard = __next_shard++ % coroutine_registry::SHARDS;
+
+coroutine_registry::coroutine_registry()
+    : _live(0)
+    , _max_live(0)
+{
+    for(shard& s : _shards)
+    {
+        s.head.prev = &s.head;
+        s.head.next = &s.head;
+    }
+}
+
+coroutine_registry::~coroutine_registry()
+{
+    assert(size() == 0);
+}
+
+void coroutine_registry::link_before(registry_hook* pos, registry_hook* hook)
+{
+    hook->next = pos;
+    hook->prev = pos->prev;
+    pos->prev->next = hook;
+    pos->prev = hook;
+}
+
+void coroutine_registry::unlink(registry_hook* hook)
+{
+    hook->prev->next = hook->next;
+    hook->next->prev = hook->prev;
+    hook->prev = nullptr;
+    hook->next = nullptr;
+}
+
+void coroutine_registry::add(coroutine_ptr&& coro)
+{
+    registry_hook& hook = coro->hook();
+    assert(!hook.next);
+    hook.coro = coro.release();
+    hook.shard = __shard;
+
+    {
+        shard& s = _shards[hook.shard];
+        std::lock_guard<mutex> lock(s.list_mutex);
+        link_before(&s.head, &hook);
+    }
+
+    std::size_t live = _live.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::size_t max_live = _max_live.load(std::memory_order_relaxed);
+    while(live > max_live && !_max_live.compare_exchange_weak(max_live, live, std::memory_order_relaxed))
+        ; // retry
+}
+
+void coroutine_registry::remove(coroutine* coro)
+{
+    registry_hook& hook = coro->hook();
+    assert(hook.next && hook.coro == coro);
+
+    {
+        shard& s = _shards[hook.shard];
+        std::lock_guard<mutex> lock(s.list_mutex);
+        unlink(&hook);
+    }
+
+    // destroyed before the count drops, so the stack is released before wait_empty() returns
+    coroutine::destroy(coro);
+
+    std::size_t live = _live.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        if (live == 1)
+        {
+            // the last one is dropped and notified under the mutex: the waiter can't miss it between checking the count
+            // and going to sleep, and can't see zero and destroy the registry while it's still used here
+            std::lock_guard<std::mutex> lock(_wait_mutex);
+            if (_live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                _wait_cv.notify_all();
+            return;
+        }
+        if (_live.compare_exchange_weak(live, live - 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+            return;
+    }
+}
+
+void coroutine_registry::wait_empty()
+{
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+    _wait_cv.wait(lock, [this]() { return size() == 0; });
+}
+
+}
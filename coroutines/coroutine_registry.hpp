@@ -0,0 +1,104 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_COROUTINE_REGISTRY_HPP
+#define COROUTINES_COROUTINE_REGISTRY_HPP
+
+#include "coroutines/coroutine.hpp"
+#include "coroutines/mutex.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits>
+
+namespace coroutines {
+
+// owns all live coroutines.
+// Coroutines are linked into intrusive lists, sharded by the adding thread. Each coroutine remembers its shard,
+// so adding and removing is O(1) and locks only one shard.
+class coroutine_registry
+{
+public:
+
+    static const unsigned SHARDS = 16;
+
+    coroutine_registry();
+    coroutine_registry(const coroutine_registry&) = delete;
+    ~coroutine_registry();
+
+    // takes ownership
+    void add(coroutine_ptr&& coro);
+
+    // unlinks and destroys the coroutine
+    void remove(coroutine* coro);
+
+    // number of live coroutines
+    std::size_t size() const { return _live.load(std::memory_order_acquire); }
+
+    // highest size() seen
+    std::size_t max_size() const { return _max_live.load(std::memory_order_relaxed); }
+
+    // blocks until the registry is empty
+    void wait_empty();
+
+    // calls fun(coroutine*) for every coroutine. Locks one shard at a time, releasing it every 'batch' coroutines.
+    // Coroutines added or removed meanwhile may or may not be visited
+    template<typename Callable>
+    void for_each(Callable fun, std::size_t batch = std::numeric_limits<std::size_t>::max());
+
+private:
+
+    struct shard
+    {
+        mutex list_mutex;
+        registry_hook head; // circular list sentinel
+        char padding[64]; // keep shards on separate cache lines
+    };
+
+    static void link_before(registry_hook* pos, registry_hook* hook);
+    static void unlink(registry_hook* hook);
+
+    shard _shards[SHARDS];
+
+    std::atomic<std::size_t> _live;
+    std::atomic<std::size_t> _max_live;
+
+    std::mutex _wait_mutex;
+    std::condition_variable _wait_cv;
+};
+
+template<typename Callable>
+void coroutine_registry::for_each(Callable fun, std::size_t batch)
+{
+    for(shard& s : _shards)
+    {
+        registry_hook cursor; // keeps the position while the shard is unlocked. Has no coroutine, skipped by other iterations
+        std::unique_lock<mutex> lock(s.list_mutex);
+
+        link_before(s.head.next, &cursor);
+        for(;;)
+        {
+            std::size_t visited = 0;
+            registry_hook* h = cursor.next;
+            for(; h != &s.head && visited < batch; h = h->next)
+            {
+                if (h->coro)
+                {
+                    fun(h->coro);
+                    visited++;
+                }
+            }
+
+            unlink(&cursor);
+            if (h == &s.head)
+                break;
+
+            link_before(h, &cursor);
+            lock.unlock();
+            lock.lock();
+        }
+    }
+}
+
+}
+
+#endif
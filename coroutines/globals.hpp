@@ -4,6 +4,7 @@
 
 #include "coroutines/scheduler.hpp"
 #include "coroutines/processor.hpp"
+#include "coroutines/select.hpp"
 
 // global functions used in channle-based concurent programming
 
@@ -14,17 +15,18 @@ void set_scheduler(scheduler* sched);
 scheduler* get_scheduler();
 scheduler& get_scheduler_check(); // asserts scheduler not null
 
+// the name is copied
 template<typename Callable, typename... Args>
 void go(std::string name, Callable&& fn, Args&&... args)
 {
-    get_scheduler_check().go(name, std::forward<Callable>(fn), std::forward<Args>(args)...);
+    get_scheduler_check().go(std::move(name), std::forward<Callable>(fn), std::forward<Args>(args)...);
 }
 
+// the name is not copied, has to outlive the coroutine, like a string literal. Pass a std::string, not a temporary's c_str()
 template<typename Callable, typename... Args>
 void go(const char* name, Callable&& fn, Args&&... args)
 {
-    assert(get_scheduler());
-    get_scheduler_check().go(std::string(name), std::forward<Callable>(fn), std::forward<Args>(args)...);
+    get_scheduler_check().go(name, std::forward<Callable>(fn), std::forward<Args>(args)...);
 }
 
 template<typename Callable, typename... Args>
@@ -33,11 +35,37 @@ void go(Callable&& fn, Args&&... args)
     get_scheduler_check().go(std::forward<Callable>(fn), std::forward<Args>(args)...);
 }
 
-// create channel
-template<typename T>
-channel_pair<T> make_channel(std::size_t capacity, const std::string& name = std::string())
+// with non-default stack size
+template<typename Callable, typename... Args>
+void go(stack_size ss, std::string name, Callable&& fn, Args&&... args)
+{
+    get_scheduler_check().go(ss, name, std::forward<Callable>(fn), std::forward<Args>(args)...);
+}
+
+template<typename Callable, typename... Args>
+void go(stack_size ss, const char* name, Callable&& fn, Args&&... args)
+{
+    get_scheduler_check().go(ss, name, std::forward<Callable>(fn), std::forward<Args>(args)...);
+}
+
+// create channel. channel_type is locking_channel<T> or lock_free_channel<T>
+template<typename T, typename channel_type = locking_channel<T>>
+channel_pair<T, channel_type> make_channel(std::size_t capacity, const std::string& name = std::string())
+{
+    return get_scheduler_check().make_channel<T, channel_type>(capacity, name);
+}
+
+// parks the coroutine, without blocking the thread. Resolution is 1 ms, it never wakes up early
+inline void sleep_until(std::chrono::steady_clock::time_point deadline)
+{
+    coroutine* coro = coroutine::current_corutine();
+    assert(coro);
+    coro->get_scheduler().sleep_until(deadline);
+}
+
+inline void sleep_for(std::chrono::steady_clock::duration duration)
 {
-    return get_scheduler_check().make_channel<T>(capacity, name);
+    sleep_until(std::chrono::steady_clock::now() + duration);
 }
 
 // begin blocking operation
@@ -0,0 +1,32 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_IO_POLLER_HPP
+#define COROUTINES_IO_POLLER_HPP
+
+#include "coroutines/coroutine.hpp"
+
+#include <vector>
+#include <chrono>
+
+namespace coroutines {
+
+// source of I/O readiness, polled by the processors themselves (see io_scheduler).
+// Idle processor on duty sleeps in poll() instead of just sleeping, so coroutine woken by I/O runs on the thread that got the event
+class io_poller
+{
+public:
+
+    virtual ~io_poller() { }
+
+    // adds coroutines whose I/O is ready to 'woken'. Waits up to 'timeout' for some, zero timeout only checks. Thread safe
+    virtual void poll(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout) = 0;
+
+    // non-blocking check of the descriptors the processor is responsible for (see processor::ordinal()), all of them if they are not divided
+    virtual void poll_local(unsigned processor, std::vector<coroutine_weak_ptr>& woken) = 0;
+
+    // makes poll() in progress return. If none is, the next one returns immediately
+    virtual void interrupt() = 0;
+};
+
+}
+
+#endif
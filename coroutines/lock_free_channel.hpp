@@ -1,93 +1,394 @@
-#ifndef COROUTINES_COROUTINE_CHANNEL_HPP
-#define COROUTINES_COROUTINE_CHANNEL_HPP
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_LOCK_FREE_CHANNEL_HPP
+#define COROUTINES_LOCK_FREE_CHANNEL_HPP
 
-#include "channel.hpp"
-#include "spsc_queue.hpp"
-#include "monitor.hpp"
+#include "coroutines/channel.hpp"
+#include "coroutines/mutex.hpp"
+#include "coroutines/monitor.hpp"
+#include "coroutines/channel_closed.hpp"
+#include "coroutines/metrics.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <cstddef>
+#include <cassert>
 
 namespace coroutines {
 
+class scheduler;
 
-// DOES NOT WORK
-// it may work if two mutexes would be replace by single reader/writer lock
-// to be revisited
+// bounded multi-producer multi-consumer channel.
+// Items go through a lock-free ring (Vyukov's bounded MPMC queue, sequence number per cell).
+// Waiter lists are touched only when the ring is full or empty, as long as nobody waits put() and get() take no lock.
+// Drop-in replacement for locking_channel: channel_pair<T, lock_free_channel<T>>
+// Capacity is rounded up to a power of 2.
 template<typename T>
-class lock_free_channel : public i_writer_impl<T>, public i_reader_impl<T>
+class lock_free_channel : public channel_metrics_source
 {
 public:
 
-    // factory
-    static channel_pair<T> make(std::size_t capacity)
+    lock_free_channel(scheduler& sched, std::size_t capacity, const std::string& name);
+    lock_free_channel(const lock_free_channel&) = delete;
+    ~lock_free_channel();
+
+    class writer
     {
-        std::shared_ptr<lock_free_channel<T>> me(new lock_free_channel<T>(capacity));
-        return channel_pair<T>(channel_reader<T>(me), channel_writer<T>(me));
-    }
+    public:
+        writer(const std::shared_ptr<lock_free_channel>& impl)
+            : _impl(impl) { }
 
-    lock_free_channel(const lock_free_channel&) = delete;
+        void put(T v) { _impl->put(std::move(v)); }
+        void writer_close() { _impl->do_close(); }
+        ~writer() { _impl->do_close(); }
 
-    // called by producer
-    virtual void put(T v) override;
-    virtual void writer_close() override { _closed = true; }
+    private:
 
-    // caled by consumer
-    virtual T get() override;
-    virtual void reader_close() { _closed = true; }
+        std::shared_ptr<lock_free_channel> _impl;
+    };
 
+    class reader
+    {
+    public:
+        reader(const std::shared_ptr<lock_free_channel>& impl)
+            : _impl(impl) { }
 
-private:
+        T get() { return _impl->get(); }
+        bool try_get(T& b) { return _impl->try_get(b); }
+        void reader_close() { _impl->do_close(); }
+        ~reader() { _impl->do_close(); }
+
+    private:
+
+        std::shared_ptr<lock_free_channel> _impl;
+    };
+
+    // called by producers
+    void put(T v);
+
+    // called by consumers
+    T get();
+    bool try_get(T& b);
 
-    lock_free_channel(std::size_t capacity);
     void do_close();
 
-    spsc_queue<T> _queue;
+    // puts and gets are the ring positions, nothing is counted on the lock-free path
+    void get_metrics(channel_metrics& m) const override;
+
+private:
+
+    // cell's sequence is 2*pos when free to push at 'pos', 2*pos+1 when holding the item pushed at 'pos'.
+    // Doubled, so a single-cell ring can tell 'full' from 'free for the next push'
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T* item() { return reinterpret_cast<T*>(&storage); }
+    };
+
+    // ring operations, never block. try_push moves from 'v' only on success, try_pop constructs item in uninitialized 'out'
+    bool try_push(T& v);
+    bool try_pop(T* out);
+
+    // try_pop, then wakes a producer if there is one waiting
+    bool pop(T* out);
+
+    // whether there is a free cell/an item, counting those claimed but not yet released/published.
+    // Positions are claimed with seq_cst CAS, waiters check them after registering, so no wake-up is lost
+    bool can_push() const;
+    bool can_pop() const;
+
+    // wakes one of the waiters counted in 'waiting', if any
+    void wake(monitor& waiters, std::atomic<unsigned>& waiting);
+
+    static std::size_t round_capacity(std::size_t capacity);
+
+    const std::size_t _capacity;
+    const std::size_t _mask;
+    std::unique_ptr<cell[]> _cells;
 
-    monitor _reader_monitor, _writer_monitor;
+    // producers and consumers claim positions on different cache lines, away from the read-only part
+    char _padding0[64];
+    std::atomic<std::size_t> _push_pos;
+    char _padding1[64];
+    std::atomic<std::size_t> _pop_pos;
+    char _padding2[64];
 
-    volatile bool _closed = false;
+    std::atomic<bool> _closed;
+
+    // number of coroutines in the monitors. Incremented by the waiter, decremented by whoever wakes it, always under _mutex
+    std::atomic<unsigned> _waiting_producers;
+    std::atomic<unsigned> _waiting_consumers;
+    monitor _producers;
+    monitor _consumers;
+    mutable mutex _mutex;
+
+    // under _mutex
+    std::uint64_t _put_waits = 0;
+    std::uint64_t _get_waits = 0;
+
+    scheduler& _scheduler;
+    const std::string _name;
+
+    const std::string _read_checkpoint;
+    const std::string _write_checkpoint;
 };
 
 template<typename T>
-lock_free_channel<T>::lock_free_channel(std::size_t capacity)
-    : _queue(capacity+1)
+lock_free_channel<T>::lock_free_channel(scheduler& sched, std::size_t capacity, const std::string& name)
+    : _capacity(round_capacity(capacity))
+    , _mask(_capacity - 1)
+    , _cells(new cell[_capacity])
+    , _push_pos(0)
+    , _pop_pos(0)
+    , _closed(false)
+    , _waiting_producers(0)
+    , _waiting_consumers(0)
+    , _producers(sched)
+    , _consumers(sched)
+    , _mutex("lock-free channel mutex")
+    , _scheduler(sched)
+    , _name(name)
+
+    , _read_checkpoint(name + " : reading")
+    , _write_checkpoint(name + " : writing")
 {
+    assert(capacity >= 1);
+    for(std::size_t i = 0; i < _capacity; i++)
+    {
+        _cells[i].sequence.store(2*i, std::memory_order_relaxed);
+    }
+    add_channel(_scheduler, *this);
+}
 
+template<typename T>
+std::size_t lock_free_channel<T>::round_capacity(std::size_t capacity)
+{
+    std::size_t rounded = 1;
+    while(rounded < capacity)
+        rounded *= 2;
+    return rounded;
 }
 
 template<typename T>
-void lock_free_channel<T>::put(T v)
+lock_free_channel<T>::~lock_free_channel()
 {
-    while(!_queue.put(v) && !_closed)
+    remove_channel(_scheduler, *this);
+
+    // destroy anything that could still be in there
+    for(std::size_t pos = _pop_pos.load(); _cells[pos & _mask].sequence.load() == 2*pos + 1; pos++)
     {
-        _writer_monitor.wait();
+        _cells[pos & _mask].item()->~T();
     }
+}
 
-    if (_closed)
-        throw channel_closed();
+template<typename T>
+bool lock_free_channel<T>::try_push(T& v)
+{
+    std::size_t pos = _push_pos.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        cell& c = _cells[pos & _mask];
+        std::size_t seq = c.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(2*pos);
+        if (diff == 0)
+        {
+            if (_push_pos.compare_exchange_weak(pos, pos + 1))
+            {
+                new(c.item()) T(std::move(v));
+                c.sequence.store(2*pos + 1, std::memory_order_release);
+                return true;
+            }
+            // lost the race, 'pos' is reloaded
+        }
+        else if (diff < 0)
+        {
+            return false; // full
+        }
+        else
+        {
+            pos = _push_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
 
-    _reader_monitor.wake_one();
+template<typename T>
+bool lock_free_channel<T>::try_pop(T* out)
+{
+    std::size_t pos = _pop_pos.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        cell& c = _cells[pos & _mask];
+        std::size_t seq = c.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(2*pos + 1);
+        if (diff == 0)
+        {
+            if (_pop_pos.compare_exchange_weak(pos, pos + 1))
+            {
+                new(out) T(std::move(*c.item()));
+                c.item()->~T();
+                c.sequence.store(2*(pos + _capacity), std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false; // empty
+        }
+        else
+        {
+            pos = _pop_pos.load(std::memory_order_relaxed);
+        }
+    }
 }
 
 template<typename T>
-T lock_free_channel<T>::get()
+bool lock_free_channel<T>::can_push() const
+{
+    return _push_pos.load() - _pop_pos.load() < _capacity;
+}
+
+template<typename T>
+bool lock_free_channel<T>::can_pop() const
 {
-    T v;
-    bool success = false;
-    while(!(success = _queue.get(v)) && !_closed)
+    return _pop_pos.load() != _push_pos.load();
+}
+
+template<typename T>
+void lock_free_channel<T>::wake(monitor& waiters, std::atomic<unsigned>& waiting)
+{
+    // waiter releases the mutex only after it's been added to the monitor, so it can't be missed
+    std::lock_guard<mutex> lock(_mutex);
+    unsigned w = waiting.load(std::memory_order_relaxed);
+    if (w > 0)
     {
-        _reader_monitor.wait();
+        waiting.store(w - 1, std::memory_order_relaxed);
+        waiters.wake_one();
     }
+}
 
-    if (!success)
+template<typename T>
+void lock_free_channel<T>::put(T v)
+{
+    for(;;)
     {
-        assert(_closed);
-        throw channel_closed();
+        if (_closed.load(std::memory_order_acquire))
+            throw channel_closed();
+
+        if (try_push(v))
+        {
+            if (_waiting_consumers.load() > 0)
+                wake(_consumers, _waiting_consumers);
+            return;
+        }
+
+        // full, wait for a consumer
+        std::unique_lock<mutex> lock(_mutex);
+        _waiting_producers.fetch_add(1);
+        if (can_push() || _closed.load(std::memory_order_acquire))
+        {
+            _waiting_producers.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        _put_waits++;
+        lock.release();
+        _producers.wait(_write_checkpoint, [this]() { _mutex.unlock(); });
     }
+}
 
-    _writer_monitor.wake_one();
-    return v;
+template<typename T>
+T lock_free_channel<T>::get()
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    T* item = reinterpret_cast<T*>(&storage);
+    auto take = [item]()
+    {
+        T v(std::move(*item));
+        item->~T();
+        return v;
+    };
+
+    for(;;)
+    {
+        if (pop(item))
+            return take();
+
+        // closed channel is still drained before anyone learns it's closed
+        if (_closed.load(std::memory_order_acquire))
+        {
+            if (pop(item))
+                return take();
+            throw channel_closed();
+        }
+
+        // empty, wait for a producer
+        std::unique_lock<mutex> lock(_mutex);
+        _waiting_consumers.fetch_add(1);
+        if (can_pop() || _closed.load(std::memory_order_acquire))
+        {
+            _waiting_consumers.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        _get_waits++;
+        lock.release();
+        _consumers.wait(_read_checkpoint, [this]() { _mutex.unlock(); });
+    }
 }
 
+template<typename T>
+bool lock_free_channel<T>::try_get(T& b)
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    T* item = reinterpret_cast<T*>(&storage);
+    if (!pop(item))
+        return false;
 
+    b = std::move(*item);
+    item->~T();
+    return true;
+}
+
+template<typename T>
+bool lock_free_channel<T>::pop(T* out)
+{
+    if (!try_pop(out))
+        return false;
+
+    if (_waiting_producers.load() > 0)
+        wake(_producers, _waiting_producers);
+    return true;
+}
+
+template<typename T>
+void lock_free_channel<T>::get_metrics(channel_metrics& m) const
+{
+    std::size_t pushed = _push_pos.load(std::memory_order_relaxed);
+    std::size_t popped = _pop_pos.load(std::memory_order_relaxed);
+
+    std::lock_guard<mutex> lock(_mutex);
+    m.name = _name;
+    m.capacity = _capacity;
+    m.size = pushed > popped ? pushed - popped : 0;
+    m.puts = pushed;
+    m.gets = popped;
+    m.put_waits = _put_waits;
+    m.get_waits = _get_waits;
+}
+
+template<typename T>
+void lock_free_channel<T>::do_close()
+{
+    _closed.store(true, std::memory_order_release);
+
+    std::lock_guard<mutex> lock(_mutex);
+    _waiting_producers.store(0, std::memory_order_relaxed);
+    _waiting_consumers.store(0, std::memory_order_relaxed);
+    _producers.wake_all();
+    _consumers.wake_all();
+}
 
 }
 
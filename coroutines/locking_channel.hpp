@@ -5,18 +5,21 @@
 #include "coroutines/mutex.hpp"
 #include "coroutines/condition_variable.hpp"
 #include "coroutines/channel_closed.hpp"
+#include "coroutines/metrics.hpp"
 
 #include <boost/format.hpp>
 
 #include <memory>
+#include <chrono>
 
 namespace coroutines {
 
 class scheduler;
+class selector;
 
 // non-lock-free implementation
 template<typename T>
-class locking_channel
+class locking_channel : public channel_metrics_source
 {
 public:
 
@@ -31,11 +34,14 @@ public:
             : _impl(impl) { }
 
         virtual void put(T v) { _impl->put(std::move(v)); }
+        virtual bool put_for(T v, std::chrono::steady_clock::duration timeout) { return _impl->put_for(std::move(v), timeout); }
         virtual void writer_close() { _impl->writer_close(); }
         virtual ~writer() { _impl->writer_close(); }
 
     private:
 
+        friend class selector;
+
         std::shared_ptr<locking_channel> _impl;
     };
 
@@ -47,51 +53,81 @@ public:
 
         virtual T get() { return std::move(_impl->get()); }
         virtual bool try_get(T& b) { return _impl->try_get(b); }
+        virtual bool get_for(T& b, std::chrono::steady_clock::duration timeout) { return _impl->get_for(b, timeout); }
         virtual void reader_close() { _impl->reader_close(); }
         virtual ~reader() { _impl->reader_close(); }
 
     private:
 
+        friend class selector;
+
         std::shared_ptr<locking_channel> _impl;
     };
 
     // called by producer
     void put(T v);
+    bool put_for(T v, std::chrono::steady_clock::duration timeout); // false if timed out, 'v' is dropped then
     void writer_close() { do_close(); }
 
     // caled by consumer
     T get();
     bool try_get(T& b);
+    bool get_for(T& b, std::chrono::steady_clock::duration timeout); // false if timed out
     void reader_close() { do_close(); }
 
+    // selector support.
+    // Non-blocking put/get, throw channel_closed like the blocking ones. select_try_put moves from 'v' only on success
+    bool select_try_put(T& v);
+    bool select_try_get(T& v);
+    // return true if put/get would not block now, otherwise register the waiter to be woken when it might not
+    bool select_register_put(select_waiter& waiter);
+    bool select_register_get(select_waiter& waiter);
+    void select_cancel_put(select_waiter& waiter) { _producers_cv.remove_waiter(waiter); }
+    void select_cancel_get(select_waiter& waiter) { _consumers_cv.remove_waiter(waiter); }
+
+    void get_metrics(channel_metrics& m) const override;
+
 private:
 
     void do_close();
 
-    unsigned size() const
+    std::size_t size() const
     {
-        int s = _wr - _rd;
-        if (s < 0)
-            s += _capacity;
-        //std::cout << "CHAN: _wr=" << _wr << ", _rd=" << _rd << ", size=" << s << std::endl;
-        return (unsigned)s;
+        return _wr >= _rd ? _wr - _rd : _wr + _capacity - _rd;
     }
 
-    int wr_next() const
+    std::size_t wr_next() const
     {
         return (_wr + 1) % _capacity;
     }
 
+    // under _mutex, with room for one item or with one there
+    void push(T&& v);
+    T pop();
+
+    // whether put/get can go on without waiting
+    bool can_put() const { return _rd != wr_next() || _closed; }
+    bool can_get() const { return _rd != _wr || _closed; }
+
     T* _data;
-    int _rd = 0;
-    int _wr = 0;
+    std::size_t _rd = 0;
+    std::size_t _wr = 0;
     std::size_t _capacity;
     condition_variable _producers_cv;
     condition_variable _consumers_cv;
-    mutex _mutex;
+    mutable mutex _mutex;
 
     bool _closed = false;
 
+    // under _mutex
+    std::uint64_t _puts = 0;
+    std::uint64_t _gets = 0;
+    std::uint64_t _put_waits = 0;
+    std::uint64_t _get_waits = 0;
+
+    scheduler& _scheduler;
+    const std::string _name;
+
     const std::string _read_checkpoint;
     const std::string _write_checkpoint;
 };
@@ -103,6 +139,8 @@ locking_channel<T>::locking_channel(scheduler& sched, std::size_t capacity, cons
     , _producers_cv(sched)
     , _consumers_cv(sched)
     , _mutex("channel mutex")
+    , _scheduler(sched)
+    , _name(name)
 
     , _read_checkpoint(name + " : reading")
     , _write_checkpoint(name + " : writing")
@@ -112,14 +150,17 @@ locking_channel<T>::locking_channel(scheduler& sched, std::size_t capacity, cons
     {
         throw std::bad_alloc();
     }
+    add_channel(_scheduler, *this);
 }
 
 template<typename T>
 locking_channel<T>::~locking_channel()
 {
+    remove_channel(_scheduler, *this);
+
     // destroy anything that could still be in there
-    int rd = _rd;
-    int wr = _wr;
+    std::size_t rd = _rd;
+    std::size_t wr = _wr;
     while(rd != wr)
     {
         _data[rd].~T();
@@ -128,25 +169,43 @@ locking_channel<T>::~locking_channel()
     std::free(_data);
 }
 
+template<typename T>
+void locking_channel<T>::push(T&& v)
+{
+    new(&_data[_wr]) T(std::move(v));
+    _wr = wr_next();
+    _puts++;
+
+    if (size() == 1)
+        _consumers_cv.notify_all();
+}
+
+template<typename T>
+T locking_channel<T>::pop()
+{
+    T v(std::move(_data[_rd]));
+    _data[_rd].~T();
+    _rd = (_rd + 1) % _capacity;
+    _gets++;
+
+    if (size() == _capacity - 2)
+        _producers_cv.notify_all();
+    return v;
+}
+
 template<typename T>
 void locking_channel<T>::put(T v)
 {
     std::lock_guard<mutex> lock(_mutex);
 
-    _producers_cv.wait(_write_checkpoint, _mutex, [=]()// WARNING: the value of _wr & _rd may be different before and after waiting (modified by another threads)
-    {
-        return _rd != wr_next() || _closed;
-    });
+    if (!can_put())
+        _put_waits++;
+    _producers_cv.wait(_write_checkpoint, _mutex, [this]() { return can_put(); }); // WARNING: the value of _wr & _rd may be different before and after waiting (modified by another threads)
 
     if (_closed)
         throw channel_closed();
 
-    new(&_data[_wr]) T(std::move(v));
-    _wr = wr_next();
-
-    //std::cout << boost::format("CHAN: after write, %d left in channel. _wr=%d, _rd=%d") % size() % _wr % _rd << std::endl;
-    if (size() == 1)
-        _consumers_cv.notify_all();
+    push(std::move(v));
 }
 
 template<typename T>
@@ -154,7 +213,9 @@ T locking_channel<T>::get()
 {
     std::lock_guard<mutex> lock(_mutex);
 
-    _consumers_cv.wait(_read_checkpoint, _mutex, [=]() { return _rd != _wr || _closed; });
+    if (!can_get())
+        _get_waits++;
+    _consumers_cv.wait(_read_checkpoint, _mutex, [this]() { return can_get(); });
 
     if (_rd == _wr)
     {
@@ -162,43 +223,129 @@ T locking_channel<T>::get()
         throw channel_closed();
     }
 
-    T v(std::move(_data[_rd]));
-    _data[_rd].~T();
-    _rd++;
-    if (_rd == _capacity)
-        _rd = 0;
+    return pop();
+}
 
-    //std::cout << "CHAN: after read, " << size() << " left in channel" << std::endl;
-    if (size() == _capacity - 2)
-        _producers_cv.notify_all();
+template<typename T>
+bool locking_channel<T>::try_get(T& b)
+{
+    std::lock_guard<mutex> lock(_mutex);
 
-    return v;
+    if (_rd == _wr)
+        return false;
+
+    b = pop();
+    return true;
 }
 
 template<typename T>
-bool locking_channel<T>::try_get(T& b)
+bool locking_channel<T>::put_for(T v, std::chrono::steady_clock::duration timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::lock_guard<mutex> lock(_mutex);
+
+    if (!can_put())
+        _put_waits++;
+    if (!_producers_cv.wait_until(_write_checkpoint, _mutex, deadline, [this]() { return can_put(); }))
+        return false;
+
+    if (_closed)
+        throw channel_closed();
+
+    push(std::move(v));
+    return true;
+}
+
+template<typename T>
+bool locking_channel<T>::get_for(T& b, std::chrono::steady_clock::duration timeout)
 {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
     std::lock_guard<mutex> lock(_mutex);
 
+    if (!can_get())
+        _get_waits++;
+    if (!_consumers_cv.wait_until(_read_checkpoint, _mutex, deadline, [this]() { return can_get(); }))
+        return false;
+
     if (_rd == _wr)
     {
-        return false;
+        assert(_closed);
+        throw channel_closed();
     }
-    else
+
+    b = pop();
+    return true;
+}
+
+template<typename T>
+bool locking_channel<T>::select_try_put(T& v)
+{
+    std::lock_guard<mutex> lock(_mutex);
+
+    if (_closed)
+        throw channel_closed();
+
+    if (_rd == wr_next())
+        return false;
+
+    push(std::move(v));
+    return true;
+}
+
+template<typename T>
+bool locking_channel<T>::select_try_get(T& v)
+{
+    std::lock_guard<mutex> lock(_mutex);
+
+    if (_rd == _wr)
     {
-        b = std::move(_data[_rd]);
-        _data[_rd].~T();
-        _rd++;
-        if (_rd == _capacity)
-            _rd = 0;
+        if (_closed)
+            throw channel_closed();
+        return false;
+    }
 
-        if (size() == _capacity - 2)
-            _producers_cv.notify_all();
+    v = pop();
+    return true;
+}
+
+template<typename T>
+bool locking_channel<T>::select_register_put(select_waiter& waiter)
+{
+    std::lock_guard<mutex> lock(_mutex);
 
+    if (can_put())
         return true;
-    }
+
+    _producers_cv.add_waiter(waiter);
+    _put_waits++;
+    return false;
 }
 
+template<typename T>
+bool locking_channel<T>::select_register_get(select_waiter& waiter)
+{
+    std::lock_guard<mutex> lock(_mutex);
+
+    if (can_get())
+        return true;
+
+    _consumers_cv.add_waiter(waiter);
+    _get_waits++;
+    return false;
+}
+
+template<typename T>
+void locking_channel<T>::get_metrics(channel_metrics& m) const
+{
+    std::lock_guard<mutex> lock(_mutex);
+    m.name = _name;
+    m.capacity = _capacity - 1;
+    m.size = size();
+    m.puts = _puts;
+    m.gets = _gets;
+    m.put_waits = _put_waits;
+    m.get_waits = _get_waits;
+}
 
 template<typename T>
 void locking_channel<T>::do_close()
@@ -0,0 +1,292 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/metrics.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <cassert>
+#include <cmath>
+
+namespace coroutines {
+
+const unsigned histogram::SUB_BUCKET_BITS;
+const unsigned histogram::SUB_BUCKETS;
+const unsigned histogram::BUCKETS;
+
+const std::size_t coroutine_latency::MAX_NAMES;
+const char* const coroutine_latency::OTHER_NAME = "other";
+
+unsigned histogram::bucket_of(std::uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return value;
+
+    // the highest bit selects the power of 2, the ones below it the linear sub-bucket
+    unsigned magnitude = 63 - __builtin_clzll(value);
+    unsigned shift = magnitude - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+std::uint64_t histogram::lowest_in_bucket(unsigned bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    return std::uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+std::uint64_t histogram::highest_in_bucket(unsigned bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    return lowest_in_bucket(bucket) + ((std::uint64_t(1) << shift) - 1); // wraps to max for the last one
+}
+
+void histogram::record(std::uint64_t value, std::uint64_t count)
+{
+    if (count == 0)
+        return;
+
+    unsigned bucket = bucket_of(value);
+    if (bucket >= _counts.size())
+        _counts.resize(bucket + 1, 0);
+    _counts[bucket] += count;
+    _min = _count ? std::min(_min, value) : value;
+    _max = std::max(_max, value);
+    _count += count;
+    _sum += value * count;
+}
+
+histogram& histogram::operator+=(const histogram& o)
+{
+    if (o._count == 0)
+        return *this;
+
+    if (o._counts.size() > _counts.size())
+        _counts.resize(o._counts.size(), 0);
+    for(unsigned i = 0; i < o._counts.size(); i++)
+    {
+        _counts[i] += o._counts[i];
+    }
+    _min = _count ? std::min(_min, o._min) : o._min;
+    _max = std::max(_max, o._max);
+    _count += o._count;
+    _sum += o._sum;
+    return *this;
+}
+
+std::uint64_t histogram::percentile(double quantile) const
+{
+    if (_count == 0)
+        return 0;
+
+    std::uint64_t rank = std::uint64_t(std::ceil(std::max(0.0, std::min(quantile, 1.0)) * _count));
+    rank = std::max<std::uint64_t>(rank, 1);
+
+    std::uint64_t seen = 0;
+    for(unsigned i = 0; i < _counts.size(); i++)
+    {
+        seen += _counts[i];
+        if (seen >= rank)
+            return std::max(std::min(highest_in_bucket(i), _max), _min);
+    }
+    return _max;
+}
+
+concurrent_histogram::concurrent_histogram()
+    : _sum(0)
+    , _max(0)
+{
+    for(std::atomic<std::uint64_t>& c : _counts)
+    {
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+void concurrent_histogram::read(histogram& h) const
+{
+    histogram mine;
+    for(unsigned i = 0; i < histogram::BUCKETS; i++)
+    {
+        std::uint64_t c = _counts[i].load(std::memory_order_relaxed);
+        if (c == 0)
+            continue;
+        if (mine._count == 0)
+            mine._min = histogram::lowest_in_bucket(i);
+        mine._counts.resize(i + 1, 0);
+        mine._counts[i] = c;
+        mine._count += c;
+    }
+    mine._sum = _sum.load(std::memory_order_relaxed);
+    mine._max = _max.load(std::memory_order_relaxed);
+    h += mine;
+}
+
+channel_list::channel_list()
+    : _mutex("channel list mutex")
+{
+}
+
+void channel_list::add(channel_metrics_source& channel)
+{
+    std::lock_guard<mutex> lock(_mutex);
+    channel._prev = nullptr;
+    channel._next = _head;
+    if (_head)
+        _head->_prev = &channel;
+    _head = &channel;
+}
+
+void channel_list::remove(channel_metrics_source& channel)
+{
+    std::lock_guard<mutex> lock(_mutex);
+    if (channel._prev)
+        channel._prev->_next = channel._next;
+    else
+        _head = channel._next;
+    if (channel._next)
+        channel._next->_prev = channel._prev;
+    channel._prev = channel._next = nullptr;
+}
+
+void channel_list::read(std::vector<channel_metrics>& out)
+{
+    std::lock_guard<mutex> lock(_mutex);
+    for(channel_metrics_source* c = _head; c; c = c->_next)
+    {
+        out.emplace_back();
+        c->get_metrics(out.back());
+    }
+}
+
+static void histogram_text(std::ostream& out, const char* name, const histogram& h)
+{
+    out << std::setw(24) << name << ": count " << h.count();
+    if (h.count())
+    {
+        out << ", min " << h.min() << " ns, mean " << std::uint64_t(h.mean())
+            << " ns, p50 " << h.percentile(0.5) << " ns, p99 " << h.percentile(0.99)
+            << " ns, p999 " << h.percentile(0.999) << " ns, max " << h.max() << " ns";
+    }
+    out << "\n";
+}
+
+std::string scheduler_metrics::to_text() const
+{
+    std::ostringstream out;
+    out << std::setw(24) << "coroutines" << ": " << coroutines << " (max " << max_coroutines << ")\n";
+    out << std::setw(24) << "processors" << ": " << processors.size() << " (" << blocked_processors << " blocked, "
+        << processors_spawned << " spawned, " << processors_retired << " retired)\n";
+    out << std::setw(24) << "context switches" << ": " << total.runs << "\n";
+    out << std::setw(24) << "steals" << ": " << total.steals_succeeded << "/" << total.steals_attempted
+        << " succeeded, " << total.stolen << " coroutines stolen\n";
+    out << std::setw(24) << "global queue" << ": " << global_queue_size << " now, " << global_queue_pushes << " pushes\n";
+    out << std::setw(24) << "idle" << ": " << idle.parks << " parks, " << idle.wakeups << " wakeups, "
+        << idle.spin_hits << "/" << idle.spins << " spins found work\n";
+    out << std::setw(24) << "stack pool" << ": " << stacks.hits << " hits, " << stacks.misses << " misses, "
+        << stacks.cached << " cached\n";
+    histogram_text(out, "run delay", run_delay);
+    histogram_text(out, "run slice", run_slice);
+
+    for(const processor_metrics& p : processors)
+    {
+        out << "  processor " << std::setw(4) << p.ordinal << ": queue " << p.queue_size << (p.blocked ? " (blocked)" : "")
+            << ", runs " << p.runs << ", steals " << p.steals_succeeded << "/" << p.steals_attempted << "\n";
+    }
+    for(const coroutine_latency& l : by_name)
+    {
+        out << "  coroutine '" << l.name << "'\n";
+        histogram_text(out, "run delay", l.run_delay);
+        histogram_text(out, "run slice", l.run_slice);
+    }
+    for(const channel_metrics& c : channels)
+    {
+        out << "  channel '" << c.name << "': " << c.size << "/" << c.capacity << ", puts " << c.puts
+            << " (" << c.put_waits << " waited), gets " << c.gets << " (" << c.get_waits << " waited)\n";
+    }
+    return out.str();
+}
+
+static void json_string(std::ostream& out, const std::string& s)
+{
+    out << '"';
+    for(char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+static void histogram_json(std::ostream& out, const histogram& h)
+{
+    out << "{\"count\":" << h.count() << ",\"min\":" << h.min() << ",\"max\":" << h.max()
+        << ",\"mean\":" << std::uint64_t(h.mean())
+        << ",\"p50\":" << h.percentile(0.5) << ",\"p90\":" << h.percentile(0.9)
+        << ",\"p99\":" << h.percentile(0.99) << ",\"p999\":" << h.percentile(0.999) << "}";
+}
+
+std::string scheduler_metrics::to_json() const
+{
+    std::ostringstream out;
+    out << "{\"coroutines\":" << coroutines
+        << ",\"max_coroutines\":" << max_coroutines
+        << ",\"blocked_processors\":" << blocked_processors
+        << ",\"processors_spawned\":" << processors_spawned
+        << ",\"processors_retired\":" << processors_retired
+        << ",\"context_switches\":" << total.runs
+        << ",\"steals_attempted\":" << total.steals_attempted
+        << ",\"steals_succeeded\":" << total.steals_succeeded
+        << ",\"stolen\":" << total.stolen
+        << ",\"global_queue_pushes\":" << global_queue_pushes
+        << ",\"global_queue_size\":" << global_queue_size
+        << ",\"idle\":{\"wakeups\":" << idle.wakeups << ",\"parks\":" << idle.parks << ",\"spins\":" << idle.spins
+            << ",\"spin_hits\":" << idle.spin_hits << ",\"spin_ns\":" << idle.spin_ns << "}"
+        << ",\"stacks\":{\"hits\":" << stacks.hits << ",\"misses\":" << stacks.misses << ",\"cached\":" << stacks.cached << "}"
+        << ",\"run_delay_ns\":";
+    histogram_json(out, run_delay);
+    out << ",\"run_slice_ns\":";
+    histogram_json(out, run_slice);
+
+    out << ",\"processors\":[";
+    for(std::size_t i = 0; i < processors.size(); i++)
+    {
+        const processor_metrics& p = processors[i];
+        out << (i ? "," : "") << "{\"ordinal\":" << p.ordinal << ",\"queue_size\":" << p.queue_size
+            << ",\"blocked\":" << (p.blocked ? "true" : "false") << ",\"runs\":" << p.runs
+            << ",\"steals_attempted\":" << p.steals_attempted << ",\"steals_succeeded\":" << p.steals_succeeded
+            << ",\"stolen\":" << p.stolen << "}";
+    }
+    out << "],\"coroutines_by_name\":[";
+    for(std::size_t i = 0; i < by_name.size(); i++)
+    {
+        const coroutine_latency& l = by_name[i];
+        out << (i ? "," : "") << "{\"name\":";
+        json_string(out, l.name);
+        out << ",\"run_delay_ns\":";
+        histogram_json(out, l.run_delay);
+        out << ",\"run_slice_ns\":";
+        histogram_json(out, l.run_slice);
+        out << "}";
+    }
+    out << "],\"channels\":[";
+    for(std::size_t i = 0; i < channels.size(); i++)
+    {
+        const channel_metrics& c = channels[i];
+        out << (i ? "," : "") << "{\"name\":";
+        json_string(out, c.name);
+        out << ",\"capacity\":" << c.capacity << ",\"size\":" << c.size << ",\"puts\":" << c.puts << ",\"gets\":" << c.gets
+            << ",\"put_waits\":" << c.put_waits << ",\"get_waits\":" << c.get_waits << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+}
@@ -0,0 +1,231 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_METRICS_HPP
+#define COROUTINES_METRICS_HPP
+
+#include "coroutines/stack_allocator.hpp"
+#include "coroutines/mutex.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace coroutines {
+
+class scheduler;
+
+// monotonic time in nanoseconds, for latency measurements
+inline std::uint64_t metrics_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// counters written by one thread only, read by any
+inline void increment(std::atomic<std::uint64_t>& counter, std::uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// log-linear histogram of values in nanoseconds, HDR-style: every power of 2 is split into SUB_BUCKETS linear buckets,
+// so any recorded value is known within 1/SUB_BUCKETS of its magnitude. Plain value, merged with +=.
+// Buckets are allocated up to the highest one used
+class histogram
+{
+public:
+    static const unsigned SUB_BUCKET_BITS = 4;
+    static const unsigned SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const unsigned BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    void record(std::uint64_t value, std::uint64_t count = 1);
+
+    histogram& operator+=(const histogram& o);
+
+    std::uint64_t count() const { return _count; }
+    std::uint64_t min() const { return _count ? _min : 0; }
+    std::uint64_t max() const { return _max; }
+    double mean() const { return _count ? double(_sum) / _count : 0.0; }
+
+    // highest value equivalent to the one at the quantile (0-1), 0 if empty
+    std::uint64_t percentile(double quantile) const;
+
+    static unsigned bucket_of(std::uint64_t value);
+    static std::uint64_t lowest_in_bucket(unsigned bucket);
+    static std::uint64_t highest_in_bucket(unsigned bucket);
+
+private:
+    friend class concurrent_histogram;
+
+    std::vector<std::uint64_t> _counts;
+    std::uint64_t _count = 0;
+    std::uint64_t _sum = 0;
+    std::uint64_t _min = 0;
+    std::uint64_t _max = 0;
+};
+
+// histogram recorded by one thread and read by any, without locks. Counts read while recording may be one behind,
+// min is known only to the bucket
+class concurrent_histogram
+{
+public:
+    concurrent_histogram();
+    concurrent_histogram(const concurrent_histogram&) = delete;
+
+    void record(std::uint64_t value)
+    {
+        increment(_counts[histogram::bucket_of(value)]);
+        increment(_sum, value);
+        if (value > _max.load(std::memory_order_relaxed))
+            _max.store(value, std::memory_order_relaxed);
+    }
+
+    // adds the counts to 'h'
+    void read(histogram& h) const;
+
+private:
+    std::atomic<std::uint64_t> _counts[histogram::BUCKETS];
+    std::atomic<std::uint64_t> _sum;
+    std::atomic<std::uint64_t> _max;
+};
+
+// idle protocol counters
+struct idle_stats
+{
+    std::uint64_t wakeups = 0;      // wake syscalls made to unpark processors
+    std::uint64_t parks = 0;        // times processors went to sleep
+    std::uint64_t spins = 0;        // times processors spun waiting for work
+    std::uint64_t spin_hits = 0;    // spins that ended with work found
+    std::uint64_t spin_ns = 0;      // total time spent spinning
+
+    idle_stats& operator+=(const idle_stats& o)
+    {
+        wakeups += o.wakeups;
+        parks += o.parks;
+        spins += o.spins;
+        spin_hits += o.spin_hits;
+        spin_ns += o.spin_ns;
+        return *this;
+    }
+};
+
+// run delay and run slice of coroutines with the same name, sampled like scheduler_metrics::run_delay.
+// Names can be made up at run time, only the first MAX_NAMES are kept apart, the rest are counted under OTHER_NAME
+struct coroutine_latency
+{
+    static const std::size_t MAX_NAMES = 256;
+    static const char* const OTHER_NAME;
+
+    std::string name;
+    histogram run_delay;    // ns between becoming runnable and being run
+    histogram run_slice;    // ns from being run to yielding or finishing
+};
+
+// processor's counters, since it was created
+struct processor_metrics
+{
+    unsigned ordinal = 0;
+    unsigned queue_size = 0;            // approximate, see processor::queue_size()
+    bool blocked = false;
+
+    std::uint64_t runs = 0;             // context switches into coroutines
+    std::uint64_t steals_attempted = 0; // times it ran out of work and went stealing
+    std::uint64_t steals_succeeded = 0;
+    std::uint64_t stolen = 0;           // coroutines taken from others
+
+    processor_metrics& operator+=(const processor_metrics& o)
+    {
+        runs += o.runs;
+        steals_attempted += o.steals_attempted;
+        steals_succeeded += o.steals_succeeded;
+        stolen += o.stolen;
+        return *this;
+    }
+};
+
+struct channel_metrics
+{
+    std::string name;
+    std::size_t capacity = 0;
+    std::size_t size = 0;           // items in the channel now
+    std::uint64_t puts = 0;
+    std::uint64_t gets = 0;
+    std::uint64_t put_waits = 0;    // times a producer found the channel full and parked
+    std::uint64_t get_waits = 0;    // times a consumer found it empty and parked
+};
+
+// channel's entry in its scheduler's list of live channels
+class channel_metrics_source
+{
+public:
+    virtual void get_metrics(channel_metrics& m) const = 0;
+
+protected:
+    ~channel_metrics_source() { }
+
+private:
+    friend class channel_list;
+
+    channel_metrics_source* _prev = nullptr;
+    channel_metrics_source* _next = nullptr;
+};
+
+// live channels of a scheduler
+class channel_list
+{
+public:
+    channel_list();
+    channel_list(const channel_list&) = delete;
+
+    void add(channel_metrics_source& channel);
+    void remove(channel_metrics_source& channel);
+
+    // appends metrics of every channel
+    void read(std::vector<channel_metrics>& out);
+
+private:
+    channel_metrics_source* _head = nullptr;
+    mutex _mutex;
+};
+
+// channels add themselves in constructor and remove in destructor
+void add_channel(scheduler& sched, channel_metrics_source& channel);
+void remove_channel(scheduler& sched, channel_metrics_source& channel);
+
+// snapshot of the scheduler's state, returned by scheduler::get_metrics().
+// Counters of processors already destroyed are included in the totals
+struct scheduler_metrics
+{
+    std::vector<processor_metrics> processors;
+    processor_metrics total;
+
+    std::size_t coroutines = 0;         // live now
+    std::size_t max_coroutines = 0;     // highest seen
+    unsigned blocked_processors = 0;
+    std::uint64_t processors_spawned = 0;
+    std::uint64_t processors_retired = 0;
+    std::uint64_t global_queue_pushes = 0;
+    std::size_t global_queue_size = 0;
+
+    idle_stats idle;
+    stack_pool_stats stacks;
+
+    // ns between becoming runnable and being run, and then running until yield. Sampled, see scheduler::set_run_delay_sampling()
+    histogram run_delay;
+    histogram run_slice;
+
+    // the same, by coroutine name, sorted by name
+    std::vector<coroutine_latency> by_name;
+
+    std::vector<channel_metrics> channels;
+
+    // human-readable, one value per line
+    std::string to_text() const;
+
+    // single JSON object, histograms as count/min/max/mean and percentiles
+    std::string to_json() const;
+};
+
+}
+
+#endif // COROUTINES_METRICS_HPP
@@ -9,6 +9,8 @@
 
 #include "profiling/profiling.hpp"
 
+#include <algorithm>
+
 
 namespace coroutines {
 
@@ -22,6 +24,7 @@ monitor::~monitor()
 {
     //std::cout << "MONITOR: this=" << this << " deleting" << std::endl;
     assert(_waiting.empty());
+    assert(_selecting.empty());
 }
 
 void monitor::wait(const std::string& checkopint_name, epilogue_type epilogue)
@@ -45,6 +48,48 @@ void monitor::wait(const std::string& checkopint_name, epilogue_type epilogue)
     });
 }
 
+bool monitor::wait_until(const std::string& checkopint_name, std::chrono::steady_clock::time_point deadline, epilogue_type epilogue)
+{
+    CORO_PROF("monitor", this, "wait_until", checkopint_name.c_str());
+
+    coroutine* coro = coroutine::current_corutine();
+    assert(coro);
+
+    CORO_LOG("MONITOR: this=",  this, " '", coro->name(), "' will wait with timeout");
+
+    if (deadline <= std::chrono::steady_clock::now())
+    {
+        if (epilogue)
+            epilogue();
+        return false;
+    }
+
+    // waits in the monitor and in the timer wheel, the first one to wake it wins
+    struct wait_state
+    {
+        wait_state(coroutine_weak_ptr c, std::chrono::steady_clock::time_point d, epilogue_type&& e)
+            : waiter(c), deadline(d), epilogue(std::move(e)) { }
+
+        select_waiter waiter;
+        timer t;
+        std::chrono::steady_clock::time_point deadline;
+        epilogue_type epilogue;
+    } state(coro, deadline, std::move(epilogue));
+    state.t.waiter = &state.waiter;
+
+    coro->yield(checkopint_name, [this, &state](coroutine_weak_ptr)
+    {
+        add(state.waiter);
+        _scheduler.add_timer(state.t, state.deadline);
+        if (state.epilogue)
+            state.epilogue();
+    });
+
+    remove(state.waiter);
+    _scheduler.cancel_timer(state.t);
+    return !state.t.fired;
+}
+
 void monitor::wake_all()
 {
     CORO_LOG("MONITOR: wake_all");
@@ -53,11 +98,25 @@ void monitor::wake_all()
     {
         std::lock_guard<mutex> lock(_waiting_mutex);
         _waiting.swap(waiting);
+
+        // selecting waiter can be touched only here, under the lock. Once removed it may cease to exist
+        for(select_waiter* w : _selecting)
+        {
+            if (!w->woken.exchange(true))
+                waiting.push_back(w->coro);
+        }
+        _selecting.clear();
     }
 
     CORO_LOG("MONITOR: waking up ", waiting.size(), " coroutine(s)");
 
-    if (!waiting.empty())
+    if (waiting.size() == 1)
+    {
+        // the usual case for channels. Goes to the 'next' slot, like wake_one()
+        CORO_PROF("monitor", this, "wake_all");
+        _scheduler.schedule(waiting.front());
+    }
+    else if (!waiting.empty())
     {
         CORO_PROF("monitor", this, "wake_all");
         _scheduler.schedule(waiting.begin(), waiting.end());
@@ -76,6 +135,13 @@ void monitor::wake_one()
             waiting = _waiting.back();
             _waiting.pop_back();
         }
+        while(!waiting && !_selecting.empty())
+        {
+            select_waiter* w = _selecting.back();
+            _selecting.pop_back();
+            if (!w->woken.exchange(true))
+                waiting = w->coro;
+        }
     }
 
     if (waiting)
@@ -90,4 +156,18 @@ void monitor::wake_one()
     }
 }
 
+void monitor::add(select_waiter& waiter)
+{
+    CORO_LOG("MONITOR: this=", this, " '", waiter.coro->name(), "' added to queue by select");
+
+    std::lock_guard<mutex> lock(_waiting_mutex);
+    _selecting.push_back(&waiter);
+}
+
+void monitor::remove(select_waiter& waiter)
+{
+    std::lock_guard<mutex> lock(_waiting_mutex);
+    _selecting.erase(std::remove(_selecting.begin(), _selecting.end(), &waiter), _selecting.end());
+}
+
 }
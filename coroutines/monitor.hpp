@@ -7,11 +7,24 @@
 
 #include <vector>
 #include <functional>
+#include <atomic>
+#include <chrono>
 
 namespace coroutines {
 
 class scheduler;
 
+// coroutine waiting in several monitors at once (see selector). Only the first wake-up counts
+struct select_waiter
+{
+    explicit select_waiter(coroutine_weak_ptr c)
+    : coro(c), woken(false)
+    { }
+
+    coroutine_weak_ptr coro;
+    std::atomic<bool> woken;
+};
+
 // monitor is a syncronisation tool.
 // it allows one corotunie to wait for singla from another.
 class monitor
@@ -28,16 +41,27 @@ public:
     // Epilogue will be called after the coroutine is preemted
     void wait(const std::string& checkpoint_name, epilogue_type epilogue = epilogue_type());
 
+    // as above, but gives up at the deadline. Returns false if timed out
+    bool wait_until(const std::string& checkpoint_name, std::chrono::steady_clock::time_point deadline, epilogue_type epilogue = epilogue_type());
+
     // wakes all waiting corotunies
     void wake_all();
 
     // wakes one of the waiting corountines
     void wake_one();
 
+    // adds waiter that is already parked, or is about to (called from yield epilogue).
+    // As with wait(), the caller is responsible for not missing the condition
+    void add(select_waiter& waiter);
+
+    // removes the waiter, if not woken by this monitor already
+    void remove(select_waiter& waiter);
+
 
 private:
 
     std::vector<coroutine_weak_ptr> _waiting;
+    std::vector<select_waiter*> _selecting; // woken after _waiting, may be already woken by other monitor
     mutex _waiting_mutex;
 
     scheduler& _scheduler;
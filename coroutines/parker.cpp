@@ -0,0 +1,48 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/parker.hpp"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+
+namespace coroutines {
+
+static int futex(std::atomic<int>* addr, int op, int val, const timespec* timeout)
+{
+    return ::syscall(SYS_futex, reinterpret_cast<int*>(addr), op, val, timeout, nullptr, 0);
+}
+
+bool parker::park(std::chrono::nanoseconds timeout)
+{
+    // wake-up already there, consume it
+    if (_state.exchange(EMPTY, std::memory_order_acquire) == NOTIFIED)
+        return true;
+
+    int expected = EMPTY;
+    if (!_state.compare_exchange_strong(expected, PARKED, std::memory_order_acq_rel))
+    {
+        // notified in the meantime
+        _state.store(EMPTY, std::memory_order_relaxed);
+        return true;
+    }
+
+    timespec ts;
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    futex(&_state, FUTEX_WAIT_PRIVATE, PARKED, &ts); // returns immediately if no longer PARKED
+
+    return _state.exchange(EMPTY, std::memory_order_acquire) == NOTIFIED;
+}
+
+bool parker::unpark()
+{
+    if (_state.exchange(NOTIFIED, std::memory_order_release) == PARKED)
+    {
+        futex(&_state, FUTEX_WAKE_PRIVATE, 1, nullptr);
+        return true;
+    }
+    return false;
+}
+
+}
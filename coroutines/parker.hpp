@@ -0,0 +1,42 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_PARKER_HPP
+#define COROUTINES_PARKER_HPP
+
+#include <atomic>
+#include <chrono>
+
+namespace coroutines {
+
+// puts a thread to sleep until woken by another one. Futex-based.
+// unpark() makes a syscall only if the thread is actually parked, and a wake-up sent before park() is not lost.
+class parker
+{
+public:
+
+    parker() : _state(EMPTY) { }
+    parker(const parker&) = delete;
+
+    // called by the owning thread. Returns true if woken by unpark(), false on timeout or spurious wakeup
+    bool park(std::chrono::nanoseconds timeout);
+
+    // can be called from any thread. Returns true if the wake syscall was made
+    bool unpark();
+
+private:
+
+    enum state { EMPTY = 0, PARKED = 1, NOTIFIED = 2 };
+
+    std::atomic<int> _state;
+};
+
+// busy-wait hint for the cpu
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+}
+
+#endif
@@ -8,14 +8,50 @@
 
 #include <mutex>
 #include <algorithm>
+#include <chrono>
+#include <cassert>
+#include <cstring>
 
 namespace coroutines {
 
 static thread_local processor* __current_processor= nullptr;
 
+static std::atomic<unsigned> __processors_created(0);
+
+// how often idle processor reports to the scheduler
+static const std::chrono::milliseconds IDLE_PERIOD(500);
+
+// on a single cpu other threads can't help, spinning only delays whoever is to send the work, and sharing it only adds context switches
+static const bool MULTICORE = std::thread::hardware_concurrency() > 1;
+
+// how long processor spins looking for work before going to sleep
+static const std::chrono::microseconds SPIN_PERIOD(MULTICORE ? 50 : 0);
+
+// how many times in a row the 'next' slot may go ahead of the queue
+static const unsigned NEXT_STREAK_LIMIT = 16;
+
+// how often busy processor looks for expired timers and ready I/O, in coroutines run
+static const unsigned TIMERS_INTERVAL = 64;
+
 processor::processor(scheduler& sched)
     : _scheduler(sched)
-    , _queue_mutex("processor queue mutex")
+    , _ordinal(__processors_created.fetch_add(1, std::memory_order_relaxed))
+    , _next(nullptr)
+    , _inbox_size(0)
+    , _inbox_mutex("processor inbox mutex")
+    , _stopped(false)
+    , _waiting(false)
+    , _polling(false)
+    , _wakeups(0)
+    , _parks(0)
+    , _spins(0)
+    , _spin_hits(0)
+    , _spin_ns(0)
+    , _runs(0)
+    , _steals_attempted(0)
+    , _steals_succeeded(0)
+    , _stolen(0)
+    , _latency_mutex("processor latency mutex")
     , _thread([this]() { routine(); })
 {
 }
@@ -24,24 +60,45 @@ processor::~processor()
 {
     CORO_LOG("PROC=", this, " destroyed");
 
-    _thread.join();
+    join();
+}
+
+void processor::join()
+{
+    if (_thread.joinable())
+        _thread.join();
 }
 
 template<typename InputIterator>
 bool processor::enqueue(InputIterator first, InputIterator last)
 {
+    // own thread goes straight to the queue. _blocked is changed only by this thread
+    if (current_processor() == this && !_blocked)
     {
-        std::lock_guard<mutex> lock(_queue_mutex);
+        for(; first != last; ++first)
+        {
+            _queue.push(*first);
+        }
+        CORO_LOG("PROC=", this, " enqueued coros from own thread");
+        return true;
+    }
+
+    {
+        std::lock_guard<mutex> lock(_inbox_mutex);
 
         if (_stopped || _blocked)
             return false;
 
-        _queue.insert(_queue.end(), first, last);
+        _inbox.insert(_inbox.end(), first, last);
+        _inbox_size.store(_inbox.size()); // seq_cst, pairs with _waiting in wait_for_work()
     }
 
-    CORO_LOG("PROC=", this, " enqueued ", std::distance(first, last), " coros, waking up");
-
-    _cv.notify_one();
+    // busy processor will find it in the inbox, only sleeping one needs a wake-up
+    if (_waiting.load())
+    {
+        CORO_LOG("PROC=", this, " enqueued ", std::distance(first, last), " coros, waking up");
+        notify();
+    }
     return true;
 }
 
@@ -55,22 +112,36 @@ bool processor::enqueue(coroutine_weak_ptr coro)
     return enqueue(&coro, &coro + 1);
 }
 
+bool processor::enqueue_next(coroutine_weak_ptr coro, coroutine_weak_ptr& displaced)
+{
+    assert(current_processor() == this);
+
+    // _blocked is changed only by this thread
+    if (_blocked)
+        return false;
+
+    displaced = _next.exchange(coro, std::memory_order_acq_rel);
+    CORO_LOG("PROC=", this, " coro '", coro->name(), "' will run next");
+    return true;
+}
+
 bool processor::stop()
 {
-    std::lock_guard<mutex> lock(_queue_mutex);
+    std::lock_guard<mutex> lock(_inbox_mutex);
     _stopped = true;
-    _cv.notify_one();
+    notify();
 
-    return _queue.empty() || _executing;
+    return _queue.empty() && _inbox.empty() && !_next.load();
 }
 
 bool processor::stop_if_idle()
 {
-    std::lock_guard<mutex> lock(_queue_mutex);
-    if (_queue.empty() && !_executing)
+    // while the routine is waiting, only other threads can add work, and they need the lock
+    std::lock_guard<mutex> lock(_inbox_mutex);
+    if (_waiting && _queue.empty() && _inbox.empty() && !_next.load())
     {
         _stopped = true;
-        _cv.notify_one();
+        notify();
         return true;
     }
     return false;
@@ -79,30 +150,214 @@ bool processor::stop_if_idle()
 
 void processor::steal(std::vector<coroutine_weak_ptr>& out)
 {
+    std::size_t to_steal = (_queue.size() + 1) / 2; // rounds up, a single waiting coroutine is worth stealing
+    for(std::size_t i = 0; i < to_steal; i++)
     {
-        std::lock_guard<mutex> lock(_queue_mutex);
+        coroutine_weak_ptr coro;
+        if (!_queue.steal(coro))
+            break;
+        out.push_back(coro);
+    }
 
-        unsigned to_steal = _queue.size() / 2; // rounds down
-        if (to_steal > 0)
-        {
-            unsigned to_leave = _queue.size() - to_steal;
-            auto it = _queue.begin();
-            std::advance(it, to_leave);
+    // the owner is busy with something else, so the one it has woken may as well run here
+    if (to_steal == 0 && _next.load(std::memory_order_relaxed))
+    {
+        coroutine_weak_ptr coro = _next.exchange(nullptr, std::memory_order_acq_rel);
+        if (coro)
+            out.push_back(coro);
+    }
+}
 
-            out.reserve(out.size() + to_steal);
-            std::for_each(it, _queue.end(), [&out](coroutine_weak_ptr& coro)
-            {
-                out.push_back(std::move(coro));
-            });
-            _queue.resize(to_leave);
+idle_stats processor::get_idle_stats() const
+{
+    idle_stats s;
+    s.wakeups = _wakeups.load(std::memory_order_relaxed);
+    s.parks = _parks.load(std::memory_order_relaxed);
+    s.spins = _spins.load(std::memory_order_relaxed);
+    s.spin_hits = _spin_hits.load(std::memory_order_relaxed);
+    s.spin_ns = _spin_ns.load(std::memory_order_relaxed);
+    return s;
+}
+
+processor_metrics processor::get_metrics()
+{
+    processor_metrics m;
+    m.ordinal = _ordinal;
+    m.queue_size = queue_size();
+    {
+        std::lock_guard<mutex> lock(_inbox_mutex);
+        m.blocked = _blocked;
+    }
+    m.runs = _runs.load(std::memory_order_relaxed);
+    m.steals_attempted = _steals_attempted.load(std::memory_order_relaxed);
+    m.steals_succeeded = _steals_succeeded.load(std::memory_order_relaxed);
+    m.stolen = _stolen.load(std::memory_order_relaxed);
+    return m;
+}
+
+void processor::read_latency_by_name(std::map<std::string, coroutine_latency>& out) const
+{
+    std::lock_guard<mutex> lock(_latency_mutex);
+    for(const auto& p : _latency_by_name)
+    {
+        auto it = out.find(p.first);
+        if (it == out.end())
+        {
+            // names of all processors, and of the retired ones, together. OTHER_NAME may be among them already
+            bool full = out.size() - out.count(coroutine_latency::OTHER_NAME) >= coroutine_latency::MAX_NAMES;
+            const std::string& name = full ? coroutine_latency::OTHER_NAME : p.first;
+            it = out.insert(std::make_pair(name, coroutine_latency())).first;
+            it->second.name = name;
         }
+        it->second.run_delay += p.second.run_delay;
+        it->second.run_slice += p.second.run_slice;
+    }
+}
+
+coroutine_latency& processor::latency_of(const char* name)
+{
+    latency_cache_entry& cached = _latency_cache[(reinterpret_cast<std::uintptr_t>(name) >> 3) % LATENCY_CACHE_SIZE];
+    if (cached.name == name && std::strcmp(cached.latency->name.c_str(), name) == 0)
+        return *cached.latency;
+
+    auto it = _latency_by_name.find(name);
+    if (it == _latency_by_name.end())
+    {
+        const char* key = _latency_by_name.size() < coroutine_latency::MAX_NAMES ? name : coroutine_latency::OTHER_NAME;
+        it = _latency_by_name.insert(std::make_pair(key, coroutine_latency())).first;
+        if (it->second.name.empty())
+            it->second.name = key;
+    }
+    coroutine_latency& latency = it->second; // elements don't move on rehash
+    cached.name = name;
+    cached.latency = &latency;
+    return latency;
+}
+
+void processor::run_sampled(coroutine_weak_ptr coro, std::uint64_t runnable_since)
+{
+    std::uint64_t start = metrics_now();
+    std::uint64_t delay = start > runnable_since ? start - runnable_since : 0;
+    _run_delay.record(delay);
+
+    coroutine_latency* latency;
+    {
+        std::lock_guard<mutex> lock(_latency_mutex);
+        latency = &latency_of(coro->name());
+        latency->run_delay.record(delay);
+    }
+
+    coro->run(); // finished one is gone, with its name
+
+    std::uint64_t slice = metrics_now() - start;
+    _run_slice.record(slice);
+
+    std::lock_guard<mutex> lock(_latency_mutex);
+    latency->run_slice.record(slice);
+}
+
+void processor::count_steal(std::size_t stolen)
+{
+    increment(_steals_attempted);
+    if (stolen > 0)
+    {
+        increment(_steals_succeeded);
+        increment(_stolen, stolen);
     }
 }
 
 unsigned processor::queue_size()
 {
-    std::lock_guard<mutex> lock(_queue_mutex);
-    return _queue.size() + _executing;
+    return _queue.size() + _inbox_size.load(std::memory_order_relaxed)
+        + (_next.load(std::memory_order_relaxed) != nullptr) + !_waiting.load(std::memory_order_relaxed);
+}
+
+void processor::notify()
+{
+    // the keeper may be between the two, both are cheap when not waited on
+    if (_parker.unpark())
+        _wakeups.fetch_add(1, std::memory_order_relaxed);
+    if (_polling.load())
+    {
+        _scheduler.interrupt_io();
+        _wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool processor::park(std::chrono::nanoseconds max)
+{
+    // seq_cst: notify() will see it, or what it was notifying about is seen below
+    _polling.store(true);
+
+    bool keeper;
+    std::chrono::nanoseconds timeout = _scheduler.processor_park_timeout(this, max, keeper);
+    if (!keeper)
+    {
+        _polling.store(false);
+        return _parker.park(timeout);
+    }
+
+    static thread_local std::vector<coroutine_weak_ptr> ready; // reused, no allocation after warm-up
+    ready.clear();
+    bool woken = has_work();
+    if (!woken)
+    {
+        if (_scheduler.poll_io(ready, timeout))
+            woken = !ready.empty();
+        else
+            woken = _parker.park(timeout); // no poller
+    }
+    _polling.store(false);
+
+    take(ready);
+    return woken;
+}
+
+bool processor::poll_io()
+{
+    if (!_scheduler.processor_should_poll())
+        return false;
+
+    static thread_local std::vector<coroutine_weak_ptr> ready;
+    ready.clear();
+    _scheduler.poll_io(ready, std::chrono::nanoseconds(0));
+    take(ready);
+    return !ready.empty();
+}
+
+bool processor::poll_io_local()
+{
+    static thread_local std::vector<coroutine_weak_ptr> ready;
+    ready.clear();
+    _scheduler.poll_io_local(this, ready);
+    take(ready);
+    return !ready.empty();
+}
+
+void processor::take(const std::vector<coroutine_weak_ptr>& found)
+{
+    if (found.empty())
+        return;
+
+    // the queue pops the newest first, so the first one ready runs first
+    std::uint64_t since = _scheduler.runnable_since();
+    for(auto it = found.rbegin(); it != found.rend(); ++it)
+    {
+        CORO_PROF("coroutine", *it, "runnable");
+        (*it)->set_runnable(since);
+        _queue.push(*it);
+    }
+}
+
+void processor::share_work()
+{
+    if (!MULTICORE || _queue.size() < 2)
+        return;
+
+    static thread_local std::vector<coroutine_weak_ptr> shared;
+    shared.clear();
+    steal(shared);
+    _scheduler.schedule_runnable(shared.begin(), shared.end()); // to a starved processor, or back here
 }
 
 void processor::block()
@@ -112,11 +367,18 @@ void processor::block()
 
     std::vector<coroutine_weak_ptr> queue;
     {
-        std::lock_guard<mutex> lock(_queue_mutex);
+        std::lock_guard<mutex> lock(_inbox_mutex);
 
-        queue.reserve(_queue.size());
-        std::copy(_queue.begin(), _queue.end(), std::back_inserter(queue));
-        _queue.clear();
+        coroutine_weak_ptr coro = _next.exchange(nullptr, std::memory_order_acq_rel);
+        if (coro)
+            queue.push_back(coro);
+        while(_queue.steal(coro)) // oldest first
+        {
+            queue.push_back(coro);
+        }
+        queue.insert(queue.end(), _inbox.begin(), _inbox.end());
+        _inbox.clear();
+        _inbox_size.store(0, std::memory_order_relaxed);
         _blocked = true;
     }
 
@@ -129,12 +391,117 @@ void processor::unblock()
     CORO_PROF("processor", this, "unblock");
 
     {
-        std::lock_guard<mutex> lock(_queue_mutex);
+        std::lock_guard<mutex> lock(_inbox_mutex);
         _blocked = false;
     }
     _scheduler.processor_unblocked(this);
 }
 
+void processor::drain_inbox()
+{
+    std::lock_guard<mutex> lock(_inbox_mutex);
+    for(coroutine_weak_ptr coro : _inbox)
+    {
+        _queue.push(coro);
+    }
+    _inbox.clear();
+    _inbox_size.store(0, std::memory_order_relaxed);
+}
+
+bool processor::next(coroutine_weak_ptr& coro)
+{
+    // every now and then take the oldest one, so the LIFO order can't starve anyone
+    static const unsigned FAIRNESS_INTERVAL = 32;
+
+    if (_inbox_size.load(std::memory_order_relaxed) > 0)
+        drain_inbox();
+
+    // the woken coroutine goes first, while what it was woken for is still in cache.
+    // Two coroutines passing messages would keep each other there forever, so after a streak the queue gets its turn
+    if ((_next_streak < NEXT_STREAK_LIMIT || _queue.empty()) && _next.load(std::memory_order_relaxed))
+    {
+        coro = _next.exchange(nullptr, std::memory_order_acq_rel);
+        if (coro)
+        {
+            _next_streak++;
+            return true;
+        }
+    }
+    _next_streak = 0;
+
+    if (++_pops % FAIRNESS_INTERVAL == 0 && _queue.steal(coro))
+        return true;
+
+    return _queue.pop(coro);
+}
+
+bool processor::wait_for_work()
+{
+    // own descriptors first, then spin: work often arrives soon after running out of it.
+    // I/O is checked while spinning too, if nobody is parked waiting for it
+    auto spin_start = std::chrono::steady_clock::now();
+    bool found = has_work() || poll_io_local();
+    for(unsigned i = 1; !found && SPIN_PERIOD.count() > 0; i++)
+    {
+        cpu_relax();
+        found = has_work();
+        if (i % 64 == 0)
+        {
+            found = found || poll_io();
+            if (std::chrono::steady_clock::now() - spin_start >= SPIN_PERIOD)
+                break;
+        }
+    }
+    auto spin_end = std::chrono::steady_clock::now();
+    increment(_spins);
+    increment(_spin_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(spin_end - spin_start).count());
+
+    if (found)
+    {
+        increment(_spin_hits);
+
+        // found by polling, not given by the scheduler
+        if (!_queue.empty())
+        {
+            _scheduler.processor_unparked(this);
+            share_work();
+        }
+    }
+    else
+    {
+        CORO_PROF("processor", this, "park");
+
+        _waiting.store(true); // seq_cst, enqueue() will see it, or it's enqueued item will be seen here
+        while(!has_work())
+        {
+            increment(_parks);
+            bool woken = park(IDLE_PERIOD);
+
+            // coroutines whose timers expired end up in own queue
+            _scheduler.run_timers(this);
+
+            if (!woken && !has_work())
+            {
+                // nothing to do for a while, scheduler may want to do some housekeeping
+                _scheduler.processor_idle(this);
+            }
+        }
+        _waiting.store(false);
+
+        // stopped processor may be on its way to destruction, scheduler has taken care of it
+        if (!_stopped.load())
+        {
+            _scheduler.processor_unparked(this);
+            share_work();
+        }
+
+        CORO_PROF("processor", this, "unpark");
+    }
+
+    std::lock_guard<mutex> lock(_inbox_mutex);
+    return !(_stopped && _inbox.empty());
+}
+
 processor* processor::current_processor()
 {
     return __current_processor;
@@ -142,7 +509,7 @@ processor* processor::current_processor()
 
 void processor::routine()
 {
-    CORO_PROF("PROC=", this, "routine started");
+    CORO_PROF("processor", this, "routine started");
     CORO_LOG("PROC=", this, " routine started");
 
     __current_processor = this;
@@ -150,43 +517,41 @@ void processor::routine()
 
     for(;;)
     {
-        // am I short on jobs?
-        bool starved = false;
-        {
-            std::lock_guard<mutex> lock(_queue_mutex);
-            _executing = false;
-            starved = _queue.empty();
-        }
-        // call scheduler outside of critical section
-        if(starved)
-            _scheduler.processor_starved(this); // ask for more
-
-        // take coro from queue
         coroutine_weak_ptr coro = nullptr;
+        if (!next(coro))
         {
-            std::lock_guard<mutex> lock(_queue_mutex);
+            // short on jobs, ask for more
+            _scheduler.processor_starved(this);
 
-            _cv.wait(
-                _queue_mutex,
-                [this](){ return _stopped || !_queue.empty(); });
-
-            if (_queue.empty())
+            if (!next(coro))
             {
-                assert(_stopped);
-                CORO_LOG("PROC=", this, " : Stopped, and queue empty. Stopping");
-                return;
+                if (!wait_for_work())
+                {
+                    CORO_LOG("PROC=", this, " : Stopped, and queue empty. Stopping");
+                    return;
+                }
+                continue;
             }
-            else
-            {
-                coro = _queue.front();
-                _queue.pop_front();
-            }
-            _executing = true;
         }
 
         // execute
         CORO_LOG("PROC=", this, " : will run coro '", coro->name(), "'");
-        coro->run();
+        std::uint64_t runnable_since = coro->take_runnable_since();
+        if (runnable_since)
+            run_sampled(coro, runnable_since);
+        else
+            coro->run();
+
+        increment(_runs);
+        if (_runs.load(std::memory_order_relaxed) % TIMERS_INTERVAL == 0)
+        {
+            _scheduler.run_timers();
+
+            // all descriptors if nobody is parked waiting for them, own ones otherwise
+            bool found = _scheduler.processor_should_poll() ? poll_io() : poll_io_local();
+            if (found)
+                share_work();
+        }
     }
 
     CORO_PROF("processor", this, "routine finished");
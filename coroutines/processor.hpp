@@ -4,11 +4,19 @@
 
 #include "coroutines/coroutine.hpp"
 #include "coroutines/mutex.hpp"
+#include "coroutines/stack_allocator.hpp"
+#include "coroutines/work_stealing_deque.hpp"
+#include "coroutines/parker.hpp"
+#include "coroutines/metrics.hpp"
 
-#include <deque>
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <thread>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 
 namespace coroutines {
 
@@ -33,40 +41,140 @@ public:
     template<typename InputIterator>
     void enqueue_or_die(InputIterator first, InputIterator last);
 
+    // puts the coroutine in the 'next' slot, to run as soon as the current one yields.
+    // Coroutine previously in the slot is returned in 'displaced' (null if none), caller must schedule it.
+    // Use only from processor's thread. Returns false if blocked
+    bool enqueue_next(coroutine_weak_ptr coro, coroutine_weak_ptr& displaced);
+
     // shuts the processor down, returns true if no tasks in the queue and processor can be destroyed
     // if false returned, the processor will stop after exhaustingf the queue
     bool stop();
 
+    // waits for the stopped processor's thread to finish
+    void join();
+
     // will stop the processor only if it has empty queue and is not doigng anything
     // if false is returned, the processor will continue
     bool stop_if_idle();
 
-    // steals half of work
+    // steals half of work, or the 'next' coroutine if the queue is empty. Lock-free, can be called from any thread
     void steal(std::vector<coroutine_weak_ptr>& out);
 
-    // number of tasks in the queue (including currently executed)
+    // number of tasks in the queue (including currently executed). Approximate
     unsigned queue_size();
 
+    // wakes the processor up if it's parked, so it looks at the timers again
+    void wake() { if (_waiting.load()) notify(); }
+
     // block/unblock
     void block();
     void unblock();
 
     static processor* current_processor();
 
+    // consecutive number given at creation, unique within the process
+    unsigned ordinal() const { return _ordinal; }
+
+    // stacks recycled by coroutines finished on this processor. Use only from processor's thread
+    stack_pool& stacks() { return _stacks; }
+    stack_pool_stats stack_stats() const { return _stacks.stats(); }
+
+    idle_stats get_idle_stats() const;
+
+    // counters, and queue size now
+    processor_metrics get_metrics();
+
+    // adds the delays between coroutines becoming runnable and running here, and how long they ran
+    void read_run_delay(histogram& h) const { _run_delay.read(h); }
+    void read_run_slice(histogram& h) const { _run_slice.read(h); }
+
+    // adds the same, by coroutine name
+    void read_latency_by_name(std::map<std::string, coroutine_latency>& out) const;
+
+    // called by the scheduler when the processor ran out of work and tried to steal some. Use only from processor's thread
+    void count_steal(std::size_t stolen);
+
 private:
 
     void routine();
-    void wakeup();
+
+    // runs the coroutine whose run delay is sampled, measures the delay and the slice
+    void run_sampled(coroutine_weak_ptr coro, std::uint64_t runnable_since);
+
+    // entry for the name, created if needed, or the OTHER_NAME one past MAX_NAMES. Use only from processor's thread, with _latency_mutex held
+    coroutine_latency& latency_of(const char* name);
+
+    // takes next coroutine to run from inbox or queue
+    bool next(coroutine_weak_ptr& coro);
+    void drain_inbox();
+
+    // spins for a while, then parks until something arrives in the inbox. Returns false if stopped and there is no work
+    bool wait_for_work();
+    bool has_work() const { return _inbox_size.load() > 0 || _stopped.load() || !_queue.empty(); }
+
+    // parks until notified or timeout. The keeper waits in the io poller instead, ready coroutines end up in own queue.
+    // Returns false on timeout
+    bool park(std::chrono::nanoseconds max);
+    void notify();
+
+    // non-blocking check for ready I/O, if nobody is parked waiting for it. Returns true if found any
+    bool poll_io();
+    // non-blocking check of own descriptors
+    bool poll_io_local();
+
+    void take(const std::vector<coroutine_weak_ptr>& found); // into own queue
+
+    // work found by itself (ready I/O, expired timers) while others may be idle: half of it goes to them
+    void share_work();
 
     scheduler& _scheduler;
+    const unsigned _ordinal;
+
+    work_stealing_deque<coroutine_weak_ptr> _queue; // pushed and popped by this processor's thread, stolen by others
+    unsigned _pops = 0;
 
-    std::deque<coroutine_weak_ptr> _queue;
-    mutex _queue_mutex;
+    // coroutine woken by the running one, runs before the queue. Set by this processor's thread, taken by anyone
+    std::atomic<coroutine_weak_ptr> _next;
+    unsigned _next_streak = 0; // consecutive runs from _next
 
-    bool _stopped = false;
+    std::vector<coroutine_weak_ptr> _inbox; // coroutines enqueued by other threads
+    std::atomic<std::size_t> _inbox_size;
+    mutex _inbox_mutex; // protects _inbox, _blocked and changes of _stopped
+
+    std::atomic<bool> _stopped;
     bool _blocked = false;
-    std::condition_variable_any _cv;
-    bool _executing = false;
+
+    // set before parking, and checked by enqueuers after adding to the inbox, so only sleeping processor gets woken up
+    std::atomic<bool> _waiting;
+    parker _parker;
+    std::atomic<bool> _polling; // parked in the io poller, notify() has to interrupt it
+
+    std::atomic<std::uint64_t> _wakeups;
+    std::atomic<std::uint64_t> _parks;
+    std::atomic<std::uint64_t> _spins;
+    std::atomic<std::uint64_t> _spin_hits;
+    std::atomic<std::uint64_t> _spin_ns;
+
+    std::atomic<std::uint64_t> _runs;
+    std::atomic<std::uint64_t> _steals_attempted;
+    std::atomic<std::uint64_t> _steals_succeeded;
+    std::atomic<std::uint64_t> _stolen;
+    concurrent_histogram _run_delay;
+    concurrent_histogram _run_slice;
+
+    // written only by processor's thread. Names are looked up in the cache by address first, verified by contents:
+    // names copied into coroutine's stack may be reused by another coroutine with another name
+    static const unsigned LATENCY_CACHE_SIZE = 16;
+    struct latency_cache_entry
+    {
+        const char* name = nullptr;
+        coroutine_latency* latency = nullptr;
+    };
+    std::unordered_map<std::string, coroutine_latency> _latency_by_name;
+    latency_cache_entry _latency_cache[LATENCY_CACHE_SIZE];
+    mutable mutex _latency_mutex;
+
+    stack_pool _stacks;
 
     std::thread _thread;
 };
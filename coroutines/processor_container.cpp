@@ -51,4 +51,12 @@ void processor_container::stop_all()
     }
 }
 
+void processor_container::join_all()
+{
+    for(auto& p : _container)
+    {
+        p->join();
+    }
+}
+
 }
@@ -48,6 +48,9 @@ public:
 
     void stop_all();
 
+    // waits for all stopped processors to finish
+    void join_all();
+
 private:
 
     std::vector<processor_ptr> _container;
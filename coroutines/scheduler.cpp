@@ -1,6 +1,7 @@
 // (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
 #include "coroutines/scheduler.hpp"
 #include "coroutines/algorithm.hpp"
+#include "profiling/profiling.hpp"
 
 //#define CORO_LOGGING
 #include "coroutines/logging.hpp"
@@ -13,14 +14,26 @@
 
 namespace coroutines {
 
+static const unsigned DEFAULT_RUN_DELAY_SAMPLING = 16;
+
 scheduler::scheduler(unsigned active_processors)
     : _active_processors(active_processors)
     , _processors()
     , _processors_mutex("sched processors mutex")
     , _starved_processors_mutex("sched starved processors mutex")
-    , _coroutines_mutex("sched coroutines mutex")
     , _global_queue_mutex("sched global q mutex")
-    , _random_generator(std::random_device()())
+    , _stack_trim_after(std::chrono::milliseconds(1000))
+    , _next_stack_trim(0)
+    , _global_stacks(GLOBAL_STACKS_CACHED)
+    , _global_stacks_mutex("sched global stacks mutex")
+    , _run_delay_sampling(DEFAULT_RUN_DELAY_SAMPLING)
+    , _timers_epoch(std::chrono::steady_clock::now())
+    , _timers(0)
+    , _timers_mutex("sched timers mutex")
+    , _next_timer(timer_wheel::NONE)
+    , _timer_keeper(nullptr)
+    , _io_poller(nullptr)
+    , _io_users(0)
 {
     assert(active_processors > 0);
 
@@ -31,6 +44,7 @@ scheduler::scheduler(unsigned active_processors)
         {
             _processors.emplace_back(*this);
         }
+        _processors_spawned = active_processors;
     }
 }
 
@@ -41,35 +55,87 @@ scheduler::~scheduler()
         std::lock_guard<shared_mutex> lock(_processors_mutex);
         _processors.stop_all();
     }
+    // processors call back into the scheduler until their threads end, members must outlive them
+    _processors.join_all();
     CORO_LOG("SCHED: destroyed");
 }
 
 void scheduler::debug_dump()
 {
-    std::lock(_coroutines_mutex, _processors_mutex);
+    scheduler_metrics metrics = get_metrics();
 
     std::cerr << "=========== scheduler debug dump ============" << std::endl;
-    std::cerr << "          active coroutines now: " << _coroutines.size() << std::endl;
-    std::cerr << "     max active coroutines seen: " << _max_active_coroutines << std::endl;
-    std::cerr << "               no of processors: " << _processors.size();
-    std::cerr << "       no of blocked processors: " << _blocked_processors;
+    std::cerr << metrics.to_text();
 
     std::cerr << std::endl;
     std::cerr << " Active coroutines:" << std::endl;
-    for(auto& coro : _coroutines)
+    _coroutines.for_each([](coroutine* coro)
     {
         std::cerr << " * " << coro->name() << " : " << coro->last_checkpoint() << std::endl;
-    }
+    });
     std::cerr << "=============================================" << std::endl;
     std::terminate();
 }
 
+scheduler_metrics scheduler::get_metrics()
+{
+    scheduler_metrics m;
+    m.coroutines = _coroutines.size();
+    m.max_coroutines = _coroutines.max_size();
+    m.stacks = get_stack_stats();
+    m.idle = get_idle_stats();
+
+    {
+        reader_guard<shared_mutex> lock(_processors_mutex);
+
+        m.blocked_processors = _blocked_processors;
+        m.processors_spawned = _processors_spawned;
+        m.processors_retired = _processors_retired;
+        m.total = _retired_metrics;
+        m.run_delay = _retired_run_delay;
+        m.run_slice = _retired_run_slice;
+        std::map<std::string, coroutine_latency> by_name = _retired_by_name;
+        for(unsigned i = 0; i < _processors.size(); i++)
+        {
+            m.processors.push_back(_processors[i].get_metrics());
+            m.total += m.processors.back();
+            _processors[i].read_run_delay(m.run_delay);
+            _processors[i].read_run_slice(m.run_slice);
+            _processors[i].read_latency_by_name(by_name);
+        }
+
+        m.by_name.reserve(by_name.size());
+        for(auto& p : by_name)
+        {
+            m.by_name.push_back(std::move(p.second));
+        }
+    }
+
+    {
+        std::lock_guard<mutex> lock(_global_queue_mutex);
+        m.global_queue_pushes = _global_queue_pushes;
+        m.global_queue_size = _global_queue.size();
+    }
+
+    _channels.read(m.channels);
+    return m;
+}
+
+void add_channel(scheduler& sched, channel_metrics_source& channel)
+{
+    sched.channels().add(channel);
+}
+
+void remove_channel(scheduler& sched, channel_metrics_source& channel)
+{
+    sched.channels().remove(channel);
+}
+
 void scheduler::wait()
 {
     CORO_LOG("SCHED: waiting...");
 
-    std::unique_lock<mutex> lock(_coroutines_mutex);
-    _coro_cv.wait(lock, [this]() { return _coroutines.empty(); });
+    _coroutines.wait_empty();
 
     CORO_LOG("SCHED: wait over");
 }
@@ -78,15 +144,88 @@ void scheduler::coroutine_finished(coroutine* coro)
 {
     CORO_LOG("SCHED: coro=", coro, " finished");
 
-    std::lock_guard<mutex> lock(_coroutines_mutex);
-    auto it = find_ptr(_coroutines, coro);
-    assert(it != _coroutines.end());
-    _coroutines.erase(it);
+    _coroutines.remove(coro);
+}
+
+stack scheduler::allocate_stack(std::size_t size)
+{
+    // processor's own pool first, then the shared one, which may map a new stack
+    processor* pc = processor::current_processor();
+    if (pc)
+    {
+        stack s;
+        if (pc->stacks().take(size, _stack_mode, s))
+            return s;
+    }
+
+    std::lock_guard<mutex> lock(_global_stacks_mutex);
+    return _global_stacks.get(size, _stack_mode);
+}
+
+void scheduler::release_stack(stack&& s)
+{
+    // processor's pool overflows to the shared one, so stacks can flow from where coroutines finish to where they are created
+    processor* pc = processor::current_processor();
+    if (pc && !pc->stacks().full())
+    {
+        pc->stacks().put(std::move(s));
+    }
+    else
+    {
+        std::lock_guard<mutex> lock(_global_stacks_mutex);
+        _global_stacks.put(std::move(s));
+    }
+}
+
+void scheduler::set_stack_mode(stack_mode mode, std::size_t default_size, std::chrono::milliseconds trim_after)
+{
+    _stack_mode = mode;
+    _default_stack_size = default_size;
+    _stack_trim_after = trim_after;
+}
+
+std::size_t scheduler::trim_parked_stacks(std::chrono::steady_clock::duration min_parked)
+{
+    static const std::size_t BATCH = 1024; // don't hold registry shard locked for too long
+
+    auto now = std::chrono::steady_clock::now();
+    std::size_t released = 0;
+
+    _coroutines.for_each([&](coroutine* coro)
+    {
+        released += coro->trim_stack(now, min_parked);
+    }, BATCH);
+
+    CORO_LOG("SCHED: trimmed stacks, ", released, " bytes released");
+    return released;
+}
+
+stack_pool_stats scheduler::get_stack_stats()
+{
+    reader_guard<shared_mutex> lock(_processors_mutex);
+
+    stack_pool_stats stats = _retired_stack_stats;
+    for(unsigned i = 0; i < _processors.size(); i++)
+    {
+        stats += _processors[i].stack_stats();
+    }
+
+    std::lock_guard<mutex> global_lock(_global_stacks_mutex);
+    stats += _global_stacks.stats();
+
+    return stats;
+}
+
+idle_stats scheduler::get_idle_stats()
+{
+    reader_guard<shared_mutex> lock(_processors_mutex);
 
-    if (_coroutines.empty())
+    idle_stats stats = _retired_idle_stats;
+    for(unsigned i = 0; i < _processors.size(); i++)
     {
-        _coro_cv.notify_all();
+        stats += _processors[i].get_idle_stats();
     }
+    return stats;
 }
 
 void scheduler::processor_starved(processor* pc)
@@ -106,21 +245,31 @@ void scheduler::processor_starved(processor* pc)
         }
     }
 
-    // step 2 - try to steal something
+    // step 2 - try to steal something, starting from a random victim
     {
         reader_guard<shared_mutex> lock(_processors_mutex);
 
         unsigned index = _processors.index_of(pc);
         if (index < _active_processors + _blocked_processors)
         {
-            // try to steal
-            unsigned most_busy = _processors.most_busy_index(0, _active_processors);
-            std::vector<coroutine_weak_ptr> stolen;
-            _processors[most_busy].steal(stolen);
+            unsigned count = _processors.size();
+            unsigned first = random_index(count);
+            static thread_local std::vector<coroutine_weak_ptr> stolen; // reused, no allocation after warm-up
+            stolen.clear();
+            for(unsigned i = 0; i < count && stolen.empty(); i++)
+            {
+                unsigned victim = (first + i) % count;
+                if (victim == index)
+                    continue;
+
+                _processors[victim].steal(stolen);
+                CORO_LOG("SCHED: stolen ", stolen.size(), " coros for proc=", pc, " from proc=", &_processors[victim]);
+            }
+            pc->count_steal(stolen.size());
+
             // if stealing successful - reactivate the processor
             if (!stolen.empty())
             {
-                CORO_LOG("SCHED: stolen ", stolen.size(), " coros for proc=", pc, " from proc=", &_processors[most_busy]);
                 pc->enqueue_or_die(stolen.begin(), stolen.end());
                 return;
             }
@@ -132,14 +281,41 @@ void scheduler::processor_starved(processor* pc)
         }
     }
 
-    // record as starved
+    // record as starved. Global queue is checked again under both locks, in the same order schedule() takes them,
+    // otherwise coroutines added to it in the meantime would wait until someone else starves
     {
         std::lock_guard<mutex> lock(_starved_processors_mutex);
+        std::lock_guard<mutex> global_lock(_global_queue_mutex);
+
+        if (!_global_queue.empty())
+        {
+            pc->enqueue_or_die(_global_queue.begin(), _global_queue.end());
+            _global_queue.clear();
+            return;
+        }
 
         _starved_processors.push_back(pc);
     }
 }
 
+void scheduler::processor_idle(processor* pc)
+{
+    CORO_LOG("SCHED: processor ", pc, " idle");
+
+    if (_stack_mode != stack_mode::lazy)
+        return;
+
+    // only one idle processor does the trimming, once per _stack_trim_after
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    auto due = _next_stack_trim.load(std::memory_order_relaxed);
+    if (now.count() < due)
+        return;
+    if (!_next_stack_trim.compare_exchange_strong(due, (now + _stack_trim_after).count()))
+        return;
+
+    trim_parked_stacks(_stack_trim_after);
+}
+
 void scheduler::processor_blocked(processor_weak_ptr pc, std::vector<coroutine_weak_ptr>& queue)
 {
     // move to blocked, schedule coroutines
@@ -155,13 +331,14 @@ void scheduler::processor_blocked(processor_weak_ptr pc, std::vector<coroutine_w
         {
             boost::upgrade_to_unique_lock<shared_mutex> upgrade_lock(lock);
             _processors.emplace_back(*this);
+            _processors_spawned++;
         }
     }
     // the procesor will now continue in blocked state
 
 
-    // schedule coroutines
-    schedule(queue.begin(), queue.end());
+    // schedule coroutines, they keep their time of becoming runnable
+    schedule_runnable(queue.begin(), queue.end());
 }
 
 void scheduler::processor_unblocked(processor_weak_ptr pc)
@@ -187,8 +364,20 @@ void scheduler::processor_unblocked(processor_weak_ptr pc)
                 _starved_processors.erase(
                     std::remove(_starved_processors.begin(), _starved_processors.end(), &_processors.back()),
                     _starved_processors.end());
+                processor* keeper = &_processors.back();
+                _timer_keeper.compare_exchange_strong(keeper, nullptr);
+
+                stack_pool_stats retired = _processors.back().stack_stats();
+                retired.cached = 0; // cached stacks are unmapped with the processor
+                _retired_stack_stats += retired;
+                _retired_idle_stats += _processors.back().get_idle_stats();
+                _retired_metrics += _processors.back().get_metrics();
+                _processors.back().read_run_delay(_retired_run_delay);
+                _processors.back().read_run_slice(_retired_run_slice);
+                _processors.back().read_latency_by_name(_retired_by_name);
 
                 _processors.pop_back();
+                _processors_retired++;
             }
             else
             {
@@ -198,21 +387,270 @@ void scheduler::processor_unblocked(processor_weak_ptr pc)
     }
 }
 
-// returns uniform random number between 0 and _max_allowed_running_coros
-unsigned scheduler::random_index()
+std::chrono::nanoseconds scheduler::processor_park_timeout(processor* pc, std::chrono::nanoseconds max, bool& keeper)
+{
+    processor* current = nullptr;
+    keeper = _timer_keeper.compare_exchange_strong(current, pc) || current == pc;
+    if (!keeper)
+        return max; // someone else is on duty
+
+    // loaded again after taking the duty: add_timer() lowers it first and then wakes the keeper, one of the two sees the other
+    std::uint64_t next = _next_timer.load();
+    if (next == timer_wheel::NONE)
+        return max;
+
+    return std::min(until_tick(next, std::chrono::steady_clock::now()), max);
+}
+
+void scheduler::processor_unparked(processor* pc)
+{
+    // may have found work itself, without being taken off the list
+    {
+        std::lock_guard<mutex> lock(_starved_processors_mutex);
+        _starved_processors.erase(
+            std::remove(_starved_processors.begin(), _starved_processors.end(), pc),
+            _starved_processors.end());
+    }
+
+    // no hand-off for I/O: busy processors poll between coroutines, and the next one to go idle takes the duty
+    processor* keeper = pc;
+    if (!_timer_keeper.compare_exchange_strong(keeper, nullptr))
+        return;
+
+    // busy now, pass the duty to another idle processor
+    if (_next_timer.load() != timer_wheel::NONE)
+        wake_timer_keeper();
+}
+
+void scheduler::wake_timer_keeper()
 {
-    std::uniform_int_distribution<unsigned> dist(0, _active_processors+_blocked_processors-1);
-    return dist(_random_generator);
+    // processors are destroyed under this lock
+    std::lock_guard<mutex> lock(_starved_processors_mutex);
+
+    processor* keeper = _timer_keeper.load();
+    if (keeper)
+        keeper->wake();
+    else if (!_starved_processors.empty())
+        _starved_processors.back()->wake();
+    // else: everybody is busy, processors check the timers between coroutines
 }
 
+void scheduler::set_io_poller(io_poller* poller)
+{
+    io_poller* old = _io_poller.exchange(poller);
+    if (!old)
+        return;
+
+    // users register before loading the pointer: either they see the new one, or they are counted here
+    while(_io_users.load() > 0)
+    {
+        old->interrupt();
+        std::this_thread::yield();
+    }
+}
+
+bool scheduler::poll_io(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
+{
+    _io_users.fetch_add(1);
+    io_poller* poller = _io_poller.load();
+    if (poller)
+        poller->poll(woken, timeout);
+    _io_users.fetch_sub(1);
+
+    return poller != nullptr;
+}
+
+bool scheduler::poll_io_local(processor* pc, std::vector<coroutine_weak_ptr>& woken)
+{
+    _io_users.fetch_add(1);
+    io_poller* poller = _io_poller.load();
+    if (poller)
+        poller->poll_local(pc->ordinal(), woken);
+    _io_users.fetch_sub(1);
+
+    return poller != nullptr;
+}
+
+void scheduler::interrupt_io()
+{
+    _io_users.fetch_add(1);
+    io_poller* poller = _io_poller.load();
+    if (poller)
+        poller->interrupt();
+    _io_users.fetch_sub(1);
+}
+
+std::uint64_t scheduler::to_tick(std::chrono::steady_clock::time_point tp) const
+{
+    // rounded up, timer never fires early
+    static const std::chrono::steady_clock::duration TICK = std::chrono::milliseconds(1);
+    if (tp <= _timers_epoch)
+        return 0;
+    return ((tp - _timers_epoch) + TICK - std::chrono::steady_clock::duration(1)) / TICK;
+}
+
+std::chrono::nanoseconds scheduler::until_tick(std::uint64_t tick, std::chrono::steady_clock::time_point now) const
+{
+    auto due = _timers_epoch + std::chrono::milliseconds(tick);
+    if (due <= now)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(due - now);
+}
+
+void scheduler::sleep_until(std::chrono::steady_clock::time_point deadline)
+{
+    static const std::string checkpoint("sleep");
+
+    if (deadline <= std::chrono::steady_clock::now())
+        return;
+
+    coroutine* coro = coroutine::current_corutine();
+    assert(coro);
+
+    struct sleep_state
+    {
+        sleep_state(coroutine_weak_ptr c, std::chrono::steady_clock::time_point d) : waiter(c), deadline(d) { }
+        select_waiter waiter;
+        timer t;
+        std::chrono::steady_clock::time_point deadline;
+    } state(coro, deadline);
+    state.t.waiter = &state.waiter;
+
+    // the only one who can wake it is the timer
+    coro->yield(checkpoint, [this, &state](coroutine_weak_ptr)
+    {
+        add_timer(state.t, state.deadline);
+    });
+    assert(state.t.fired);
+}
+
+void scheduler::add_timer(timer& t, std::chrono::steady_clock::time_point deadline)
+{
+    t.expiry = to_tick(deadline);
+    t.fired = false;
+
+    bool earlier;
+    {
+        std::lock_guard<mutex> lock(_timers_mutex);
+        _timers.add(t);
+
+        std::uint64_t next = _timers.next_expiry();
+        earlier = next < _next_timer.load(std::memory_order_relaxed);
+        if (earlier)
+            _next_timer.store(next);
+    }
+
+    // whoever parks for the timers has to re-arm
+    if (earlier)
+        wake_timer_keeper();
+}
+
+void scheduler::cancel_timer(timer& t)
+{
+    // fired is set under the lock, before the coroutine is scheduled
+    if (t.fired)
+        return;
+
+    std::lock_guard<mutex> lock(_timers_mutex);
+    if (t.pending())
+        _timers.remove(t);
+}
+
+std::chrono::nanoseconds scheduler::run_timers(processor* idle)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::uint64_t now_tick = (now - _timers_epoch) / std::chrono::milliseconds(1);
+
+    std::uint64_t next = _next_timer.load(std::memory_order_relaxed);
+    if (next > now_tick)
+        return next == timer_wheel::NONE ? std::chrono::nanoseconds::max() : until_tick(next, now);
+
+    static thread_local std::vector<coroutine_weak_ptr> expired; // reused, no allocation after warm-up
+    expired.clear();
+    {
+        std::unique_lock<mutex> lock(_timers_mutex, std::try_to_lock);
+        if (!lock)
+            return std::chrono::nanoseconds(0); // someone else is firing them right now
+
+        std::uint64_t since = runnable_since();
+        _timers.advance(now_tick, [since](timer& t)
+        {
+            // the waiter may have been woken by a channel already
+            if (!t.waiter->woken.exchange(true))
+            {
+                t.fired = true;
+                CORO_PROF("coroutine", t.waiter->coro, "runnable");
+                t.waiter->coro->set_runnable(since);
+                expired.push_back(t.waiter->coro);
+            }
+        });
+        next = _timers.next_expiry();
+        _next_timer.store(next);
+    }
+
+    CORO_LOG("SCHED: ", expired.size(), " timers expired");
+    if (!expired.empty() && !(idle && idle->enqueue(expired.begin(), expired.end())))
+        schedule_runnable(expired.begin(), expired.end());
+
+    return next == timer_wheel::NONE ? std::chrono::nanoseconds::max() : until_tick(next, now);
+}
+
+// returns uniform random number between 0 and max-1
+unsigned scheduler::random_index(unsigned max)
+{
+    static thread_local std::minstd_rand generator(std::random_device{}());
+    std::uniform_int_distribution<unsigned> dist(0, max-1);
+    return dist(generator);
+}
+
+
+std::uint64_t scheduler::runnable_since()
+{
+    static thread_local unsigned skipped = 0;
+
+    unsigned one_in = _run_delay_sampling.load(std::memory_order_relaxed);
+    if (one_in == 0 || ++skipped < one_in)
+        return 0;
+    skipped = 0;
+    return metrics_now();
+}
 
 void scheduler::schedule(coroutine_weak_ptr coro)
 {
-    schedule(&coro, &coro + 1);
+    CORO_PROF("coroutine", coro, "runnable");
+    coro->set_runnable(runnable_since());
+
+    // woken (or spawned) by a running coroutine: runs next on the same processor, handoff without a trip through the queue
+    processor* pc = processor::current_processor();
+    coroutine_weak_ptr displaced = nullptr;
+    if (pc && pc->enqueue_next(coro, displaced))
+    {
+        if (displaced)
+            schedule_runnable(&displaced, &displaced + 1); // to starved processor, or back to own queue
+        return;
+    }
+
+    schedule_runnable(&coro, &coro + 1);
 }
 
 template<typename InputIterator>
 void scheduler::schedule(InputIterator first,  InputIterator last)
+{
+    if (first == last)
+        return;
+
+    std::uint64_t since = runnable_since();
+    for(InputIterator it = first; it != last; ++it)
+    {
+        CORO_PROF("coroutine", *it, "runnable");
+        (*it)->set_runnable(since);
+    }
+
+    schedule_runnable(first, last);
+}
+
+template<typename InputIterator>
+void scheduler::schedule_runnable(InputIterator first,  InputIterator last)
 {
     if (first == last)
         return; // that was easy :)
@@ -242,26 +680,36 @@ void scheduler::schedule(InputIterator first,  InputIterator last)
 
     // total failure, add to global queue?
     {
-        std::lock_guard<mutex> lock(_global_queue_mutex);
+        // processor could have starved since step 1
+        std::lock_guard<mutex> lock(_starved_processors_mutex);
+
+        if (!_starved_processors.empty())
+        {
+            CORO_LOG("SCHED: scheduling corountine, will add to starved processor");
+            processor_weak_ptr starved = _starved_processors.back();
+            _starved_processors.pop_back();
+            starved->enqueue_or_die(first, last);
+            return;
+        }
+
+        std::lock_guard<mutex> global_lock(_global_queue_mutex);
 
         CORO_LOG("SCHED: scheduling corountines, added to global queue");
         _global_queue.insert(_global_queue.end(), first, last);
+        _global_queue_pushes++;
     }
 }
 
 template
 void scheduler::schedule<std::vector<coroutine_weak_ptr>::iterator>(std::vector<coroutine_weak_ptr>::iterator, std::vector<coroutine_weak_ptr>::iterator);
+template
+void scheduler::schedule_runnable<std::vector<coroutine_weak_ptr>::iterator>(std::vector<coroutine_weak_ptr>::iterator, std::vector<coroutine_weak_ptr>::iterator);
 
 void scheduler::go(coroutine_ptr&& coro)
 {
     CORO_LOG("SCHED: go '", coro->name(), "'");
     coroutine_weak_ptr coro_weak = coro.get();
-    {
-        std::lock_guard<mutex> lock(_coroutines_mutex);
-
-        _coroutines.emplace_back(std::move(coro));
-        _max_active_coroutines = std::max(_coroutines.size(), _max_active_coroutines);
-    }
+    _coroutines.add(std::move(coro));
 
     schedule(coro_weak);
 }
@@ -4,14 +4,22 @@
 
 #include "coroutines/channel.hpp"
 #include "coroutines/coroutine.hpp"
+#include "coroutines/coroutine_registry.hpp"
 #include "coroutines/processor.hpp"
 #include "coroutines/locking_channel.hpp"
+#include "coroutines/lock_free_channel.hpp"
 #include "coroutines/condition_variable.hpp"
 #include "coroutines/processor_container.hpp"
+#include "coroutines/timer_wheel.hpp"
+#include "coroutines/io_poller.hpp"
+#include "coroutines/metrics.hpp"
 
 #include <thread>
 #include <mutex>
 #include <random>
+#include <chrono>
+#include <atomic>
+#include <map>
 
 namespace coroutines {
 
@@ -29,22 +37,87 @@ public:
     template<typename Callable, typename... Args>
     void go(Callable&& fn, Args&&... args);
 
-    // debug version, with coroutine's name
+    // debug version, with coroutine's name. The name is copied
     template<typename Callable, typename... Args>
     void go(std::string name, Callable&& fn, Args&&... args);
 
-    // debug version, with coroutine's name
+    // debug version, with coroutine's name. The name is not copied, it has to outlive the coroutine, like a string literal.
+    // A temporary's c_str() would dangle, pass the std::string instead
     template<typename Callable, typename... Args>
     void go(const char* name, Callable&& fn, Args&&... args);
 
-    // create channel
-    template<typename T>
-    channel_pair<T> make_channel(std::size_t capacity, const std::string& name)
+    // named coroutine with non-default stack size
+    template<typename Callable, typename... Args>
+    void go(stack_size ss, std::string name, Callable&& fn, Args&&... args);
+
+    template<typename Callable, typename... Args>
+    void go(stack_size ss, const char* name, Callable&& fn, Args&&... args);
+
+    // stack size used when none given to go()
+    void set_default_stack_size(std::size_t size) { _default_stack_size = size; }
+    std::size_t default_stack_size() const { return _default_stack_size; }
+
+    // sets how new stacks are mapped, and the default size.
+    // In lazy mode, idle processors trim stacks of coroutines parked for longer than trim_after
+    void set_stack_mode(stack_mode mode, std::size_t default_size, std::chrono::milliseconds trim_after = std::chrono::milliseconds(1000));
+
+    // returns unused stack pages of coroutines parked for at least min_parked to the OS.
+    // Has effect only on lazy stacks. Returns number of bytes released
+    std::size_t trim_parked_stacks(std::chrono::steady_clock::duration min_parked);
+
+    // stack pool counters, summed over all processors
+    stack_pool_stats get_stack_stats();
+
+    // idle protocol counters, summed over all processors
+    idle_stats get_idle_stats();
+
+    // counters of all processors, run delay and slice histograms, also by coroutine name, and live channels. Cheap enough to be polled
+    scheduler_metrics get_metrics();
+
+    // channels created by this scheduler, see add_channel()
+    channel_list& channels() { return _channels; }
+
+    // run delay and slice are measured for one in 'one_in' coroutines becoming runnable, reading the clock costs more than a switch.
+    // 1 measures all, 0 none
+    void set_run_delay_sampling(unsigned one_in) { _run_delay_sampling.store(one_in, std::memory_order_relaxed); }
+
+    // create channel. channel_type is locking_channel<T> or lock_free_channel<T>
+    template<typename T, typename channel_type = locking_channel<T>>
+    channel_pair<T, channel_type> make_channel(std::size_t capacity, const std::string& name)
     {
-        return channel_pair<T>::make(*this, capacity, name);
+        return channel_pair<T, channel_type>::make(*this, capacity, name);
     }
 
-    // wrties current status to stderr
+    // timers, with 1 ms resolution. Expired timers are fired by processors, the idle ones park until the next one is due
+
+    // parks current coroutine until the deadline, without blocking the thread
+    void sleep_until(std::chrono::steady_clock::time_point deadline);
+
+    // arms the timer, it will wake t.waiter at the deadline unless something else wakes it first.
+    // Call from the yield epilogue, like monitor::add()
+    void add_timer(timer& t, std::chrono::steady_clock::time_point deadline);
+
+    // disarms the timer, whether it has fired or not. t.fired tells if it did
+    void cancel_timer(timer& t);
+
+    // wakes coroutines whose timers have expired. Returns time until the next timer is due, or nanoseconds::max() if there is none.
+    // Idle processor calling it gets the coroutines itself, instead of waking up another one
+    std::chrono::nanoseconds run_timers(processor* idle = nullptr);
+
+    // I/O readiness polled by the processors: the idle one parked for the timers waits in the poller,
+    // busy ones check it between coroutines when nobody does, and each checks its own descriptors when its queue empties. Replacing the poller waits until no processor uses the old one
+    void set_io_poller(io_poller* poller);
+
+    // polls the io poller, if there is one. Returns false if there isn't
+    bool poll_io(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout);
+
+    // non-blocking check of the processor's own descriptors, see io_poller::poll_local()
+    bool poll_io_local(processor* pc, std::vector<coroutine_weak_ptr>& woken);
+
+    // makes poll_io() in progress return
+    void interrupt_io();
+
+    // wrties current status and all coroutines to stderr, then terminates the process
     void debug_dump();
 
     // wait for all coroutines to complete
@@ -52,28 +125,54 @@ public:
 
     // coroutine interface
     void coroutine_finished(coroutine* coro);
+    stack allocate_stack(std::size_t size);
+    void release_stack(stack&& s);
 
     ///////
     // processor's interface
 
     void processor_starved(processor* pr);
+    void processor_idle(processor* pr); // called periodically when processor has nothing to do
     void processor_blocked(processor_weak_ptr pr, std::vector<coroutine_weak_ptr>& queue);
     void processor_unblocked(processor_weak_ptr pr);
 
+    // how long an idle processor may park. One of them, the keeper, parks only until the next timer is due, and fires it.
+    // The keeper also waits for I/O
+    std::chrono::nanoseconds processor_park_timeout(processor* pr, std::chrono::nanoseconds max, bool& keeper);
+    void processor_unparked(processor* pr); // has work again
+
+    // if there is I/O nobody is waiting for
+    bool processor_should_poll() const { return _io_poller.load(std::memory_order_relaxed) && !_timer_keeper.load(std::memory_order_relaxed); }
+
     void schedule(coroutine_weak_ptr coro);
 
+    // time to stamp a coroutine becoming runnable with, 0 if this one is not sampled
+    std::uint64_t runnable_since();
+
     template<typename InputIterator>
     void schedule(InputIterator first,  InputIterator last);
 
+    // the same for coroutines already marked runnable, e.g. taken from a processor's queue
+    template<typename InputIterator>
+    void schedule_runnable(InputIterator first,  InputIterator last);
+
 
 private:
 
     void go(coroutine_ptr&& coro);
 
-    unsigned random_index();
+    static unsigned random_index(unsigned max);
+
+    std::uint64_t to_tick(std::chrono::steady_clock::time_point tp) const;
+    std::chrono::nanoseconds until_tick(std::uint64_t tick, std::chrono::steady_clock::time_point now) const;
+
+    // wakes the processor parked for the next timer, or makes one of the idle ones take the role
+    void wake_timer_keeper();
 
     const unsigned _active_processors;
     unsigned _blocked_processors = 0;
+    std::uint64_t _processors_spawned = 0; // changed under _processors_mutex
+    std::uint64_t _processors_retired = 0;
 
     processor_container _processors;
     shared_mutex _processors_mutex;
@@ -81,36 +180,68 @@ private:
     std::vector<processor_weak_ptr> _starved_processors;
     mutex _starved_processors_mutex;
 
-    std::vector<coroutine_ptr> _coroutines;
-    mutex _coroutines_mutex;
-
-    std::condition_variable_any _coro_cv;
-    std::size_t _max_active_coroutines = 0; // stat counter
+    coroutine_registry _coroutines;
 
     std::vector<coroutine_weak_ptr> _global_queue;
     mutex _global_queue_mutex;
-
-    std::minstd_rand _random_generator;
+    std::uint64_t _global_queue_pushes = 0; // under _global_queue_mutex
+
+    std::size_t _default_stack_size = DEFAULT_STACK_SIZE;
+    stack_mode _stack_mode = stack_mode::fixed;
+    std::chrono::steady_clock::duration _stack_trim_after;
+    std::atomic<std::chrono::steady_clock::rep> _next_stack_trim; // time_since_epoch
+    static const std::size_t GLOBAL_STACKS_CACHED = 4096;
+    stack_pool _global_stacks; // used by threads other than processors, and when processor's pool is empty or full
+    mutex _global_stacks_mutex;
+    stack_pool_stats _retired_stack_stats; // stats of processors already destroyed
+    idle_stats _retired_idle_stats;
+    processor_metrics _retired_metrics;
+    histogram _retired_run_delay;
+    histogram _retired_run_slice;
+    std::map<std::string, coroutine_latency> _retired_by_name;
+
+    channel_list _channels;
+    std::atomic<unsigned> _run_delay_sampling;
+
+    const std::chrono::steady_clock::time_point _timers_epoch; // tick 0
+    timer_wheel _timers;
+    mutex _timers_mutex;
+    std::atomic<std::uint64_t> _next_timer; // no timer expires before this tick
+    std::atomic<processor*> _timer_keeper; // parked until _next_timer, in the io poller. Changed under _starved_processors_mutex or by itself
+
+    std::atomic<io_poller*> _io_poller;
+    std::atomic<unsigned> _io_users; // calls to _io_poller in progress
 };
 
 
 template<typename Callable, typename... Args>
 void scheduler::go(Callable&& fn, Args&&... args)
 {
-    this->go(std::string(), std::forward<Callable>(fn), std::forward<Args>(args)...);
+    this->go(stack_size(_default_stack_size), static_cast<const char*>(nullptr), std::forward<Callable>(fn), std::forward<Args>(args)...);
 }
 
 template<typename Callable, typename... Args>
 void scheduler::go(std::string name, Callable&& fn, Args&&... args)
 {
-    this->go(make_coroutine(*this, std::move(name), std::bind(std::forward<Callable>(fn), std::forward<Args>(args)...)));
+    this->go(stack_size(_default_stack_size), std::move(name), std::forward<Callable>(fn), std::forward<Args>(args)...);
 }
 
 template<typename Callable, typename... Args>
 void scheduler::go(const char* name, Callable&& fn, Args&&... args)
 {
+    this->go(stack_size(_default_stack_size), name, std::forward<Callable>(fn), std::forward<Args>(args)...);
+}
 
-    this->go(make_coroutine(*this, std::string(name), std::bind(std::forward<Callable>(fn), std::forward<Args>(args)...)));
+template<typename Callable, typename... Args>
+void scheduler::go(stack_size ss, std::string name, Callable&& fn, Args&&... args)
+{
+    this->go(make_coroutine(*this, name, allocate_stack(ss.size), std::bind(std::forward<Callable>(fn), std::forward<Args>(args)...)));
+}
+
+template<typename Callable, typename... Args>
+void scheduler::go(stack_size ss, const char* name, Callable&& fn, Args&&... args)
+{
+    this->go(make_coroutine(*this, name, allocate_stack(ss.size), std::bind(std::forward<Callable>(fn), std::forward<Args>(args)...)));
 }
 
 } // namespace coroutines
@@ -0,0 +1,87 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/select.hpp"
+#include "coroutines/coroutine.hpp"
+#include "coroutines/scheduler.hpp"
+
+#include <random>
+#include <algorithm>
+#include <cassert>
+
+namespace coroutines {
+
+selector& selector::otherwise(std::function<void()> handler)
+{
+    _has_otherwise = true;
+    _otherwise = std::move(handler);
+    return *this;
+}
+
+int selector::try_cases()
+{
+    // start at random case, so a busy channel can't starve the others
+    static thread_local std::minstd_rand generator(std::random_device{}());
+
+    unsigned count = _cases.size();
+    unsigned first = std::uniform_int_distribution<unsigned>(0, count - 1)(generator);
+    for(unsigned i = 0; i < count; i++)
+    {
+        unsigned index = (first + i) % count;
+        if (_cases[index]->try_run())
+            return index;
+    }
+    return -1;
+}
+
+int selector::wait(const std::string& checkpoint_name)
+{
+    for(;;)
+    {
+        if (!_cases.empty())
+        {
+            int performed = try_cases();
+            if (performed >= 0)
+                return performed;
+        }
+
+        if (_has_otherwise)
+        {
+            if (_otherwise)
+                _otherwise();
+            return -1;
+        }
+
+        // nothing could ever wake us up
+        if (std::all_of(_cases.begin(), _cases.end(), [](const std::unique_ptr<select_case>& sc) { return sc->closed(); }))
+            throw channel_closed();
+
+        coroutine* coro = coroutine::current_corutine();
+        assert(coro);
+
+        // registered only after the coroutine is parked, so whoever wakes it can schedule it right away
+        select_waiter waiter(coro);
+        coro->yield(checkpoint_name, [this, &waiter](coroutine_weak_ptr c)
+        {
+            for(const std::unique_ptr<select_case>& sc : _cases)
+            {
+                if (waiter.woken)
+                    break;
+
+                if (sc->register_waiter(waiter))
+                {
+                    // ready already, wake up unless one of the channels did it in the meantime
+                    if (!waiter.woken.exchange(true))
+                        c->get_scheduler().schedule(c);
+                    break;
+                }
+            }
+        });
+
+        // the waiter is going out of scope, no monitor can keep it
+        for(const std::unique_ptr<select_case>& sc : _cases)
+        {
+            sc->cancel(waiter);
+        }
+    }
+}
+
+}
@@ -0,0 +1,202 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_SELECT_HPP
+#define COROUTINES_SELECT_HPP
+
+#include "coroutines/channel.hpp"
+#include "coroutines/locking_channel.hpp"
+#include "coroutines/monitor.hpp"
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <string>
+
+namespace coroutines {
+
+namespace detail {
+
+// keeps argument out of template argument deduction, so T comes from the channel endpoint only
+template<typename T>
+struct non_deduced { typedef T type; };
+
+}
+
+// Go-style select: waits for the first of several channel operations that can proceed.
+//
+//   selector()
+//       .get(reader, [](int v) { ... })
+//       .put(writer, 7, []() { ... })
+//       .otherwise([]() { ... }) // optional, makes it non-blocking
+//       .wait();
+//
+// wait() performs exactly one operation and calls its handler. If more are ready, the one performed is chosen at random.
+// Without otherwise(), the coroutine parks until one of the operations can proceed.
+// Returns index of the case performed (in order of adding), or -1 if otherwise() was taken.
+// If the operation chosen is on a closed channel, its endpoint is closed and channel_closed is thrown.
+// Cases on closed endpoints are never ready, like nil channels in Go, so the loop can go on with the rest:
+//
+//   while(!r1.is_closed() || !r2.is_closed())
+//       try { selector().get(r1, h1).get(r2, h2).wait(); } catch(const channel_closed&) { }
+//
+// With all endpoints closed and no otherwise(), wait() throws channel_closed.
+// Works with locking_channel endpoints
+class selector
+{
+public:
+
+    selector() = default;
+    selector(const selector&) = delete;
+
+    template<typename T>
+    selector& get(channel_reader<T>& reader, typename detail::non_deduced<std::function<void(T)>>::type handler = nullptr);
+
+    template<typename T>
+    selector& put(channel_writer<T>& writer, typename detail::non_deduced<T>::type value, std::function<void()> handler = nullptr);
+
+    selector& otherwise(std::function<void()> handler = nullptr);
+
+    int wait(const std::string& checkpoint_name = "select");
+
+private:
+
+    struct select_case
+    {
+        virtual ~select_case() { }
+
+        virtual bool closed() const = 0;
+
+        // performs the operation and calls the handler, or returns false if it would block
+        virtual bool try_run() = 0;
+
+        // returns true if the operation would not block now, otherwise registers the waiter with the channel
+        virtual bool register_waiter(select_waiter& waiter) = 0;
+        virtual void cancel(select_waiter& waiter) = 0;
+    };
+
+    template<typename T>
+    struct get_case;
+
+    template<typename T>
+    struct put_case;
+
+    // returns index of the case performed, or -1
+    int try_cases();
+
+    std::vector<std::unique_ptr<select_case>> _cases;
+    bool _has_otherwise = false;
+    std::function<void()> _otherwise;
+};
+
+template<typename T>
+struct selector::get_case : public select_case
+{
+    get_case(channel_reader<T>& r, std::function<void(T)>&& h)
+    : reader(r), handler(std::move(h))
+    { }
+
+    locking_channel<T>& channel() { return *reader._impl->_impl; }
+
+    bool closed() const override { return reader.is_closed(); }
+
+    bool try_run() override
+    {
+        if (closed())
+            return false;
+
+        T v;
+        try
+        {
+            if (!channel().select_try_get(v))
+                return false;
+        }
+        catch(const channel_closed&)
+        {
+            reader.close();
+            throw;
+        }
+
+        if (handler)
+            handler(std::move(v));
+        return true;
+    }
+
+    bool register_waiter(select_waiter& waiter) override
+    {
+        return !closed() && channel().select_register_get(waiter);
+    }
+
+    void cancel(select_waiter& waiter) override
+    {
+        if (!closed())
+            channel().select_cancel_get(waiter);
+    }
+
+    channel_reader<T>& reader;
+    std::function<void(T)> handler;
+};
+
+template<typename T>
+struct selector::put_case : public select_case
+{
+    put_case(channel_writer<T>& w, T&& v, std::function<void()>&& h)
+    : writer(w), value(std::move(v)), handler(std::move(h))
+    { }
+
+    locking_channel<T>& channel() { return *writer._impl->_impl; }
+
+    bool closed() const override { return writer.is_closed(); }
+
+    bool try_run() override
+    {
+        if (closed())
+            return false;
+
+        try
+        {
+            if (!channel().select_try_put(value))
+                return false;
+        }
+        catch(const channel_closed&)
+        {
+            writer.close();
+            throw;
+        }
+
+        if (handler)
+            handler();
+        return true;
+    }
+
+    bool register_waiter(select_waiter& waiter) override
+    {
+        return !closed() && channel().select_register_put(waiter);
+    }
+
+    void cancel(select_waiter& waiter) override
+    {
+        if (!closed())
+            channel().select_cancel_put(waiter);
+    }
+
+    channel_writer<T>& writer;
+    T value;
+    std::function<void()> handler;
+};
+
+template<typename T>
+selector& selector::get(channel_reader<T>& reader, typename detail::non_deduced<std::function<void(T)>>::type handler)
+{
+    _cases.emplace_back(new get_case<T>(reader, std::move(handler)));
+    return *this;
+}
+
+template<typename T>
+selector& selector::put(channel_writer<T>& writer, typename detail::non_deduced<T>::type value, std::function<void()> handler)
+{
+    _cases.emplace_back(new put_case<T>(writer, std::move(value), std::move(handler)));
+    return *this;
+}
+
+}
+
+#endif
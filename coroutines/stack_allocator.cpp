@@ -0,0 +1,159 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/stack_allocator.hpp"
+
+#include <new>
+#include <cassert>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace coroutines {
+
+std::size_t stack::page_size()
+{
+    static const std::size_t size = ::sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+std::size_t stack::round_size(std::size_t size)
+{
+    std::size_t page = page_size();
+    return (size + page - 1) / page * page;
+}
+
+stack::stack(std::size_t size, stack_mode mode)
+{
+    std::size_t usable = round_size(size);
+    std::size_t mapped = usable + page_size();
+
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK;
+    if (mode == stack_mode::lazy)
+        flags |= MAP_NORESERVE; // don't account the whole reservation against overcommit limits
+
+    void* mem = ::mmap(nullptr, mapped, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+
+    // guard page at the bottom, stack grows down towards it
+    if (::mprotect(mem, page_size(), PROT_NONE) != 0)
+    {
+        ::munmap(mem, mapped);
+        throw std::bad_alloc();
+    }
+
+    _base = static_cast<char*>(mem);
+    _mapped_size = mapped;
+    _mode = mode;
+}
+
+stack::~stack()
+{
+    if (_base)
+    {
+        ::munmap(_base, _mapped_size);
+    }
+}
+
+std::size_t stack::trim(const char* sp)
+{
+    // margin for whatever context switch pushed below the last known stack pointer
+    static const std::size_t SAFETY_MARGIN = 1024;
+
+    assert(sp > _base && sp <= top());
+
+    char* bottom = _base + page_size();
+    std::uintptr_t limit = std::uintptr_t(sp) - SAFETY_MARGIN;
+    char* end = reinterpret_cast<char*>(limit - limit % page_size());
+
+    if (end <= bottom)
+        return 0;
+
+    if (::madvise(bottom, end - bottom, MADV_DONTNEED) != 0)
+        return 0;
+
+    return end - bottom;
+}
+
+stack_pool::stack_pool(std::size_t max_cached)
+    : _max_cached(max_cached)
+    , _hits(0)
+    , _misses(0)
+    , _cached(0)
+{
+}
+
+stack_pool::bucket* stack_pool::find_bucket(std::size_t size, stack_mode mode)
+{
+    for(bucket& b : _buckets)
+    {
+        if (b.size == size && b.mode == mode)
+            return &b;
+    }
+    return nullptr;
+}
+
+stack stack_pool::get(std::size_t size, stack_mode mode)
+{
+    stack s;
+    if (take(size, mode, s))
+        return s;
+
+    _misses.store(_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return stack(size, mode);
+}
+
+bool stack_pool::take(std::size_t size, stack_mode mode, stack& out)
+{
+    size = stack::round_size(size);
+
+    bucket* b = find_bucket(size, mode);
+    if (b && !b->stacks.empty())
+    {
+        out = std::move(b->stacks.back());
+        b->stacks.pop_back();
+
+        _cached.store(_cached.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        _hits.store(_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void stack_pool::put(stack&& s)
+{
+    assert(!s.is_null());
+
+    if (full())
+    {
+        stack dropped(std::move(s)); // unmapped here
+        return;
+    }
+
+    if (s.mode() == stack_mode::lazy && s.size() > DEFAULT_STACK_SIZE)
+    {
+        s.trim(s.top() - DEFAULT_STACK_SIZE);
+    }
+
+    bucket* b = find_bucket(s.size(), s.mode());
+    if (!b)
+    {
+        _buckets.push_back(bucket{s.size(), s.mode(), std::vector<stack>()});
+        b = &_buckets.back();
+    }
+
+    b->stacks.push_back(std::move(s));
+    _cached.store(_cached.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+stack_pool_stats stack_pool::stats() const
+{
+    stack_pool_stats s;
+    s.hits = _hits.load(std::memory_order_relaxed);
+    s.misses = _misses.load(std::memory_order_relaxed);
+    s.cached = _cached.load(std::memory_order_relaxed);
+    return s;
+}
+
+}
@@ -0,0 +1,151 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_STACK_ALLOCATOR_HPP
+#define COROUTINES_STACK_ALLOCATOR_HPP
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace coroutines {
+
+static const std::size_t DEFAULT_STACK_SIZE = 64*1024; // 64kb should be enough for anyone :)
+static const std::size_t DEFAULT_LAZY_STACK_SIZE = 1024*1024; // reserved, not committed
+
+// how stacks are mapped
+enum class stack_mode
+{
+    fixed,  // stack is as big as requested, pages stay committed once touched
+    lazy    // large virtual reservation, only touched pages are committed. Unused part can be given back with trim()
+};
+
+// stack size requested for a single coroutine. Passed as the first argument to go()
+struct stack_size
+{
+    explicit stack_size(std::size_t s) : size(s) { }
+
+    std::size_t size;
+};
+
+// coroutine stack.
+// mmap-ed memory with a PROT_NONE guard page at the bottom, so overflow crashes instead of corrupting the neighbours.
+// Movable, but not copyable
+class stack
+{
+public:
+
+    // null stack
+    stack() = default;
+
+    // maps new stack. Size is rounded up to page size. Throws std::bad_alloc
+    explicit stack(std::size_t size, stack_mode mode = stack_mode::fixed);
+
+    ~stack();
+
+    stack(const stack&) = delete;
+    stack(stack&& o) noexcept
+    {
+        swap(o);
+    }
+
+    stack& operator=(stack&& o) noexcept
+    {
+        swap(o);
+        return *this;
+    }
+
+    // stack grows down, this is where it begins
+    char* top() const { return _base + _mapped_size; }
+
+    // usable size, guard page not included
+    std::size_t size() const { return _mapped_size ? _mapped_size - page_size() : 0; }
+
+    bool is_null() const { return !_base; }
+
+    stack_mode mode() const { return _mode; }
+
+    // returns pages below the stack pointer 'sp' to the OS. They will be zero-filled when touched again.
+    // Must not be called on a stack that is currently running. Returns number of bytes released
+    std::size_t trim(const char* sp);
+
+    void swap(stack& o) noexcept
+    {
+        std::swap(_base, o._base);
+        std::swap(_mapped_size, o._mapped_size);
+        std::swap(_mode, o._mode);
+    }
+
+    static std::size_t page_size();
+
+    // rounds requested size up to what will actually be mapped (guard not included)
+    static std::size_t round_size(std::size_t size);
+
+private:
+
+    char* _base = nullptr;          // beginning of the mapping, guard page included
+    std::size_t _mapped_size = 0;   // total size of the mapping
+    stack_mode _mode = stack_mode::fixed;
+};
+
+struct stack_pool_stats
+{
+    std::uint64_t hits = 0;     // stacks reused from pool
+    std::uint64_t misses = 0;   // stacks mapped because pool had none of this size
+    std::size_t cached = 0;     // stacks waiting in pool now
+
+    stack_pool_stats& operator+=(const stack_pool_stats& o)
+    {
+        hits += o.hits;
+        misses += o.misses;
+        cached += o.cached;
+        return *this;
+    }
+};
+
+// free list of recycled stacks.
+// Not thread-safe, each processor owns one. Stats may be read from any thread.
+class stack_pool
+{
+public:
+
+    static const std::size_t DEFAULT_MAX_CACHED = 256;
+
+    explicit stack_pool(std::size_t max_cached = DEFAULT_MAX_CACHED);
+    stack_pool(const stack_pool&) = delete;
+
+    // returns cached stack of the requested size and mode, or maps a new one
+    stack get(std::size_t size, stack_mode mode = stack_mode::fixed);
+
+    // returns cached stack in 'out', or false if there is none. Never maps
+    bool take(std::size_t size, stack_mode mode, stack& out);
+
+    // stores the stack for reuse. If the pool is full, the stack is unmapped.
+    // Lazy stacks are trimmed, only the top DEFAULT_STACK_SIZE stays committed
+    void put(stack&& s);
+
+    bool full() const { return _cached.load(std::memory_order_relaxed) >= _max_cached; }
+
+    stack_pool_stats stats() const;
+
+private:
+
+    struct bucket
+    {
+        std::size_t size;
+        stack_mode mode;
+        std::vector<stack> stacks;
+    };
+
+    bucket* find_bucket(std::size_t size, stack_mode mode);
+
+    std::vector<bucket> _buckets; // one per distinct stack size
+    const std::size_t _max_cached;
+
+    std::atomic<std::uint64_t> _hits;
+    std::atomic<std::uint64_t> _misses;
+    std::atomic<std::size_t> _cached;
+};
+
+}
+
+#endif
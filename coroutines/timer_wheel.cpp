@@ -0,0 +1,146 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/timer_wheel.hpp"
+
+#include <cassert>
+
+namespace coroutines {
+
+const std::uint64_t timer_wheel::NONE;
+
+timer_wheel::timer_wheel(std::uint64_t now)
+    : _current(now)
+{
+    for(timer& slot : _root)
+    {
+        slot.prev = slot.next = &slot;
+    }
+    for(auto& level : _levels)
+    {
+        for(timer& slot : level)
+        {
+            slot.prev = slot.next = &slot;
+        }
+    }
+    for(std::uint64_t& word : _root_occupied)
+    {
+        word = 0;
+    }
+}
+
+void timer_wheel::link(timer& slot, timer& t)
+{
+    t.prev = slot.prev;
+    t.next = &slot;
+    slot.prev->next = &t;
+    slot.prev = &t;
+}
+
+void timer_wheel::unlink(timer& t)
+{
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = t.next = nullptr;
+}
+
+void timer_wheel::mark_root(unsigned index, bool occupied)
+{
+    std::uint64_t bit = std::uint64_t(1) << (index % 64);
+    if (occupied)
+        _root_occupied[index / 64] |= bit;
+    else
+        _root_occupied[index / 64] &= ~bit;
+}
+
+unsigned timer_wheel::next_root_slot(unsigned index) const
+{
+    while(index < ROOT_SIZE)
+    {
+        std::uint64_t word = _root_occupied[index / 64] >> (index % 64);
+        if (word)
+            return index + __builtin_ctzll(word);
+        index = (index / 64 + 1) * 64;
+    }
+    return ROOT_SIZE;
+}
+
+void timer_wheel::add(timer& t)
+{
+    assert(!t.pending());
+    place(t);
+    _size++;
+}
+
+void timer_wheel::remove(timer& t)
+{
+    assert(t.pending());
+    // root slot's bit may stay set, advance clears it when passing by
+    unlink(t);
+    _size--;
+}
+
+void timer_wheel::place(timer& t)
+{
+    std::uint64_t expiry = t.expiry < _current ? _current : t.expiry;
+    std::uint64_t delta = expiry - _current;
+
+    if (delta < ROOT_SIZE)
+    {
+        unsigned index = expiry & (ROOT_SIZE - 1);
+        link(_root[index], t);
+        mark_root(index, true);
+        return;
+    }
+
+    for(unsigned level = 0; level < LEVELS; level++)
+    {
+        unsigned shift = ROOT_BITS + level*LEVEL_BITS;
+        std::uint64_t range = std::uint64_t(1) << (shift + LEVEL_BITS);
+        if (delta >= range)
+        {
+            if (level < LEVELS - 1)
+                continue;
+            // beyond the wheel, parked at its far end until cascaded back
+            expiry = _current + range - 1;
+        }
+
+        link(_levels[level][(expiry >> shift) & (LEVEL_SIZE - 1)], t);
+        return;
+    }
+}
+
+unsigned timer_wheel::cascade(unsigned level)
+{
+    unsigned index = (_current >> (ROOT_BITS + level*LEVEL_BITS)) & (LEVEL_SIZE - 1);
+    timer& slot = _levels[level][index];
+
+    // detach the list first, timers may go back to the same level
+    if (!empty(slot))
+    {
+        timer* first = slot.next;
+        timer* last = slot.prev;
+        slot.prev = slot.next = &slot;
+        last->next = nullptr;
+
+        for(timer* t = first; t != nullptr;)
+        {
+            timer* next = t->next;
+            t->prev = t->next = nullptr;
+            place(*t);
+            t = next;
+        }
+    }
+
+    return index;
+}
+
+std::uint64_t timer_wheel::next_expiry() const
+{
+    if (_size == 0)
+        return NONE;
+
+    // exact if in the root, otherwise the next wrap, when the upper levels cascade
+    unsigned index = _current & (ROOT_SIZE - 1);
+    return _current - index + next_root_slot(index);
+}
+
+}
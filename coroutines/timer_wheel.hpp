@@ -0,0 +1,125 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_TIMER_WHEEL_HPP
+#define COROUTINES_TIMER_WHEEL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+namespace coroutines {
+
+struct select_waiter;
+
+// pending timeout. Intrusive, lives wherever the waiting code keeps it (usually the stack), so adding costs no allocation
+struct timer
+{
+    std::uint64_t expiry = 0;   // tick
+    timer* prev = nullptr;      // null when not in a wheel
+    timer* next = nullptr;
+    select_waiter* waiter = nullptr; // woken when the timer expires
+    bool fired = false;         // set if the timer woke the waiter
+
+    bool pending() const { return prev != nullptr; }
+};
+
+// hierarchical timing wheel (Varghese & Lauck), as in the Linux kernel.
+// 256 slots of 1 tick, then 4 levels of 64 slots, each covering the whole lower level per slot: ~2^32 ticks in total.
+// Timers further away wait in the last level and are re-inserted when it cascades.
+// Add and remove are O(1), advancing is amortized O(1) per tick and timer. Not thread-safe
+class timer_wheel
+{
+public:
+
+    static const std::uint64_t NONE = std::numeric_limits<std::uint64_t>::max();
+
+    // 'now' is the first tick to be processed
+    explicit timer_wheel(std::uint64_t now = 0);
+    timer_wheel(const timer_wheel&) = delete;
+
+    // timer already expired goes to the next tick processed
+    void add(timer& t);
+
+    // timer must be pending
+    void remove(timer& t);
+
+    // processes all ticks up to and including 'now'. Expired timers are removed and passed to on_expired
+    template<typename Callback>
+    void advance(std::uint64_t now, Callback on_expired);
+
+    // no timer expires before the returned tick. NONE if the wheel is empty
+    std::uint64_t next_expiry() const;
+
+    std::size_t size() const { return _size; }
+
+    // next tick to be processed
+    std::uint64_t current() const { return _current; }
+
+private:
+
+    static const unsigned ROOT_BITS = 8;
+    static const unsigned ROOT_SIZE = 1 << ROOT_BITS;
+    static const unsigned LEVEL_BITS = 6;
+    static const unsigned LEVEL_SIZE = 1 << LEVEL_BITS;
+    static const unsigned LEVELS = 4;
+
+    static void link(timer& slot, timer& t);
+    static void unlink(timer& t);
+    static bool empty(const timer& slot) { return slot.next == &slot; }
+
+    void place(timer& t);
+
+    // moves timers from the level slot down to where they belong now. Returns the slot index
+    unsigned cascade(unsigned level);
+
+    // first occupied root slot at or after 'index', or ROOT_SIZE
+    unsigned next_root_slot(unsigned index) const;
+    void mark_root(unsigned index, bool occupied);
+
+    // circular lists with sentinel
+    timer _root[ROOT_SIZE];
+    timer _levels[LEVELS][LEVEL_SIZE];
+    std::uint64_t _root_occupied[ROOT_SIZE / 64]; // bitmap of non-empty root slots, to skip idle ticks quickly
+
+    std::uint64_t _current;
+    std::size_t _size = 0;
+};
+
+template<typename Callback>
+void timer_wheel::advance(std::uint64_t now, Callback on_expired)
+{
+    while(_current <= now)
+    {
+        if (_size == 0)
+        {
+            _current = now + 1;
+            return;
+        }
+
+        unsigned index = _current & (ROOT_SIZE - 1);
+        if (index == 0)
+        {
+            // root wrapped, bring the next range down
+            for(unsigned level = 0; level < LEVELS && cascade(level) == 0; level++)
+                ;
+        }
+
+        timer& slot = _root[index];
+        while(!empty(slot))
+        {
+            timer* t = slot.next;
+            unlink(*t);
+            _size--;
+            on_expired(*t);
+        }
+        mark_root(index, false);
+
+        // skip empty slots, up to the next wrap
+        unsigned next = next_root_slot(index + 1);
+        std::uint64_t skip_to = _current - index + next;
+        _current = skip_to <= now + 1 ? skip_to : now + 1;
+    }
+}
+
+}
+
+#endif
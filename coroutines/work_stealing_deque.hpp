@@ -0,0 +1,168 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#ifndef COROUTINES_WORK_STEALING_DEQUE_HPP
+#define COROUTINES_WORK_STEALING_DEQUE_HPP
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace coroutines {
+
+// lock-free Chase-Lev work-stealing deque.
+// The owner thread pushes and pops at the bottom, any other thread can steal from the top.
+// Grows when full. Old arrays are kept until destruction, as thieves may still be reading them.
+// Based on "Correct and Efficient Work-Stealing for Weak Memory Models", Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013
+// T must be trivially copyable, pointers are what it's meant for.
+template<typename T>
+class work_stealing_deque
+{
+public:
+
+    // capacity must be a power of 2
+    explicit work_stealing_deque(std::size_t capacity = 256);
+    work_stealing_deque(const work_stealing_deque&) = delete;
+
+    // owner only
+    void push(T v);
+
+    // owner only. Takes the most recently pushed item (LIFO). Returns false if empty
+    bool pop(T& out);
+
+    // any thread. Takes the oldest item (FIFO). Returns false if empty
+    bool steal(T& out);
+
+    // approximate, when called by other than owner
+    std::size_t size() const;
+    bool empty() const { return size() == 0; }
+
+private:
+
+    struct array
+    {
+        explicit array(std::size_t c)
+        : capacity(c), mask(c-1), items(new std::atomic<T>[c])
+        { }
+
+        T get(std::int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+        void put(std::int64_t i, T v) { items[i & mask].store(v, std::memory_order_relaxed); }
+
+        const std::size_t capacity;
+        const std::size_t mask;
+        std::unique_ptr<std::atomic<T>[]> items;
+    };
+
+    array* grow(array* a, std::int64_t top, std::int64_t bottom);
+
+    // top and bottom are written by different threads, keep them apart
+    std::atomic<std::int64_t> _top;
+    char _padding1[64];
+    std::atomic<std::int64_t> _bottom;
+    char _padding2[64];
+    std::atomic<array*> _array;
+    std::vector<std::unique_ptr<array>> _arrays; // owner only
+};
+
+template<typename T>
+work_stealing_deque<T>::work_stealing_deque(std::size_t capacity)
+    : _top(0)
+    , _bottom(0)
+{
+    assert(capacity > 0 && (capacity & (capacity-1)) == 0);
+    _arrays.emplace_back(new array(capacity));
+    _array.store(_arrays.back().get(), std::memory_order_relaxed);
+}
+
+template<typename T>
+void work_stealing_deque<T>::push(T v)
+{
+    std::int64_t b = _bottom.load(std::memory_order_relaxed);
+    std::int64_t t = _top.load(std::memory_order_acquire);
+    array* a = _array.load(std::memory_order_relaxed);
+
+    if (b - t > std::int64_t(a->capacity) - 1)
+    {
+        a = grow(a, t, b);
+    }
+
+    a->put(b, v);
+    std::atomic_thread_fence(std::memory_order_release);
+    _bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+template<typename T>
+bool work_stealing_deque<T>::pop(T& out)
+{
+    std::int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+    array* a = _array.load(std::memory_order_relaxed);
+    _bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = _top.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        // empty
+        _bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    out = a->get(b);
+    if (t == b)
+    {
+        // last one, race against thieves
+        bool won = _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        _bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+template<typename T>
+bool work_stealing_deque<T>::steal(T& out)
+{
+    for(;;)
+    {
+        std::int64_t t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = _bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return false;
+
+        array* a = _array.load(std::memory_order_acquire);
+        T v = a->get(t);
+        if (_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            out = v;
+            return true;
+        }
+        // lost to other thief or the owner, someone made progress. Try again
+    }
+}
+
+template<typename T>
+std::size_t work_stealing_deque<T>::size() const
+{
+    std::int64_t b = _bottom.load(std::memory_order_relaxed);
+    std::int64_t t = _top.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+template<typename T>
+typename work_stealing_deque<T>::array* work_stealing_deque<T>::grow(array* a, std::int64_t top, std::int64_t bottom)
+{
+    _arrays.emplace_back(new array(a->capacity * 2));
+    array* bigger = _arrays.back().get();
+    for(std::int64_t i = top; i < bottom; i++)
+    {
+        bigger->put(i, a->get(i));
+    }
+    _array.store(bigger, std::memory_order_release);
+    return bigger;
+}
+
+}
+
+#endif
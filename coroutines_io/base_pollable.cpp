@@ -5,20 +5,64 @@
 #include "coroutines_io/io_scheduler.hpp"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <climits>
+
+#include <algorithm>
 
 namespace coroutines {
 
+// I/O through the ring reports errors as -errno
+static void throw_result(int r, const char* what)
+{
+    throw std::system_error(-r, std::system_category(), what);
+}
+
+// skips n bytes of the vector. Partially written block is adjusted in a copy, caller's array is never modified
+static void advance(const iovec*& iov, std::size_t& count, std::size_t n, std::vector<iovec>& copy)
+{
+    while(count > 0 && n >= iov->iov_len)
+    {
+        n -= iov->iov_len;
+        iov++;
+        count--;
+    }
+    if (n > 0)
+    {
+        if (copy.empty() || iov < copy.data() || iov >= copy.data() + copy.size())
+        {
+            copy.assign(iov, iov + count);
+            iov = copy.data();
+        }
+        iovec& first = copy[iov - copy.data()];
+        first.iov_base = static_cast<char*>(first.iov_base) + n;
+        first.iov_len -= n;
+    }
+}
+
 base_pollable::base_pollable(io_scheduler& srv)
     : _service(srv)
+    , _uring(srv.get_uring())
 {
 }
 
 base_pollable::base_pollable(base_pollable&& o)
     : _service(o._service)
+    , _uring(o._uring)
 {
+    swap(o);
+}
+
+void base_pollable::swap(base_pollable& o)
+{
+    assert(&_service == &o._service);
+
     std::swap(_fd, o._fd);
-    std::swap(_reader, o._reader);
-    std::swap(_writer, o._writer);
+    std::swap(_poll_state, o._poll_state);
+    std::swap(_shard, o._shard);
 }
 
 base_pollable::~base_pollable()
@@ -30,53 +74,83 @@ void base_pollable::close()
 {
     if (_fd != -1)
     {
-        ::close(_fd);
+        // closed first: a coroutine woken from waiting on it finds it closed
+        int fd = _fd;
+        detail::poll_state* state = _poll_state;
         _fd = -1;
+        _poll_state = nullptr;
+        if (_uring)
+            _uring->cancel(fd); // in-flight operations hold the file open
+        ::close(fd);
+        if (state)
+            _service.unregister_fd(state);
     }
 }
 
 void base_pollable::set_fd(int fd)
+{
+    set_fd(fd, _service.current_shard());
+}
+
+void base_pollable::set_fd(int fd, unsigned shard)
 {
     assert(_fd == -1);
 
     _fd = fd;
-
-    auto pair = _service.get_scheduler().make_channel<std::error_code>(1, "pollable notification channel");
-    _reader = std::move(pair.reader);
-    _writer = std::move(pair.writer);
-
+    _shard = shard;
+    // the ring waits for readiness itself, the descriptor stays as it is: non-blocking, for the syscalls made directly
+    if (!_uring)
+        _poll_state = _service.register_fd(fd, shard);
 }
 
 void base_pollable::wait_for_readable()
 {
     assert(_fd != -1);
 
-    _service.wait_for_readable(_fd, _writer);
-    std::error_code e = _reader.get();
-    if (e)
-    {
-        throw std::system_error(e, "wait_for_readable");
-    }
+    if (_uring)
+        _uring->poll(_fd, POLLIN);
+    else if (_poll_state)
+        _poll_state->wait(detail::poll_state::READ, "wait_for_readable");
+
+    if (_fd == -1)
+        throw std::system_error(ECANCELED, std::system_category(), "closed while waiting for read");
 }
 
 void base_pollable::wait_for_writable()
 {
-    _service.wait_for_writable(_fd, _writer);
-    std::error_code e = _reader.get();
-    if (e)
-    {
-        throw std::system_error(e, "wait_for_writable");
-    }
+    assert(_fd != -1);
 
+    if (_uring)
+        _uring->poll(_fd, POLLOUT);
+    else if (_poll_state)
+        _poll_state->wait(detail::poll_state::WRITE, "wait_for_writable");
+
+    if (_fd == -1)
+        throw std::system_error(ECANCELED, std::system_category(), "closed while waiting for write");
 }
 
 std::size_t base_pollable::read(char* buf, std::size_t how_much)
 {
-     assert(is_open());
+    assert(is_open());
+
+    if (_uring)
+    {
+        std::size_t total = 0;
+        while(total < how_much)
+        {
+            int r = _uring->read(get_fd(), buf + total, how_much - total);
+            if (r < 0)
+                throw_result(r, "read");
+            if (r == 0)
+                break;
+            total += r;
+        }
+        return total;
+    }
 
-     std::size_t total = 0;
-     while(total < how_much)
-     {
+    std::size_t total = 0;
+    while(total < how_much)
+    {
         ssize_t r = ::read(get_fd(), buf + total, how_much - total);
         if (r == 0)
         {
@@ -97,16 +171,24 @@ std::size_t base_pollable::read(char* buf, std::size_t how_much)
         {
             total += r;
         }
-     }
-     return total;
+    }
+    return total;
 }
 
 std::size_t base_pollable::read_some(char* buf, std::size_t how_much)
 {
-     assert(is_open());
+    assert(is_open());
 
-     for(;;)
-     {
+    if (_uring)
+    {
+        int r = _uring->read(get_fd(), buf, how_much);
+        if (r < 0)
+            throw_result(r, "read_some");
+        return r;
+    }
+
+    for(;;)
+    {
         ssize_t r = ::read(get_fd(), buf, how_much);
         if (r < 0)
         {
@@ -123,16 +205,16 @@ std::size_t base_pollable::read_some(char* buf, std::size_t how_much)
         {
             return r;
         }
-     }
+    }
 }
 
 std::size_t base_pollable::read_unitl(char* buf, std::size_t how_much, const std::string& pattern)
 {
-     assert(is_open());
+    assert(is_open());
 
-     std::size_t total = 0;
-     while(total < how_much)
-     {
+    std::size_t total = 0;
+    while(total < how_much)
+    {
         std::size_t r= read_some(buf+total, how_much-total);
         if (r == 0)
         {
@@ -140,22 +222,40 @@ std::size_t base_pollable::read_unitl(char* buf, std::size_t how_much, const std
         }
         total += r;
 
-        auto it = std::search(buf, buf+total, pattern.begin(), pattern.end());
+        // only the new data, and the end of the old one the pattern could have started in
+        std::size_t from = total - r;
+        from = from >= pattern.size() ? from - pattern.size() + 1 : 0;
+        auto it = std::search(buf+from, buf+total, pattern.begin(), pattern.end());
         if (it != buf+total)
         {
             return total;
         }
-     }
-     return total;
+    }
+    return total;
 }
 
 std::size_t base_pollable::write(const char* buf, std::size_t how_much)
 {
-     assert(is_open());
+    assert(is_open());
+
+    if (_uring)
+    {
+        std::size_t total = 0;
+        while(total < how_much)
+        {
+            int r = _uring->write(get_fd(), buf + total, how_much - total);
+            if (r < 0)
+                throw_result(r, "write");
+            if (r == 0)
+                break;
+            total += r;
+        }
+        return total;
+    }
 
-     std::size_t total = 0;
-     while(total < how_much)
-     {
+    std::size_t total = 0;
+    while(total < how_much)
+    {
         ssize_t r = ::write(get_fd(), buf + total, how_much - total);
         if (r == 0)
         {
@@ -176,8 +276,209 @@ std::size_t base_pollable::write(const char* buf, std::size_t how_much)
         {
             total += r;
         }
-     }
-     return total;
+    }
+    return total;
+}
+
+namespace {
+
+// kernel buffer for splicing
+struct splice_pipe
+{
+    // non-blocking for epoll, the ring needs blocking ends
+    splice_pipe(bool nonblocking)
+    {
+        if (::pipe2(fds, O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0)) < 0)
+            throw_errno("pipe");
+    }
+    ~splice_pipe()
+    {
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    int read_end() const { return fds[0]; }
+    int write_end() const { return fds[1]; }
+
+    int fds[2];
+};
+
+}
+
+// pipe capacity, default on Linux
+static const std::size_t SPLICE_CHUNK = 64*1024;
+
+static const std::uint64_t NO_OFFSET = -1;
+
+std::size_t base_pollable::splice_through(base_pollable& in, std::uint64_t offset, base_pollable& out, std::size_t how_much)
+{
+    detail::uring* ring = out._uring;
+    int in_fd = in._fd;
+    int out_fd = out._fd;
+    splice_pipe pipe(!ring);
+
+    std::size_t total = 0;
+    while(total < how_much)
+    {
+        std::size_t chunk = std::min(how_much - total, SPLICE_CHUNK);
+        std::uint64_t in_offset = offset == NO_OFFSET ? NO_OFFSET : offset + total;
+
+        // fill the pipe
+        ssize_t in_pipe;
+        if (ring)
+        {
+            in_pipe = ring->splice(in_fd, in_offset, pipe.write_end(), NO_OFFSET, chunk);
+            if (in_pipe < 0)
+                throw_result(in_pipe, "splice");
+        }
+        else
+        {
+            loff_t off = in_offset;
+            in_pipe = ::splice(in_fd, offset == NO_OFFSET ? nullptr : &off, pipe.write_end(), nullptr, chunk, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if (in_pipe < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    in.wait_for_readable();
+                    continue;
+                }
+                throw_errno("splice");
+            }
+        }
+        if (in_pipe == 0)
+            break; // EOF
+
+        // and drain it
+        for(ssize_t left = in_pipe; left > 0;)
+        {
+            ssize_t r;
+            if (ring)
+            {
+                r = ring->splice(pipe.read_end(), NO_OFFSET, out_fd, NO_OFFSET, left);
+                if (r < 0)
+                    throw_result(r, "splice");
+            }
+            else
+            {
+                r = ::splice(pipe.read_end(), nullptr, out_fd, nullptr, left, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+                if (r < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        out.wait_for_writable();
+                        continue;
+                    }
+                    throw_errno("splice");
+                }
+            }
+            if (r == 0)
+                throw std::system_error(EPIPE, std::system_category(), "splice");
+            left -= r;
+        }
+        total += in_pipe;
+    }
+    return total;
+}
+
+std::size_t base_pollable::splice_to(base_pollable& to, std::size_t how_much)
+{
+    assert(is_open());
+    assert(to.is_open());
+
+    return splice_through(*this, NO_OFFSET, to, how_much);
+}
+
+std::size_t base_pollable::send_from(base_pollable& in, std::uint64_t offset, std::size_t length)
+{
+    assert(is_open());
+    assert(in.is_open());
+
+    // the ring has no sendfile, splice is what sendfile does inside anyway
+    if (_uring)
+        return splice_through(in, offset, *this, length);
+
+    std::size_t total = 0;
+    while(total < length)
+    {
+        off_t off = offset + total;
+        ssize_t r = ::sendfile(_fd, in._fd, &off, std::min(length - total, SPLICE_CHUNK * 16));
+        if (r < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait_for_writable();
+                continue;
+            }
+            throw_errno("sendfile");
+        }
+        if (r == 0)
+            break; // EOF
+        total += r;
+    }
+    return total;
+}
+
+std::size_t base_pollable::read_v(const iovec* iov, std::size_t count)
+{
+    assert(is_open());
+
+    int n = std::min<std::size_t>(count, IOV_MAX);
+    if (_uring)
+    {
+        int r = _uring->readv(get_fd(), iov, n);
+        if (r < 0)
+            throw_result(r, "readv");
+        return r;
+    }
+
+    for(;;)
+    {
+        ssize_t r = ::readv(get_fd(), iov, n);
+        if (r >= 0)
+            return r;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_for_readable();
+        else
+            throw_errno("readv");
+    }
+}
+
+std::size_t base_pollable::write_v(const iovec* iov, std::size_t count)
+{
+    assert(is_open());
+
+    std::vector<iovec> copy; // only if a block was written partially
+    std::size_t total = 0;
+    while(count > 0)
+    {
+        int n = std::min<std::size_t>(count, IOV_MAX);
+        ssize_t r;
+        if (_uring)
+        {
+            r = _uring->writev(get_fd(), iov, n);
+            if (r < 0)
+                throw_result(r, "writev");
+        }
+        else
+        {
+            r = ::writev(get_fd(), iov, n);
+            if (r < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    wait_for_writable();
+                    continue;
+                }
+                throw_errno("writev");
+            }
+        }
+
+        if (r == 0)
+            break;
+        total += r;
+        advance(iov, count, r, copy);
+    }
+    return total;
 }
 
 }
@@ -2,9 +2,12 @@
 #ifndef COROUTINES_BASE_POLLABLE_HPP
 #define COROUTINES_BASE_POLLABLE_HPP
 
-#include "coroutines/channel.hpp"
+#include "coroutines_io/detail/poll_state.hpp"
+#include "coroutines_io/detail/uring.hpp"
+#include "coroutines_io/buffer_chain.hpp"
 
 #include <system_error>
+#include <string>
 
 namespace coroutines {
 
@@ -33,27 +36,54 @@ public:
     // write all
     std::size_t write(const char* buf, std::size_t how_much);
 
+    // scatter/gather, one syscall for all the blocks.
+    // read_v reads whatever is available, like read_some. write_v writes all
+    std::size_t read_v(const iovec* iov, std::size_t count);
+    std::size_t write_v(const iovec* iov, std::size_t count);
+    std::size_t write_v(const coroutines_io::buffer_chain& chain) { return write_v(chain.iovecs(), chain.count()); }
+
+    // moves data to another descriptor through a kernel pipe, never copied to user memory. For proxying.
+    // Transfers how_much, or until EOF
+    std::size_t splice_to(base_pollable& to, std::size_t how_much);
+
 
 protected:
 
+    // registers the descriptor with the io_scheduler for its lifetime, in the shard of the current processor or given one
     void set_fd(int get_fd);
+    void set_fd(int get_fd, unsigned shard);
 
+    // to be called after the I/O returned EAGAIN, parks until the descriptor becomes ready.
+    // May wake up spuriously, the I/O has to be retried. With io_uring, waits through the ring
     void wait_for_readable();
     void wait_for_writable();
 
+    // sends part of a file, without copying it to user memory. Until length, or EOF
+    std::size_t send_from(base_pollable& in, std::uint64_t offset, std::size_t length);
+
+    // exchanges descriptors, both objects use the same io_scheduler
+    void swap(base_pollable& o);
+
     int get_fd() const { return _fd; }
     bool is_open() const { return _fd != -1; }
 
     io_scheduler& get_service() { return _service; }
+    detail::uring* get_uring() { return _uring; }
+
+    unsigned get_shard() const { return _shard; }
 
 private:
 
+    // in -> pipe -> out, in chunks the pipe can hold. Offset -1 if 'in' has none, or its position is to be used
+    static std::size_t splice_through(base_pollable& in, std::uint64_t offset, base_pollable& out, std::size_t how_much);
+
     int _fd = -1;
 
     io_scheduler& _service;
 
-    channel_reader<std::error_code> _reader;
-    channel_writer<std::error_code> _writer;
+    detail::poll_state* _poll_state = nullptr; // null if the descriptor is always ready
+    detail::uring* _uring; // with io_uring backend, I/O goes through it instead
+    unsigned _shard = 0;
 };
 
 }
@@ -0,0 +1,81 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_BUFFER_CHAIN_HPP
+#define COROUTINES_IO_BUFFER_CHAIN_HPP
+
+#include "coroutines_io/buffer.hpp"
+
+#include <sys/uio.h>
+
+#include <vector>
+#include <string>
+
+namespace coroutines_io
+{
+
+// sequence of blocks sent with a single writev, nothing is copied.
+// Blocks are either owned buffers, moved in, or borrowed memory that has to outlive the write (cached body, constant header).
+// Movable, but not copyable
+class buffer_chain
+{
+public:
+
+    buffer_chain() = default;
+    buffer_chain(const buffer_chain&) = delete;
+    buffer_chain(buffer_chain&&) = default;
+    buffer_chain& operator=(buffer_chain&&) = default;
+
+    // takes the buffer, its data goes out
+    void append(buffer&& b)
+    {
+        if (b.size() == 0)
+            return;
+        _iovecs.push_back(make_iovec(b.begin(), b.size()));
+        _owned.push_back(std::move(b));
+        _size += _iovecs.back().iov_len;
+    }
+
+    // borrowed
+    void append(const char* data, std::size_t size)
+    {
+        if (size == 0)
+            return;
+        _iovecs.push_back(make_iovec(data, size));
+        _size += size;
+    }
+
+    void append(const std::string& s) { append(s.data(), s.size()); }
+
+    // for read_v()/write_v()
+    const iovec* iovecs() const { return _iovecs.data(); }
+    std::size_t count() const { return _iovecs.size(); }
+
+    // total bytes
+    std::size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    // releases owned buffers, ready to be filled again
+    void clear()
+    {
+        _iovecs.clear();
+        _owned.clear();
+        _size = 0;
+    }
+
+private:
+
+    static iovec make_iovec(const char* data, std::size_t size)
+    {
+        iovec v;
+        v.iov_base = const_cast<char*>(data);
+        v.iov_len = size;
+        return v;
+    }
+
+    std::vector<iovec> _iovecs;
+    std::vector<buffer> _owned; // moving a buffer doesn't move its data, iovecs stay valid
+    std::size_t _size = 0;
+};
+
+}
+
+#endif
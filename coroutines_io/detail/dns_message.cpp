@@ -0,0 +1,258 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/detail/dns_message.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cctype>
+
+namespace coroutines { namespace detail {
+
+static const std::size_t HEADER_SIZE = 12;
+static const std::uint16_t CLASS_IN = 1;
+static const std::uint16_t FLAG_RESPONSE = 0x8000;
+static const std::uint16_t FLAG_TRUNCATED = 0x0200;
+static const std::uint16_t FLAG_RECURSION_DESIRED = 0x0100;
+static const unsigned MAX_CNAME_CHAIN = 8;
+
+static void put16(std::string& out, std::uint16_t v)
+{
+    out.push_back(char(v >> 8));
+    out.push_back(char(v & 0xff));
+}
+
+std::string make_dns_query(std::uint16_t id, const std::string& name, dns_type type)
+{
+    std::string out;
+    out.reserve(HEADER_SIZE + name.size() + 6);
+    put16(out, id);
+    put16(out, FLAG_RECURSION_DESIRED);
+    put16(out, 1); // questions
+    put16(out, 0);
+    put16(out, 0);
+    put16(out, 0);
+
+    // labels
+    std::size_t start = 0;
+    while(start < name.size())
+    {
+        std::size_t end = name.find('.', start);
+        if (end == std::string::npos)
+            end = name.size();
+        std::size_t length = end - start;
+        if (length == 0 || length > 63)
+            throw std::invalid_argument("invalid host name: " + name);
+        out.push_back(char(length));
+        out.append(name, start, length);
+        start = end + 1;
+    }
+    out.push_back(0);
+    if (out.size() - HEADER_SIZE > 255)
+        throw std::invalid_argument("host name too long: " + name);
+
+    put16(out, type);
+    put16(out, CLASS_IN);
+    return out;
+}
+
+namespace {
+
+class reader
+{
+public:
+    reader(const char* data, std::size_t size) : _data(reinterpret_cast<const std::uint8_t*>(data)), _size(size) { }
+
+    bool u16(std::uint16_t& v)
+    {
+        if (_pos + 2 > _size)
+            return false;
+        v = (_data[_pos] << 8) | _data[_pos + 1];
+        _pos += 2;
+        return true;
+    }
+
+    bool u32(std::uint32_t& v)
+    {
+        std::uint16_t hi, lo;
+        if (!u16(hi) || !u16(lo))
+            return false;
+        v = (std::uint32_t(hi) << 16) | lo;
+        return true;
+    }
+
+    bool skip(std::size_t n)
+    {
+        if (_pos + n > _size)
+            return false;
+        _pos += n;
+        return true;
+    }
+
+    // lowercase, dot-separated. Follows compression pointers, which only ever point backwards
+    bool name(std::string& out)
+    {
+        return name_at(_pos, out, true);
+    }
+
+    bool name_at(std::size_t pos, std::string& out, bool advance)
+    {
+        out.clear();
+        std::size_t limit = pos; // pointers have to go below this
+        bool jumped = false;
+        for(;;)
+        {
+            if (pos >= _size)
+                return false;
+            std::uint8_t length = _data[pos];
+            if ((length & 0xc0) == 0xc0)
+            {
+                if (pos + 1 >= _size)
+                    return false;
+                std::size_t target = ((length & 0x3f) << 8) | _data[pos + 1];
+                if (target >= limit)
+                    return false; // loop
+                if (!jumped && advance)
+                    _pos = pos + 2;
+                jumped = true;
+                limit = target;
+                pos = target;
+            }
+            else if (length == 0)
+            {
+                if (!jumped && advance)
+                    _pos = pos + 1;
+                return true;
+            }
+            else
+            {
+                if (length > 63 || pos + 1 + length > _size)
+                    return false;
+                if (!out.empty())
+                    out.push_back('.');
+                for(std::size_t i = 0; i < length; i++)
+                    out.push_back(std::tolower(_data[pos + 1 + i]));
+                pos += 1 + length;
+            }
+        }
+    }
+
+    std::size_t position() const { return _pos; }
+    const std::uint8_t* at(std::size_t pos) const { return _data + pos; }
+
+private:
+    const std::uint8_t* _data;
+    std::size_t _size;
+    std::size_t _pos = 0;
+};
+
+struct record
+{
+    std::string owner;
+    std::uint16_t type;
+    std::uint32_t ttl;
+    std::size_t rdata; // position
+    std::uint16_t rdata_length;
+};
+
+}
+
+bool parse_dns_answer(const char* data, std::size_t size, dns_answer& out)
+{
+    reader r(data, size);
+    std::uint16_t flags, questions, answers, authority, additional;
+    if (!r.u16(out.id) || !r.u16(flags) || !r.u16(questions) || !r.u16(answers) || !r.u16(authority) || !r.u16(additional))
+        return false;
+    if (!(flags & FLAG_RESPONSE) || questions != 1)
+        return false;
+    out.rcode = flags & 0x0f;
+    out.truncated = flags & FLAG_TRUNCATED;
+
+    std::uint16_t qclass;
+    if (!r.name(out.question) || !r.u16(out.question_type) || !r.u16(qclass))
+        return false;
+
+    std::vector<record> records;
+    std::size_t answers_kept = 0; // the first ones in 'records', the authority section follows
+    for(unsigned i = 0; i < unsigned(answers) + authority; i++)
+    {
+        record rec;
+        std::uint16_t rclass;
+        if (!r.name(rec.owner) || !r.u16(rec.type) || !r.u16(rclass) || !r.u32(rec.ttl) || !r.u16(rec.rdata_length))
+            return false;
+        rec.rdata = r.position();
+        if (!r.skip(rec.rdata_length))
+            return false;
+        if (rclass == CLASS_IN)
+        {
+            records.push_back(rec);
+            if (i < answers)
+                answers_kept++;
+        }
+    }
+
+    // answers first, then authority
+    std::string target = out.question;
+    std::uint32_t ttl = std::numeric_limits<std::uint32_t>::max();
+    for(unsigned hops = 0; hops < MAX_CNAME_CHAIN; hops++)
+    {
+        auto cname = std::find_if(records.begin(), records.begin() + answers_kept, [&](const record& rec)
+        {
+            return rec.type == DNS_CNAME && rec.owner == target;
+        });
+        if (cname == records.begin() + answers_kept)
+            break;
+        if (!r.name_at(cname->rdata, target, false))
+            return false;
+        ttl = std::min(ttl, cname->ttl);
+    }
+
+    out.addresses.clear();
+    for(std::size_t i = 0; i < answers_kept; i++)
+    {
+        const record& rec = records[i];
+        if (rec.owner != target || rec.type != out.question_type)
+            continue;
+
+        if (rec.type == DNS_A && rec.rdata_length == 4)
+        {
+            boost::asio::ip::address_v4::bytes_type bytes;
+            std::copy(r.at(rec.rdata), r.at(rec.rdata) + 4, bytes.begin());
+            out.addresses.push_back(boost::asio::ip::address_v4(bytes));
+        }
+        else if (rec.type == DNS_AAAA && rec.rdata_length == 16)
+        {
+            boost::asio::ip::address_v6::bytes_type bytes;
+            std::copy(r.at(rec.rdata), r.at(rec.rdata) + 16, bytes.begin());
+            out.addresses.push_back(boost::asio::ip::address_v6(bytes));
+        }
+        else
+        {
+            continue;
+        }
+        ttl = std::min(ttl, rec.ttl);
+    }
+
+    if (out.addresses.empty())
+    {
+        // negative answer is cached for the SOA's minimum (RFC 2308)
+        ttl = 0;
+        for(const record& rec : records)
+        {
+            if (rec.type != DNS_SOA)
+                continue;
+            reader soa(data, size);
+            std::string mname, rname;
+            std::uint32_t serial, refresh, retry, expire, minimum;
+            if (soa.skip(rec.rdata) && soa.name(mname) && soa.name(rname)
+                && soa.u32(serial) && soa.u32(refresh) && soa.u32(retry) && soa.u32(expire) && soa.u32(minimum))
+            {
+                ttl = std::min(rec.ttl, minimum);
+            }
+            break;
+        }
+    }
+    out.ttl = ttl;
+    return true;
+}
+
+}}
@@ -0,0 +1,49 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DETAIL_DNS_MESSAGE_HPP
+#define COROUTINES_IO_DETAIL_DNS_MESSAGE_HPP
+
+#include <boost/asio/ip/address.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace coroutines { namespace detail {
+
+// DNS wire format (RFC 1035), just what a stub resolver needs
+
+enum dns_type : std::uint16_t
+{
+    DNS_A = 1,
+    DNS_CNAME = 5,
+    DNS_SOA = 6,
+    DNS_AAAA = 28
+};
+
+enum dns_rcode
+{
+    DNS_NOERROR = 0,
+    DNS_SERVFAIL = 2,
+    DNS_NXDOMAIN = 3
+};
+
+// recursive query for one name. Throws std::invalid_argument if the name can't be encoded
+std::string make_dns_query(std::uint16_t id, const std::string& name, dns_type type);
+
+struct dns_answer
+{
+    std::uint16_t id = 0;
+    int rcode = 0;
+    bool truncated = false;
+    std::string question; // lowercase, no trailing dot
+    std::uint16_t question_type = 0;
+    std::vector<boost::asio::ip::address> addresses; // of the question's type, CNAMEs followed
+    std::uint32_t ttl = 0; // minimum of the records used; negative answer: from the SOA, 0 if there's none
+};
+
+// false if it's not a well-formed response
+bool parse_dns_answer(const char* data, std::size_t size, dns_answer& out);
+
+}}
+
+#endif
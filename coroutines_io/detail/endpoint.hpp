@@ -0,0 +1,32 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DETAIL_ENDPOINT_HPP
+#define COROUTINES_IO_DETAIL_ENDPOINT_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include <sys/socket.h>
+
+#include <cstring>
+
+namespace coroutines { namespace detail {
+
+// asio endpoint holds the native sockaddr already, for both families: endpoint.data(), endpoint.size()
+
+// decodes address returned by accept/getpeername.
+// IPv4 peers of a dual-stack socket come as v4-mapped IPv6 (::ffff:a.b.c.d), they're reported as plain IPv4
+inline boost::asio::ip::tcp::endpoint to_endpoint(const sockaddr_storage& addr, socklen_t len)
+{
+    boost::asio::ip::tcp::endpoint endpoint;
+    if (len > endpoint.capacity())
+        len = endpoint.capacity();
+    std::memcpy(endpoint.data(), &addr, len);
+    endpoint.resize(len);
+
+    if (endpoint.address().is_v6() && endpoint.address().to_v6().is_v4_mapped())
+        endpoint.address(endpoint.address().to_v6().to_v4());
+    return endpoint;
+}
+
+}}
+
+#endif
@@ -0,0 +1,94 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/detail/file_io.hpp"
+#include "coroutines_io/detail/poll_state.hpp"
+#include "coroutines/scheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+
+namespace coroutines { namespace detail {
+
+const unsigned file_io::DEFAULT_THREADS;
+
+file_io::file_io(unsigned max_threads)
+    : _max_threads(std::max(max_threads, 1u))
+{
+}
+
+file_io::~file_io()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cv.notify_all();
+    for(std::thread& t : _threads)
+        t.join();
+}
+
+ssize_t file_io::execute(const std::function<ssize_t()>& operation)
+{
+    ssize_t result = 0;
+    poll_state done; // READ direction used
+
+    post([&]()
+    {
+        ssize_t r = operation();
+        result = r < 0 ? -errno : r;
+
+        // the coroutine may be gone as soon as it's woken, nothing is touched after that
+        std::vector<coroutine_weak_ptr> woken;
+        done.set_ready(poll_state::READ, woken);
+        for(coroutine_weak_ptr c : woken)
+            c->get_scheduler().schedule(c);
+    });
+
+    done.wait(poll_state::READ, "file_io");
+    return result;
+}
+
+void file_io::post(std::function<void()> operation)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        assert(!_stopping);
+        _queue.push_back(std::move(operation));
+
+        if (_idle == 0 && _threads.size() < _max_threads)
+        {
+            _threads.emplace_back([this]() { worker(); });
+            return;
+        }
+    }
+    _cv.notify_one();
+}
+
+void file_io::worker()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(;;)
+    {
+        if (!_queue.empty())
+        {
+            std::function<void()> operation = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            operation();
+            lock.lock();
+        }
+        else if (_stopping)
+        {
+            return;
+        }
+        else
+        {
+            _idle++;
+            _cv.wait(lock);
+            _idle--;
+        }
+    }
+}
+
+}}
@@ -0,0 +1,52 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DETAIL_FILE_IO_HPP
+#define COROUTINES_IO_DETAIL_FILE_IO_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace coroutines { namespace detail {
+
+// runs blocking disk I/O on a bounded pool of threads, so processors don't block.
+// Regular files are always 'ready' for epoll, the only way to not wait for the disk is to let someone else do it.
+// Threads are started as needed, up to the limit; requests wait in the queue when all are busy
+class file_io
+{
+public:
+
+    static const unsigned DEFAULT_THREADS = 4;
+
+    file_io(unsigned max_threads = DEFAULT_THREADS);
+    file_io(const file_io&) = delete;
+    ~file_io();
+
+    // from a coroutine: runs the operation on an I/O thread, parks until it's done.
+    // Returns what the operation did, or -errno if it returned a negative value
+    ssize_t execute(const std::function<ssize_t()>& operation);
+
+    // runs the operation without waiting for it
+    void post(std::function<void()> operation);
+
+private:
+
+    void worker();
+
+    const unsigned _max_threads;
+
+    std::mutex _mutex; // I/O threads block, not a spinlock
+    std::condition_variable _cv;
+    std::deque<std::function<void()>> _queue;
+    std::vector<std::thread> _threads;
+    unsigned _idle = 0;
+    bool _stopping = false;
+};
+
+}}
+
+#endif
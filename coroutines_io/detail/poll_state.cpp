@@ -0,0 +1,75 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/detail/poll_state.hpp"
+#include "coroutines/scheduler.hpp"
+
+//#define CORO_LOGGING
+#include "coroutines/logging.hpp"
+
+#include <cassert>
+
+namespace coroutines { namespace detail {
+
+const std::uintptr_t poll_state::EMPTY;
+const std::uintptr_t poll_state::READY;
+
+void poll_state::reset()
+{
+    _state[READ].store(EMPTY, std::memory_order_relaxed);
+    _state[WRITE].store(EMPTY, std::memory_order_relaxed);
+}
+
+void poll_state::wait(direction d, const std::string& checkpoint_name)
+{
+    std::atomic<std::uintptr_t>& state = _state[d];
+
+    // edge that came after the last wait may be the one EAGAIN raced with, try again
+    std::uintptr_t expected = READY;
+    if (state.compare_exchange_strong(expected, EMPTY))
+        return;
+    assert(expected == EMPTY); // someone else waiting?
+
+    coroutine* coro = coroutine::current_corutine();
+    assert(coro);
+
+    // published only once parked, so the poller can schedule it right away
+    coro->yield(checkpoint_name, [&state](coroutine_weak_ptr c)
+    {
+        std::uintptr_t expected = EMPTY;
+        if (!state.compare_exchange_strong(expected, reinterpret_cast<std::uintptr_t>(c)))
+        {
+            // became ready in the meantime
+            state.store(EMPTY);
+            c->get_scheduler().schedule(c);
+        }
+    });
+}
+
+void poll_state::set_ready(direction d, std::vector<coroutine_weak_ptr>& woken)
+{
+    std::atomic<std::uintptr_t>& state = _state[d];
+
+    std::uintptr_t current = state.load();
+    for(;;)
+    {
+        if (current == READY)
+            return;
+
+        if (current == EMPTY)
+        {
+            if (state.compare_exchange_weak(current, READY))
+                return;
+        }
+        else
+        {
+            // the waiter gets the edge, it will find out what happened by retrying the I/O
+            if (state.compare_exchange_weak(current, EMPTY))
+            {
+                CORO_LOG("POLL: waking up coro '", reinterpret_cast<coroutine*>(current)->name(), "'");
+                woken.push_back(reinterpret_cast<coroutine_weak_ptr>(current));
+                return;
+            }
+        }
+    }
+}
+
+}}
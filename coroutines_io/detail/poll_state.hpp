@@ -0,0 +1,45 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DETAIL_POLL_STATE_HPP
+#define COROUTINES_IO_DETAIL_POLL_STATE_HPP
+
+#include "coroutines/coroutine.hpp"
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace coroutines { namespace detail {
+
+// readiness of a descriptor registered with the poller for its whole lifetime, edge-triggered.
+// For each direction: empty, ready (an edge came since the last wait), or the coroutine parked waiting for it.
+// One coroutine at a time may wait in each direction
+class poll_state
+{
+public:
+
+    enum direction { READ = 0, WRITE = 1 };
+
+    poll_state() { reset(); }
+    poll_state(const poll_state&) = delete;
+
+    // called after I/O returned EAGAIN. Returns at once if an edge came in the meantime, otherwise parks until it does
+    void wait(direction d, const std::string& checkpoint_name);
+
+    // called by the poller. Parked coroutine is added to 'woken', the caller schedules it
+    void set_ready(direction d, std::vector<coroutine_weak_ptr>& woken);
+
+    // when recycled for another descriptor
+    void reset();
+
+private:
+
+    static const std::uintptr_t EMPTY = 0;
+    static const std::uintptr_t READY = 1;
+
+    std::atomic<std::uintptr_t> _state[2]; // EMPTY, READY or coroutine*
+};
+
+}}
+
+#endif
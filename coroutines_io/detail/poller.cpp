@@ -13,26 +13,49 @@
 
 #include <limits>
 #include <iostream>
+#include <cassert>
 
 namespace coroutines { namespace detail {
 
-static const std::uint64_t EVENTFD_KEY = std::numeric_limits<std::uint64_t>::max();
+static const unsigned EPOLL_BUFFER = 256;
 
-poller::poller()
+poller::poller(unsigned shards)
 {
+    assert(shards > 0);
+
     _event_fd = ::eventfd(0, EFD_NONBLOCK);
     if (_event_fd < 0)
         throw_errno();
 
-    _epoll = ::epoll_create(10);
-    if (_epoll < 0)
-        throw_errno();
+    for(unsigned i = 0; i < shards; i++)
+    {
+        int e = ::epoll_create(10);
+        if (e < 0)
+            throw_errno();
+        _shards.push_back(e);
+    }
 
-    // add event to epoll
     epoll_event ev;
+    if (shards > 1)
+    {
+        _root = ::epoll_create(10);
+        if (_root < 0)
+            throw_errno();
+
+        // level-triggered, reported for as long as the shard has events ready
+        for(unsigned i = 0; i < shards; i++)
+        {
+            ev.events = EPOLLIN;
+            ev.data.u64 = i + 1;
+            if (::epoll_ctl(_root, EPOLL_CTL_ADD, _shards[i], &ev) < 0)
+                throw_errno();
+        }
+    }
+
+    // add event to epoll. Level-triggered, so it needs to be read
     ev.events = EPOLLIN;
-    ev.data.u64 = EVENTFD_KEY;
-    int r = ::epoll_ctl(_epoll, EPOLL_CTL_ADD, _event_fd,  &ev);
+    ev.data.u64 = 0; // null ptr
+    int r = ::epoll_ctl(_root != -1 ? _root : _shards[0], EPOLL_CTL_ADD, _event_fd,  &ev);
     if (r < 0)
         throw_errno();
 }
@@ -40,80 +63,127 @@ poller::poller()
 poller::~poller()
 {
     ::close(_event_fd);
-    ::close(_epoll);
+    if (_root != -1)
+        ::close(_root);
+    for(int e : _shards)
+    {
+        ::close(e);
+    }
 }
 
-void poller::add_fd(int fd, fd_events e, std::uint64_t key)
+bool poller::add_fd(int fd, poll_state* state, unsigned shard)
 {
-    // add to epoll
+    assert(shard < _shards.size());
+
     epoll_event ev;
-    ev.events = to_epoll_events(e) | EPOLLERR | EPOLLHUP /*| EPOLLET*/;
-    ev.data.u64 = key;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = state;
 
-    int r = ::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+    int r = ::epoll_ctl(_shards[shard], EPOLL_CTL_ADD, fd, &ev);
     if (r < 0)
+    {
+        if (errno == EPERM)
+            return false;
         throw_errno("poller::add_fd");
+    }
 
-    CORO_LOG("POLLER: fd ", fd, " added to epoll with flags ", ev.events, ", fd_Events=", int(e));
+    CORO_LOG("POLLER: fd ", fd, " added to epoll shard ", shard);
+    return true;
 }
 
-void poller::remove_fd(int fd)
+void poller::wait(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
 {
-    int r = ::epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
-    if (r < 0)
-        throw_errno("poller::remove_fd");
+    if (_root == -1)
+        wait_shard(_shards[0], woken, timeout);
+    else
+        wait_root(woken, timeout);
 }
 
-void poller::wait(std::vector<std::uint64_t>& keys)
+void poller::poll_shard(unsigned shard, std::vector<coroutine_weak_ptr>& woken)
 {
-    static const unsigned EPOLL_BUFFER = 256;
-    epoll_event events[EPOLL_BUFFER];
+    assert(shard < _shards.size());
+    wait_shard(_shards[shard], woken, std::chrono::nanoseconds(0));
+}
 
+int poller::epoll_wait(int epoll, epoll_event* events, int max, std::chrono::nanoseconds timeout)
+{
     sigset_t sigs;
     sigemptyset(&sigs);
     sigaddset(&sigs, SIGTRAP);
 
-    int r = ::epoll_pwait(_epoll, events, EPOLL_BUFFER, -1, &sigs);
+    // epoll has millisecond resolution, rounded up so the timer is due when it returns
+    int timeout_ms = -1;
+    if (timeout != std::chrono::nanoseconds::max())
+    {
+        auto ms = (timeout + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)) / std::chrono::milliseconds(1);
+        timeout_ms = ms < std::numeric_limits<int>::max() ? int(ms) : std::numeric_limits<int>::max();
+    }
+
+    int r = ::epoll_pwait(epoll, events, max, timeout_ms, &sigs);
 
     CORO_LOG("POLLER: woken up with ", r, " events ready");
 
-    if (r < 0 && errno != EINTR)
-        throw_errno();
+    if (r < 0)
+    {
+        if (errno != EINTR)
+            throw_errno();
+        return 0;
+    }
+    return r;
+}
+
+void poller::wait_shard(int epoll, std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
+{
+    epoll_event events[EPOLL_BUFFER];
+    int r = epoll_wait(epoll, events, EPOLL_BUFFER, timeout);
 
     for(int i = 0; i < r; i++)
     {
-        std::uint64_t key = events[i].data.u64;
-        if (key == EVENTFD_KEY)
+        poll_state* state = static_cast<poll_state*>(events[i].data.ptr);
+        if (!state)
         {
-            // re-arm eventfd
-            std::uint64_t v = 1;
-            if (::read(_event_fd, &v, sizeof(v)) < 0 )
-                throw_errno();
+            consume_wake(timeout);
+            continue;
         }
+
+        // errors and hang-ups wake both sides, they learn the details from the I/O call
+        std::uint32_t e = events[i].events;
+        if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            state->set_ready(poll_state::READ, woken);
+        if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            state->set_ready(poll_state::WRITE, woken);
+    }
+}
+
+void poller::wait_root(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
+{
+    epoll_event events[EPOLL_BUFFER];
+    int r = epoll_wait(_root, events, EPOLL_BUFFER, timeout);
+
+    // ready shards are drained without blocking
+    for(int i = 0; i < r; i++)
+    {
+        std::uint64_t shard = events[i].data.u64;
+        if (shard == 0)
+            consume_wake(timeout);
         else
-        {
-            keys.push_back(key);
-        }
+            wait_shard(_shards[shard - 1], woken, std::chrono::nanoseconds(0));
     }
 }
 
-void poller::wake()
+void poller::consume_wake(std::chrono::nanoseconds timeout)
 {
+    // re-arm eventfd. Left alone by non-blocking waits, they could consume wake-up meant for the blocked one
     std::uint64_t v = 1;
-    if (::write(_event_fd, &v, sizeof(v)) < 0 )
+    if (timeout != std::chrono::nanoseconds(0) && ::read(_event_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
         throw_errno();
 }
 
-int poller::to_epoll_events(fd_events e)
+void poller::wake()
 {
-    int result = 0;
-
-    if (e & FD_READABLE) result |= EPOLLIN;
-    if (e & FD_WRITABLE) result |= EPOLLOUT;
-
-    return result;
+    std::uint64_t v = 1;
+    if (::write(_event_fd, &v, sizeof(v)) < 0 )
+        throw_errno();
 }
 
-
-
 }}
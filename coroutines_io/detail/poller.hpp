@@ -2,42 +2,61 @@
 #ifndef COROUTINES_IO_DETAIL_POLLER_HPP
 #define COROUTINES_IO_DETAIL_POLLER_HPP
 
-#include "coroutines/channel.hpp"
+#include "coroutines/coroutine.hpp"
 #include "coroutines_io/globals.hpp"
+#include "coroutines_io/detail/poll_state.hpp"
 
 #include <system_error>
 #include <vector>
+#include <chrono>
+
+struct epoll_event;
 
 namespace coroutines {
 
 namespace detail {
 
 
-// wrapper for epoll
+// wrapper for epoll. Descriptors are divided between shards, one epoll instance each.
+// With more than one, the shards are registered in a root instance, so they can be waited for all at once
 class poller
 {
 public:
 
-    poller();
+    poller(unsigned shards = 1);
     ~poller();
 
-    // not thread safe, has to be called between calls to wait();
-    void add_fd(int fd, fd_events e, std::uint64_t key);
-    void remove_fd(int fd);
+    unsigned shards() const { return _shards.size(); }
+
+    // registers descriptor for both directions, edge-triggered, until it's closed. Thread safe.
+    // Returns false if the descriptor can't be polled (regular files are always ready)
+    bool add_fd(int fd, poll_state* state, unsigned shard);
+
+    // will block until one of the fd's bcomes active, ro wakeup() is called, or the timeout passes (nanoseconds::max() - no timeout)
+    // fills 'woken' with coroutines waiting for the descriptors that became ready. Thread safe, only one thread should block at a time
+    void wait(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max());
 
-    // will block until one of the fd's bcomes active, ro wakeup() is called
-    // filles 'keys' with activated descriptors
-    void wait(std::vector<std::uint64_t>& keys);
+    // non-blocking check of one shard
+    void poll_shard(unsigned shard, std::vector<coroutine_weak_ptr>& woken);
 
     // interrupts wait().
     void wake();
 
 private:
 
-    static int to_epoll_events(fd_events e);
+    // returns number of events, 0 on EINTR
+    static int epoll_wait(int epoll, epoll_event* events, int max, std::chrono::nanoseconds timeout);
+
+    // waits on the shard, or on the root
+    void wait_shard(int epoll, std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout);
+    void wait_root(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout);
+
+    // eventfd event, read only by a blocking wait
+    void consume_wake(std::chrono::nanoseconds timeout);
 
     int _event_fd = -1;
-    int _epoll = -1;
+    int _root = -1; // only with multiple shards
+    std::vector<int> _shards;
 };
 
 }}
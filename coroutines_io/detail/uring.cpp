@@ -0,0 +1,662 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/detail/uring.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines/scheduler.hpp"
+
+//#define CORO_LOGGING
+#include "coroutines/logging.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <system_error>
+#include <cstring>
+#include <cassert>
+
+namespace coroutines { namespace detail {
+
+// sqe's len is 32 bits, longer transfers are cut short like file's
+static const std::size_t MAX_TRANSFER = 1 << 30;
+
+const std::uint64_t uring::WAKE_TAG;
+const std::uint64_t uring::IGNORED_TAG;
+const std::uint64_t uring::ACCEPTOR_TAG;
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, std::size_t arg_size)
+{
+    return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+template<typename T>
+static T* offset(void* base, std::uint32_t off)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(base) + off);
+}
+
+uring::uring(unsigned entries)
+    : _sq_mutex("uring sq mutex")
+    , _cq_mutex("uring cq mutex")
+    , _acceptors_mutex("uring acceptors mutex")
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    _fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0)
+        throw_errno("io_uring_setup");
+
+    // waiting with a timeout needs it (5.11)
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+        throw std::system_error(ENOSYS, std::system_category(), "io_uring without IORING_FEAT_EXT_ARG");
+
+    _sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map)
+        _sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+
+    _sq_map = ::mmap(nullptr, _sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sq_map == MAP_FAILED)
+        throw_errno("io_uring mmap");
+    if (single_map)
+    {
+        _cq_map = _sq_map;
+    }
+    else
+    {
+        _cq_map = ::mmap(nullptr, _cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (_cq_map == MAP_FAILED)
+            throw_errno("io_uring mmap");
+    }
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        throw_errno("io_uring mmap");
+    _sqes = static_cast<io_uring_sqe*>(sqes);
+
+    _sq_head = offset<unsigned>(_sq_map, params.sq_off.head);
+    _sq_tail = offset<unsigned>(_sq_map, params.sq_off.tail);
+    _sq_array = offset<unsigned>(_sq_map, params.sq_off.array);
+    _sq_mask = *offset<unsigned>(_sq_map, params.sq_off.ring_mask);
+    _sq_entries = *offset<unsigned>(_sq_map, params.sq_off.ring_entries);
+    _cq_head = offset<unsigned>(_cq_map, params.cq_off.head);
+    _cq_tail = offset<unsigned>(_cq_map, params.cq_off.tail);
+    _cqes = offset<io_uring_cqe>(_cq_map, params.cq_off.cqes);
+    _cq_mask = *offset<unsigned>(_cq_map, params.cq_off.ring_mask);
+
+    _event_fd = ::eventfd(0, 0); // blocking, read by the ring
+    if (_event_fd < 0)
+        throw_errno();
+
+    std::unique_lock<mutex> lock(_sq_mutex);
+    arm_wake(lock);
+    submit_locked(lock);
+}
+
+uring::~uring()
+{
+    ::munmap(_sqes, _sqes_size);
+    if (_cq_map != _sq_map)
+        ::munmap(_cq_map, _cq_map_size);
+    ::munmap(_sq_map, _sq_map_size);
+    ::close(_fd); // cancels whatever is left
+    ::close(_event_fd);
+
+    for(acceptor* a : _acceptors)
+    {
+        delete a;
+    }
+}
+
+io_uring_sqe* uring::get_sqe(std::unique_lock<mutex>& lock)
+{
+    for(;;)
+    {
+        while(*_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+        {
+            // full, the batch goes now. If the completion queue is full too, the kernel takes nothing
+            // until it's drained, and run() can't drain it without this lock: drained here then
+            if (!submit_locked(lock))
+                reap_inline();
+        }
+
+        if (!_rearm_wake)
+            return push_sqe();
+
+        // reap_inline() consumed the wake-up, it was meant for the blocked run()
+        _rearm_wake = false;
+        prepare_wake(push_sqe());
+        wake();
+    }
+}
+
+void uring::reap_inline()
+{
+    std::vector<coroutine_weak_ptr> woken;
+    if (reap_completions(woken))
+        _rearm_wake = true;
+    for(coroutine_weak_ptr c : woken)
+    {
+        c->get_scheduler().schedule(c);
+    }
+}
+
+io_uring_sqe* uring::push_sqe()
+{
+    unsigned tail = *_sq_tail;
+    unsigned index = tail & _sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+
+    // published right away, the kernel looks at it only when entered
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return sqe;
+}
+
+void uring::submit()
+{
+    std::unique_lock<mutex> lock(_sq_mutex);
+    submit_locked(lock);
+}
+
+bool uring::submit_locked(std::unique_lock<mutex>&)
+{
+    while(_queued > 0)
+    {
+        int r = io_uring_enter(_fd, _queued, 0, 0, nullptr, 0);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EBUSY)
+                return false; // completion queue full, try again after the next reap
+            throw_errno("io_uring_enter");
+        }
+        _queued -= r;
+    }
+    return true;
+}
+
+void uring::arm_wake(std::unique_lock<mutex>& lock)
+{
+    prepare_wake(get_sqe(lock));
+}
+
+void uring::prepare_wake(io_uring_sqe* sqe)
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = _event_fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&_event_value);
+    sqe->len = sizeof(_event_value);
+    sqe->user_data = WAKE_TAG;
+}
+
+void uring::wake()
+{
+    std::uint64_t v = 1;
+    if (::write(_event_fd, &v, sizeof(v)) < 0 )
+        throw_errno();
+}
+
+template<typename Prepare>
+int uring::execute(Prepare prepare)
+{
+    operation op;
+    {
+        std::unique_lock<mutex> lock(_sq_mutex);
+        io_uring_sqe* sqe = get_sqe(lock);
+        prepare(sqe);
+        sqe->user_data = reinterpret_cast<std::uint64_t>(&op);
+    }
+    op.done.wait(poll_state::READ, "uring");
+    return op.result;
+}
+
+template<typename Prepare>
+int uring::execute_when_ready(int fd, std::uint32_t events, Prepare prepare)
+{
+    for(;;)
+    {
+        int r = execute(prepare);
+        if (r != -EAGAIN)
+            return r;
+        r = poll(fd, events);
+        if (r < 0)
+            return r;
+    }
+}
+
+int uring::read(int fd, void* buf, std::size_t len, std::uint64_t off)
+{
+    return execute_when_ready(fd, POLLIN, [&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->off = off;
+        sqe->addr = reinterpret_cast<std::uint64_t>(buf);
+        sqe->len = std::min(len, MAX_TRANSFER);
+    });
+}
+
+int uring::write(int fd, const void* buf, std::size_t len, std::uint64_t off)
+{
+    return execute_when_ready(fd, POLLOUT, [&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->off = off;
+        sqe->addr = reinterpret_cast<std::uint64_t>(buf);
+        sqe->len = std::min(len, MAX_TRANSFER);
+    });
+}
+
+int uring::readv(int fd, const iovec* iov, unsigned count)
+{
+    return execute_when_ready(fd, POLLIN, [&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = -1;
+        sqe->addr = reinterpret_cast<std::uint64_t>(iov);
+        sqe->len = count;
+    });
+}
+
+int uring::writev(int fd, const iovec* iov, unsigned count)
+{
+    return execute_when_ready(fd, POLLOUT, [&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->off = -1;
+        sqe->addr = reinterpret_cast<std::uint64_t>(iov);
+        sqe->len = count;
+    });
+}
+
+int uring::splice(int fd_in, std::uint64_t offset_in, int fd_out, std::uint64_t offset_out, std::size_t len)
+{
+    for(;;)
+    {
+        int r = execute([&](io_uring_sqe* sqe)
+        {
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = fd_out;
+            sqe->off = offset_out;
+            sqe->splice_fd_in = fd_in;
+            sqe->splice_off_in = offset_in;
+            sqe->len = std::min(len, MAX_TRANSFER);
+            sqe->splice_flags = SPLICE_F_MOVE;
+        });
+        if (r != -EAGAIN)
+            return r;
+
+        // either end may be the one not ready, the pipe is
+        r = poll(fd_in, POLLIN);
+        if (r >= 0)
+            r = poll(fd_out, POLLOUT);
+        if (r < 0)
+            return r;
+    }
+}
+
+int uring::fsync(int fd, bool data_only)
+{
+    return execute([&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = data_only ? IORING_FSYNC_DATASYNC : 0;
+    });
+}
+
+void uring::advise(int fd, std::uint64_t offset, std::uint32_t len, int advice)
+{
+    // a hint, nobody waits for it
+    std::unique_lock<mutex> lock(_sq_mutex);
+    io_uring_sqe* sqe = get_sqe(lock);
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = len;
+    sqe->fadvise_advice = advice;
+    sqe->user_data = IGNORED_TAG;
+}
+
+int uring::connect(int fd, const sockaddr* addr, unsigned addr_len)
+{
+    int r = execute([&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(addr);
+        sqe->off = addr_len;
+    });
+    if (r != -EINPROGRESS && r != -EAGAIN)
+        return r;
+
+    // non-blocking descriptor, connected once writable
+    r = poll(fd, POLLOUT);
+    if (r < 0)
+        return r;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+        return -errno;
+    return -err;
+}
+
+int uring::poll(int fd, std::uint32_t events)
+{
+    return execute([&](io_uring_sqe* sqe)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+    });
+}
+
+void uring::cancel(int fd)
+{
+    // looked up by the kernel when submitted, so the descriptor must still be open
+    std::unique_lock<mutex> lock(_sq_mutex);
+    io_uring_sqe* sqe = get_sqe(lock);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = IGNORED_TAG;
+    while(!submit_locked(lock))
+        reap_inline();
+}
+
+uring::acceptor* uring::make_acceptor(int listening_fd)
+{
+    acceptor* a = new acceptor(*this, listening_fd);
+    std::lock_guard<mutex> lock(_acceptors_mutex);
+    _acceptors.push_back(a);
+    return a;
+}
+
+void uring::forget(acceptor* a)
+{
+    {
+        std::lock_guard<mutex> lock(_acceptors_mutex);
+        _acceptors.erase(std::remove(_acceptors.begin(), _acceptors.end(), a), _acceptors.end());
+    }
+    delete a;
+}
+
+void uring::run(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
+{
+    submit();
+
+    bool blocking = timeout != std::chrono::nanoseconds(0);
+    if (blocking && __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) == *_cq_head)
+    {
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        std::memset(&arg, 0, sizeof(arg));
+        if (timeout != std::chrono::nanoseconds::max())
+        {
+            ts.tv_sec = timeout / std::chrono::seconds(1);
+            ts.tv_nsec = (timeout % std::chrono::seconds(1)).count();
+            arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+        }
+
+        int r = io_uring_enter(_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (r < 0 && errno != EINTR && errno != ETIME)
+            throw_errno("io_uring_enter");
+    }
+
+    reap(woken, blocking);
+}
+
+void uring::reap(std::vector<coroutine_weak_ptr>& woken, bool blocking)
+{
+    bool wake_consumed = reap_completions(woken);
+
+    if (wake_consumed)
+    {
+        {
+            std::unique_lock<mutex> sq_lock(_sq_mutex);
+            arm_wake(sq_lock);
+            submit_locked(sq_lock);
+        }
+        // it was meant for the blocked one, non-blocking reap passes it on
+        if (!blocking)
+            wake();
+    }
+
+    CORO_LOG("URING: ", woken.size(), " coroutines woken");
+}
+
+bool uring::reap_completions(std::vector<coroutine_weak_ptr>& woken)
+{
+    std::unique_lock<mutex> lock(_cq_mutex, std::try_to_lock);
+    if (!lock)
+        return false; // someone else is doing it
+
+    bool wake_consumed = false;
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+    {
+        const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+        std::uint64_t tag = cqe.user_data;
+
+        if (tag == WAKE_TAG)
+        {
+            wake_consumed = true;
+        }
+        else if (tag == IGNORED_TAG)
+        {
+        }
+        else if (tag & ACCEPTOR_TAG)
+        {
+            reinterpret_cast<acceptor*>(tag & ~ACCEPTOR_TAG)->completed(cqe.res, cqe.flags, woken);
+        }
+        else
+        {
+            operation* op = reinterpret_cast<operation*>(tag);
+            op->result = cqe.res;
+            op->done.set_ready(poll_state::READ, woken);
+        }
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return wake_consumed;
+}
+
+uring::acceptor::~acceptor()
+{
+    for(int fd : _accepted)
+    {
+        ::close(fd);
+    }
+}
+
+int uring::acceptor::accept()
+{
+    std::unique_lock<mutex> lock(_mutex);
+    assert(!_closed);
+    for(;;)
+    {
+        if (!_accepted.empty())
+        {
+            int fd = _accepted.front();
+            _accepted.pop_front();
+            return fd;
+        }
+        if (_error)
+        {
+            int e = _error;
+            _error = 0;
+            return -e;
+        }
+
+        // alive while waiting, close() leaves destroying it to this one
+        _waiting = true;
+        bool arm = !_armed;
+        bool poll = _would_block;
+        if (arm)
+        {
+            _armed = true;
+            _polling = poll;
+            _would_block = false;
+        }
+        lock.unlock();
+
+        // not under _mutex: get_sqe() may reap completions, this one's too
+        if (arm)
+            queue(poll ? IORING_OP_POLL_ADD : IORING_OP_ACCEPT, _multishot);
+        _ready.wait(poll_state::READ, "accept");
+
+        lock.lock();
+        _waiting = false;
+        if (_closed)
+        {
+            // woken by close(), which may have cancelled before this one queued. If armed, the completion destroys it
+            uring& ring = _ring;
+            bool armed = _armed;
+            lock.unlock();
+            if (armed)
+                cancel(ring, this);
+            else
+                ring.forget(this);
+            return -ECANCELED;
+        }
+    }
+}
+
+void uring::acceptor::queue(std::uint8_t opcode, bool multishot)
+{
+    std::unique_lock<mutex> sq_lock(_ring._sq_mutex);
+    io_uring_sqe* sqe = _ring.get_sqe(sq_lock);
+    sqe->opcode = opcode;
+    sqe->fd = _fd;
+    if (opcode == IORING_OP_POLL_ADD)
+    {
+        // the kernel didn't wait on the non-blocking socket, a connection is waited for before accepting again
+        sqe->poll32_events = POLLIN;
+    }
+    else
+    {
+        sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    sqe->user_data = reinterpret_cast<std::uint64_t>(this) | ACCEPTOR_TAG;
+}
+
+void uring::acceptor::cancel(uring& ring, acceptor* a)
+{
+    // by address only, 'a' may be gone already
+    std::unique_lock<mutex> sq_lock(ring._sq_mutex);
+    io_uring_sqe* sqe = ring.get_sqe(sq_lock);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<std::uint64_t>(a) | ACCEPTOR_TAG;
+    sqe->user_data = IGNORED_TAG;
+    ring.submit_locked(sq_lock);
+}
+
+int uring::acceptor::try_accept()
+{
+    std::lock_guard<mutex> lock(_mutex);
+    assert(!_closed);
+    if (_accepted.empty())
+        return -EAGAIN;
+    int fd = _accepted.front();
+    _accepted.pop_front();
+    return fd;
+}
+
+void uring::acceptor::completed(int res, std::uint32_t flags, std::vector<coroutine_weak_ptr>& woken)
+{
+    bool finished;
+    {
+        std::lock_guard<mutex> lock(_mutex);
+        if (_polling)
+        {
+            _polling = false;
+            if (res < 0 && !_closed)
+                _error = -res;
+        }
+        else if (res >= 0)
+        {
+            if (_closed)
+                ::close(res);
+            else
+                _accepted.push_back(res);
+            if (flags & IORING_CQE_F_MORE)
+                _multishot_confirmed = true;
+        }
+        else if (res == -EAGAIN)
+        {
+            _would_block = true;
+        }
+        else if (res == -EINVAL && _multishot && !_multishot_confirmed)
+        {
+            // multishot accept needs 5.19, the older kernels refuse it. Single-shot ones from now on
+            _multishot = false;
+        }
+        else if (!_closed)
+        {
+            _error = -res;
+        }
+
+        if (!(flags & IORING_CQE_F_MORE))
+            _armed = false; // the next accept() re-arms
+        finished = _closed && !_armed && !_waiting;
+
+        // under the lock, close() may destroy it as soon as it's released. Once closed, close() has woken the waiter
+        if (!_closed)
+            _ready.set_ready(poll_state::READ, woken);
+    }
+
+    if (finished)
+        _ring.forget(this);
+}
+
+void uring::acceptor::close()
+{
+    uring& ring = _ring;
+    bool armed;
+    bool finished;
+    std::vector<coroutine_weak_ptr> woken;
+    {
+        std::lock_guard<mutex> lock(_mutex);
+        _closed = true;
+        for(int fd : _accepted)
+        {
+            ::close(fd);
+        }
+        _accepted.clear();
+
+        // accept() in progress fails with ECANCELED
+        if (_waiting)
+            _ready.set_ready(poll_state::READ, woken);
+
+        armed = _armed;
+        finished = !_armed && !_waiting;
+    }
+
+    for(coroutine_weak_ptr c : woken)
+    {
+        c->get_scheduler().schedule(c);
+    }
+
+    // the kernel holds the listening socket until it's cancelled, so it goes right away
+    if (armed)
+        cancel(ring, this);
+    if (finished)
+        ring.forget(this);
+}
+
+}}
@@ -0,0 +1,169 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DETAIL_URING_HPP
+#define COROUTINES_IO_DETAIL_URING_HPP
+
+#include "coroutines/coroutine.hpp"
+#include "coroutines/mutex.hpp"
+#include "coroutines_io/detail/poll_state.hpp"
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct sockaddr;
+struct iovec;
+
+namespace coroutines { namespace detail {
+
+// completion-based I/O on io_uring, talking to the kernel directly.
+// Operations park the calling coroutine until their completion is reaped. Entries are only queued when prepared,
+// and submitted in batches: when a processor runs out of work, every now and then, or when the queue fills up.
+// Transfers go straight to and from the caller's buffer
+class uring
+{
+public:
+
+    uring(unsigned entries = 1024);
+    uring(const uring&) = delete;
+    ~uring();
+
+    // operations, from a coroutine. Return what the syscall would, or -errno. offset -1 means the current position.
+    // Descriptors may be non-blocking: when the kernel returns EAGAIN instead of waiting, readiness is polled for and it's retried
+    int read(int fd, void* buf, std::size_t len, std::uint64_t offset = -1);
+    int write(int fd, const void* buf, std::size_t len, std::uint64_t offset = -1);
+    int readv(int fd, const iovec* iov, unsigned count);
+    int writev(int fd, const iovec* iov, unsigned count);
+    int fsync(int fd, bool data_only);
+    // one of the descriptors must be a pipe, its offset -1
+    int splice(int fd_in, std::uint64_t offset_in, int fd_out, std::uint64_t offset_out, std::size_t len);
+    int connect(int fd, const sockaddr* addr, unsigned addr_len);
+
+    // posix_fadvise(), queued without waiting for the result
+    void advise(int fd, std::uint64_t offset, std::uint32_t len, int advice);
+
+    // waits for poll(2) events, returns them
+    int poll(int fd, std::uint32_t events);
+
+    // operations still in the kernel on 'fd' complete with -ECANCELED. Submitted at once, call before closing it
+    void cancel(int fd);
+
+    // multishot accept: armed once, every connection arrives as a completion and waits in the queue.
+    // Single-shot, re-armed by every accept(), on kernels without it
+    class acceptor
+    {
+    public:
+        // returns the accepted descriptor, or -errno. -ECANCELED if closed while waiting
+        int accept();
+
+        // what's already queued, -EAGAIN if nothing is
+        int try_accept();
+
+        // cancels, the object is destroyed once the kernel is done with it
+        void close();
+
+    private:
+        friend class uring;
+        acceptor(uring& ring, int fd) : _ring(ring), _fd(fd), _mutex("uring acceptor mutex") { }
+        ~acceptor();
+
+        void completed(int res, std::uint32_t flags, std::vector<coroutine_weak_ptr>& woken);
+
+        // queues the accept, or the poll if the last one found nothing. Not under _mutex
+        void queue(std::uint8_t opcode, bool multishot);
+        static void cancel(uring& ring, acceptor* a);
+
+        uring& _ring;
+        const int _fd;
+        poll_state _ready; // READ direction used
+        mutex _mutex; // protects the fields below
+        std::deque<int> _accepted;
+        int _error = 0;
+        bool _armed = false; // accept or poll in the kernel
+        bool _polling = false;
+        bool _would_block = false;
+        bool _multishot = true;
+        bool _multishot_confirmed = false; // a completion said more will come, EINVAL is not about the kernel then
+        bool _waiting = false; // accept() parked
+        bool _closed = false;
+    };
+
+    acceptor* make_acceptor(int listening_fd);
+
+    // submits what's queued and reaps completions. Waits up to 'timeout' for some, thread safe
+    void run(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout);
+
+    // interrupts run() in progress
+    void wake();
+
+private:
+
+    struct operation
+    {
+        poll_state done; // READ direction used
+        int result = 0;
+    };
+
+    // user_data tags, other values are operation* or acceptor* | ACCEPTOR_TAG
+    static const std::uint64_t WAKE_TAG = 0;
+    static const std::uint64_t IGNORED_TAG = 2;
+    static const std::uint64_t ACCEPTOR_TAG = 1;
+
+    // prepares entry under _sq_mutex, submits it when the queue is full
+    io_uring_sqe* get_sqe(std::unique_lock<mutex>& lock);
+    io_uring_sqe* push_sqe(); // there's room
+
+    // queues the operation and parks until it completes
+    template<typename Prepare>
+    int execute(Prepare prepare);
+
+    // the same, polling for 'events' on 'fd' and retrying while it returns EAGAIN
+    template<typename Prepare>
+    int execute_when_ready(int fd, std::uint32_t events, Prepare prepare);
+
+    void submit();
+    bool submit_locked(std::unique_lock<mutex>& lock); // false if the kernel took nothing, the completion queue being full
+    void reap(std::vector<coroutine_weak_ptr>& woken, bool blocking);
+    bool reap_completions(std::vector<coroutine_weak_ptr>& woken); // true if the wake-up was consumed
+    void reap_inline(); // from get_sqe(), schedules the woken right away
+    void forget(acceptor* a); // destroys it
+    void arm_wake(std::unique_lock<mutex>& lock);
+    void prepare_wake(io_uring_sqe* sqe);
+
+    int _fd = -1;
+    int _event_fd = -1;
+    std::uint64_t _event_value = 0; // wake READ target
+
+    // rings, shared with the kernel
+    void* _sq_map = nullptr;
+    std::size_t _sq_map_size = 0;
+    void* _cq_map = nullptr;
+    std::size_t _cq_map_size = 0;
+    io_uring_sqe* _sqes = nullptr;
+    std::size_t _sqes_size = 0;
+
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    io_uring_cqe* _cqes;
+    unsigned _cq_mask;
+
+    mutex _sq_mutex; // prepared entries and submission
+    unsigned _queued = 0; // prepared, not submitted
+    bool _rearm_wake = false; // wake-up consumed by reap_inline(), under _sq_mutex
+    mutex _cq_mutex; // reaping
+
+    std::vector<acceptor*> _acceptors; // alive, destroyed with the ring if not yet finished
+    mutex _acceptors_mutex;
+};
+
+}}
+
+#endif
@@ -0,0 +1,508 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/dns_resolver.hpp"
+#include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/udp_socket.hpp"
+#include "coroutines_io/detail/dns_message.hpp"
+
+#include "coroutines/scheduler.hpp"
+#include "coroutines/mutex.hpp"
+
+#include <sys/socket.h>
+
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+namespace coroutines {
+
+typedef boost::asio::ip::udp::endpoint udp_endpoint;
+
+// expired entries are dropped when the cache grows over this
+static const std::size_t CACHE_PRUNE_SIZE = 4096;
+
+// enough for any UDP answer without EDNS
+static const std::size_t MAX_DATAGRAM = 512;
+
+static const unsigned MAX_NAMESERVERS = 3; // like glibc
+
+static std::string lowercase(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](char c) { return std::tolower(c); });
+    return s;
+}
+
+static bool parse_address(const std::string& s, boost::asio::ip::address& out)
+{
+    boost::system::error_code ec;
+    out = boost::asio::ip::address::from_string(s, ec);
+    return !ec;
+}
+
+// v6 first, then v4
+static void sort_families(std::vector<boost::asio::ip::address>& addresses)
+{
+    std::stable_partition(addresses.begin(), addresses.end(), [](const boost::asio::ip::address& a) { return a.is_v6(); });
+}
+
+dns_config dns_config::from_system(const std::string& resolv_conf_path, const std::string& hosts_path)
+{
+    dns_config config;
+
+    std::ifstream resolv_conf(resolv_conf_path);
+    for(std::string line; std::getline(resolv_conf, line);)
+    {
+        std::istringstream words(line.substr(0, line.find_first_of("#;")));
+        std::string keyword;
+        if (!(words >> keyword))
+            continue;
+
+        if (keyword == "nameserver")
+        {
+            std::string server;
+            boost::asio::ip::address a;
+            if (words >> server && parse_address(server, a) && config.nameservers.size() < MAX_NAMESERVERS)
+                config.nameservers.emplace_back(a, 53);
+        }
+        else if (keyword == "search" || keyword == "domain")
+        {
+            // the last one wins
+            config.search.clear();
+            for(std::string domain; words >> domain;)
+                config.search.push_back(lowercase(domain));
+        }
+        else if (keyword == "options")
+        {
+            for(std::string option; words >> option;)
+            {
+                std::size_t colon = option.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                std::string name = option.substr(0, colon);
+                unsigned value = std::strtoul(option.c_str() + colon + 1, nullptr, 10);
+                if (name == "ndots")
+                    config.ndots = std::min(value, 15u);
+                else if (name == "timeout" && value > 0)
+                    config.timeout = std::chrono::seconds(value);
+                else if (name == "attempts" && value > 0)
+                    config.attempts = std::min(value, 5u);
+            }
+        }
+    }
+    if (config.nameservers.empty())
+        config.nameservers.emplace_back(boost::asio::ip::address_v4::loopback(), 53);
+
+    std::ifstream hosts(hosts_path);
+    for(std::string line; std::getline(hosts, line);)
+    {
+        std::istringstream words(line.substr(0, line.find('#')));
+        std::string address;
+        boost::asio::ip::address a;
+        if (!(words >> address) || !parse_address(address, a))
+            continue;
+        for(std::string name; words >> name;)
+            config.hosts.emplace(lowercase(name), a);
+    }
+
+    return config;
+}
+
+// result of a lookup, immutable once done
+struct dns_resolver::lookup
+{
+    bool ok = false;
+    dns_error::status_type failure = dns_error::not_found;
+    std::vector<address_type> addresses;
+    std::chrono::steady_clock::time_point expires;
+
+    std::vector<channel_writer<int>> followers; // lookups waiting for this one to finish
+};
+
+struct dns_resolver::state
+{
+    state(io_scheduler& srv)
+        : service(srv)
+        , socket(srv)
+        , mutex("dns_resolver mutex")
+        , random(std::random_device()())
+    { }
+
+    struct waiting_query
+    {
+        channel_writer<detail::dns_answer> reply;
+        udp_endpoint server;
+        std::string name;
+        detail::dns_type type;
+    };
+
+    io_scheduler& service;
+    udp_socket socket;
+    udp_endpoint wake_endpoint; // the socket's own address
+
+    coroutines::mutex mutex; // protects the fields below
+    std::map<std::uint16_t, waiting_query> waiting; // by query id
+    bool receiving = false;
+    std::map<std::string, std::shared_ptr<lookup>> in_progress;
+    std::map<std::string, std::shared_ptr<lookup>> cache;
+    std::mt19937 random;
+    stats counters;
+};
+
+dns_resolver::dns_resolver(io_scheduler& srv)
+    : dns_resolver(srv, dns_config::from_system())
+{
+}
+
+dns_resolver::dns_resolver(io_scheduler& srv, dns_config config)
+    : _config(std::move(config))
+    , _state(std::make_shared<state>(srv))
+{
+    // dual-stack if the host has IPv6
+    try
+    {
+        _state->socket.bind(udp_endpoint(boost::asio::ip::address_v6::any(), 0));
+        _state->wake_endpoint = udp_endpoint(boost::asio::ip::address_v6::loopback(), _state->socket.local_endpoint().port());
+    }
+    catch(const std::system_error&)
+    {
+        _state->socket.close();
+        _state->socket.bind(udp_endpoint(boost::asio::ip::address_v4::any(), 0));
+        _state->wake_endpoint = udp_endpoint(boost::asio::ip::address_v4::loopback(), _state->socket.local_endpoint().port());
+    }
+}
+
+dns_resolver::~dns_resolver()
+{
+    // the receiver, if still running, ends by itself: it runs only while there are queries
+}
+
+std::vector<dns_resolver::address_type> dns_resolver::resolve(const std::string& hostname)
+{
+    std::string name = lowercase(hostname);
+    bool absolute = !name.empty() && name.back() == '.';
+    if (absolute)
+        name.pop_back();
+    if (name.empty())
+        throw dns_error(dns_error::not_found, "resolve: empty host name");
+
+    address_type literal;
+    if (parse_address(name, literal))
+        return { literal };
+
+    auto hosts = _config.hosts.equal_range(name);
+    if (hosts.first != hosts.second)
+    {
+        std::vector<address_type> addresses;
+        for(auto it = hosts.first; it != hosts.second; ++it)
+            addresses.push_back(it->second);
+        sort_families(addresses);
+        return addresses;
+    }
+
+    // names with few dots are more likely relative to the search domains
+    std::vector<std::string> candidates;
+    bool few_dots = unsigned(std::count(name.begin(), name.end(), '.')) < _config.ndots;
+    if (absolute || !few_dots)
+        candidates.push_back(name);
+    if (!absolute)
+        for(const std::string& domain : _config.search)
+            candidates.push_back(name + "." + domain);
+    if (!absolute && few_dots)
+        candidates.push_back(name);
+
+    dns_error::status_type failure = dns_error::not_found;
+    for(const std::string& candidate : candidates)
+    {
+        std::shared_ptr<lookup> l = lookup_name(candidate);
+        if (l->ok)
+            return l->addresses;
+        if (l->failure != dns_error::not_found)
+            failure = l->failure;
+    }
+
+    static const char* const REASONS[] = { "host not found", "timed out", "server failure" };
+    throw dns_error(failure, "resolve " + hostname + ": " + REASONS[failure]);
+}
+
+std::shared_ptr<dns_resolver::lookup> dns_resolver::lookup_name(const std::string& name)
+{
+    state& st = *_state;
+    std::shared_ptr<lookup> l;
+    channel_reader<int> done; // open if someone else does the query
+    {
+        std::lock_guard<coroutines::mutex> lock(st.mutex);
+
+        auto cached = st.cache.find(name);
+        if (cached != st.cache.end())
+        {
+            if (cached->second->expires > std::chrono::steady_clock::now())
+            {
+                st.counters.cache_hits++;
+                return cached->second;
+            }
+            st.cache.erase(cached);
+        }
+
+        auto running = st.in_progress.find(name);
+        if (running != st.in_progress.end())
+        {
+            st.counters.coalesced++;
+            l = running->second;
+            auto pair = st.service.get_scheduler().make_channel<int>(1, "dns lookup");
+            l->followers.push_back(pair.writer);
+            done = std::move(pair.reader);
+        }
+        else
+        {
+            l = std::make_shared<lookup>();
+            st.in_progress.emplace(name, l);
+        }
+    }
+
+    if (!done.is_closed())
+    {
+        done.get();
+        return l;
+    }
+
+    try
+    {
+        query(name, *l);
+    }
+    catch(...)
+    {
+        // the followers must not wait forever, they fail too
+        l->ok = false;
+        l->failure = dns_error::server_failure;
+        finish_lookup(name, l, false);
+        throw;
+    }
+
+    finish_lookup(name, l, true);
+    return l;
+}
+
+void dns_resolver::finish_lookup(const std::string& name, const std::shared_ptr<lookup>& l, bool cacheable)
+{
+    state& st = *_state;
+    std::vector<channel_writer<int>> followers;
+    {
+        std::lock_guard<coroutines::mutex> lock(st.mutex);
+        st.in_progress.erase(name);
+
+        // failures to get an answer are not cached, answers are, 'not found' too
+        if (cacheable && (l->ok || l->failure == dns_error::not_found) && l->expires > std::chrono::steady_clock::now())
+        {
+            if (st.cache.size() >= CACHE_PRUNE_SIZE)
+            {
+                auto now = std::chrono::steady_clock::now();
+                for(auto it = st.cache.begin(); it != st.cache.end();)
+                    it = it->second->expires <= now ? st.cache.erase(it) : std::next(it);
+            }
+            st.cache[name] = l;
+        }
+        followers.swap(l->followers);
+    }
+    for(channel_writer<int>& f : followers)
+        f.put(0);
+}
+
+void dns_resolver::query(const std::string& name, lookup& result)
+{
+    state& st = *_state;
+    static const detail::dns_type TYPES[2] = { detail::DNS_AAAA, detail::DNS_A };
+
+    std::string datagrams[2];
+    try
+    {
+        for(int i = 0; i < 2; i++)
+            datagrams[i] = detail::make_dns_query(0, name, TYPES[i]);
+    }
+    catch(const std::invalid_argument&)
+    {
+        result.failure = dns_error::not_found;
+        return;
+    }
+
+    result.failure = dns_error::timed_out;
+    for(unsigned attempt = 0; attempt < _config.attempts; attempt++)
+    {
+        for(const udp_endpoint& server : _config.nameservers)
+        {
+            // both types at once
+            channel_pair<detail::dns_answer> replies[2] = {
+                st.service.get_scheduler().make_channel<detail::dns_answer>(1, "dns reply"),
+                st.service.get_scheduler().make_channel<detail::dns_answer>(1, "dns reply") };
+            std::uint16_t ids[2];
+            {
+                std::lock_guard<coroutines::mutex> lock(st.mutex);
+                for(int i = 0; i < 2; i++)
+                {
+                    do
+                        ids[i] = st.random();
+                    while(st.waiting.count(ids[i]));
+                    st.waiting[ids[i]] = state::waiting_query{ replies[i].writer, server, name, TYPES[i] };
+                }
+                st.counters.queries += 2;
+
+                if (!st.receiving)
+                {
+                    st.receiving = true;
+                    st.service.get_scheduler().go("dns_resolver receiver", receive, _state);
+                }
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + _config.timeout;
+            detail::dns_answer answers[2];
+            bool answered[2] = { false, false };
+            try
+            {
+                for(int i = 0; i < 2; i++)
+                {
+                    datagrams[i][0] = char(ids[i] >> 8);
+                    datagrams[i][1] = char(ids[i] & 0xff);
+                    st.socket.send_to(datagrams[i].data(), datagrams[i].size(), server);
+                }
+                for(int i = 0; i < 2; i++)
+                    answered[i] = replies[i].reader.get_for(answers[i], deadline - std::chrono::steady_clock::now());
+            }
+            catch(const std::system_error&)
+            {
+                // unreachable server, try the next one
+            }
+
+            bool wake = false;
+            {
+                std::lock_guard<coroutines::mutex> lock(st.mutex);
+                for(int i = 0; i < 2; i++)
+                    st.waiting.erase(ids[i]);
+                wake = st.waiting.empty() && st.receiving;
+            }
+            if (wake)
+                wake_receiver(st);
+
+            // NXDOMAIN for one type is for the name
+            for(int i = 0; i < 2; i++)
+            {
+                if (answered[i] && answers[i].rcode == detail::DNS_NXDOMAIN)
+                {
+                    result.failure = dns_error::not_found;
+                    result.expires = std::chrono::steady_clock::now() + std::chrono::seconds(answers[i].ttl);
+                    return;
+                }
+            }
+
+            // one type is enough if the other one didn't come.
+            // The ttl of a type with no addresses counts only when neither type has any
+            std::uint32_t ttl = std::numeric_limits<std::uint32_t>::max();
+            std::uint32_t negative_ttl = ttl;
+            bool any = false;
+            bool server_failed = false;
+            for(int i = 0; i < 2; i++)
+            {
+                if (!answered[i])
+                    continue;
+                if (answers[i].rcode != detail::DNS_NOERROR)
+                {
+                    server_failed = true;
+                    continue;
+                }
+                any = true;
+                if (answers[i].addresses.empty())
+                    negative_ttl = std::min(negative_ttl, answers[i].ttl);
+                else
+                    ttl = std::min(ttl, answers[i].ttl);
+                result.addresses.insert(result.addresses.end(), answers[i].addresses.begin(), answers[i].addresses.end());
+            }
+            if (result.addresses.empty())
+                ttl = negative_ttl;
+
+            if (!result.addresses.empty() || (any && answered[0] && answered[1] && !server_failed))
+            {
+                // addresses, or the name with no addresses at all
+                result.ok = !result.addresses.empty();
+                result.failure = dns_error::not_found;
+                result.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+                sort_families(result.addresses);
+                return;
+            }
+            if (server_failed)
+                result.failure = dns_error::server_failure;
+        }
+    }
+}
+
+void dns_resolver::receive(std::shared_ptr<state> st)
+{
+    char buf[MAX_DATAGRAM];
+    for(;;)
+    {
+        udp_endpoint from;
+        std::size_t size = 0;
+        try
+        {
+            size = st->socket.receive_from(buf, sizeof(buf), from);
+        }
+        catch(const std::system_error&)
+        {
+            // ICMP errors are reported here, the queries time out
+        }
+
+        detail::dns_answer answer;
+        bool parsed = size > 0 && detail::parse_dns_answer(buf, size, answer);
+
+        channel_writer<detail::dns_answer> reply;
+        bool last;
+        {
+            std::lock_guard<coroutines::mutex> lock(st->mutex);
+
+            // has to match the question, and come from where it was sent
+            auto it = parsed ? st->waiting.find(answer.id) : st->waiting.end();
+            if (it != st->waiting.end()
+                && it->second.server == from
+                && it->second.name == answer.question
+                && it->second.type == answer.question_type)
+            {
+                reply = std::move(it->second.reply);
+                st->waiting.erase(it);
+            }
+
+            last = st->waiting.empty();
+            if (last)
+                st->receiving = false;
+        }
+
+        // never blocks, it's the only one. The query may have timed out in the meantime
+        reply.put_nothrow(std::move(answer));
+
+        if (last)
+            return;
+    }
+}
+
+void dns_resolver::wake_receiver(state& st)
+{
+    try
+    {
+        st.socket.send_to("", 0, st.wake_endpoint);
+    }
+    catch(const std::system_error&)
+    {
+    }
+}
+
+void dns_resolver::clear_cache()
+{
+    std::lock_guard<coroutines::mutex> lock(_state->mutex);
+    _state->cache.clear();
+}
+
+dns_resolver::stats dns_resolver::get_stats()
+{
+    std::lock_guard<coroutines::mutex> lock(_state->mutex);
+    return _state->counters;
+}
+
+}
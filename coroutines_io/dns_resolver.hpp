@@ -0,0 +1,102 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_DNS_RESOLVER_HPP
+#define COROUTINES_IO_DNS_RESOLVER_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace coroutines {
+
+class io_scheduler;
+
+// where and how to look names up
+struct dns_config
+{
+    std::vector<boost::asio::ip::udp::endpoint> nameservers;
+    std::vector<std::string> search; // domains tried for names with less than ndots dots
+    unsigned ndots = 1;
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(5000); // per attempt
+    unsigned attempts = 2; // rounds over all the name servers
+    std::multimap<std::string, boost::asio::ip::address> hosts; // lowercase names
+
+    // reads resolv.conf(5) and hosts(5). Missing files are skipped, with no name server 127.0.0.1 is used, like glibc does
+    static dns_config from_system(const std::string& resolv_conf_path = "/etc/resolv.conf", const std::string& hosts_path = "/etc/hosts");
+};
+
+class dns_error : public std::runtime_error
+{
+public:
+    enum status_type { not_found, timed_out, server_failure };
+
+    dns_error(status_type status, const std::string& what) : std::runtime_error(what), _status(status) { }
+
+    status_type status() const { return _status; }
+
+private:
+    status_type _status;
+};
+
+// resolves host names without blocking the thread: hosts first, then the cache, then UDP queries to the name servers.
+// Answers are cached for their TTL, negative ones too (RFC 2308). Concurrent lookups of a name share one query.
+// All replies are read by a single coroutine, running only while there are queries waiting for them
+class dns_resolver
+{
+public:
+    typedef boost::asio::ip::address address_type;
+
+    struct stats
+    {
+        std::uint64_t queries = 0; // datagrams sent
+        std::uint64_t cache_hits = 0;
+        std::uint64_t coalesced = 0; // lookups that waited for someone else's query
+    };
+
+    dns_resolver(io_scheduler& srv); // system configuration
+    dns_resolver(io_scheduler& srv, dns_config config);
+    dns_resolver(const dns_resolver&) = delete;
+    ~dns_resolver();
+
+    // from a coroutine. IPv6 addresses first, then IPv4. Throws dns_error
+    std::vector<address_type> resolve(const std::string& hostname);
+
+    void clear_cache();
+
+    stats get_stats();
+
+    const dns_config& config() const { return _config; }
+
+private:
+
+    struct state;
+    struct lookup;
+
+    // one name, no search list: cached, or queried by this coroutine or the one already doing it
+    std::shared_ptr<lookup> lookup_name(const std::string& name);
+
+    // ends the query in progress: caches the result if it may be, wakes the lookups waiting for it
+    void finish_lookup(const std::string& name, const std::shared_ptr<lookup>& l, bool cacheable);
+
+    // A and AAAA queries, server after server
+    void query(const std::string& name, lookup& result);
+
+    // reads replies and hands them to the queries waiting for them. Ends when nobody waits
+    static void receive(std::shared_ptr<state> st);
+
+    // makes receive() notice there's nobody waiting anymore
+    static void wake_receiver(state& st);
+
+    const dns_config _config;
+    std::shared_ptr<state> _state; // shared with the receiving coroutine
+};
+
+}
+
+#endif
@@ -2,15 +2,30 @@
 #include "coroutines_io/file.hpp"
 
 #include "coroutines_io/globals.hpp"
+#include "coroutines_io/io_scheduler.hpp"
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 
 namespace coroutines {
 
+static const std::uint64_t CURRENT_POSITION = -1;
+
+// single transfer is limited to what fits the int result of the ring
+static const std::size_t MAX_TRANSFER = 1 << 30;
+
+static std::size_t check_result(ssize_t r, const char* what)
+{
+    if (r < 0)
+        throw std::system_error(-r, std::system_category(), what);
+    return r;
+}
+
 file::file(io_scheduler& srv)
     : base_pollable(srv)
 {
@@ -24,19 +39,19 @@ file::file()
 
 void file::open_for_reading(const std::string& path)
 {
-    open(path, O_NONBLOCK|O_RDONLY);
+    open(path, O_RDONLY);
 }
 
 void file::open_for_writing(const std::string& path)
 {
-    open(path, O_NONBLOCK|O_WRONLY|O_CREAT|O_TRUNC);
+    open(path, O_WRONLY|O_CREAT|O_TRUNC);
 }
 
 void file::open(const std::string& path, int flags)
 {
     assert(!is_open());
 
-    int fd = ::open(path.c_str(), flags, 00666);
+    int fd = ::open(path.c_str(), flags|O_CLOEXEC, 00666);
     if (fd < 0 )
     {
         throw_errno("open");
@@ -47,4 +62,128 @@ void file::open(const std::string& path, int flags)
     }
 }
 
+ssize_t file::read_at(char* buf, std::size_t how_much, std::uint64_t offset)
+{
+    assert(is_open());
+    how_much = std::min(how_much, MAX_TRANSFER);
+
+    if (get_uring())
+        return get_uring()->read(get_fd(), buf, how_much, offset);
+
+    int fd = get_fd();
+    return get_service().get_file_io().execute([=]()
+    {
+        return offset == CURRENT_POSITION ? ::read(fd, buf, how_much) : ::pread(fd, buf, how_much, offset);
+    });
+}
+
+ssize_t file::write_at(const char* buf, std::size_t how_much, std::uint64_t offset)
+{
+    assert(is_open());
+    how_much = std::min(how_much, MAX_TRANSFER);
+
+    if (get_uring())
+        return get_uring()->write(get_fd(), buf, how_much, offset);
+
+    int fd = get_fd();
+    return get_service().get_file_io().execute([=]()
+    {
+        return offset == CURRENT_POSITION ? ::write(fd, buf, how_much) : ::pwrite(fd, buf, how_much, offset);
+    });
+}
+
+std::size_t file::read(char* buf, std::size_t how_much)
+{
+    std::size_t total = 0;
+    while(total < how_much)
+    {
+        std::size_t r = check_result(read_at(buf + total, how_much - total, CURRENT_POSITION), "read");
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+std::size_t file::write(const char* buf, std::size_t how_much)
+{
+    std::size_t total = 0;
+    while(total < how_much)
+    {
+        std::size_t r = check_result(write_at(buf + total, how_much - total, CURRENT_POSITION), "write");
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+std::size_t file::pread(char* buf, std::size_t how_much, std::uint64_t offset)
+{
+    std::size_t total = 0;
+    while(total < how_much)
+    {
+        std::size_t r = check_result(read_at(buf + total, how_much - total, offset + total), "pread");
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+std::size_t file::pwrite(const char* buf, std::size_t how_much, std::uint64_t offset)
+{
+    std::size_t total = 0;
+    while(total < how_much)
+    {
+        std::size_t r = check_result(write_at(buf + total, how_much - total, offset + total), "pwrite");
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+void file::readahead(std::uint64_t offset, std::size_t length)
+{
+    assert(is_open());
+
+    if (get_uring())
+    {
+        get_uring()->advise(get_fd(), offset, std::min(length, MAX_TRANSFER), POSIX_FADV_WILLNEED);
+    }
+    else
+    {
+        // may block while the reads are being started, so it's not done here.
+        // The descriptor may be closed by the time it runs, worst case it's a useless hint for another file
+        int fd = get_fd();
+        get_service().get_file_io().post([=]()
+        {
+            ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+        });
+    }
+}
+
+void file::datasync()
+{
+    assert(is_open());
+
+    int fd = get_fd();
+    ssize_t r = get_uring()
+        ? get_uring()->fsync(fd, true)
+        : get_service().get_file_io().execute([=]() { return ssize_t(::fdatasync(fd)); });
+    check_result(r, "fdatasync");
+}
+
+void file::sync()
+{
+    assert(is_open());
+
+    int fd = get_fd();
+    ssize_t r = get_uring()
+        ? get_uring()->fsync(fd, false)
+        : get_service().get_file_io().execute([=]() { return ssize_t(::fsync(fd)); });
+    check_result(r, "fsync");
+}
+
 }
@@ -4,9 +4,12 @@
 
 #include "coroutines_io/base_pollable.hpp"
 
+#include <cstdint>
+
 namespace coroutines {
 
-// disk file
+// disk file.
+// I/O doesn't block the processor: it runs on io_scheduler's I/O threads, or goes through io_uring
 class file : public base_pollable
 {
 public:
@@ -17,9 +20,28 @@ public:
     void open_for_reading(const std::string& path);
     void open_for_writing(const std::string& path);
 
+    // from the current position. Read all unless how_much or EOF
+    std::size_t read(char* buf, std::size_t how_much);
+    std::size_t write(const char* buf, std::size_t how_much);
+
+    // at the offset, the current position doesn't change
+    std::size_t pread(char* buf, std::size_t how_much, std::uint64_t offset);
+    std::size_t pwrite(const char* buf, std::size_t how_much, std::uint64_t offset);
+
+    // hint that the range is going to be read soon. Doesn't wait
+    void readahead(std::uint64_t offset, std::size_t length);
+
+    // fdatasync()/fsync()
+    void datasync();
+    void sync();
+
 private:
 
     void open(const std::string& path, int flags);
+
+    // one transfer, offset -1 means the current position. Returns the result or -errno
+    ssize_t read_at(char* buf, std::size_t how_much, std::uint64_t offset);
+    ssize_t write_at(const char* buf, std::size_t how_much, std::uint64_t offset);
 };
 
 }
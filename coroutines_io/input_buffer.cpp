@@ -0,0 +1,123 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/input_buffer.hpp"
+#include "coroutines_io/base_pollable.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+namespace coroutines_io
+{
+
+const std::size_t input_buffer::DEFAULT_INITIAL;
+const std::size_t input_buffer::DEFAULT_MAX;
+const std::size_t input_buffer::npos;
+
+// shrinking is considered every this many fills of an empty buffer
+static const unsigned SHRINK_CHECK_FILLS = 16;
+
+input_buffer::input_buffer(std::size_t initial, std::size_t max)
+    : _data(new char[initial])
+    , _capacity(initial)
+    , _initial(initial)
+    , _max(std::max(initial, max))
+{
+}
+
+std::size_t input_buffer::fill(coroutines::base_pollable& source)
+{
+    if (empty())
+    {
+        _begin = _end = 0;
+
+        // halved if the last messages used a quarter of it at most. Nothing to copy now
+        if (++_empty_fills == SHRINK_CHECK_FILLS)
+        {
+            if (_capacity > _initial && _peak <= _capacity / 4)
+                reallocate(std::max(_initial, _capacity / 2));
+            _peak = 0;
+            _empty_fills = 0;
+        }
+    }
+    else if (_end == _capacity || (_begin > 0 && _capacity - _end < _capacity / 4))
+    {
+        // moved to the front if it makes enough room, doubled otherwise
+        if (_begin >= _capacity / 4)
+        {
+            std::memmove(_data.get(), data(), size());
+            _end -= _begin;
+            _begin = 0;
+        }
+        else if (_capacity < _max)
+        {
+            reallocate(std::min(_capacity * 2, _max));
+        }
+        else if (_end == _capacity)
+        {
+            if (_begin == 0)
+                throw std::length_error("input_buffer: full");
+            std::memmove(_data.get(), data(), size());
+            _end -= _begin;
+            _begin = 0;
+        }
+    }
+
+    std::size_t r = source.read_some(_data.get() + _end, _capacity - _end);
+    _end += r;
+    _peak = std::max(_peak, size());
+    return r;
+}
+
+std::size_t input_buffer::find(const std::string& delimiter)
+{
+    if (delimiter != _delimiter)
+    {
+        _delimiter = delimiter;
+        _scanned = 0;
+    }
+    if (delimiter.empty())
+        return 0;
+
+    const char* end = data() + size();
+    const char* found = std::search(data() + _scanned, end, delimiter.begin(), delimiter.end());
+    if (found != end)
+    {
+        _scanned = found - data();
+        return _scanned;
+    }
+
+    // the delimiter may have started in the last few bytes
+    _scanned = size() >= delimiter.size() ? size() - delimiter.size() + 1 : 0;
+    return npos;
+}
+
+std::size_t input_buffer::read_until(coroutines::base_pollable& source, const std::string& delimiter)
+{
+    for(;;)
+    {
+        std::size_t found = find(delimiter);
+        if (found != npos)
+            return found + delimiter.size();
+        if (fill(source) == 0)
+            return 0;
+    }
+}
+
+void input_buffer::consume(std::size_t n)
+{
+    n = std::min(n, size());
+    _begin += n;
+    _scanned = _scanned > n ? _scanned - n : 0;
+}
+
+void input_buffer::reallocate(std::size_t capacity)
+{
+    std::unique_ptr<char[]> data(new char[capacity]);
+    std::memcpy(data.get(), this->data(), size());
+    _end -= _begin;
+    _begin = 0;
+    _data = std::move(data);
+    _capacity = capacity;
+}
+
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_INPUT_BUFFER_HPP
+#define COROUTINES_IO_INPUT_BUFFER_HPP
+
+#include <boost/utility/string_ref.hpp>
+
+#include <memory>
+#include <string>
+
+namespace coroutines {
+class base_pollable;
+}
+
+namespace coroutines_io
+{
+
+// data received from a socket, not consumed yet.
+// Grows while a message doesn't fit, and shrinks back once large messages stop coming, so idle connections stay small.
+// Contents are seen in place: pointers and views are valid until the next fill() or consume()
+class input_buffer
+{
+public:
+
+    static const std::size_t DEFAULT_INITIAL = 4096;
+    static const std::size_t DEFAULT_MAX = 1024*1024;
+    static const std::size_t npos = std::size_t(-1);
+
+    explicit input_buffer(std::size_t initial = DEFAULT_INITIAL, std::size_t max = DEFAULT_MAX);
+    input_buffer(const input_buffer&) = delete;
+    input_buffer(input_buffer&&) = default;
+    input_buffer& operator=(input_buffer&&) = default;
+
+    // not consumed yet
+    const char* data() const { return _data.get() + _begin; }
+    std::size_t size() const { return _end - _begin; }
+    bool empty() const { return _begin == _end; }
+    boost::string_ref view() const { return boost::string_ref(data(), size()); }
+
+    std::size_t capacity() const { return _capacity; }
+
+    // reads whatever is available, parks only if nothing is. Returns bytes read, 0 on EOF.
+    // Throws std::length_error if max bytes are held already
+    std::size_t fill(coroutines::base_pollable& source);
+
+    // offset of the delimiter, or npos. Resumes where the previous call for the same delimiter stopped,
+    // data already searched is not searched again
+    std::size_t find(const std::string& delimiter);
+
+    // fills until the delimiter is in. Returns the length up to and including it, 0 on EOF before it.
+    // Throws std::length_error if there's max bytes without it
+    std::size_t read_until(coroutines::base_pollable& source, const std::string& delimiter);
+
+    // drops n bytes from the front
+    void consume(std::size_t n);
+
+private:
+
+    void reallocate(std::size_t capacity);
+
+    std::unique_ptr<char[]> _data;
+    std::size_t _capacity;
+    std::size_t _initial;
+    std::size_t _max;
+    std::size_t _begin = 0;
+    std::size_t _end = 0;
+
+    std::string _delimiter; // the last one looked for
+    std::size_t _scanned = 0; // from data(), the delimiter doesn't start before this
+
+    std::size_t _peak = 0; // most held since the last shrink check
+    unsigned _empty_fills = 0; // since the last shrink check
+};
+
+}
+
+#endif
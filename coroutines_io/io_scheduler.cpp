@@ -2,6 +2,7 @@
 
 #include "coroutines_io/io_scheduler.hpp"
 #include "coroutines_io/globals.hpp"
+#include "coroutines_io/dns_resolver.hpp"
 #include "coroutines/globals.hpp"
 
 #include "coroutines_io/detail/poller.hpp"
@@ -9,120 +10,124 @@
 //#define CORO_LOGGING
 #include "coroutines/logging.hpp"
 
-#include <unordered_map>
-#include <iostream>
-
-#include <sys/socket.h>
+#include <cassert>
 
 namespace coroutines {
 
-io_scheduler::io_scheduler(scheduler& sched)
+io_scheduler::io_scheduler(scheduler& sched, unsigned shards, io_backend backend)
     : _scheduler(sched)
+    , _states_mutex("io_scheduler states mutex")
+    , _resolver_mutex("io_scheduler resolver mutex")
 {
+    if (backend == io_backend::uring)
+        _uring.reset(new detail::uring());
+    else
+        _poller.reset(new detail::poller(shards));
 }
 
 io_scheduler::~io_scheduler()
 {
+    stop();
 }
 
-void io_scheduler::wait_for_writable(int fd, const channel_writer<std::error_code>& writer)
+dns_resolver& io_scheduler::get_resolver()
 {
-    CORO_LOG("SERV: wait for writable fd=", fd);
-    _command_writer.put(command{fd, FD_WRITABLE, writer});
-    _poller.wake();
-}
-
-void io_scheduler::wait_for_readable(int fd, const channel_writer<std::error_code>& writer)
-{
-    CORO_LOG("SERV: wait for readable fd=", fd);
-    _command_writer.put(command{fd, FD_READABLE, writer});
-    _poller.wake();
-}
-
-void io_scheduler::start()
-{
-    auto pair = _scheduler.make_channel<command>(256, "io_scheduler command channel");
-    _command_writer = std::move(pair.writer);
-    _command_reader = std::move(pair.reader);
-
-    _scheduler.go("service loop", [this](){ loop(); });
+    std::lock_guard<mutex> lock(_resolver_mutex);
+    if (!_resolver)
+        _resolver.reset(new dns_resolver(*this));
+    return *_resolver;
 }
 
-void io_scheduler::stop()
+unsigned io_scheduler::current_shard() const
 {
-    _command_writer.close();
+    processor* pc = processor::current_processor();
+    return pc ? pc->ordinal() % shards() : 0;
 }
 
-void io_scheduler::loop()
+detail::poll_state* io_scheduler::register_fd(int fd, unsigned shard)
 {
-    std::unordered_map<std::uint64_t, command> commands;
-    std::uint64_t counter = 0;
-    std::vector<std::uint64_t> keys;
+    assert(_poller);
 
-    for(;;)
+    detail::poll_state* state = nullptr;
     {
-        command cmd;
-
-        // if no pending commands, block on reader
-        if (commands.empty())
+        std::lock_guard<mutex> lock(_states_mutex);
+        if (_free_states.empty())
         {
-            CORO_LOG("SERV: blocking on commands");
-            try
-            {
-                cmd = _command_reader.get();
-            }
-            catch(const channel_closed&)
-            {
-                CORO_LOG("SERV: blocking on commands interrupted");
-                throw;
-            }
-            _poller.add_fd(cmd.fd, cmd.events, counter);
-            commands.insert(std::make_pair(counter++, cmd));
+            _states.emplace_back(new detail::poll_state());
+            state = _states.back().get();
         }
-
-        // read all events
-        while(_command_reader.try_get(cmd))
+        else
         {
-            _poller.add_fd(cmd.fd, cmd.events, counter);
-            commands.insert(std::make_pair(counter++, cmd));
+            state = _free_states.back();
+            _free_states.pop_back();
+            state->reset();
         }
+    }
 
-        CORO_LOG("SERV: polling, ", commands.size(), " sockets pending");
+    if (!_poller->add_fd(fd, state, shard))
+    {
+        unregister_fd(state);
+        return nullptr;
+    }
+    CORO_LOG("SERV: fd=", fd, " registered in shard ", shard);
+    return state;
+}
 
-        // poll!
-        keys.clear();
-        block([&]()
-        {
-            _poller.wait(keys);
-        });
+void io_scheduler::unregister_fd(detail::poll_state* state)
+{
+    // whoever is still waiting must not be lost with the state, it retries and finds the descriptor closed
+    std::vector<coroutine_weak_ptr> woken;
+    state->set_ready(detail::poll_state::READ, woken);
+    state->set_ready(detail::poll_state::WRITE, woken);
+    for(coroutine_weak_ptr c : woken)
+    {
+        _scheduler.schedule(c);
+    }
 
-        CORO_LOG("SERV: ", keys.size(), " events ready");
+    std::lock_guard<mutex> lock(_states_mutex);
+    _free_states.push_back(state);
+}
 
-        // serve events
-        for(std::uint64_t key : keys)
-        {
-            auto it = commands.find(key);
-            assert(it != commands.end());
-
-            // get error
-            std::error_code ec;
-            int err = 0;
-            socklen_t err_len = sizeof(err);
-            int r = ::getsockopt(it->second.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
-            if (r == 0)
-            {
-                ec = std::error_code(err, std::system_category());
-            }
-            CORO_LOG("SERV: sending event on fd=", it->second.fd, " ec=", ec);
-
-            it->second.writer.put(ec);
-            commands.erase(it);
-            _poller.remove_fd(it->second.fd);
-        }
+void io_scheduler::start()
+{
+    assert(!_started);
+    _started = true;
+    _scheduler.set_io_poller(this);
+}
 
+void io_scheduler::stop()
+{
+    if (_started)
+    {
+        _scheduler.set_io_poller(nullptr);
+        _started = false;
     }
+}
 
+void io_scheduler::poll(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout)
+{
+    if (_uring)
+        _uring->run(woken, timeout);
+    else
+        _poller->wait(woken, timeout);
+    CORO_LOG("SERV: ", woken.size(), " coroutines woken");
+}
 
+void io_scheduler::poll_local(unsigned processor, std::vector<coroutine_weak_ptr>& woken)
+{
+    // submits what the processor's coroutines have queued, as one batch
+    if (_uring)
+        _uring->run(woken, std::chrono::nanoseconds(0));
+    else
+        _poller->poll_shard(processor % _poller->shards(), woken);
+}
+
+void io_scheduler::interrupt()
+{
+    if (_uring)
+        _uring->wake();
+    else
+        _poller->wake();
 }
 
 }
@@ -4,42 +4,90 @@
 
 #include "coroutines/scheduler.hpp"
 #include "coroutines_io/detail/poller.hpp"
+#include "coroutines_io/detail/uring.hpp"
+#include "coroutines_io/detail/file_io.hpp"
 #include "coroutines_io/globals.hpp"
 
 #include <system_error>
+#include <memory>
+#include <vector>
 
 namespace coroutines {
 
-class io_scheduler
+enum class io_backend
+{
+    epoll,  // readiness: I/O is retried when epoll reports the descriptor ready
+    uring   // completion: operations are submitted to io_uring, regular files get asynchronous I/O too
+};
+
+class dns_resolver;
+
+// waits for descriptors to become ready, and resumes coroutines waiting for them.
+// There is no polling thread: started io_scheduler is polled by the scheduler's processors, so the coroutine runs on the thread that got the event.
+// With epoll, descriptors are registered once, edge-triggered. They can be divided between shards, one epoll each.
+// Processor checks its own shard whenever it runs out of work, pass the number of processors for one shard each.
+// With io_uring there is one ring, shared by all processors.
+// Disk files are never ready for epoll, their I/O runs on a pool of threads instead, or goes through the ring
+class io_scheduler : private io_poller
 {
 public:
 
-    io_scheduler(scheduler& sched);
+    io_scheduler(scheduler& sched, unsigned shards = 1, io_backend backend = io_backend::epoll);
     ~io_scheduler();
 
     scheduler& get_scheduler() { return _scheduler; }
 
+    io_backend backend() const { return _uring ? io_backend::uring : io_backend::epoll; }
+
+    unsigned shards() const { return _poller ? _poller->shards() : 1; }
+
+    // the ring, null with epoll backend
+    detail::uring* get_uring() { return _uring.get(); }
+
+    // I/O threads for disk files, with epoll backend
+    detail::file_io& get_file_io() { return _file_io; }
+
+    // created on first use, with the system configuration
+    dns_resolver& get_resolver();
+
+    // shard of the current processor
+    unsigned current_shard() const;
+
     // services provided
-    void wait_for_writable(int fd, const channel_writer<std::error_code>& writer);
-    void wait_for_readable(int fd, const channel_writer<std::error_code>& writer);
 
+    // registers descriptor for its whole lifetime, in given shard. Returns null if it can't be polled (regular files), it's always ready then.
+    // The state is used to wait for readiness. Epoll backend only
+    detail::poll_state* register_fd(int fd, unsigned shard);
+
+    // call once the descriptor is closed, closing removes it from epoll. Coroutines waiting on it are woken
+    void unregister_fd(detail::poll_state* state);
+
+    // installs/removes itself as scheduler's io poller
     void start();
     void stop();
 
 private:
 
-    struct command
-    {
-        int fd;
-        fd_events events;
-        channel_writer<std::error_code> writer;
-    };
+    // io_poller
+    virtual void poll(std::vector<coroutine_weak_ptr>& woken, std::chrono::nanoseconds timeout) override;
+    virtual void poll_local(unsigned processor, std::vector<coroutine_weak_ptr>& woken) override;
+    virtual void interrupt() override;
 
-    void loop();
     scheduler& _scheduler;
-    detail::poller _poller;
-    channel_writer<command> _command_writer;
-    channel_reader<command> _command_reader;
+    std::unique_ptr<detail::poller> _poller; // one of the two
+    std::unique_ptr<detail::uring> _uring;
+    detail::file_io _file_io;
+    bool _started = false;
+
+    // recycled, never freed while started: an event may still be on its way for a descriptor just closed.
+    // It can only cause a spurious wake-up, the coroutine then retries the I/O
+    std::vector<std::unique_ptr<detail::poll_state>> _states;
+    std::vector<detail::poll_state*> _free_states;
+    mutex _states_mutex;
+
+    // last: its socket is unregistered before the states go
+    std::unique_ptr<dns_resolver> _resolver;
+    mutex _resolver_mutex;
 };
 
 }
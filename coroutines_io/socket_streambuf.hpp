@@ -3,14 +3,17 @@
 #define COROUTINES_IO_SOCKET_STREAMBUF_HPP
 
 #include "coroutines_io/base_pollable.hpp"
+#include "coroutines_io/input_buffer.hpp"
 
 #include <array>
 #include <streambuf>
+#include <algorithm>
+#include <cstring>
 
 namespace coroutines {
 
-// current status:
-// * no putback
+// reads through an input_buffer, which grows for large messages.
+// The last few bytes read can be put back. Large reads bypass the buffer
 class socket_istreambuf : public std::streambuf
 {
 public:
@@ -21,7 +24,7 @@ public:
     explicit socket_istreambuf(base_pollable& sock)
     : _socket(sock)
     {
-        setg(end(), end(), end());
+        setg(nullptr, nullptr, nullptr);
     }
 
     socket_istreambuf(const socket_istreambuf&) = delete;
@@ -31,41 +34,42 @@ protected:
     virtual int_type underflow() override
     {
         if (gptr() < egptr())
-        {
-//            std::cout << "STREAM: buffer not exhausetd, why are you bothering me?" << std::endl;
             return traits_type::to_int_type(*gptr());
-        }
-        else
+
+        // what's been read goes, but for the putback area
+        std::size_t read = gptr() - eback();
+        std::size_t kept = read < PUTBACK_SIZE ? read : PUTBACK_SIZE;
+        _buffer.consume(read - kept);
+
+        if (_buffer.fill(_socket) == 0)
         {
-            //std::cout << "STREAM: need to refill..." << std::endl;
-            // need to load some data
-            std::size_t n = _socket.read_some(begin(), BUFFER_SIZE);
-            if (n == 0)
-            {
-                return traits_type::eof();
-            }
-            else
-            {
-                //std::cout << "STREAM: " << n << " bytes added to buffer" << std::endl;
-                setg(begin(), begin(), begin() + n);
-                return traits_type::to_int_type(*gptr());
-            }
+            setg(nullptr, nullptr, nullptr);
+            _buffer.consume(_buffer.size());
+            return traits_type::eof();
         }
-    }
 
-private:
+        char* begin = const_cast<char*>(_buffer.data());
+        setg(begin, begin + kept, begin + _buffer.size());
+        return traits_type::to_int_type(*gptr());
+    }
 
-    static constexpr unsigned BUFFER_SIZE = 4096;
+    virtual std::streamsize xsgetn(char* s, std::streamsize n) override
+    {
+        std::streamsize buffered = std::min(n, std::streamsize(egptr() - gptr()));
+        if (n - buffered < std::streamsize(BYPASS_SIZE))
+            return std::streambuf::xsgetn(s, n);
 
-    typedef std::array<char, BUFFER_SIZE> buffer_type;
+        std::memcpy(s, gptr(), buffered);
+        gbump(buffered);
+        return buffered + _socket.read(s + buffered, n - buffered);
+    }
 
-    const char* begin() const { return _buffer.data(); }
-    const char* end() const { return _buffer.data() + BUFFER_SIZE; }
+private:
 
-    char* begin() { return _buffer.data(); }
-    char* end() { return _buffer.data() + BUFFER_SIZE; }
+    static constexpr std::size_t PUTBACK_SIZE = 8;
+    static constexpr std::size_t BYPASS_SIZE = 16*1024;
 
-    buffer_type _buffer;
+    coroutines_io::input_buffer _buffer;
     base_pollable& _socket;
 };
 
@@ -108,6 +112,22 @@ protected:
         return 0;
     }
 
+    // large block goes out together with what's buffered, in one syscall, without being copied
+    virtual std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        if (n < std::streamsize(BUFFER_SIZE / 2))
+            return std::streambuf::xsputn(s, n);
+
+        iovec iov[2];
+        iov[0].iov_base = begin();
+        iov[0].iov_len = pptr() - begin();
+        iov[1].iov_base = const_cast<char*>(s);
+        iov[1].iov_len = n;
+        _socket.write_v(iov, 2);
+        setp(begin(), end());
+        return n;
+    }
+
 private:
 
     static constexpr unsigned BUFFER_SIZE = 4096;
@@ -2,6 +2,7 @@
 #include "coroutines_io/tcp_acceptor.hpp"
 #include "coroutines_io/globals.hpp"
 #include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/detail/endpoint.hpp"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -20,68 +21,164 @@ tcp_acceptor::tcp_acceptor()
 {
 }
 
-void tcp_acceptor::listen(const tcp_acceptor::endpoint_type& endpoint)
+tcp_acceptor::tcp_acceptor(io_scheduler& srv, unsigned shard)
+    : base_pollable(srv)
+    , _listen_shard(shard)
 {
-    assert(!_listening);
-
-    int af = endpoint.address().is_v4() ? AF_INET : AF_INET6;
+}
 
-    open(af);
+tcp_acceptor::~tcp_acceptor()
+{
+    close();
+}
 
-    int cr = 0;
-    if (af == AF_INET)
+void tcp_acceptor::close()
+{
+    if (_multishot)
     {
-        sockaddr_in addr;
-        std::memset(&addr, 0, sizeof(addr));
+        _multishot->close();
+        _multishot = nullptr;
+    }
+    base_pollable::close();
+    _listening = false;
+}
+
+void tcp_acceptor::listen(const tcp_acceptor::endpoint_type& endpoint, unsigned backlog, bool reuse_port)
+{
+    assert(!_listening);
+
+    open(endpoint.protocol().family());
 
-        addr.sin_family = af;
-        addr.sin_addr.s_addr = htonl(endpoint.address().to_v4().to_ulong());
-        addr.sin_port = htons(endpoint.port());
-        cr = ::bind(get_fd(), (sockaddr*)&addr, sizeof(addr));
+    if (reuse_port)
+    {
+        int one = 1;
+        if (::setsockopt(get_fd(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+            throw_errno("SO_REUSEPORT");
     }
-    else
+
+    if (endpoint.address().is_v6())
     {
-        assert(true); // not implemented
+        // dual-stack: IPv4 clients are accepted too, as v4-mapped addresses
+        int zero = 0;
+        ::setsockopt(get_fd(), IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
     }
 
+    int cr = ::bind(get_fd(), endpoint.data(), endpoint.size());
     if (cr < 0)
     {
-        throw_errno();
+        throw_errno("bind");
     }
 
-    cr = ::listen(get_fd(), 256); // compeltely arbitrary queue size
+    cr = ::listen(get_fd(), backlog);
     if (cr < 0)
-        throw_errno();
+        throw_errno("listen");
+
+    if (get_uring())
+        _multishot = get_uring()->make_acceptor(get_fd());
 
     _listening = true;
 
 }
 
+void tcp_acceptor::shutdown()
+{
+    // wakes up the waiting accept, it fails with EINVAL
+    _shut_down = true;
+    if (is_open())
+        ::shutdown(get_fd(), SHUT_RDWR);
+}
+
 tcp_socket tcp_acceptor::accept()
 {
     assert(_listening);
 
-    sockaddr_in addr;
+    sockaddr_storage addr;
     socklen_t addr_len = sizeof(addr);
+
+    if (_multishot)
+    {
+        int fd = _multishot->accept();
+        if (fd < 0)
+            throw std::system_error(-fd, std::system_category(), "accept");
+        return accepted_by_ring(fd);
+    }
+
     for(;;)
     {
-        int fd = ::accept4(get_fd(), (sockaddr*)&addr, &addr_len, SOCK_NONBLOCK);
-        if (fd < 0 )
+        int fd = try_accept(addr, addr_len);
+        if (fd >= 0)
         {
-            if (errno == EWOULDBLOCK || errno == EAGAIN)
-            {
-//                std::cout << "ACCEPT: acceptor would block" << std::endl;
-                wait_for_readable();
-                continue;
-            }
+            // polled in the acceptor's shard
+            return tcp_socket(get_service(), fd, detail::to_endpoint(addr, addr_len), get_shard());
         }
-        else
-        {
-            boost::asio::ip::address_v4 a(ntohl(addr.sin_addr.s_addr));
+        wait_for_readable();
+    }
+}
+
+tcp_socket tcp_acceptor::accepted_by_ring(int fd)
+{
+    // the ring doesn't return the address
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (::getpeername(fd, (sockaddr*)&addr, &addr_len) < 0)
+    {
+        // peer already gone, the socket will report it
+        std::memset(&addr, 0, sizeof(addr));
+        addr.ss_family = AF_INET;
+        addr_len = sizeof(sockaddr_in);
+    }
+    return tcp_socket(get_service(), fd, detail::to_endpoint(addr, addr_len), get_shard());
+}
+
+int tcp_acceptor::try_accept(sockaddr_storage& addr, socklen_t& addr_len)
+{
+    for(;;)
+    {
+        addr_len = sizeof(addr);
+        int fd = ::accept4(get_fd(), (sockaddr*)&addr, &addr_len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+
+        if (errno == EWOULDBLOCK || errno == EAGAIN)
+            return -1;
+        if (errno != ECONNABORTED && errno != EINTR)
+            throw_errno("accept");
+    }
+}
 
-            return tcp_socket(get_service(), fd, endpoint_type(a, ntohs(addr.sin_port)));
+std::size_t tcp_acceptor::accept_some(std::vector<tcp_socket>& accepted, std::size_t max)
+{
+    assert(_listening);
+    assert(max > 0);
+
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (_multishot)
+    {
+        // the first one may wait, the rest is what the ring has queued already
+        accepted.push_back(accept());
+        std::size_t n = 1;
+        for(int fd; n < max && (fd = _multishot->try_accept()) >= 0; n++)
+            accepted.push_back(accepted_by_ring(fd));
+        return n;
+    }
+
+    // edge-triggered: parking is allowed only after EAGAIN, so the whole queue is taken at once
+    for(;;)
+    {
+        std::size_t n = 0;
+        for(; n < max; n++)
+        {
+            int fd = try_accept(addr, addr_len);
+            if (fd < 0)
+                break;
+            accepted.emplace_back(get_service(), fd, detail::to_endpoint(addr, addr_len), get_shard());
         }
-    };
+        if (n > 0)
+            return n;
+        wait_for_readable();
+    }
 }
 
 void tcp_acceptor::open(int address_family)
@@ -90,19 +187,21 @@ void tcp_acceptor::open(int address_family)
     {
         int fd = ::socket(
             address_family,
-            SOCK_STREAM | SOCK_NONBLOCK,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
             0);
 
-        int one = 1;
-        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-
         if (fd == -1)
         {
             throw_errno("open acceptor");
         }
         else
         {
-            set_fd(fd);
+            int one = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (_listen_shard < 0)
+                set_fd(fd);
+            else
+                set_fd(fd, _listen_shard);
         }
     }
 }
@@ -8,6 +8,11 @@
 
 #include <boost/asio/ip/tcp.hpp>
 
+#include <sys/socket.h>
+
+#include <vector>
+#include <atomic>
+
 namespace coroutines {
 
 class io_scheduler;
@@ -17,21 +22,45 @@ class tcp_acceptor : public base_pollable
 public:
     typedef boost::asio::ip::tcp::endpoint endpoint_type;
 
+    // the kernel caps it at net.core.somaxconn
+    static const unsigned DEFAULT_BACKLOG = 4096;
+
     tcp_acceptor(coroutines::io_scheduler& srv);
     tcp_acceptor(); // uses get_io_scheduler_check()
     tcp_acceptor(const tcp_acceptor&) = delete;
 
-    ~tcp_acceptor() = default;
+    // polled in the given shard, and so are the accepted sockets
+    tcp_acceptor(coroutines::io_scheduler& srv, unsigned shard);
+
+    ~tcp_acceptor();
 
-    void listen(const endpoint_type& endpoint);
+    // with reuse_port, many acceptors can listen on the same endpoint, the kernel spreads connections between them
+    void listen(const endpoint_type& endpoint, unsigned backlog = DEFAULT_BACKLOG, bool reuse_port = false);
 
     tcp_socket accept();
 
+    // accepts until nothing's waiting, or 'max' were accepted. Parks only if there was nothing at all.
+    // Returns the number of sockets appended
+    std::size_t accept_some(std::vector<tcp_socket>& accepted, std::size_t max);
+
+    void close();
+
+    // stops listening, accept() in progress or later throws. The socket stays open until closed
+    void shutdown();
+    bool is_shut_down() const { return _shut_down; }
+
 private:
 
     void open(int af);
 
+    // one accept4(), -1 on EAGAIN
+    int try_accept(sockaddr_storage& addr, socklen_t& addr_len);
+    tcp_socket accepted_by_ring(int fd);
+
     bool _listening = false;
+    std::atomic<bool> _shut_down{false};
+    int _listen_shard = -1; // -1: the one of the processor calling listen()
+    detail::uring::acceptor* _multishot = nullptr; // io_uring backend only
 };
 
 }
@@ -0,0 +1,86 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/tcp_listener.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines_io/io_scheduler.hpp"
+
+#include "coroutines/globals.hpp"
+
+namespace coroutines {
+
+const std::size_t tcp_listener::ACCEPT_BATCH;
+const unsigned tcp_listener::ERROR_PAUSE_MS;
+
+tcp_listener::tcp_listener(io_scheduler& srv, unsigned acceptors)
+    : _service(srv)
+    , _acceptors_count(acceptors ? acceptors : srv.shards())
+{
+}
+
+tcp_listener::tcp_listener()
+    : tcp_listener(get_io_scheduler_check())
+{
+}
+
+tcp_listener::~tcp_listener()
+{
+    stop();
+}
+
+void tcp_listener::listen(const endpoint_type& endpoint, handler_type handler, unsigned backlog)
+{
+    assert(_acceptors.empty());
+
+    // all bound before any loop starts, a failure leaves nothing running
+    for(unsigned i = 0; i < _acceptors_count; i++)
+    {
+        std::shared_ptr<tcp_acceptor> acceptor = std::make_shared<tcp_acceptor>(_service, i % _service.shards());
+        acceptor->listen(endpoint, backlog, _acceptors_count > 1);
+        _acceptors.push_back(acceptor);
+    }
+
+    for(const std::shared_ptr<tcp_acceptor>& acceptor : _acceptors)
+    {
+        scheduler& sched = _service.get_scheduler();
+        sched.go("tcp_listener accept loop", accept_loop, std::ref(sched), acceptor, handler);
+    }
+}
+
+void tcp_listener::stop()
+{
+    for(const std::shared_ptr<tcp_acceptor>& acceptor : _acceptors)
+    {
+        acceptor->shutdown();
+    }
+    _acceptors.clear();
+}
+
+void tcp_listener::accept_loop(scheduler& sched, std::shared_ptr<tcp_acceptor> acceptor, handler_type handler)
+{
+    std::vector<tcp_socket> accepted;
+    accepted.reserve(ACCEPT_BATCH);
+    for(;;)
+    {
+        try
+        {
+            acceptor->accept_some(accepted, ACCEPT_BATCH);
+        }
+        catch(const std::exception&)
+        {
+            if (acceptor->is_shut_down())
+                return;
+
+            // out of descriptors or memory, connections wait in the backlog meanwhile
+            sleep_for(std::chrono::milliseconds(ERROR_PAUSE_MS));
+            continue;
+        }
+
+        // started here, they run on this processor
+        for(tcp_socket& s : accepted)
+        {
+            sched.go("tcp_listener connection", [handler](tcp_socket& s) { handler(s); }, std::move(s));
+        }
+        accepted.clear();
+    }
+}
+
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_TCP_LISTENER_HPP
+#define COROUTINES_IO_TCP_LISTENER_HPP
+
+#include "coroutines_io/tcp_acceptor.hpp"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace coroutines {
+
+class io_scheduler;
+class scheduler;
+
+// listens on one endpoint with many SO_REUSEPORT acceptors, one per io_scheduler shard, each with its own accept loop.
+// The kernel spreads new connections between them, a connection storm isn't served by a single loop and backlog.
+// Every connection is handled in a new coroutine, started by the loop that accepted it: it begins on the same processor,
+// and its socket is polled in the same shard
+class tcp_listener
+{
+public:
+    typedef boost::asio::ip::tcp::endpoint endpoint_type;
+    typedef std::function<void(tcp_socket&)> handler_type;
+
+    // sockets accepted by a loop before it starts their coroutines
+    static const std::size_t ACCEPT_BATCH = 64;
+
+    // after accept failed, other than by stop()
+    static const unsigned ERROR_PAUSE_MS = 10;
+
+    // acceptors = 0: one per shard
+    tcp_listener(io_scheduler& srv, unsigned acceptors = 0);
+    tcp_listener(); // uses get_io_scheduler_check()
+    tcp_listener(const tcp_listener&) = delete;
+
+    ~tcp_listener();
+
+    // opens the sockets and starts the loops
+    void listen(const endpoint_type& endpoint, handler_type handler, unsigned backlog = tcp_acceptor::DEFAULT_BACKLOG);
+
+    // closes the sockets, the loops end. Connections already accepted are not affected
+    void stop();
+
+private:
+
+    static void accept_loop(scheduler& sched, std::shared_ptr<tcp_acceptor> acceptor, handler_type handler);
+
+    io_scheduler& _service;
+    unsigned _acceptors_count;
+    std::vector<std::shared_ptr<tcp_acceptor>> _acceptors; // shared with the loops
+};
+
+}
+
+#endif
@@ -2,52 +2,50 @@
 
 #include "coroutines_io/tcp_resolver.hpp"
 #include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/dns_resolver.hpp"
 
-#include "coroutines/globals.hpp"
-
-#include <sys/types.h>
-#include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
 
-#include <cstring>
+#include <cstdlib>
+#include <cerrno>
 
 
 namespace coroutines {
 
-void tcp_resolve(const std::string& hostname, const std::string& service, std::vector<tcp_socket::endpoint_type>& out)
+static unsigned short resolve_service(const std::string& service)
 {
-    addrinfo hints;
-    addrinfo* result = nullptr;
-    std::memset(&hints, 0, sizeof(addrinfo));
-
-    block("address resolution started");
-
-    int r = getaddrinfo(
-        hostname.c_str(),
-        service.c_str(),
-        &hints,
-        &result);
-
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    unblock("address resolution finished");
-
-    if (r != 0)
+    char* end = nullptr;
+    unsigned long port = std::strtoul(service.c_str(), &end, 10);
+    if (!service.empty() && *end == 0)
     {
-        throw_errno("tcp_resolver::resolve");
+        if (port > 0xffff)
+            throw std::invalid_argument("tcp_resolve: bad port " + service);
+        return port;
     }
 
-    for(addrinfo* addr_info = result; addr_info; addr_info = addr_info->ai_next)
+    // reads /etc/services, off the processor
+    int found = -1;
+    get_io_scheduler_check().get_file_io().execute([&]() -> ssize_t
     {
-        if(addr_info->ai_family == AF_INET)
-        {
-            const sockaddr_in* addr = reinterpret_cast<const sockaddr_in*>(addr_info->ai_addr);
-            boost::asio::ip::address_v4 a(ntohl(addr->sin_addr.s_addr));
+        servent entry;
+        servent* result = nullptr;
+        char buf[1024];
+        if (::getservbyname_r(service.c_str(), "tcp", &entry, buf, sizeof(buf), &result) == 0 && result)
+            found = ntohs(result->s_port);
+        return 0;
+    });
+    if (found < 0)
+        throw std::invalid_argument("tcp_resolve: unknown service " + service);
+    return found;
+}
 
-            out.emplace_back(a, ntohs(addr->sin_port));
-        }
-    }
+void tcp_resolve(const std::string& hostname, const std::string& service, std::vector<tcp_socket::endpoint_type>& out)
+{
+    unsigned short port = resolve_service(service);
+
+    for(const boost::asio::ip::address& a : get_io_scheduler_check().get_resolver().resolve(hostname))
+        out.emplace_back(a, port);
 }
 
 }
@@ -10,7 +10,9 @@
 
 namespace coroutines {
 
-void tcp_resolve(const std::string& hostname, const std::string& io_scheduler, std::vector<tcp_socket::endpoint_type>& out);
+// from a coroutine, with the io_scheduler's dns_resolver: the thread is not blocked.
+// Service is a port number or a name from /etc/services. IPv6 endpoints first. Throws dns_error if the name is unknown
+void tcp_resolve(const std::string& hostname, const std::string& service, std::vector<tcp_socket::endpoint_type>& out);
 
 }
 
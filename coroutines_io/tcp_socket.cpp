@@ -8,11 +8,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <algorithm>
+#include <memory>
 #include <cstring>
 #include <system_error>
 
 namespace coroutines {
 
+constexpr unsigned tcp_socket::ATTEMPT_DELAY_MS;
+
 tcp_socket::tcp_socket(coroutines::io_scheduler& srv)
     : base_pollable(srv)
 {
@@ -36,40 +40,201 @@ tcp_socket::tcp_socket(io_scheduler& srv, int fd, const endpoint_type& remote_en
     set_fd(fd);
 }
 
+tcp_socket::tcp_socket(io_scheduler& srv, int fd, const endpoint_type& remote_endpoint, unsigned shard)
+    : base_pollable(srv)
+    , _remote_endpoint(remote_endpoint)
+{
+    set_fd(fd, shard);
+}
+
 
 void tcp_socket::connect(const tcp_socket::endpoint_type& endpoint)
 {
+    open(endpoint.protocol().family());
+    connect_opened(endpoint);
+}
 
-    int af = endpoint.address().is_v4() ? AF_INET : AF_INET6;
+void tcp_socket::connect_opened(const tcp_socket::endpoint_type& endpoint)
+{
+    if (get_uring())
+    {
+        // the ring waits for the connection
+        int cr = get_uring()->connect(get_fd(), endpoint.data(), endpoint.size());
+        if (cr < 0)
+            throw std::system_error(-cr, std::system_category(), "connect");
+        _remote_endpoint = endpoint;
+        return;
+    }
 
-    open(af);
+    int cr = ::connect(get_fd(), endpoint.data(), endpoint.size());
+    if (cr < 0 && errno != EINPROGRESS)
+    {
+        throw_errno("connect");
+    }
 
-    int cr = 0;
-    if (af == AF_INET)
+    // writable may be reported for the fresh socket already, so it's connected only once it has a peer
+    while(cr < 0)
     {
-        sockaddr_in addr;
-        std::memset(&addr, 0, sizeof(addr));
+        wait_for_writable();
+
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (::getsockopt(get_fd(), SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+            throw_errno("connect");
+        if (err != 0)
+            throw std::system_error(err, std::system_category(), "connect");
 
-        addr.sin_family = af;
-        addr.sin_addr.s_addr = htonl(endpoint.address().to_v4().to_ulong());
-        addr.sin_port = htons(endpoint.port());
-        cr = ::connect(get_fd(), (sockaddr*)&addr, sizeof(addr));
+        sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (::getpeername(get_fd(), (sockaddr*)&peer, &peer_len) == 0)
+            break;
     }
-    else
+    _remote_endpoint = endpoint;
+}
+
+namespace {
+
+// shared by the racing attempts, outlives the caller if they're still going
+struct connection_race
+{
+    connection_race(scheduler& sched, std::size_t attempts)
+        : results(sched.make_channel<int>(attempts, "happy eyeballs")) // never blocks
+        , mutex("happy eyeballs mutex")
+    { }
+
+    channel_pair<int> results; // index of the attempt, or -1 for a failure
+
+    coroutines::mutex mutex; // protects the fields below
+    std::vector<int> connecting; // descriptors of attempts in progress
+    bool decided = false;
+    std::unique_ptr<tcp_socket> winner;
+    std::exception_ptr last_error;
+};
+
+}
+
+void tcp_socket::connect(const std::vector<endpoint_type>& endpoints)
+{
+    if (endpoints.empty())
+        throw std::system_error(EINVAL, std::system_category(), "connect: no endpoints");
+
+    if (endpoints.size() == 1)
     {
-        assert(true); // not implemented
+        connect(endpoints.front());
+        return;
     }
 
-    if (cr == 0 )
+    // interleaved families, the first endpoint's first
+    std::vector<endpoint_type> preferred, other;
+    for(const endpoint_type& e : endpoints)
+        (e.protocol() == endpoints.front().protocol() ? preferred : other).push_back(e);
+    std::vector<endpoint_type> order;
+    for(std::size_t i = 0; i < std::max(preferred.size(), other.size()); i++)
     {
-        assert(false);
+        if (i < preferred.size())
+            order.push_back(preferred[i]);
+        if (i < other.size())
+            order.push_back(other[i]);
     }
-    if (errno != EINPROGRESS)
+
+    io_scheduler& service = get_service();
+    auto race = std::make_shared<connection_race>(service.get_scheduler(), order.size());
+
+    auto start_attempt = [&service, &race](const endpoint_type& endpoint)
     {
-        throw_errno("connect");
+        channel_writer<int> results = race->results.writer;
+        service.get_scheduler().go("happy eyeballs attempt", [endpoint, race, results, &service]() mutable
+        {
+            std::unique_ptr<tcp_socket> s(new tcp_socket(service));
+            bool won = false;
+            try
+            {
+                s->open(endpoint.protocol().family());
+                {
+                    std::lock_guard<coroutines::mutex> lock(race->mutex);
+                    if (race->decided)
+                        return;
+                    race->connecting.push_back(s->get_fd());
+                }
+
+                std::exception_ptr error;
+                try
+                {
+                    s->connect_opened(endpoint);
+                }
+                catch(...)
+                {
+                    error = std::current_exception();
+                }
+
+                std::lock_guard<coroutines::mutex> lock(race->mutex);
+                race->connecting.erase(std::find(race->connecting.begin(), race->connecting.end(), s->get_fd()));
+                if (error)
+                {
+                    race->last_error = error;
+                }
+                else if (!race->decided)
+                {
+                    // the others are aborted, shutdown wakes them up with an error
+                    race->decided = true;
+                    for(int fd : race->connecting)
+                        ::shutdown(fd, SHUT_RDWR);
+                    race->winner = std::move(s);
+                    won = true;
+                }
+            }
+            catch(const std::exception&)
+            {
+                std::lock_guard<coroutines::mutex> lock(race->mutex);
+                race->last_error = std::current_exception();
+            }
+
+            try
+            {
+                results.put(won ? 0 : -1);
+            }
+            catch(const channel_closed&)
+            {
+                // the caller is gone
+            }
+        });
+    };
+
+    std::size_t started = 0;
+    std::size_t failed = 0;
+    start_attempt(order[started++]);
+    for(;;)
+    {
+        int result;
+        if (started < order.size())
+        {
+            if (!race->results.reader.get_for(result, std::chrono::milliseconds(ATTEMPT_DELAY_MS)))
+            {
+                start_attempt(order[started++]);
+                continue;
+            }
+        }
+        else
+        {
+            result = race->results.reader.get();
+        }
+
+        if (result >= 0)
+            break;
+
+        if (++failed == order.size())
+        {
+            std::lock_guard<coroutines::mutex> lock(race->mutex);
+            std::rethrow_exception(race->last_error);
+        }
+        if (failed == started)
+            start_attempt(order[started++]); // nothing in progress, no point waiting
     }
-    wait_for_writable();
-    _remote_endpoint = endpoint;
+
+    std::lock_guard<coroutines::mutex> lock(race->mutex);
+    swap(*race->winner);
+    _remote_endpoint = race->winner->_remote_endpoint;
+    race->winner.reset();
 }
 
 void tcp_socket::shutdown()
@@ -80,11 +245,18 @@ void tcp_socket::shutdown()
 }
 
 
+std::size_t tcp_socket::send_file(file& f, std::uint64_t offset, std::size_t length)
+{
+    return send_from(f, offset, length);
+}
+
 void tcp_socket::open(int address_family)
 {
+    assert(!is_open());
+
     int fd = ::socket(
         address_family,
-        SOCK_STREAM | SOCK_NONBLOCK,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
         0);
 
     if (fd == -1)
@@ -5,9 +5,11 @@
 #include "coroutines/channel.hpp"
 
 #include "coroutines_io/base_pollable.hpp"
+#include "coroutines_io/file.hpp"
 
 #include <boost/asio/ip/tcp.hpp>
 #include <system_error>
+#include <vector>
 
 namespace coroutines {
 
@@ -29,18 +31,31 @@ public:
     tcp_socket(tcp_socket&&);
 
     tcp_socket(io_scheduler& srv, int get_fd, const endpoint_type& remote_endpoint);
+    tcp_socket(io_scheduler& srv, int get_fd, const endpoint_type& remote_endpoint, unsigned shard);
 
     ~tcp_socket() = default;
 
     void connect(const endpoint_type& endpoint);
 
+    // happy eyeballs (RFC 8305): endpoints are tried alternating address families, starting with the first one's.
+    // Next attempt starts when the previous one failed, or didn't succeed within ATTEMPT_DELAY_MS, they race.
+    // The first to connect wins, the others are aborted. Throws the last error if none succeeded
+    void connect(const std::vector<endpoint_type>& endpoints);
+
+    static constexpr unsigned ATTEMPT_DELAY_MS = 250;
+
     endpoint_type remote_endpoint() const { return _remote_endpoint; }
 
     void shutdown();
 
+    // sends part of the file with sendfile(2), the data is not copied to user memory. Until length, or EOF
+    std::size_t send_file(file& f, std::uint64_t offset, std::size_t length);
+
 private:
 
     void open(int address_family);
+    void connect_opened(const endpoint_type& endpoint);
+
     endpoint_type _remote_endpoint;
 
 };
@@ -0,0 +1,105 @@
+// Copyright (c) 2013 Maciej Gajewski
+#include "coroutines_io/udp_socket.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines_io/detail/endpoint.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <cassert>
+
+namespace coroutines {
+
+udp_socket::udp_socket(io_scheduler& srv)
+    : base_pollable(srv)
+{
+}
+
+udp_socket::udp_socket()
+    : base_pollable(get_io_scheduler_check())
+{
+}
+
+void udp_socket::open(int address_family)
+{
+    assert(!is_open());
+
+    int fd = ::socket(address_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw_errno("udp socket");
+
+    if (address_family == AF_INET6)
+    {
+        int zero = 0;
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    }
+    set_fd(fd);
+    _family = address_family;
+}
+
+void udp_socket::bind(const endpoint_type& endpoint)
+{
+    if (!is_open())
+        open(endpoint.protocol().family());
+
+    if (::bind(get_fd(), endpoint.data(), endpoint.size()) < 0)
+        throw_errno("udp bind");
+}
+
+udp_socket::endpoint_type udp_socket::local_endpoint() const
+{
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (::getsockname(get_fd(), (sockaddr*)&addr, &addr_len) < 0)
+        throw_errno("getsockname");
+
+    boost::asio::ip::tcp::endpoint e = detail::to_endpoint(addr, addr_len);
+    return endpoint_type(e.address(), e.port());
+}
+
+// MSG_DONTWAIT: never blocks the processor. With io_uring, readiness is waited for through the ring
+
+void udp_socket::send_to(const char* buf, std::size_t size, const endpoint_type& to)
+{
+    assert(is_open());
+
+    // IPv4 destination for dual-stack socket goes as v4-mapped
+    endpoint_type destination = to;
+    if (to.address().is_v4() && _family == AF_INET6)
+        destination = endpoint_type(boost::asio::ip::address_v6::v4_mapped(to.address().to_v4()), to.port());
+
+    for(;;)
+    {
+        ssize_t r = ::sendto(get_fd(), buf, size, MSG_DONTWAIT, destination.data(), destination.size());
+        if (r >= 0)
+            return;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_for_writable();
+        else
+            throw_errno("sendto");
+    }
+}
+
+std::size_t udp_socket::receive_from(char* buf, std::size_t size, endpoint_type& from)
+{
+    assert(is_open());
+
+    for(;;)
+    {
+        sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t r = ::recvfrom(get_fd(), buf, size, MSG_DONTWAIT, (sockaddr*)&addr, &addr_len);
+        if (r >= 0)
+        {
+            boost::asio::ip::tcp::endpoint e = detail::to_endpoint(addr, addr_len);
+            from = endpoint_type(e.address(), e.port());
+            return r;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_for_readable();
+        else
+            throw_errno("recvfrom");
+    }
+}
+
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef COROUTINES_IO_UDP_SOCKET_HPP
+#define COROUTINES_IO_UDP_SOCKET_HPP
+
+#include "coroutines_io/base_pollable.hpp"
+
+#include <boost/asio/ip/udp.hpp>
+
+namespace coroutines {
+
+class io_scheduler;
+
+// datagram socket
+class udp_socket : public base_pollable
+{
+public:
+
+    typedef boost::asio::ip::udp::endpoint endpoint_type;
+
+    udp_socket(io_scheduler& srv);
+    udp_socket(); // uses get_io_scheduler_check()
+    udp_socket(const udp_socket&) = delete;
+    udp_socket(udp_socket&&) = default;
+
+    // IPv6 socket is dual-stack, it can talk to IPv4 endpoints too
+    void open(int address_family);
+
+    void bind(const endpoint_type& endpoint);
+
+    endpoint_type local_endpoint() const;
+
+    // one datagram
+    void send_to(const char* buf, std::size_t size, const endpoint_type& to);
+
+    // parks until a datagram arrives, returns its size. Truncated if it doesn't fit
+    std::size_t receive_from(char* buf, std::size_t size, endpoint_type& from);
+
+private:
+
+    int _family = 0;
+};
+
+}
+
+#endif
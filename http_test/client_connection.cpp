@@ -3,10 +3,6 @@
 #include "coroutines_io/socket_streambuf.hpp"
 
 #include <iostream>
-#include <array>
-#include <algorithm>
-
-#include "Poco/Net/NetException.h"
 
 client_connection::client_connection(tcp_socket&& s, handler_type&& handler)
     : _socket(std::move(s))
@@ -14,37 +10,21 @@ client_connection::client_connection(tcp_socket&& s, handler_type&& handler)
 {
 }
 
-// case-insensitive comparison
-template<typename StringA, typename StringB>
-bool ci_equal(const StringA& a, const StringB& b)
-{
-    return std::equal(
-        std::begin(a), std::end(a), std::begin(b),
-        [](char ac, char bc) { return (ac & 0x1f) == (bc & 0x1f); }
-        );
-}
-
 void client_connection::start()
 {
     //std::cout << "HTTP: conenction from: " << _socket.remote_endpoint() << std::endl;
 
     try
     {
-        socket_istreambuf ibuf(_socket);
+        coroutines_io::input_buffer ibuf;
         socket_ostreambuf obuf(_socket);
-        std::istream istream(&ibuf);
         std::ostream ostream(&obuf);
 
         for(;;)
         {
-            http_request request(istream);
-            try
-            {
-                //std::cout << "HTTP: reading header..." << std::endl;
-                request.read_header();
-                //std::cout << "HTTP: header read OK" << std::endl;
-            }
-            catch(const Poco::Net::NoMessageException&)
+            // parsed where it was received, nothing is copied
+            http_request request;
+            if (!request.read_header(_socket, ibuf))
             {
                 //std::cout << "HTTP: no message" << std::endl;
                 return;
@@ -54,11 +34,11 @@ void client_connection::start()
 
             // honour HTTP 1.0 vs 1.1 and Connection: close
             bool keep_alive = false;
-            if (request.getVersion() == http_response::HTTP_1_1 && ci_equal(request.get("Connection", ""), "close"))
+            if (request.version() == http_request::HTTP_1_1 && !ci_equal(request.get("Connection"), "close"))
             {
                 keep_alive = true;
             }
-            else if (ci_equal(request.get("Connection", ""), "keep-alive"))
+            else if (ci_equal(request.get("Connection"), "keep-alive"))
             {
                 keep_alive = true;
             }
@@ -76,6 +56,7 @@ void client_connection::start()
             }
 
             _handler(request, response);
+            ibuf.consume(request.header_size());
 
             if (!keep_alive)
                 break;
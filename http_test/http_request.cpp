@@ -1,2 +1,74 @@
 #include "http_request.hpp"
 
+#include <stdexcept>
+
+const std::string http_request::HTTP_1_1 = "HTTP/1.1";
+
+static const std::string CRLF = "\r\n";
+static const std::string HEADER_END = "\r\n\r\n";
+
+static boost::string_ref trim(boost::string_ref s)
+{
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// up to the separator, which is skipped. All that's left if it's not there
+static boost::string_ref next_token(boost::string_ref& s, char separator)
+{
+    std::size_t pos = s.find(separator);
+    boost::string_ref token = s.substr(0, pos);
+    s.remove_prefix(pos == boost::string_ref::npos ? s.size() : pos + 1);
+    return token;
+}
+
+bool http_request::read_header(coroutines::base_pollable& socket, coroutines_io::input_buffer& buffer)
+{
+    _header_size = buffer.read_until(socket, HEADER_END);
+    if (_header_size == 0)
+    {
+        if (buffer.empty())
+            return false;
+        throw std::runtime_error("http_request: connection closed within header");
+    }
+
+    // without the final empty line
+    boost::string_ref header(buffer.data(), _header_size - CRLF.size());
+
+    boost::string_ref request_line = header.substr(0, header.find(CRLF));
+    header.remove_prefix(std::min(header.size(), request_line.size() + CRLF.size()));
+
+    _method = next_token(request_line, ' ');
+    _uri = next_token(request_line, ' ');
+    _version = request_line;
+    if (_method.empty() || _uri.empty() || _version.substr(0, 5) != "HTTP/")
+        throw std::runtime_error("http_request: bad request line");
+
+    _fields.clear();
+    while(!header.empty())
+    {
+        std::size_t eol = header.find(CRLF);
+        boost::string_ref line = header.substr(0, eol);
+        header.remove_prefix(eol == boost::string_ref::npos ? header.size() : eol + CRLF.size());
+
+        std::size_t colon = line.find(':');
+        if (colon == boost::string_ref::npos || colon == 0)
+            throw std::runtime_error("http_request: bad header field");
+        _fields.emplace_back(line.substr(0, colon), trim(line.substr(colon + 1)));
+    }
+
+    return true;
+}
+
+http_request::string_ref http_request::get(string_ref name, string_ref default_value) const
+{
+    for(const auto& field : _fields)
+    {
+        if (ci_equal(field.first, name))
+            return field.second;
+    }
+    return default_value;
+}
@@ -1,27 +1,53 @@
 #ifndef HTTP_REQUEST_HPP
 #define HTTP_REQUEST_HPP
 
-#include "Poco/Net/HTTPRequest.h"
+#include "coroutines_io/base_pollable.hpp"
+#include "coroutines_io/input_buffer.hpp"
 
-class http_request : public Poco::Net::HTTPRequest
+#include <boost/utility/string_ref.hpp>
+
+#include <vector>
+#include <utility>
+
+// case-insensitive comparison
+inline bool ci_equal(boost::string_ref a, boost::string_ref b)
+{
+    return a.size() == b.size() && std::equal(
+        a.begin(), a.end(), b.begin(),
+        [](char ac, char bc) { return (ac | 0x20) == (bc | 0x20); }
+        );
+}
+
+// request header, parsed in place: everything points into the connection's input buffer,
+// valid until the buffer is read from again. The body, if any, is left in the buffer
+class http_request
 {
 public:
-    http_request(std::istream& stream)
-    : _stream(stream)
-    {
-    }
 
-    void read_header()
-    {
-        read(_stream);
-    }
+    typedef boost::string_ref string_ref;
+
+    static const std::string HTTP_1_1;
+
+    // false on EOF before a request. Throws std::runtime_error on malformed header, std::length_error on too large
+    bool read_header(coroutines::base_pollable& socket, coroutines_io::input_buffer& buffer);
+
+    string_ref method() const { return _method; }
+    string_ref uri() const { return _uri; }
+    string_ref version() const { return _version; }
+
+    // value of the first field with the name, case-insensitive
+    string_ref get(string_ref name, string_ref default_value = string_ref()) const;
 
-    // stream for reading body
-    std::istream& stream() { return _stream; }
+    // request line and fields, with the empty line
+    std::size_t header_size() const { return _header_size; }
 
 private:
 
-    std::istream& _stream;
+    string_ref _method;
+    string_ref _uri;
+    string_ref _version;
+    std::vector<std::pair<string_ref, string_ref>> _fields;
+    std::size_t _header_size = 0;
 };
 
 #endif // HTTP_REQUEST_HPP
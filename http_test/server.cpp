@@ -6,7 +6,7 @@
 
 #include "coroutines_io/globals.hpp"
 #include "coroutines_io/io_scheduler.hpp"
-#include "coroutines_io/tcp_acceptor.hpp"
+#include "coroutines_io/tcp_listener.hpp"
 
 #include "client_connection.hpp"
 
@@ -32,27 +32,6 @@ void start_client_connection(tcp_socket& sock)
     c.start();
 }
 
-void server()
-{
-    try
-    {
-        tcp_acceptor acc;
-        acc.listen(tcp::endpoint(address_v4::any(), 8080));
-
-        std::cout << "Server accepting connections" << std::endl;
-        for(;;)
-        {
-            tcp_socket sock = acc.accept();
-            //std::cout << "HTTP: connection accepted" << std::endl;
-            go("client connection", start_client_connection, std::move(sock));
-        }
-    }
-    catch(const std::exception& e)
-    {
-        std::cerr << "server error: " << e.what() << std::endl;
-    }
-}
-
 void signal_handler(int)
 {
     CORO_PROF_DUMP();
@@ -62,15 +41,29 @@ void signal_handler(int)
 int main(int argc, char** argv)
 {
     signal(SIGINT, signal_handler);
+    CORO_PROF_DUMP_ON_SIGNAL(SIGUSR2); // flight recorder, when configured
+
+    static const unsigned PROCESSORS = 4;
 
-    scheduler sched(4);
-    io_scheduler io_sched(sched);
+    scheduler sched(PROCESSORS);
+    io_scheduler io_sched(sched, PROCESSORS); // shard per processor
     set_scheduler(&sched);
     set_io_scheduler(&io_sched);
 
     io_sched.start();
 
-    go("acceptor", server);
+    // SO_REUSEPORT acceptor and accept loop per processor
+    tcp_listener listener;
+    try
+    {
+        listener.listen(tcp::endpoint(address_v4::any(), 8080), start_client_connection);
+        std::cout << "Server accepting connections" << std::endl;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "server error: " << e.what() << std::endl;
+        listener.stop();
+    }
 
     sched.wait();
 }
@@ -1,60 +1,90 @@
 // Copyright (c) 2013 Maciej Gajewski
 #include "profiling/profiling.hpp"
 
+#include "profiling/trace_format.hpp"
+
 #include <iostream>
-#include <forward_list>
-#include <list>
+#include <deque>
 #include <cstring>
+#include <cmath>
 #include <thread>
 #include <fstream>
 #include <vector>
+#include <string>
 #include <chrono>
 #include <algorithm>
-#include <sstream>
+#include <unordered_map>
+#include <limits>
 #include <mutex>
-#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <system_error>
 
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
 
 namespace profiling {
 
-static const unsigned DATA_SIZE = 64;
+using trace_format::record;
 
 static std::uint64_t __sys_tv_sec_base = 0;
 static std::uint64_t __clock_base; // first-ever tcs call
 static double __ticks_per_ns = 0.0;
 
-struct record
-{
-    std::int64_t time;
-    std::thread::id thread_id;
-    const char* object_type;
-    void* object_id;
-    std::uint32_t ordinal = 0;
-    const char* event;
-    char data[DATA_SIZE];
+static const unsigned BLOCK_SIZE = 4096; // records
+static const unsigned MAX_QUEUED_BLOCKS = 256; // waiting for the disk, records are dropped above that
+static const char* PROFILING_FILE_NAME = "profiling_data.bin";
 
-    void write(std::ostream& stream, std::uint64_t time_ns);
+// interned first, their ids are known
+static const std::uint16_t COROUTINE_NAME = 1;
+static const std::uint16_t ENTER_NAME = 2;
+static const std::uint16_t EXIT_NAME = 3;
+
+// settings, read by the recording threads
+std::atomic<bool> __enabled(true);
+static std::atomic<int> __mode(int(mode::trace));
+static std::atomic<unsigned> __categories(CATEGORY_ALL);
+static std::atomic<unsigned> __sample_one_in(1);
+static std::atomic<std::size_t> __ring_records(settings().ring_records);
+
+// records of one thread, filled by it, then written by the flusher
+struct block
+{
+    std::uint32_t thread;
+    std::atomic<std::uint32_t> count; // published after the record is written, finish_trace() reads the block being filled
+    std::int64_t base_ticks;
+    std::int64_t last_ticks;
+    record records[BLOCK_SIZE];
 };
 
-void record::write(std::ostream& stream, std::uint64_t time_ns)
+// flight recorder of one thread. Written by it only, read by dumps at any time
+struct ring
 {
-    stream << time_ns << "," << time << "," << std::hash<std::thread::id>()(thread_id) << "," << object_type << "," << (std::uintptr_t)object_id << "," << ordinal << "," << event << "," << data << "\n";
-}
+    struct entry
+    {
+        std::int64_t ticks;
+        record r;
+    };
+
+    explicit ring(std::size_t size) : entries(size), head(0) { }
 
-static unsigned BLOCK_SIZE = 1000;
-static const char* PROFILING_FILE_NAME = "profiling_data.csv";
+    std::vector<entry> entries;
+    std::atomic<std::uint64_t> head; // records ever written, the next one goes to head % size
+};
 
 struct per_thread_data
 {
-    std::forward_list<record*> blocks;
-    unsigned counter = 0;
+    std::uint32_t index;
     std::thread::id thread_id;
     // tsc<->sys time relation. time from both clocks taken at the same time
-    std::uint64_t sys_ns;
-    std::uint64_t tsc_ticks;
+    std::int64_t sys_ns;
+    std::int64_t tsc_ticks;
+
+    block* current = nullptr; // changed under global_profiling_data's mutex
+    std::shared_ptr<ring> flight; // created with the thread's first flight recorder record, recycled when it exits
 };
 
 // returns tsc, in ticks. Takes 30-40 ticks
@@ -80,11 +110,31 @@ static std::int64_t get_systime()
 // returns ticks per nanosecond
 static double calibrate_clock();
 
+static unsigned category_of(const std::string& object_type)
+{
+    if (object_type == "coroutine")
+        return CATEGORY_COROUTINE;
+    if (object_type == "processor")
+        return CATEGORY_PROCESSOR;
+    if (object_type == "monitor")
+        return CATEGORY_MONITOR;
+    if (object_type == "spinlock" || object_type == "rw_spinlock")
+        return CATEGORY_SPINLOCK;
+    return CATEGORY_OTHER;
+}
+
+struct interned_name
+{
+    std::uint16_t id;
+    unsigned category; // if it's an object type
+};
+
+// owns the trace file. Full blocks are queued by the threads, and written by the flusher thread while the program runs.
+// Interned strings and threads are written before the first block that could use them.
+// Flight recorder dumps go to files of their own, with everything interned so far
 class global_profiling_data
 {
 public:
-    typedef std::forward_list<record*> block_list; // needs to be fast and simple
-    typedef std::list<per_thread_data> block_list_list; // modified once per thread, we can have some sophistication
 
     global_profiling_data()
     {
@@ -94,31 +144,173 @@ public:
         timespec ts;
         clock_gettime(CLOCK_MONOTONIC, &ts);
         __sys_tv_sec_base = ts.tv_sec;
+
+        intern_name("coroutine");
+        intern_name("enter");
+        intern_name("exit");
+
+        _flusher = std::thread([this]() { flush_loop(); });
+    }
+
+    ~global_profiling_data()
+    {
+        finish_trace();
     }
 
     // caled when thred instrumentation is created, in the thread
-    per_thread_data* get_per_thread_data()
+    per_thread_data* register_thread()
     {
-        std::lock_guard<std::mutex> lock(_block_list_mutex);
-        _block_lists.emplace_front();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _threads.emplace_back();
+        per_thread_data& data = _threads.back();
+        data.index = _threads.size() - 1;
+        data.thread_id = std::this_thread::get_id();
 
         // stick this thread to a core
         stick_to_core(_core++);
 
-        return &_block_lists.front();
+        // tsc <-> sys relation in this thread
+        std::int64_t sys1 = get_systime();
+        data.tsc_ticks = get_tsc() - __clock_base;
+        std::int64_t sys2 = get_systime();
+        data.sys_ns = (sys1+sys2)/2;
+
+        data.current = new_block(data, data.tsc_ticks);
+        return &data;
     }
 
-    void dump();
+    // queues the current block, unless empty, returns the next one
+    block* exchange(per_thread_data& thread, std::int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        queue(thread.current);
+        thread.current = new_block(thread, now);
+        return thread.current;
+    }
 
-    ~global_profiling_data()
+    // thread exits, its records are left out of the flight recorder dumps from now on
+    void release(per_thread_data& thread)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        queue(thread.current);
+        thread.current = nullptr;
+        if (thread.flight)
+            _free_rings.push_back(std::move(thread.flight));
+    }
+
+    ring& create_ring(per_thread_data& thread)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::size_t size = std::max<std::size_t>(__ring_records, 1);
+
+        // one of an exited thread, unless a dump still reads it or the size has changed. Those are freed
+        while(!_free_rings.empty() && !thread.flight)
+        {
+            std::shared_ptr<ring> r = std::move(_free_rings.back());
+            _free_rings.pop_back();
+            if (r.use_count() == 1 && r->entries.size() == size)
+            {
+                r->head.store(0, std::memory_order_relaxed);
+                thread.flight = std::move(r);
+            }
+        }
+        if (!thread.flight)
+            thread.flight = std::make_shared<ring>(size);
+        return *thread.flight;
+    }
+
+    interned_name intern_name(const char* name)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _names.find(name);
+        if (it != _names.end())
+            return it->second;
+
+        if (_name_list.size() == std::numeric_limits<std::uint16_t>::max())
+            return interned_name{ 0, CATEGORY_OTHER }; // out of ids, shown as empty
+
+        interned_name interned{ std::uint16_t(_name_list.size() + 1), category_of(name) };
+        _names.emplace(name, interned);
+        _name_list.push_back(name);
+        return interned;
+    }
+
+    std::uint32_t intern_data(const char* data)
     {
-        dump();
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _data.find(data);
+        if (it != _data.end())
+            return it->second;
+
+        std::uint32_t id = _data_list.size() + 1;
+        _data.emplace(data, id);
+        _data_list.push_back(data);
+        return id;
     }
 
-    std::int64_t sys_tv_sec_base;
+    // stops the flusher, writes what's left, partially filled blocks of running threads too.
+    // Records after that are dropped
+    void finish_trace();
+
+    std::string dump_flight_recorder(const std::string& file_name);
 
 private:
 
+    typedef std::vector<std::pair<std::uint32_t, std::string>> string_list;
+
+    // under the mutex
+    void queue(block* b)
+    {
+        if (!b)
+            return;
+        if (b->count == 0 || _dumped || _queue.size() >= MAX_QUEUED_BLOCKS)
+        {
+            if (!_dumped)
+                _dropped += b->count;
+            _free.push_back(b);
+        }
+        else
+        {
+            _queue.push_back(b);
+            _cv.notify_one();
+        }
+    }
+
+    // under the mutex
+    block* new_block(const per_thread_data& thread, std::int64_t now)
+    {
+        block* b;
+        if (_free.empty())
+        {
+            b = new block;
+        }
+        else
+        {
+            b = _free.back();
+            _free.pop_back();
+        }
+        b->thread = thread.index;
+        b->count = 0;
+        b->base_ticks = b->last_ticks = now;
+        return b;
+    }
+
+    void flush_loop();
+
+    // strings and threads added since the last call. Under the mutex
+    void take_new(string_list& names, string_list& data, std::vector<trace_format::thread_chunk>& threads);
+    void take_strings(const std::vector<std::string>& all, std::size_t& taken, string_list& out);
+    void take_threads(std::size_t& taken, std::vector<trace_format::thread_chunk>& out);
+
+    // the trace file is created with the first write
+    std::ostream& trace_file();
+
+    static void write_header(std::ostream& out);
+    static void write_strings(std::ostream& out, trace_format::chunk_type type, const string_list& strings);
+    static void write_threads(std::ostream& out, const std::vector<trace_format::thread_chunk>& threads);
+    static void write_block(std::ostream& out, const block& b, std::uint32_t count);
+    static void write_chunk(std::ostream& out, trace_format::chunk_type type, const void* head, std::size_t head_size, const void* body, std::size_t body_size);
+
     void stick_to_core(int core)
     {
         int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
@@ -132,64 +324,168 @@ private:
         pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
     }
 
-
-    block_list_list _block_lists;
-    std::mutex _block_list_mutex;
+    std::mutex _mutex; // protects all but the file
+    std::condition_variable _cv;
+    std::deque<per_thread_data> _threads; // never moved
+    std::unordered_map<std::string, interned_name> _names;
+    std::unordered_map<std::string, std::uint32_t> _data;
+    std::vector<std::string> _name_list; // by id - 1
+    std::vector<std::string> _data_list;
+    std::size_t _threads_written = 0; // to the trace
+    std::size_t _names_written = 0;
+    std::size_t _data_written = 0;
+    std::deque<block*> _queue;
+    std::vector<block*> _free;
+    std::vector<std::shared_ptr<ring>> _free_rings; // of exited threads
+    bool _dumped = false;
+    std::uint64_t _dropped = 0;
     int _core = 0;
+
+    std::ofstream _file; // the flusher's, then finish_trace()'s
+    std::uint64_t _written = 0;
+    std::thread _flusher;
 };
 
 static global_profiling_data __global_profiling_data;
-thread_local std::thread::id __thread_id;
 
+// per-thread instrumentation, created by the thread's first event
 class profiling_data
 {
 public:
 
     profiling_data()
     {
-        __thread_id = std::this_thread::get_id();
-        _data = __global_profiling_data.get_per_thread_data();
-        _data->thread_id = __thread_id;
-
-        record* block = new record[BLOCK_SIZE];
-        _data->blocks.push_front(block);
-
-        // tsc <-> sys relation in this thread
-        std::int64_t sys1 = get_systime();
-        _data->tsc_ticks = get_tsc() - __clock_base;
-        std::int64_t sys2 = get_systime();
-        _data->sys_ns = (sys1+sys2)/2;
+        _data = __global_profiling_data.register_thread();
+        std::memset(_name_cache, 0, sizeof(_name_cache));
     }
 
     ~profiling_data()
     {
         // this is a good place to put any code that should be executed when thread finishes
+        __global_profiling_data.release(*_data);
+    }
+
+    // the record is seen by finish_trace() after commit()
+    record* get_next(std::int64_t now)
+    {
+        block* b = _data->current;
+        std::uint32_t count = b->count.load(std::memory_order_relaxed);
+        std::int64_t delta = now - b->last_ticks;
+        if (count == BLOCK_SIZE || delta < 0 || delta > std::numeric_limits<std::uint32_t>::max())
+        {
+            // a new block starts with absolute time
+            b = __global_profiling_data.exchange(*_data, now);
+            count = 0;
+            delta = 0;
+        }
+        b->last_ticks = now;
+
+        record* r = b->records + count;
+        r->delta_ticks = delta;
+        return r;
+    }
+
+    void commit()
+    {
+        block* b = _data->current;
+        b->count.store(b->count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // the record is seen by dumps after ring_commit()
+    record* ring_next(std::int64_t now)
+    {
+        ring& rg = _data->flight ? *_data->flight : __global_profiling_data.create_ring(*_data);
+        _ring_position = rg.head.load(std::memory_order_relaxed);
+        ring::entry& e = rg.entries[_ring_position % rg.entries.size()];
+        e.ticks = now;
+        e.r.delta_ticks = 0;
+        return &e.r;
+    }
+
+    void ring_commit()
+    {
+        _data->flight->head.store(_ring_position + 1, std::memory_order_release);
+    }
+
+    // false for events of the coroutine sessions left out
+    bool sampled(std::uint16_t object_type, std::uint16_t event)
+    {
+        if (object_type == COROUTINE_NAME && event == ENTER_NAME)
+        {
+            unsigned one_in = __sample_one_in.load(std::memory_order_relaxed);
+            _skipping = one_in > 1 && (_sessions++ % one_in) != 0;
+            return !_skipping;
+        }
+        if (object_type == COROUTINE_NAME && event == EXIT_NAME && _skipping)
+        {
+            _skipping = false;
+            return false;
+        }
+        return !_skipping;
     }
 
-    record* get_next()
+    // object types and events are literals, looked up by address first
+    const interned_name& name(const char* name)
     {
-        if (_data->counter < BLOCK_SIZE)
+        name_cache_entry& entry = _name_cache[(reinterpret_cast<std::uintptr_t>(name) >> 3) % NAME_CACHE_SIZE];
+        if (entry.name != name)
         {
-            return _data->blocks.front() + _data->counter++;
+            entry.name = name;
+            entry.interned = __global_profiling_data.intern_name(name);
+        }
+        return entry.interned;
+    }
+
+    // data is mostly coroutine names, kept by the coroutines. Looked up by address first, verified by contents:
+    // the address may be reused for another string
+    std::uint32_t data_id(const char* data)
+    {
+        data_cache_entry& entry = _data_cache[(reinterpret_cast<std::uintptr_t>(data) >> 3) % DATA_CACHE_SIZE];
+        if (entry.data == data && entry.value == data)
+            return entry.id;
+
+        entry.data = data;
+        entry.value = data; // reuses the capacity
+        auto it = _data_ids.find(entry.value);
+        if (it != _data_ids.end())
+        {
+            entry.id = it->second;
         }
         else
         {
-            // need to allocate another one
-            record* block = new record[BLOCK_SIZE];
-            block[0].thread_id = __thread_id;
-            block[0].time = get_tsc() - __clock_base;
-            block[0].object_type = "profiler";
-            block[0].object_id = this;
-            block[0].event = "new block";
-
-            _data->blocks.push_front(block);
-            _data->counter = 2;
-            return block + 1;
+            entry.id = __global_profiling_data.intern_data(data);
+            _data_ids.emplace(entry.value, entry.id);
         }
+        return entry.id;
     }
 
 private:
+
+    static const unsigned NAME_CACHE_SIZE = 256;
+    static const unsigned DATA_CACHE_SIZE = 64;
+
+    struct name_cache_entry
+    {
+        const char* name;
+        interned_name interned;
+    };
+
     per_thread_data* _data;
+    name_cache_entry _name_cache[NAME_CACHE_SIZE];
+
+    struct data_cache_entry
+    {
+        const char* data = nullptr;
+        std::string value;
+        std::uint32_t id = 0;
+    };
+
+    data_cache_entry _data_cache[DATA_CACHE_SIZE];
+    std::unordered_map<std::string, std::uint32_t> _data_ids;
+
+    std::uint64_t _ring_position = 0;
+    bool _skipping = false; // in a session not sampled
+    std::uint32_t _sessions = 0;
 };
 
 thread_local profiling_data __profiling_data;
@@ -198,87 +494,352 @@ void profiling_event(const char* object_type, void* object_id, const char* event
 {
     // this is hotpath!
 
-    record* r = __profiling_data.get_next();
+    profiling_data& thread_data = __profiling_data;
+    interned_name type = thread_data.name(object_type); // a copy, the event may take its cache slot
+    std::uint16_t event_id = thread_data.name(event).id;
+    if (!thread_data.sampled(type.id, event_id) || !(type.category & __categories.load(std::memory_order_relaxed)))
+        return;
+
+    std::int64_t now = get_tsc() - __clock_base;
+    bool flight = __mode.load(std::memory_order_relaxed) == int(mode::flight_recorder);
+    record* r = flight ? thread_data.ring_next(now) : thread_data.get_next(now);
 
-    r->thread_id = __thread_id;
-    r->time = get_tsc() - __clock_base;
-    r->object_type = object_type;
-    r->object_id = object_id;
     r->ordinal = ordinal;
-    r->event = event;
-    if (data)
-        std::strncpy(r->data, data, DATA_SIZE-1);
+    r->object_type = type.id;
+    r->event = event_id;
+    r->data = (data && *data) ? thread_data.data_id(data) : 0;
+    r->object_id = reinterpret_cast<std::uintptr_t>(object_id);
+
+    if (flight)
+        thread_data.ring_commit();
     else
-        r->data[0] = 0;
+        thread_data.commit();
+}
+
+void configure(const settings& s)
+{
+    __mode.store(int(s.mode));
+    __categories.store(s.categories);
+    __sample_one_in.store(std::max(s.sample_one_in, 1u));
+    __ring_records.store(std::max<std::size_t>(s.ring_records, 1));
+    __enabled.store(s.mode != mode::off);
+}
+
+settings get_settings()
+{
+    settings s;
+    s.mode = mode(__mode.load());
+    s.categories = __categories.load();
+    s.sample_one_in = __sample_one_in.load();
+    s.ring_records = __ring_records.load();
+    return s;
 }
 
 void dump()
 {
-    __global_profiling_data.dump();
+    if (__mode.load() == int(mode::flight_recorder))
+        __global_profiling_data.dump_flight_recorder(std::string());
+    else
+        __global_profiling_data.finish_trace();
 }
 
-// tick->ns converter
-class tsc_to_ns_functor
+std::string dump_flight_recorder(const std::string& file_name)
 {
-public:
+    return __global_profiling_data.dump_flight_recorder(file_name);
+}
 
-    // sys_ns and tcs are clock values taken at the same time
-    tsc_to_ns_functor(double ticks_per_ns, std::int64_t calib_sys_ns, std::int64_t calib_tcs)
+static int __dump_signal_pipe[2] = { -1, -1 };
+
+static void on_dump_signal(int)
+{
+    // async-signal-safe: the dumping thread is woken up
+    char c = 0;
+    ssize_t r = ::write(__dump_signal_pipe[1], &c, 1);
+    (void)r;
+}
+
+void dump_on_signal(int signal)
+{
+    static std::once_flag started;
+    std::call_once(started, []()
+    {
+        if (::pipe2(__dump_signal_pipe, O_CLOEXEC) < 0)
+            throw std::system_error(errno, std::system_category(), "dump_on_signal: pipe");
+
+        std::thread([]()
+        {
+            for(;;)
+            {
+                char c;
+                ssize_t r = ::read(__dump_signal_pipe[0], &c, 1);
+                if (r > 0)
+                    dump_flight_recorder();
+                else if (r < 0 && errno == EINTR)
+                    continue;
+                else
+                    return;
+            }
+        }).detach();
+    });
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = on_dump_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (::sigaction(signal, &action, nullptr) < 0)
+        throw std::system_error(errno, std::system_category(), "dump_on_signal: sigaction");
+}
+
+void global_profiling_data::flush_loop()
+{
+    string_list names;
+    string_list data;
+    std::vector<trace_format::thread_chunk> threads;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(;;)
     {
-        _ticks_per_ns = ticks_per_ns;
-        _ns_shift = calib_sys_ns - calib_tcs/ticks_per_ns;
+        if (_queue.empty())
+        {
+            if (_dumped)
+                return;
+            _cv.wait(lock);
+            continue;
+        }
+
+        block* b = _queue.front();
+        _queue.pop_front();
+        take_new(names, data, threads);
+
+        lock.unlock();
+        std::ostream& out = trace_file();
+        write_strings(out, trace_format::CHUNK_NAME, names);
+        write_strings(out, trace_format::CHUNK_DATA, data);
+        write_threads(out, threads);
+        write_block(out, *b, b->count);
+        _written += b->count;
+        lock.lock();
+
+        _free.push_back(b);
     }
+}
+
+void global_profiling_data::take_strings(const std::vector<std::string>& all, std::size_t& taken, string_list& out)
+{
+    out.clear();
+    for(; taken < all.size(); taken++)
+        out.emplace_back(taken + 1, all[taken]);
+}
 
-    // returns time in ns
-    std::int64_t operator()(std::int64_t tcs) const
+void global_profiling_data::take_threads(std::size_t& taken, std::vector<trace_format::thread_chunk>& out)
+{
+    out.clear();
+    for(; taken < _threads.size(); taken++)
     {
-        return tcs/_ticks_per_ns + _ns_shift;
+        const per_thread_data& t = _threads[taken];
+        trace_format::thread_chunk chunk;
+        chunk.thread = t.index;
+        chunk.reserved = 0;
+        chunk.thread_id = std::hash<std::thread::id>()(t.thread_id);
+        chunk.sys_ns = t.sys_ns;
+        chunk.ticks = t.tsc_ticks;
+        out.push_back(chunk);
     }
+}
 
-private:
-    double _ticks_per_ns;
-    std::int64_t _ns_shift;
-};
+void global_profiling_data::take_new(string_list& names, string_list& data, std::vector<trace_format::thread_chunk>& threads)
+{
+    take_strings(_name_list, _names_written, names);
+    take_strings(_data_list, _data_written, data);
+    take_threads(_threads_written, threads);
+}
 
-void global_profiling_data::dump()
+std::ostream& global_profiling_data::trace_file()
 {
-    std::cerr << "dumping profiling data to... " << PROFILING_FILE_NAME << std::endl;
-    try
+    if (!_file.is_open())
     {
-        std::ofstream file(PROFILING_FILE_NAME, std::ios_base::out | std::ios_base::trunc);
+        _file.open(PROFILING_FILE_NAME, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+        write_header(_file);
+    }
+    return _file;
+}
 
-        unsigned counter = 0;
+void global_profiling_data::write_header(std::ostream& out)
+{
+    trace_format::file_header header;
+    std::memcpy(header.magic, trace_format::MAGIC, sizeof(header.magic));
+    header.version = trace_format::VERSION;
+    header.reserved = 0;
+    header.ticks_per_ns = __ticks_per_ns;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
 
-        // store the earliest clock calibration event
-        std::int64_t min_sys_ns = _block_lists.back().sys_ns;
+void global_profiling_data::write_strings(std::ostream& out, trace_format::chunk_type type, const string_list& strings)
+{
+    for(const auto& s : strings)
+    {
+        trace_format::string_chunk chunk;
+        chunk.id = s.first;
+        write_chunk(out, type, &chunk, sizeof(chunk), s.second.data(), s.second.size());
+    }
+}
 
-        for(per_thread_data& thread_data : _block_lists)
-        {
+void global_profiling_data::write_threads(std::ostream& out, const std::vector<trace_format::thread_chunk>& threads)
+{
+    for(const trace_format::thread_chunk& t : threads)
+        write_chunk(out, trace_format::CHUNK_THREAD, &t, sizeof(t), nullptr, 0);
+}
 
-            tsc_to_ns_functor tcs_to_ns(__ticks_per_ns, thread_data.sys_ns - min_sys_ns, thread_data.tsc_ticks);
+void global_profiling_data::write_block(std::ostream& out, const block& b, std::uint32_t count)
+{
+    trace_format::block_chunk chunk;
+    chunk.thread = b.thread;
+    chunk.count = count;
+    chunk.base_ticks = b.base_ticks;
+    write_chunk(out, trace_format::CHUNK_BLOCK, &chunk, sizeof(chunk), b.records, count * sizeof(record));
+}
 
-            unsigned records = thread_data.counter; // only valid for the first block
-            for(record* block : thread_data.blocks)
-            {
-                // write records
-                for(unsigned i = 0; i < records; i++)
-                {
-                    block[i].write(file, tcs_to_ns(block[i].time));
-                    counter ++;
-                }
-                // all subsequent blocks are fully utilized
-                records = BLOCK_SIZE;
-            }
-        }
+void global_profiling_data::write_chunk(std::ostream& out, trace_format::chunk_type type, const void* head, std::size_t head_size, const void* body, std::size_t body_size)
+{
+    trace_format::chunk_header header;
+    header.type = type;
+    header.size = head_size + body_size;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(head), head_size);
+    if (body_size > 0)
+        out.write(reinterpret_cast<const char*>(body), body_size);
+}
 
-        file.close();
+void global_profiling_data::finish_trace()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_dumped)
+            return;
+        _dumped = true;
+        _cv.notify_one();
+    }
+    _flusher.join();
+
+    // the flusher is gone, the file is written here now
+    std::lock_guard<std::mutex> lock(_mutex);
 
-        std::cerr << "dumping profiling data completed, " << counter << " records written" << std::endl;
+    // threads still running: their records committed up to now. They go on filling the blocks past that,
+    // and can't exchange them until the mutex is released
+    std::vector<std::pair<const block*, std::uint32_t>> rest;
+    for(block* b : _queue)
+        rest.emplace_back(b, b->count.load());
+    for(per_thread_data& t : _threads)
+    {
+        std::uint32_t count = t.current ? t.current->count.load(std::memory_order_acquire) : 0;
+        if (count > 0)
+            rest.emplace_back(t.current, count);
     }
-    catch(const std::exception& e)
+    if (rest.empty() && !_file.is_open())
+        return; // nothing traced
+
+    std::cerr << "writing the rest of profiling data to... " << PROFILING_FILE_NAME << std::endl;
+
+    string_list names;
+    string_list data;
+    std::vector<trace_format::thread_chunk> threads;
+    take_new(names, data, threads);
+    std::ostream& out = trace_file();
+    write_strings(out, trace_format::CHUNK_NAME, names);
+    write_strings(out, trace_format::CHUNK_DATA, data);
+    write_threads(out, threads);
+    for(const auto& b : rest)
     {
-        std::cerr << "Error dumping profiling data: " << e.what() << std::endl;
+        write_block(out, *b.first, b.second);
+        _written += b.second;
     }
+    _file.close();
+
+    std::cerr << "profiling data completed, " << _written << " records written";
+    if (_dropped)
+        std::cerr << ", " << _dropped << " dropped, the disk was too slow";
+    std::cerr << std::endl;
+}
+
+std::string global_profiling_data::dump_flight_recorder(const std::string& file_name)
+{
+    static std::atomic<unsigned> dumps(0);
+
+    std::string name = file_name;
+    if (name.empty())
+        name = "profiling_flight_" + std::to_string(::getpid()) + "_" + std::to_string(dumps++) + ".bin";
+
+    // everything interned so far. Rings are read after unlocking, they aren't recycled while shared with the dump
+    string_list names;
+    string_list data;
+    std::vector<trace_format::thread_chunk> threads;
+    std::vector<std::pair<std::uint32_t, std::shared_ptr<ring>>> rings;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::size_t all_names = 0;
+        std::size_t all_data = 0;
+        std::size_t all_threads = 0;
+        take_strings(_name_list, all_names, names);
+        take_strings(_data_list, all_data, data);
+        take_threads(all_threads, threads);
+
+        for(per_thread_data& t : _threads)
+        {
+            if (t.flight)
+                rings.emplace_back(t.index, t.flight);
+        }
+    }
+
+    std::ofstream out(name, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+    write_header(out);
+    write_strings(out, trace_format::CHUNK_NAME, names);
+    write_strings(out, trace_format::CHUNK_DATA, data);
+    write_threads(out, threads);
+
+    std::unique_ptr<block> b(new block);
+    std::uint64_t total = 0;
+    for(const auto& r : rings)
+    {
+        ring& rg = *r.second;
+        std::uint64_t size = rg.entries.size();
+
+        // the oldest ones may be overwritten while copied, those are left out
+        std::uint64_t head = rg.head.load(std::memory_order_acquire);
+        std::vector<ring::entry> copy;
+        std::uint64_t first = head > size ? head - size : 0;
+        for(std::uint64_t i = first; i < head; i++)
+            copy.push_back(rg.entries[i % size]);
+        std::uint64_t head_after = rg.head.load(std::memory_order_acquire);
+        std::uint64_t safe = head_after + 1 > size ? head_after + 1 - size : 0;
+
+        b->thread = r.first;
+        b->count = 0;
+        for(std::uint64_t i = std::max(first, safe); i < head; i++)
+        {
+            const ring::entry& e = copy[i - first];
+            std::int64_t delta = e.ticks - b->last_ticks;
+            if (b->count == BLOCK_SIZE || b->count == 0 || delta < 0 || delta > std::numeric_limits<std::uint32_t>::max())
+            {
+                if (b->count > 0)
+                    write_block(out, *b, b->count);
+                b->count = 0;
+                b->base_ticks = e.ticks;
+                delta = 0;
+            }
+            b->last_ticks = e.ticks;
+            b->records[b->count] = e.r;
+            b->records[b->count].delta_ticks = delta;
+            b->count++;
+            total++;
+        }
+        if (b->count > 0)
+            write_block(out, *b, b->count);
+    }
+    out.close();
+
+    std::cerr << "flight recorder dumped to " << name << ", " << total << " records" << std::endl;
+    return name;
 }
 
 
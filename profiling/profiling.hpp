@@ -3,28 +3,77 @@
 #define PROFILING_PROFILING_HPP
 
 #include <atomic>
+#include <string>
 #include <cstdint>
+#include <cstddef>
 
 namespace profiling {
 
+enum class mode
+{
+    off,
+    trace,          // every record streamed to profiling_data.bin
+    flight_recorder // the last records of each thread kept in a ring, written on demand
+};
+
+// by object type
+enum category : unsigned
+{
+    CATEGORY_COROUTINE = 1,
+    CATEGORY_PROCESSOR = 2,
+    CATEGORY_MONITOR = 4,
+    CATEGORY_SPINLOCK = 8,
+    CATEGORY_OTHER = 16,
+    CATEGORY_ALL = 31
+};
+
+struct settings
+{
+    profiling::mode mode = profiling::mode::trace;
+    unsigned categories = CATEGORY_ALL;
+    unsigned sample_one_in = 1; // coroutine sessions recorded: enter, exit and what the thread records in between
+    std::size_t ring_records = 64*1024; // per thread, for rings created after the change
+};
+
+// can be changed at any time, from any thread
+void configure(const settings& s);
+settings get_settings();
+
 void profiling_event(const char* object_type, void* object_id, const char* event, std::uint32_t ordinal, const char* data);
 inline void profiling_event(const char* object_type, void* object_id, const char* event, const char* data = nullptr)
 {
     profiling_event(object_type, object_id, event, 0, data);
 }
 
+// trace: writes the rest and closes the file, nothing is recorded after. Flight recorder: dump_flight_recorder()
 void dump();
 
+// writes what the rings hold, oldest first, in the trace format. Recording goes on. Returns the file name
+std::string dump_flight_recorder(const std::string& file_name = std::string());
+
+// the signal makes a thread of the profiler call dump_flight_recorder()
+void dump_on_signal(int signal);
+
+extern std::atomic<bool> __enabled;
+
+// all that's left at the call sites when profiling is off
+inline bool enabled()
+{
+    return __builtin_expect(__enabled.load(std::memory_order_relaxed), false);
+}
+
 }
 
 #ifdef COROUTINES_PROFILING
-#define CORO_PROF profiling::profiling_event
+#define CORO_PROF(...) if (!profiling::enabled()) {} else profiling::profiling_event(__VA_ARGS__)
 #define CORO_PROF_DUMP profiling::dump
+#define CORO_PROF_DUMP_ON_SIGNAL profiling::dump_on_signal
 #define CORO_PROF_DECLARE_COUNTER(name) static std::atomic<std::uint32_t> __coro_prof_counter ## name;
 #define CORO_PROF_COUNTER(name) __coro_prof_counter ## name ++;
 #else
 #define CORO_PROF(...);
 #define CORO_PROF_DUMP();
+#define CORO_PROF_DUMP_ON_SIGNAL(signal);
 #define CORO_PROF_DECLARE_COUNTER(name);
 #define CORO_PROF_COUNTER(name)
 #endif
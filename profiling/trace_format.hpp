@@ -0,0 +1,73 @@
+// Copyright (c) 2013 Maciej Gajewski
+#ifndef PROFILING_TRACE_FORMAT_HPP
+#define PROFILING_TRACE_FORMAT_HPP
+
+#include <cstdint>
+
+// binary trace written by the profiler, read by profiling_reader.
+// file_header, then chunks, each starting with chunk_header. Native byte order and layout, read where it was written.
+// Object types and events are interned as names, data strings separately; a string's chunk comes before the first block using it.
+// Records of a block are from one thread, each one's time is the delta from the previous one, in TSC ticks
+namespace profiling { namespace trace_format {
+
+static const char MAGIC[8] = { 'C', 'O', 'R', 'O', 'P', 'R', 'O', 'F' };
+static const std::uint32_t VERSION = 1;
+
+struct file_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    double ticks_per_ns;
+};
+
+enum chunk_type : std::uint32_t
+{
+    CHUNK_NAME = 1,     // string_chunk, then the characters
+    CHUNK_DATA = 2,     // string_chunk, then the characters
+    CHUNK_THREAD = 3,   // thread_chunk
+    CHUNK_BLOCK = 4     // block_chunk, then the records
+};
+
+struct chunk_header
+{
+    std::uint32_t type;
+    std::uint32_t size; // what follows
+};
+
+struct string_chunk
+{
+    std::uint32_t id;
+};
+
+struct thread_chunk
+{
+    std::uint32_t thread;       // used by the blocks
+    std::uint32_t reserved;
+    std::uint64_t thread_id;    // hash of std::thread::id
+    std::int64_t sys_ns;        // CLOCK_MONOTONIC and ticks taken at the same time, for conversion
+    std::int64_t ticks;
+};
+
+struct block_chunk
+{
+    std::uint32_t thread;
+    std::uint32_t count;
+    std::int64_t base_ticks;    // the first record's delta is from here
+};
+
+struct record
+{
+    std::uint32_t delta_ticks;
+    std::uint32_t ordinal;
+    std::uint16_t object_type;  // name id
+    std::uint16_t event;        // name id
+    std::uint32_t data;         // data id, 0 if none
+    std::uint64_t object_id;
+};
+
+static_assert(sizeof(record) == 24, "record is written as it is");
+
+}}
+
+#endif
@@ -3,8 +3,13 @@
 #include "profiling_reader/reader.hpp"
 
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <vector>
+#include <map>
 #include <unordered_map>
+#include <algorithm>
+#include <cstdint>
 
 // holds process state
 struct processor_state
@@ -18,38 +23,109 @@ struct processor_state
     double time_last_coro_end = 0;
 };
 
+// coroutine's state, by address. Addresses are reused, 'created' starts over
+struct coroutine_state
+{
+    std::string name;
+    double runnable = -1; // since when, if waiting to be run
+    double entered = -1;
+};
+
+// wake-to-run delays and run slices of coroutines with one name
+struct latencies
+{
+    std::vector<double> run_delay;
+    std::vector<double> run_slice;
+};
+
+static void print_percentiles(const char* title, std::vector<double>& values)
+{
+    if (values.empty())
+        return;
+
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p)
+    {
+        return values[std::size_t(p * (values.size() - 1))];
+    };
+
+    std::cout << "  * " << std::setw(10) << title << ": " << values.size() << " samples, p50 " << percentile(0.5)
+        << " ns, p99 " << percentile(0.99) << " ns, p999 " << percentile(0.999) << " ns, max " << values.back() << " ns" << std::endl;
+}
+
 void analyze(const profiling_reader::reader& reader)
 {
     std::unordered_map<std::size_t, processor_state> processors;
+    std::unordered_map<std::uintptr_t, coroutine_state> coroutines;
+    std::map<std::string, latencies> by_name;
 
     std::cout << "analyzing..." << std::endl;
 
-    reader.for_each_by_time([&processors](const profiling_reader::record_type& record)
+    // strings are interned, records are compared by id
+    const std::uint32_t processor = reader.string_id("processor");
+    const std::uint32_t routine_started = reader.string_id("routine started");
+    const std::uint32_t coroutine = reader.string_id("coroutine");
+    const std::uint32_t created = reader.string_id("created");
+    const std::uint32_t runnable = reader.string_id("runnable");
+    const std::uint32_t enter = reader.string_id("enter");
+    const std::uint32_t exit = reader.string_id("exit");
+
+    for(std::size_t i = 0; i < reader.size(); i++)
     {
-        if (record.object_type == "processor" && record.event == "routine started")
+        profiling_reader::record_ref record = reader[i];
+        const std::uint32_t event = record.event_id();
+        const std::int64_t time_ns = record.time_ns();
+
+        if (record.object_type_id() == processor && event == routine_started)
         {
-            processor_state& ps = processors[record.thread_id];
-            ps.routine_started = record.time_ns;
+            processor_state& ps = processors[record.thread_id()];
+            ps.routine_started = time_ns;
         }
 
-        if (record.object_type == "coroutine")
+        if (record.object_type_id() == coroutine)
         {
-            processor_state& ps = processors[record.thread_id];
+            // wake-to-run delay from the first 'runnable' after the last 'exit', run slice from 'enter' to 'exit'
+            coroutine_state& cs = coroutines[record.object_id()];
+            if (event == created)
+            {
+                cs = coroutine_state();
+                cs.name = record.data();
+            }
+            else if (event == runnable)
+            {
+                if (cs.runnable < 0)
+                    cs.runnable = time_ns;
+            }
+            else if (event == enter)
+            {
+                if (cs.runnable >= 0)
+                    by_name[cs.name].run_delay.push_back(time_ns - cs.runnable);
+                cs.runnable = -1;
+                cs.entered = time_ns;
+            }
+            else if (event == exit)
+            {
+                if (cs.entered >= 0)
+                    by_name[cs.name].run_slice.push_back(time_ns - cs.entered);
+                cs.entered = -1;
+            }
+
+            processor_state& ps = processors[record.thread_id()];
 
-            if (record.event == "enter")
+            if (event == enter)
             {
                 if (ps.time_first_coro_start == 0)
-                    ps.time_first_coro_start = record.time_ns;
-                ps.time_last_coro_start = record.time_ns;
+                    ps.time_first_coro_start = time_ns;
+                ps.time_last_coro_start = time_ns;
                 ps.tasks_run++;
             }
-            else if (record.event == "exit")
+            else if (event == exit)
             {
-                ps.time_last_coro_end = record.time_ns;
-                ps.time_in_coroutines += (record.time_ns - ps.time_last_coro_start);
+                ps.time_last_coro_end = time_ns;
+                ps.time_in_coroutines += (time_ns - ps.time_last_coro_start);
             }
         }
-    });
+    }
 
     // display some info
     for(auto& p : processors)
@@ -67,6 +143,14 @@ void analyze(const profiling_reader::reader& reader)
         std::cout << "  * time from first to last coro: " << (ps.time_last_coro_end - ps.time_first_coro_start) << " ns" << std::endl;
         std::cout << std::endl;
     }
+
+    for(auto& p : by_name)
+    {
+        std::cout << "Coroutine '" << p.first << "'" << std::endl;
+        print_percentiles("run delay", p.second.run_delay);
+        print_percentiles("run slice", p.second.run_slice);
+        std::cout << std::endl;
+    }
 }
 
 int main(int argc, char** argv)
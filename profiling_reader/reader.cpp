@@ -1,47 +1,383 @@
 // Copyright (c) 2013 Maciej Gajewski
 #include "profiling_reader/reader.hpp"
+#include "profiling/trace_format.hpp"
 
-#include <boost/lexical_cast.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <cerrno>
+#include <cstring>
 
 namespace profiling_reader {
 
+namespace format = profiling::trace_format;
+
+namespace {
+
+// whole file mapped read-only
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::string& file_name)
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("can't open " + file_name + ": " + std::strerror(errno));
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0)
+        {
+            int error = errno;
+            ::close(fd);
+            throw std::runtime_error("can't stat " + file_name + ": " + std::strerror(error));
+        }
+
+        _size = st.st_size;
+        if (_size > 0)
+        {
+            void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            int error = errno;
+            ::close(fd);
+            if (data == MAP_FAILED)
+                throw std::runtime_error("can't map " + file_name + ": " + std::strerror(error));
+            _data = static_cast<const char*>(data);
+            ::madvise(data, _size, MADV_SEQUENTIAL);
+        }
+        else
+        {
+            ::close(fd);
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if (_data)
+            ::munmap(const_cast<char*>(_data), _size);
+    }
+
+    const char* data() const { return _data; }
+    std::size_t size() const { return _size; }
+
+private:
+    const char* _data = nullptr;
+    std::size_t _size = 0;
+};
+
+// records between two thread chunks of one thread, in file order, decoded into columns
+struct stream
+{
+    std::uint64_t thread_id;
+    double ns_shift; // ns since the thread's calibration, plus its sys time
+    std::uint32_t thread_index = std::numeric_limits<std::uint32_t>::max(); // assigned when merged
+
+    std::size_t size = 0;
+    std::vector<std::int64_t> time_ns;
+    std::vector<std::int64_t> ticks;
+    std::vector<std::uint64_t> object_id;
+    std::vector<std::uint32_t> ordinal;
+    std::vector<std::uint32_t> object_type;
+    std::vector<std::uint32_t> event;
+    std::vector<std::uint32_t> data;
+    std::vector<std::uint64_t> sequence; // position in the file, orders records of the same time
+};
+
+struct block
+{
+    const char* records; // unaligned
+    std::uint32_t count;
+    std::int64_t base_ticks;
+    std::size_t stream;
+    std::size_t first; // in the stream
+    std::uint64_t sequence;
+};
+
 template<typename T>
-void read_until(std::ifstream& file, T& o, char delim)
+void permute(std::vector<T>& v, const std::vector<std::size_t>& order)
+{
+    std::vector<T> sorted;
+    sorted.reserve(v.size());
+    for(std::size_t i : order)
+    {
+        sorted.push_back(v[i]);
+    }
+    v.swap(sorted);
+}
+
+// streams are in time order, unless the clock went back (i.e. the thread moved between CPUs with unsynchronized TSCs)
+void sort(stream& s)
+{
+    auto less = [&s](std::size_t a, std::size_t b)
+    {
+        return std::tie(s.time_ns[a], s.sequence[a]) < std::tie(s.time_ns[b], s.sequence[b]);
+    };
+
+    bool sorted = true;
+    for(std::size_t i = 1; i < s.size && sorted; i++)
+    {
+        sorted = !less(i, i - 1);
+    }
+    if (sorted)
+        return;
+
+    std::vector<std::size_t> order(s.size);
+    for(std::size_t i = 0; i < s.size; i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), less);
+
+    permute(s.time_ns, order);
+    permute(s.ticks, order);
+    permute(s.object_id, order);
+    permute(s.ordinal, order);
+    permute(s.object_type, order);
+    permute(s.event, order);
+    permute(s.data, order);
+    permute(s.sequence, order);
+}
+
+std::uint32_t lookup(const std::vector<std::uint32_t>& ids, std::uint32_t id)
 {
-    static const unsigned bufsize = 128;
-    char buf[bufsize];
-    file.getline(buf, bufsize, delim);
-    o = boost::lexical_cast<T>(buf);
+    return id < ids.size() ? ids[id] : 0;
+}
+
 }
 
-reader::reader(const std::string& file_name)
+reader::reader(const std::string& file_name, unsigned threads)
 {
-    std::ifstream file(file_name);
-    file.exceptions(std::ios_base::eofbit);
+    mapped_file file(file_name);
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    format::file_header header;
+    if (file.size() < sizeof(header) || (std::memcpy(&header, begin, sizeof(header)), std::memcmp(header.magic, format::MAGIC, sizeof(header.magic)) != 0))
+        throw std::runtime_error(file_name + " is not a profiling trace");
+    if (header.version != format::VERSION)
+        throw std::runtime_error(file_name + ": unsupported trace version " + std::to_string(header.version));
 
-    try
+    _strings.emplace_back();
+    _string_ids.emplace(std::string(), 0);
+    auto intern = [this](std::string s) -> std::uint32_t
     {
-        while(!file.eof())
+        auto it = _string_ids.find(s);
+        if (it != _string_ids.end())
+            return it->second;
+        std::uint32_t id = _strings.size();
+        _strings.push_back(s);
+        _string_ids.emplace(std::move(s), id);
+        return id;
+    };
+
+    // name and data ids to interned strings
+    std::vector<std::uint32_t> names;
+    std::vector<std::uint32_t> data;
+
+    std::vector<stream> streams;
+    std::unordered_map<std::uint32_t, std::size_t> current_stream; // by thread in the blocks
+    std::vector<block> blocks;
+    std::uint64_t records = 0;
+
+    // time is relative to the first thread's calibration, known once all are read
+    std::int64_t min_sys_ns = std::numeric_limits<std::int64_t>::max();
+
+    // scan the chunks, blocks are decoded later. A trace cut short ends with the last complete chunk
+    const char* pos = begin + sizeof(header);
+    format::chunk_header chunk;
+    while(std::size_t(end - pos) >= sizeof(chunk))
+    {
+        std::memcpy(&chunk, pos, sizeof(chunk));
+        const char* body = pos + sizeof(chunk);
+        if (std::size_t(end - body) < chunk.size)
+            break;
+        pos = body + chunk.size;
+
+        if ((chunk.type == format::CHUNK_NAME || chunk.type == format::CHUNK_DATA) && chunk.size >= sizeof(format::string_chunk))
+        {
+            format::string_chunk s;
+            std::memcpy(&s, body, sizeof(s));
+            std::vector<std::uint32_t>& ids = chunk.type == format::CHUNK_NAME ? names : data;
+            if (s.id >= ids.size())
+                ids.resize(s.id + 1, 0);
+            ids[s.id] = intern(std::string(body + sizeof(s), chunk.size - sizeof(s)));
+        }
+        else if (chunk.type == format::CHUNK_THREAD && chunk.size >= sizeof(format::thread_chunk))
+        {
+            format::thread_chunk t;
+            std::memcpy(&t, body, sizeof(t));
+            current_stream[t.thread] = streams.size();
+            streams.emplace_back();
+            streams.back().thread_id = t.thread_id;
+            streams.back().ns_shift = t.sys_ns - t.ticks / header.ticks_per_ns;
+            min_sys_ns = std::min(min_sys_ns, t.sys_ns);
+        }
+        else if (chunk.type == format::CHUNK_BLOCK && chunk.size >= sizeof(format::block_chunk))
         {
-            record_type record;
+            format::block_chunk b;
+            std::memcpy(&b, body, sizeof(b));
+            auto s = current_stream.find(b.thread);
+            if (s == current_stream.end())
+                throw std::runtime_error(file_name + ": block of an unknown thread");
+
+            std::uint32_t count = std::min<std::size_t>(b.count, (chunk.size - sizeof(b)) / sizeof(format::record));
+            blocks.push_back(block{ body + sizeof(b), count, b.base_ticks, s->second, streams[s->second].size, records });
+            streams[s->second].size += count;
+            records += count;
+        }
+    }
+
+    if (records > std::numeric_limits<index_type::value_type>::max())
+        throw std::runtime_error(file_name + ": too many records");
+
+    for(stream& s : streams)
+    {
+        s.time_ns.resize(s.size);
+        s.ticks.resize(s.size);
+        s.object_id.resize(s.size);
+        s.ordinal.resize(s.size);
+        s.object_type.resize(s.size);
+        s.event.resize(s.size);
+        s.data.resize(s.size);
+        s.sequence.resize(s.size);
+    }
 
-            read_until(file, record.time_ns, ',');
-            read_until(file, record.ticks, ',');
-            read_until(file, record.thread_id, ',');
-            read_until(file, record.object_type, ',');
-            read_until(file, record.object_id, ',');
-            read_until(file, record.ordinal, ',');
-            read_until(file, record.event, ',');
-            read_until(file, record.data, '\n');
+    // decode the blocks in parallel, each into its own place in the stream
+    std::atomic<std::size_t> next_block(0);
+    auto decode = [&]()
+    {
+        for(std::size_t i = next_block++; i < blocks.size(); i = next_block++)
+        {
+            const block& b = blocks[i];
+            stream& s = streams[b.stream];
+            std::int64_t ticks = b.base_ticks;
+            for(std::uint32_t j = 0; j < b.count; j++)
+            {
+                format::record r;
+                std::memcpy(&r, b.records + j * sizeof(r), sizeof(r));
+                ticks += r.delta_ticks;
 
-            _by_time.insert(std::make_pair(record.time_ns, record));
+                std::size_t k = b.first + j;
+                s.ticks[k] = ticks;
+                s.time_ns[k] = std::int64_t(ticks / header.ticks_per_ns + s.ns_shift) - min_sys_ns;
+                s.object_id[k] = r.object_id;
+                s.ordinal[k] = r.ordinal;
+                s.object_type[k] = lookup(names, r.object_type);
+                s.event[k] = lookup(names, r.event);
+                s.data[k] = r.data ? lookup(data, r.data) : 0;
+                s.sequence[k] = b.sequence + j;
+            }
         }
+    };
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<std::size_t>(threads, blocks.size());
+
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < threads; i++)
+    {
+        workers.emplace_back(decode);
     }
-    catch(const std::ios_base::failure&)
+    decode();
+    for(std::thread& t : workers)
     {
+        t.join();
     }
+
+    for(stream& s : streams)
+    {
+        sort(s);
+    }
+
+    // k-way merge of the streams. Records of the same time stay in file order
+    _time_ns.reserve(records);
+    _ticks.reserve(records);
+    _thread.reserve(records);
+    _object_id.reserve(records);
+    _ordinal.reserve(records);
+    _object_type.reserve(records);
+    _event.reserve(records);
+    _data.reserve(records);
+
+    typedef std::tuple<std::int64_t, std::uint64_t, std::size_t, std::size_t> head_type; // time, sequence, stream, position
+    std::priority_queue<head_type, std::vector<head_type>, std::greater<head_type>> heads;
+    for(std::size_t i = 0; i < streams.size(); i++)
+    {
+        if (streams[i].size)
+            heads.emplace(streams[i].time_ns[0], streams[i].sequence[0], i, 0);
+    }
+
+    while(!heads.empty())
+    {
+        std::size_t si = std::get<2>(heads.top());
+        std::size_t k = std::get<3>(heads.top());
+        heads.pop();
+        stream& s = streams[si];
+
+        if (s.thread_index == std::numeric_limits<std::uint32_t>::max())
+        {
+            auto known = std::find(_thread_ids.begin(), _thread_ids.end(), s.thread_id);
+            s.thread_index = known - _thread_ids.begin();
+            if (known == _thread_ids.end())
+            {
+                _thread_ids.push_back(s.thread_id);
+                _by_thread.emplace_back();
+            }
+        }
+
+        _by_thread[s.thread_index].push_back(_time_ns.size());
+        _time_ns.push_back(s.time_ns[k]);
+        _ticks.push_back(s.ticks[k]);
+        _thread.push_back(s.thread_index);
+        _object_id.push_back(s.object_id[k]);
+        _ordinal.push_back(s.ordinal[k]);
+        _object_type.push_back(s.object_type[k]);
+        _event.push_back(s.event[k]);
+        _data.push_back(s.data[k]);
+
+        if (++k < s.size)
+            heads.emplace(s.time_ns[k], s.sequence[k], si, k);
+    }
+}
+
+const reader::index_type& reader::by_thread(std::size_t thread_id) const
+{
+    static const index_type none;
+    auto it = std::find(_thread_ids.begin(), _thread_ids.end(), thread_id);
+    return it == _thread_ids.end() ? none : _by_thread[it - _thread_ids.begin()];
+}
+
+const reader::index_type& reader::by_object(std::uintptr_t object_id) const
+{
+    static const index_type none;
+    std::call_once(_object_index_built, [this]() { build_object_index(); });
+    auto it = _by_object.find(object_id);
+    return it == _by_object.end() ? none : it->second;
+}
+
+void reader::build_object_index() const
+{
+    for(std::size_t i = 0; i < _object_id.size(); i++)
+    {
+        _by_object[_object_id[i]].push_back(i);
+    }
+}
+
+std::uint32_t reader::string_id(const std::string& s) const
+{
+    auto it = _string_ids.find(s);
+    return it == _string_ids.end() ? NO_STRING : it->second;
 }
 
-} // namespace profiling
+} // namespace profiling_reader
@@ -3,11 +3,11 @@
 #ifndef PROFILING_READER_HPP
 #define PROFILING_READER_HPP
 
-#include <fstream>
-#include <thread>
+#include <mutex>
 #include <cstdint>
 #include <string>
-#include <map>
+#include <vector>
+#include <unordered_map>
 
 namespace profiling_reader {
 
@@ -23,27 +23,143 @@ struct record_type
     std::string data;
 };
 
+class reader;
+
+// record in the reader's columns. Strings are interned, the references stay valid as long as the reader
+class record_ref
+{
+public:
+    record_ref(const reader& r, std::size_t index) : _reader(&r), _index(index) { }
+
+    std::size_t index() const { return _index; } // in time order
+
+    std::int64_t time_ns() const;
+    std::int64_t ticks() const;
+    std::size_t thread_id() const;
+    std::uintptr_t object_id() const;
+    std::uint32_t ordinal() const;
+
+    const std::string& object_type() const;
+    const std::string& event() const;
+    const std::string& data() const;
+
+    // interned string ids, compared with reader::string_id() instead of comparing strings
+    std::uint32_t object_type_id() const;
+    std::uint32_t event_id() const;
+    std::uint32_t data_id() const;
+
+    // copies into 'r', reusing its strings
+    void copy_to(record_type& r) const;
+
+private:
+    const reader* _reader;
+    std::size_t _index;
+};
+
+// reads the binary trace. The file is mapped and its blocks decoded in parallel, straight into columns,
+// one stream per thread; the streams, each in time order already, are then merged.
+// Records are kept in time order, indexed by thread and, on the first use, by object id
 class reader
 {
 public:
-    reader(const std::string& file_name);
+    typedef std::vector<std::uint32_t> index_type; // record indices, in time order
+
+    static const std::uint32_t NO_STRING = 0xffffffff;
+
+    // 'threads' decode the blocks, 0 for one per core
+    explicit reader(const std::string& file_name, unsigned threads = 0);
 
-    // visits all records in chronological order
+    reader(const reader&) = delete;
+
+    std::size_t size() const { return _time_ns.size(); }
+
+    record_ref operator[](std::size_t index) const { return record_ref(*this, index); }
+
+    // visits all records in chronological order. The record passed is reused between calls
     template<typename Callable>
     void for_each_by_time(Callable c) const
     {
-        for(auto& p : _by_time)
+        record_type record;
+        for(std::size_t i = 0; i < size(); i++)
         {
-            c(p.second);
+            (*this)[i].copy_to(record);
+            c(static_cast<const record_type&>(record));
         }
     }
 
+    // visits the records of the index, e.g. by_thread() or by_object(), in time order
+    template<typename Callable>
+    void for_each_in(const index_type& index, Callable c) const
+    {
+        for(std::uint32_t i : index)
+        {
+            c((*this)[i]);
+        }
+    }
+
+    // ids of threads that recorded something, in order of their first record
+    const std::vector<std::size_t>& threads() const { return _thread_ids; }
+
+    // records of the thread, or of the object, in time order. Empty if none
+    const index_type& by_thread(std::size_t thread_id) const;
+    const index_type& by_object(std::uintptr_t object_id) const;
+
+    // interned string
+    const std::string& string(std::uint32_t id) const { return _strings[id]; }
+
+    // id of the string, NO_STRING if the trace has no such string
+    std::uint32_t string_id(const std::string& s) const;
+
 private:
 
-    // index by time. key is time_ns
-    std::multimap<std::int64_t, record_type> _by_time;
+    friend class record_ref;
+
+    void build_object_index() const;
+
+    // columns, in time order
+    std::vector<std::int64_t> _time_ns;
+    std::vector<std::int64_t> _ticks;
+    std::vector<std::uint32_t> _thread; // index in _thread_ids
+    std::vector<std::uint64_t> _object_id;
+    std::vector<std::uint32_t> _ordinal;
+    std::vector<std::uint32_t> _object_type;
+    std::vector<std::uint32_t> _event;
+    std::vector<std::uint32_t> _data;
+
+    std::vector<std::string> _strings; // 0 is the empty one
+    std::unordered_map<std::string, std::uint32_t> _string_ids;
+
+    std::vector<std::size_t> _thread_ids;
+    std::vector<index_type> _by_thread;
+
+    mutable std::once_flag _object_index_built;
+    mutable std::unordered_map<std::uintptr_t, index_type> _by_object;
 };
 
-} // namespace profiling
+inline std::int64_t record_ref::time_ns() const { return _reader->_time_ns[_index]; }
+inline std::int64_t record_ref::ticks() const { return _reader->_ticks[_index]; }
+inline std::size_t record_ref::thread_id() const { return _reader->_thread_ids[_reader->_thread[_index]]; }
+inline std::uintptr_t record_ref::object_id() const { return _reader->_object_id[_index]; }
+inline std::uint32_t record_ref::ordinal() const { return _reader->_ordinal[_index]; }
+inline const std::string& record_ref::object_type() const { return _reader->_strings[_reader->_object_type[_index]]; }
+inline const std::string& record_ref::event() const { return _reader->_strings[_reader->_event[_index]]; }
+inline const std::string& record_ref::data() const { return _reader->_strings[_reader->_data[_index]]; }
+inline std::uint32_t record_ref::object_type_id() const { return _reader->_object_type[_index]; }
+inline std::uint32_t record_ref::event_id() const { return _reader->_event[_index]; }
+inline std::uint32_t record_ref::data_id() const { return _reader->_data[_index]; }
+
+inline void record_ref::copy_to(record_type& r) const
+{
+    r.time_ns = time_ns();
+    r.ticks = ticks();
+    r.thread_id = thread_id();
+    r.object_type = object_type();
+    r.object_id = object_id();
+    r.ordinal = ordinal();
+    r.event = event();
+    r.data = data();
+}
+
+} // namespace profiling_reader
 
 #endif // PROFILING_READER_HPP
@@ -272,4 +272,115 @@ BOOST_FIXTURE_TEST_CASE(test_non_blocking_read, fixture)
     BOOST_CHECK_EQUAL(completed, true);
 }
 
+/////////////
+// lock-free channel
+
+typedef lock_free_channel<int> lock_free_int;
+
+BOOST_FIXTURE_TEST_CASE(test_lock_free_reading_after_close, fixture)
+{
+    channel_pair<int, lock_free_int> pair = make_channel<int, lock_free_int>(10);
+
+    int last_read = -1;
+
+    go("lock_free_reading_after_close writer", [](channel_pair<int, lock_free_int>::writer_type& writer)
+    {
+        for(int i = 0; i < 5; i++)
+            writer.put(i);
+    }, std::move(pair.writer));
+
+    go("lock_free_reading_after_close reader", [&last_read](channel_pair<int, lock_free_int>::reader_type& reader)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        try
+        {
+            for(;;)
+                last_read = reader.get();
+        }
+        catch(const channel_closed&)
+        {
+        }
+    }, std::move(pair.reader));
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(last_read, 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_lock_free_writer_exit_when_closed, fixture)
+{
+    channel_pair<int, lock_free_int> pair = make_channel<int, lock_free_int>(1);
+
+    go("lock_free_writer_exit_when_closed reader", [](channel_pair<int, lock_free_int>::reader_type& r)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        // do nothing, close the chanel on exit
+    }, std::move(pair.reader));
+
+    bool writer_threw = false;
+    go("lock_free_writer_exit_when_closed writer", [&writer_threw](channel_pair<int, lock_free_int>::writer_type& w)
+    {
+        try
+        {
+            w.put(1);
+            w.put(2); // this will block
+        }
+        catch(const channel_closed&)
+        {
+            writer_threw = true;
+        }
+    }, std::move(pair.writer));
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(writer_threw, true);
+}
+
+// many writers and readers on a small channel, every message must arrive exactly once
+BOOST_FIXTURE_TEST_CASE(test_lock_free_mpmc, fixture)
+{
+    static const int WRITERS = 8;
+    static const int READERS = 8;
+    static const int MSGS_PER_WRITER = 10000;
+
+    std::atomic<long> sum(0);
+    std::atomic<int> received(0);
+
+    channel_pair<int, lock_free_int> pair = make_channel<int, lock_free_int>(4);
+
+    for(int i = 0; i < WRITERS; i++)
+    {
+        go("lock_free_mpmc writer", [](channel_pair<int, lock_free_int>::writer_type writer)
+        {
+            for(int i = 1; i <= MSGS_PER_WRITER; i++)
+                writer.put(i);
+        }, pair.writer);
+    }
+    pair.writer.close();
+
+    for(int i = 0; i < READERS; i++)
+    {
+        go("lock_free_mpmc reader", [&sum, &received](channel_pair<int, lock_free_int>::reader_type reader)
+        {
+            try
+            {
+                for(;;)
+                {
+                    sum += reader.get();
+                    received++;
+                }
+            }
+            catch(const channel_closed&)
+            {
+            }
+        }, pair.reader);
+    }
+    pair.reader.close();
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(received, WRITERS*MSGS_PER_WRITER);
+    BOOST_CHECK_EQUAL(sum, long(WRITERS) * MSGS_PER_WRITER * (MSGS_PER_WRITER + 1) / 2);
+}
+
 }}
@@ -0,0 +1,201 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "profiling/profiling.hpp"
+#include "profiling_reader/reader.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <thread>
+#include <functional>
+#include <string>
+#include <cstdio>
+
+namespace coroutines { namespace tests {
+
+// runs 'f' in a thread of its own, so it records into fresh blocks and rings. Returns its id, as in the trace
+static std::size_t record_in_thread(std::function<void()> f)
+{
+    std::size_t id = 0;
+    std::thread t([&]()
+    {
+        id = std::hash<std::thread::id>()(std::this_thread::get_id());
+        f();
+    });
+    t.join();
+    return id;
+}
+
+// records of the thread and type, the library records in the thread too when built with profiling
+static profiling_reader::reader::index_type only(const profiling_reader::reader& r, std::size_t thread, const std::string& object_type)
+{
+    profiling_reader::reader::index_type records;
+    std::uint32_t type = r.string_id(object_type);
+    r.for_each_in(r.by_thread(thread), [&](const profiling_reader::record_ref& rec)
+    {
+        if (rec.object_type_id() == type)
+            records.push_back(rec.index());
+    });
+    return records;
+}
+
+// records in a thread with the flight recorder configured as 's', and dumps it before the thread exits
+static std::size_t record_flight(profiling::settings s, const std::string& file_name, std::function<void()> f)
+{
+    profiling::settings before = profiling::get_settings();
+    s.mode = profiling::mode::flight_recorder;
+    profiling::configure(s);
+
+    std::size_t thread = record_in_thread([&]()
+    {
+        f();
+        profiling::dump_flight_recorder(file_name);
+    });
+
+    profiling::configure(before);
+    return thread;
+}
+
+BOOST_AUTO_TEST_CASE(test_profiling_trace)
+{
+    const unsigned RECORDS = 10000; // a few blocks, some written by the flusher
+    static const char* EVENTS[] = { "event a", "event b" };
+    int object = 0;
+
+    profiling::settings before = profiling::get_settings();
+    profiling::settings s;
+    s.mode = profiling::mode::trace;
+    profiling::configure(s);
+
+    std::size_t thread = record_in_thread([&]()
+    {
+        char data[16]; // the same address, another string every time
+        for(unsigned i = 0; i < RECORDS; i++)
+        {
+            std::snprintf(data, sizeof(data), "data %u", i % 3);
+            profiling::profiling_event("test object", &object, EVENTS[i % 2], i, i % 5 ? data : nullptr);
+        }
+    });
+
+    profiling::dump(); // the end of the trace, once per process
+    profiling::configure(before);
+
+    {
+        profiling_reader::reader r("profiling_data.bin");
+        profiling_reader::reader::index_type records = only(r, thread, "test object");
+        BOOST_REQUIRE_EQUAL(records.size(), RECORDS);
+
+        for(unsigned i = 0; i < RECORDS; i++)
+        {
+            profiling_reader::record_ref rec = r[records[i]];
+            BOOST_REQUIRE_EQUAL(rec.ordinal(), i); // in the order recorded
+            BOOST_CHECK_EQUAL(rec.object_type(), "test object");
+            BOOST_CHECK_EQUAL(rec.object_id(), reinterpret_cast<std::uintptr_t>(&object));
+            BOOST_CHECK_EQUAL(rec.event(), EVENTS[i % 2]);
+            BOOST_CHECK_EQUAL(rec.data(), i % 5 ? "data " + std::to_string(i % 3) : std::string());
+            if (i > 0)
+                BOOST_CHECK(rec.time_ns() >= r[records[i-1]].time_ns());
+        }
+    }
+
+    std::remove("profiling_data.bin");
+}
+
+BOOST_AUTO_TEST_CASE(test_profiling_flight_recorder)
+{
+    const unsigned RING = 100;
+    const unsigned RECORDS = 1000;
+    int object = 0;
+
+    profiling::settings s;
+    s.ring_records = RING;
+    std::size_t thread = record_flight(s, "test_flight.bin", [&]()
+    {
+        for(unsigned i = 0; i < RECORDS; i++)
+            profiling::profiling_event("test object", &object, "flight", i, nullptr);
+    });
+
+    {
+        profiling_reader::reader r("test_flight.bin");
+        profiling_reader::reader::index_type records = only(r, thread, "test object");
+
+        // the last ones, the ring was overwritten many times. The oldest slot is left out, the next record goes there
+        BOOST_REQUIRE_EQUAL(records.size(), RING - 1);
+        for(unsigned i = 0; i < records.size(); i++)
+        {
+            BOOST_CHECK_EQUAL(r[records[i]].ordinal(), RECORDS - RING + 1 + i);
+            BOOST_CHECK_EQUAL(r[records[i]].event(), "flight");
+        }
+    }
+
+    std::remove("test_flight.bin");
+}
+
+BOOST_AUTO_TEST_CASE(test_profiling_sampling)
+{
+    const unsigned SESSIONS = 20;
+    int coro = 0;
+    int object = 0;
+
+    profiling::settings s;
+    s.sample_one_in = 4;
+    std::size_t thread = record_flight(s, "test_sampling.bin", [&]()
+    {
+        for(unsigned i = 0; i < SESSIONS; i++)
+        {
+            profiling::profiling_event("coroutine", &coro, "enter", i, nullptr);
+            profiling::profiling_event("test object", &object, "in session", i, nullptr);
+            profiling::profiling_event("coroutine", &coro, "exit", i, nullptr);
+        }
+    });
+
+    {
+        profiling_reader::reader r("test_sampling.bin");
+
+        // whole sessions, from the first one
+        profiling_reader::reader::index_type in_session = only(r, thread, "test object");
+        BOOST_REQUIRE_EQUAL(in_session.size(), SESSIONS / 4);
+        for(unsigned i = 0; i < in_session.size(); i++)
+            BOOST_CHECK_EQUAL(r[in_session[i]].ordinal(), i * 4);
+
+        profiling_reader::reader::index_type enter_exit = only(r, thread, "coroutine");
+        BOOST_REQUIRE_EQUAL(enter_exit.size(), SESSIONS / 4 * 2);
+        for(unsigned i = 0; i < enter_exit.size(); i++)
+        {
+            BOOST_CHECK_EQUAL(r[enter_exit[i]].event(), i % 2 ? "exit" : "enter");
+            BOOST_CHECK_EQUAL(r[enter_exit[i]].ordinal(), i / 2 * 4);
+        }
+    }
+
+    std::remove("test_sampling.bin");
+}
+
+BOOST_AUTO_TEST_CASE(test_profiling_categories)
+{
+    const unsigned RECORDS = 10;
+    int object = 0;
+
+    profiling::settings s;
+    s.categories = profiling::CATEGORY_MONITOR | profiling::CATEGORY_OTHER;
+    std::size_t thread = record_flight(s, "test_categories.bin", [&]()
+    {
+        for(unsigned i = 0; i < RECORDS; i++)
+        {
+            profiling::profiling_event("monitor", &object, "wait", i, nullptr);
+            profiling::profiling_event("spinlock", &object, "locked", i, nullptr);
+            profiling::profiling_event("processor", &object, "idle", i, nullptr);
+            profiling::profiling_event("test object", &object, "other", i, nullptr);
+        }
+    });
+
+    {
+        profiling_reader::reader r("test_categories.bin");
+        BOOST_CHECK_EQUAL(only(r, thread, "monitor").size(), RECORDS);
+        BOOST_CHECK_EQUAL(only(r, thread, "test object").size(), RECORDS);
+        BOOST_CHECK_EQUAL(only(r, thread, "spinlock").size(), 0);
+        BOOST_CHECK_EQUAL(only(r, thread, "processor").size(), 0);
+        BOOST_CHECK_EQUAL(only(r, thread, "coroutine").size(), 0); // the ring of the previous test, recycled empty
+    }
+
+    std::remove("test_categories.bin");
+}
+
+}}
@@ -6,6 +6,10 @@
 #include <boost/test/unit_test.hpp>
 
 #include <iostream>
+#include <array>
+#include <string>
+#include <thread>
+#include <chrono>
 
 namespace coroutines { namespace tests {
 
@@ -245,6 +249,305 @@ BOOST_FIXTURE_TEST_CASE(tree_traverse_test, fixture)
     BOOST_CHECK_EQUAL(sum, psum);
 }
 
+/////////////
+// stacks
 
-}}
+static void stack_chain(std::atomic<int>& counter, int left)
+{
+    counter++;
+    if (left > 0)
+    {
+        go("stack chain", stack_chain, std::ref(counter), left-1);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_stack_reuse, fixture)
+{
+    const int LENGTH = 1000;
+    std::atomic<int> counter(0);
+
+    go("stack chain", stack_chain, std::ref(counter), LENGTH);
+
+    wait_for_completion();
+
+    stack_pool_stats stats = get_scheduler_check().get_stack_stats();
+    std::cout << "stack pool hits: " << stats.hits << ", misses: " << stats.misses << std::endl;
+
+    BOOST_CHECK_EQUAL(counter, LENGTH+1);
+    BOOST_CHECK_EQUAL(stats.hits + stats.misses, LENGTH+1);
+    BOOST_CHECK(stats.hits > 0);
+}
+
+// each level uses more than 1kb, so 512 levels would overflow the default stack
+static int use_stack(int depth)
+{
+    volatile char buf[1024];
+    buf[0] = 1;
+    if (depth == 0)
+        return buf[0];
+    else
+        return use_stack(depth-1) + buf[0];
+}
+
+BOOST_FIXTURE_TEST_CASE(test_custom_stack_size, fixture)
+{
+    int result = 0;
+
+    go(stack_size(1024*1024), "big stack", [&result]()
+    {
+        result = use_stack(512);
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(result, 513);
+}
+
+/////////////
+// spawning
+
+BOOST_FIXTURE_TEST_CASE(test_large_callable, fixture)
+{
+    // too big for the buffer in coroutine, will be stored in the stack
+    std::array<int, 1024> values;
+    for(unsigned i = 0; i < values.size(); i++)
+        values[i] = i;
+
+    std::string name = std::string("large callable ") + std::to_string(values.size());
+    int sum = 0;
+    std::string seen_name;
+
+    go(name, [values, &sum, &seen_name]()
+    {
+        seen_name = coroutine::current_corutine()->name();
+        for(int v : values)
+            sum += v;
+    });
+    name = "changed";
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(sum, 1023*1024/2);
+    BOOST_CHECK_EQUAL(seen_name, "large callable 1024");
+}
+
+/////////////
+// registry
+
+static void spawn_tree(std::atomic<int>& counter, int depth)
+{
+    counter++;
+    if (depth > 0)
+    {
+        go("tree", spawn_tree, std::ref(counter), depth-1);
+        go("tree", spawn_tree, std::ref(counter), depth-1);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_wait_for_all, fixture)
+{
+    // coroutines are added and removed from all threads at once, wait() must see them all
+    std::atomic<int> counter(0);
+
+    go("tree", spawn_tree, std::ref(counter), 12);
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(counter, (1<<13) - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_next_slot_fairness)
+{
+    // two coroutines keep handing the only processor to each other, the third one must still get its turn
+    scheduler sched(1);
+    set_scheduler(&sched);
+
+    std::atomic<bool> done(false);
+    {
+        channel_pair<int> ping = make_channel<int>(1, "ping");
+        channel_pair<int> pong = make_channel<int>(1, "pong");
+
+        go("pong", [](channel_reader<int>& in, channel_writer<int>& out)
+        {
+            try
+            {
+                for(;;)
+                    out.put(in.get());
+            }
+            catch(const channel_closed&)
+            {
+            }
+        }, std::move(ping.reader), std::move(pong.writer));
+
+        go("ping", [&done](channel_writer<int>& out, channel_reader<int>& in)
+        {
+            while(!done)
+            {
+                out.put(0);
+                in.get();
+            }
+            out.close();
+        }, std::move(ping.writer), std::move(pong.reader));
+
+        go("other", [&done]()
+        {
+            done = true;
+        });
+    }
+
+    sched.wait();
+    set_scheduler(nullptr);
+
+    BOOST_CHECK(done);
+}
+
+// metrics
+
+BOOST_AUTO_TEST_CASE(test_histogram)
+{
+    histogram h;
+    BOOST_CHECK_EQUAL(h.percentile(0.5), 0);
+
+    for(std::uint64_t v = 1; v <= 1000; v++)
+        h.record(v * 1000);
+
+    BOOST_CHECK_EQUAL(h.count(), 1000);
+    BOOST_CHECK_EQUAL(h.min(), 1000);
+    BOOST_CHECK_EQUAL(h.max(), 1000000);
+
+    // within the bucket precision, 1/16
+    std::uint64_t p50 = h.percentile(0.5);
+    std::uint64_t p99 = h.percentile(0.99);
+    BOOST_CHECK(p50 >= 500000 && p50 <= 500000 + 500000/16);
+    BOOST_CHECK(p99 >= 990000 && p99 <= 1000000);
+    BOOST_CHECK_EQUAL(h.percentile(1.0), 1000000);
+
+    histogram other;
+    other.record(5, 10);
+    h += other;
+    BOOST_CHECK_EQUAL(h.count(), 1010);
+    BOOST_CHECK_EQUAL(h.min(), 5);
+    BOOST_CHECK_EQUAL(h.percentile(0.001), 5);
+
+    for(unsigned b = 0; b < histogram::BUCKETS; b++)
+    {
+        BOOST_CHECK_EQUAL(histogram::bucket_of(histogram::lowest_in_bucket(b)), b);
+        BOOST_CHECK_EQUAL(histogram::bucket_of(histogram::highest_in_bucket(b)), b);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_metrics)
+{
+    const int MSGS = 1000;
+
+    scheduler sched(2);
+    sched.set_run_delay_sampling(1);
+    set_scheduler(&sched);
+
+    {
+        channel_pair<int> pair = make_channel<int>(4, "metrics channel");
+
+        go("metrics reader", [](channel_reader<int>& r)
+        {
+            for(int i = 0; i < MSGS; i++)
+                r.get();
+        }, pair.reader); // copies, the channel lives until the end of the block
+
+        go("metrics writer", [](channel_writer<int>& w)
+        {
+            for(int i = 0; i < MSGS; i++)
+                w.put(i);
+        }, pair.writer);
+
+        sched.wait();
+
+        scheduler_metrics m = sched.get_metrics();
+        BOOST_REQUIRE_EQUAL(m.channels.size(), 1);
+        BOOST_CHECK_EQUAL(m.channels[0].name, "metrics channel");
+        BOOST_CHECK_EQUAL(m.channels[0].capacity, 4);
+        BOOST_CHECK_EQUAL(m.channels[0].puts, MSGS);
+        BOOST_CHECK_EQUAL(m.channels[0].gets, MSGS);
+        BOOST_CHECK_EQUAL(m.channels[0].size, 0);
+        BOOST_CHECK(m.channels[0].put_waits + m.channels[0].get_waits > 0);
+
+        BOOST_CHECK_EQUAL(m.processors.size(), 2);
+        BOOST_CHECK_EQUAL(m.processors_spawned, 2);
+        BOOST_CHECK_EQUAL(m.coroutines, 0);
+        BOOST_CHECK(m.total.runs >= 2);
+        BOOST_CHECK(m.run_delay.count() >= m.total.runs); // recorded before the run, counted after
+        BOOST_CHECK(m.run_slice.count() + 2 >= m.run_delay.count()); // the last ones may be recorded after wait() returns
+
+        BOOST_REQUIRE_EQUAL(m.by_name.size(), 2);
+        BOOST_CHECK_EQUAL(m.by_name[0].name, "metrics reader");
+        BOOST_CHECK_EQUAL(m.by_name[1].name, "metrics writer");
+        BOOST_CHECK_EQUAL(m.by_name[0].run_delay.count() + m.by_name[1].run_delay.count(), m.run_delay.count());
+        BOOST_CHECK(m.by_name[0].run_slice.count() <= m.by_name[0].run_delay.count());
+
+        std::string json = m.to_json();
+        BOOST_CHECK_EQUAL(json.front(), '{');
+        BOOST_CHECK_EQUAL(json.back(), '}');
+        BOOST_CHECK(json.find("\"name\":\"metrics channel\"") != std::string::npos);
+        BOOST_CHECK(m.to_text().find("run delay") != std::string::npos);
+    }
+
+    // gone with the endpoints
+    BOOST_CHECK(sched.get_metrics().channels.empty());
+
+    set_scheduler(nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_metrics_by_name)
+{
+    const std::size_t EXTRA = 20;
+
+    // one processor: names are kept in the order they are first run, not in the order processors are merged
+    scheduler sched(1);
+    sched.set_run_delay_sampling(1);
+    set_scheduler(&sched);
 
+    go("metrics named", []() { });
+    sched.wait();
+
+    go("metrics launcher", []()
+    {
+        // names made up at run time, more than are kept apart
+        for(std::size_t i = 0; i < coroutine_latency::MAX_NAMES + EXTRA; i++)
+            go("metrics dynamic " + std::to_string(i), []() { });
+    });
+
+    sched.wait();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10)); // last run slices are recorded after wait() returns
+
+    scheduler_metrics m = sched.get_metrics();
+    BOOST_REQUIRE_EQUAL(m.by_name.size(), coroutine_latency::MAX_NAMES + 1);
+
+    std::uint64_t delays = 0;
+    std::uint64_t slices = 0;
+    const coroutine_latency* named = nullptr;
+    const coroutine_latency* other = nullptr;
+    for(const coroutine_latency& l : m.by_name)
+    {
+        delays += l.run_delay.count();
+        slices += l.run_slice.count();
+        if (l.name == "metrics named")
+            named = &l;
+        if (l.name == coroutine_latency::OTHER_NAME)
+            other = &l;
+    }
+    BOOST_CHECK_EQUAL(delays, m.run_delay.count());
+    BOOST_CHECK_EQUAL(slices, m.run_slice.count());
+    BOOST_CHECK_EQUAL(delays, slices);
+
+    BOOST_REQUIRE(named);
+    BOOST_CHECK_EQUAL(named->run_delay.count(), 1);
+    BOOST_CHECK_EQUAL(named->run_slice.count(), 1);
+
+    // each ran once, the ones past the limit are in one bucket
+    BOOST_REQUIRE(other);
+    BOOST_CHECK(other->run_delay.count() >= EXTRA);
+    BOOST_CHECK_EQUAL(delays, coroutine_latency::MAX_NAMES + EXTRA + 2);
+
+    set_scheduler(nullptr);
+}
+
+}}
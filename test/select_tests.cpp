@@ -0,0 +1,169 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/globals.hpp"
+
+#include "test/fixtures.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+namespace coroutines { namespace tests {
+
+// nothing ready: default case is taken
+BOOST_FIXTURE_TEST_CASE(test_select_default, fixture)
+{
+    channel_pair<int> pair1 = make_channel<int>(1);
+    channel_pair<int> pair2 = make_channel<int>(1);
+
+    int result = 0;
+    bool default_taken = false;
+    go("test_select_default", [&]()
+    {
+        result = selector()
+            .get(pair1.reader)
+            .get(pair2.reader)
+            .otherwise([&]() { default_taken = true; })
+            .wait();
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(result, -1);
+    BOOST_CHECK(default_taken);
+}
+
+// select parks until the second channel gets something
+BOOST_FIXTURE_TEST_CASE(test_select_blocking_get, fixture)
+{
+    channel_pair<int> pair1 = make_channel<int>(1);
+    channel_pair<int> pair2 = make_channel<int>(1);
+
+    int index = -1;
+    int value = 0;
+    go("test_select_blocking_get selector", [&]()
+    {
+        index = selector()
+            .get(pair1.reader, [&](int v) { value = -v; })
+            .get(pair2.reader, [&](int v) { value = v; })
+            .wait();
+    });
+
+    go("test_select_blocking_get writer", [&]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pair2.writer.put(7);
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(index, 1);
+    BOOST_CHECK_EQUAL(value, 7);
+}
+
+// put case waits for space
+BOOST_FIXTURE_TEST_CASE(test_select_blocking_put, fixture)
+{
+    channel_pair<int> pair = make_channel<int>(1);
+    pair.writer.put(1); // full now
+
+    int index = -1;
+    go("test_select_blocking_put selector", [&]()
+    {
+        index = selector()
+            .put(pair.writer, 2)
+            .wait();
+    });
+
+    int first = 0;
+    int second = 0;
+    go("test_select_blocking_put reader", [&]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        first = pair.reader.get();
+        second = pair.reader.get();
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(index, 0);
+    BOOST_CHECK_EQUAL(first, 1);
+    BOOST_CHECK_EQUAL(second, 2);
+}
+
+// closed channel makes select throw
+BOOST_FIXTURE_TEST_CASE(test_select_closed, fixture)
+{
+    channel_pair<int> pair1 = make_channel<int>(1);
+    channel_pair<int> pair2 = make_channel<int>(1);
+
+    bool threw = false;
+    go("test_select_closed selector", [&]()
+    {
+        try
+        {
+            selector()
+                .get(pair1.reader)
+                .get(pair2.reader)
+                .wait();
+        }
+        catch(const channel_closed&)
+        {
+            threw = true;
+        }
+    });
+
+    go("test_select_closed closer", [&]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pair2.writer.close();
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK(threw);
+    BOOST_CHECK(pair2.reader.is_closed());
+    BOOST_CHECK(!pair1.reader.is_closed());
+}
+
+// one coroutine merging two busy channels, nothing lost or duplicated
+BOOST_FIXTURE_TEST_CASE(test_select_merge, fixture)
+{
+    static const int MSGS = 10000;
+
+    channel_pair<int> pair1 = make_channel<int>(4);
+    channel_pair<int> pair2 = make_channel<int>(4);
+
+    for(channel_writer<int>* writer : { &pair1.writer, &pair2.writer })
+    {
+        go("test_select_merge writer", [](channel_writer<int>& w)
+        {
+            for(int i = 1; i <= MSGS; i++)
+                w.put(i);
+        }, std::move(*writer));
+    }
+
+    long sum1 = 0;
+    long sum2 = 0;
+    go("test_select_merge selector", [&](channel_reader<int>& r1, channel_reader<int>& r2)
+    {
+        // closed endpoints drop out of select
+        while(!r1.is_closed() || !r2.is_closed())
+        {
+            try
+            {
+                selector()
+                    .get(r1, [&](int v) { sum1 += v; })
+                    .get(r2, [&](int v) { sum2 += v; })
+                    .wait();
+            }
+            catch(const channel_closed&)
+            {
+            }
+        }
+    }, std::move(pair1.reader), std::move(pair2.reader));
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(sum1, long(MSGS) * (MSGS + 1) / 2);
+    BOOST_CHECK_EQUAL(sum2, long(MSGS) * (MSGS + 1) / 2);
+}
+
+}}
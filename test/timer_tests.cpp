@@ -0,0 +1,190 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/globals.hpp"
+#include "coroutines/timer_wheel.hpp"
+
+#include "test/fixtures.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <vector>
+#include <atomic>
+
+namespace coroutines { namespace tests {
+
+// every timer fires in the first advance() that reaches its tick, through all levels of the wheel
+BOOST_AUTO_TEST_CASE(test_timer_wheel_expiry)
+{
+    static const unsigned TIMERS = 20000;
+
+    std::minstd_rand generator(7);
+    std::vector<timer> timers(TIMERS);
+    std::vector<bool> removed(TIMERS, false);
+    std::vector<std::uint64_t> fired_at(TIMERS, timer_wheel::NONE);
+
+    timer_wheel wheel(1000);
+    for(unsigned i = 0; i < TIMERS; i++)
+    {
+        // spread over all levels, some beyond the wheel's range, some already due
+        unsigned bits = 4 + generator() % 30;
+        timers[i].expiry = 900 + generator() % (std::uint64_t(1) << bits);
+        if (i % 100 == 0)
+            timers[i].expiry += std::uint64_t(1) << 33;
+        wheel.add(timers[i]);
+    }
+    BOOST_CHECK_EQUAL(wheel.size(), TIMERS);
+
+    for(unsigned i = 0; i < TIMERS; i += 3)
+    {
+        wheel.remove(timers[i]);
+        removed[i] = true;
+    }
+
+    // big steps at first, then tick by tick and then jumps to the end
+    std::uint64_t now = 1000;
+    std::uint64_t last = 999;
+    while(wheel.size() > 0)
+    {
+        BOOST_REQUIRE(wheel.next_expiry() >= wheel.current());
+        std::uint64_t step = now < 5000 ? 1 : now < (1 << 20) ? generator() % 1000 : generator() % (std::uint64_t(1) << 28);
+        now += step;
+        wheel.advance(now, [&](timer& t)
+        {
+            fired_at[&t - timers.data()] = now;
+            BOOST_CHECK(!t.pending());
+            BOOST_CHECK(t.expiry <= now);
+            BOOST_CHECK(t.expiry > last || t.expiry < 1000); // not late
+        });
+        BOOST_REQUIRE_EQUAL(wheel.current(), now + 1);
+        last = now;
+    }
+
+    for(unsigned i = 0; i < TIMERS; i++)
+    {
+        if (removed[i])
+        {
+            BOOST_CHECK_EQUAL(fired_at[i], timer_wheel::NONE);
+        }
+        else
+        {
+            BOOST_CHECK(fired_at[i] >= timers[i].expiry);
+            BOOST_CHECK(fired_at[i] != timer_wheel::NONE);
+        }
+    }
+    BOOST_CHECK(last > (std::uint64_t(1) << 33));
+}
+
+// next_expiry is exact for near timers and never late for far ones
+BOOST_AUTO_TEST_CASE(test_timer_wheel_next_expiry)
+{
+    timer_wheel wheel(0);
+    BOOST_CHECK_EQUAL(wheel.next_expiry(), timer_wheel::NONE);
+
+    timer far;
+    far.expiry = 100000;
+    wheel.add(far);
+    BOOST_CHECK(wheel.next_expiry() <= far.expiry);
+
+    timer near;
+    near.expiry = 10;
+    wheel.add(near);
+    BOOST_CHECK_EQUAL(wheel.next_expiry(), 10);
+
+    unsigned fired = 0;
+    wheel.advance(9, [&](timer&) { fired++; });
+    BOOST_CHECK_EQUAL(fired, 0);
+    wheel.advance(10, [&](timer& t) { fired++; BOOST_CHECK_EQUAL(&t, &near); });
+    BOOST_CHECK_EQUAL(fired, 1);
+
+    while(wheel.size() > 0)
+    {
+        std::uint64_t next = wheel.next_expiry();
+        BOOST_REQUIRE(next <= far.expiry);
+        wheel.advance(next, [&](timer& t) { fired++; BOOST_CHECK_EQUAL(&t, &far); BOOST_CHECK_EQUAL(next, far.expiry); });
+    }
+    BOOST_CHECK_EQUAL(fired, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sleep_for, fixture)
+{
+    static const unsigned SLEEPERS = 1000;
+
+    std::atomic<unsigned> early(0);
+    std::atomic<unsigned> done(0);
+    for(unsigned i = 0; i < SLEEPERS; i++)
+    {
+        go("test_sleep_for", [&, i]()
+        {
+            auto duration = std::chrono::milliseconds(1 + i % 50);
+            auto start = std::chrono::steady_clock::now();
+            sleep_for(duration);
+            if (std::chrono::steady_clock::now() - start < duration)
+                early++;
+            done++;
+        });
+    }
+
+    wait_for_completion();
+
+    BOOST_CHECK_EQUAL(done, SLEEPERS);
+    BOOST_CHECK_EQUAL(early, 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_get_for, fixture)
+{
+    channel_pair<int> pair = make_channel<int>(1);
+
+    bool timed_out = false;
+    bool received = false;
+    int value = 0;
+    go("test_get_for reader", [&]()
+    {
+        int v;
+        timed_out = !pair.reader.get_for(v, std::chrono::milliseconds(10));
+        received = pair.reader.get_for(value, std::chrono::seconds(10));
+    });
+
+    go("test_get_for writer", [&]()
+    {
+        sleep_for(std::chrono::milliseconds(50));
+        pair.writer.put(7);
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK(timed_out);
+    BOOST_CHECK(received);
+    BOOST_CHECK_EQUAL(value, 7);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_put_for, fixture)
+{
+    channel_pair<int> pair = make_channel<int>(1);
+
+    bool first = false;
+    bool timed_out = false;
+    bool closed = false;
+    go("test_put_for", [&]()
+    {
+        first = pair.writer.put_for(1, std::chrono::milliseconds(10));
+        timed_out = !pair.writer.put_for(2, std::chrono::milliseconds(10));
+
+        pair.reader.close();
+        try
+        {
+            pair.writer.put_for(3, std::chrono::seconds(10));
+        }
+        catch(const channel_closed&)
+        {
+            closed = true;
+        }
+    });
+
+    wait_for_completion();
+
+    BOOST_CHECK(first);
+    BOOST_CHECK(timed_out);
+    BOOST_CHECK(closed);
+}
+
+}}
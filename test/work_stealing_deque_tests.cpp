@@ -0,0 +1,81 @@
+// (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
+#include "coroutines/work_stealing_deque.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <thread>
+#include <vector>
+#include <atomic>
+
+namespace coroutines { namespace tests {
+
+BOOST_AUTO_TEST_CASE(work_stealing_deque_order)
+{
+    work_stealing_deque<long> deque(2); // will have to grow
+
+    for(long i = 0; i < 10; i++)
+        deque.push(i);
+
+    BOOST_CHECK_EQUAL(deque.size(), 10);
+
+    long v = -1;
+    BOOST_REQUIRE(deque.pop(v));
+    BOOST_CHECK_EQUAL(v, 9); // owner takes newest
+    BOOST_REQUIRE(deque.steal(v));
+    BOOST_CHECK_EQUAL(v, 0); // thief takes oldest
+
+    int left = 0;
+    while(deque.pop(v))
+        left++;
+    BOOST_CHECK_EQUAL(left, 8);
+    BOOST_CHECK(!deque.steal(v));
+}
+
+// owner pushes and pops, thieves steal. Every item has to be taken exactly once
+BOOST_AUTO_TEST_CASE(work_stealing_deque_torture)
+{
+    const long ITEMS = 1000000;
+    const int THIEVES = 3;
+
+    work_stealing_deque<long> deque(16);
+    std::vector<std::atomic<int>> taken(ITEMS);
+    for(auto& t : taken)
+        t = 0;
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> thieves;
+    for(int i = 0; i < THIEVES; i++)
+    {
+        thieves.emplace_back([&]()
+        {
+            long v;
+            while(!done)
+            {
+                if (deque.steal(v))
+                    taken[v]++;
+            }
+        });
+    }
+
+    long v;
+    for(long i = 0; i < ITEMS; i++)
+    {
+        deque.push(i);
+        if (i % 3 == 0 && deque.pop(v))
+            taken[v]++;
+    }
+    while(deque.pop(v))
+        taken[v]++;
+
+    done = true;
+    for(std::thread& t : thieves)
+        t.join();
+
+    long wrong = 0;
+    for(auto& t : taken)
+        if (t != 1)
+            wrong++;
+    BOOST_CHECK_EQUAL(wrong, 0);
+}
+
+}}
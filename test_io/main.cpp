@@ -6,12 +6,23 @@
 #include "coroutines_io/io_scheduler.hpp"
 #include "coroutines_io/tcp_socket.hpp"
 #include "coroutines_io/tcp_acceptor.hpp"
+#include "coroutines_io/tcp_listener.hpp"
+#include "coroutines_io/file.hpp"
+#include "coroutines_io/udp_socket.hpp"
+#include "coroutines_io/dns_resolver.hpp"
+#include "coroutines_io/input_buffer.hpp"
+#include "coroutines_io/socket_streambuf.hpp"
 
 
 #include <boost/format.hpp>
 
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <cstring>
+
+#include <unistd.h>
 
 using namespace coroutines;
 
@@ -27,17 +38,18 @@ void _TEST_EQUAL(const T1& a, const T2& b, long line, const char* msg)
 #define TEST_EQUAL(a, b) _TEST_EQUAL(a, b,  __LINE__, #a "==" #b)
 #define RUN_TEST(test_name) std::cout << ">>> Starting test: " << #test_name << std::endl; test_name();
 
-void test_connect()
+// with 'gather', hello is sent and received in pieces, one syscall each way
+static void connect_and_send(unsigned shards, io_backend backend = io_backend::epoll, bool gather = false)
 {
     scheduler sched(4);
-    io_scheduler io_sched(sched);
+    io_scheduler io_sched(sched, shards, backend);
     set_scheduler(&sched);
     set_io_scheduler(&io_sched);
     io_sched.start();
 
     auto pair = make_channel<int>(1);
 
-    go("test_connect acceptor", [&pair]()
+    go("test_connect acceptor", [&pair, gather]()
     {
         try
         {
@@ -58,10 +70,24 @@ void test_connect()
             char buf[BUFSIZE];
 
             std::cout << "receiving...." << std::endl;
-            std::size_t received = s.read(buf, BUFSIZE);
+            std::size_t received = 0;
+            if (gather)
+            {
+                char head[2];
+                iovec iov[2] = { { head, sizeof(head) }, { buf, BUFSIZE } };
+                received = s.read_v(iov, 2); // sent with one writev, arrives together
+                TEST_EQUAL(received, 5u);
+                std::memmove(buf + 2, buf, 3);
+                std::memcpy(buf, head, 2);
+            }
+            else
+            {
+                received = s.read(buf, BUFSIZE);
+            }
 
             std::string rstr(buf, received);
             std::cout << "received: " << rstr << std::endl;
+            TEST_EQUAL(rstr, "hello");
         }
         catch(const std::exception& e)
         {
@@ -70,7 +96,7 @@ void test_connect()
 
     });
 
-    go("test_connect connector", [&pair]()
+    go("test_connect connector", [&pair, gather]()
     {
         try
         {
@@ -90,7 +116,22 @@ void test_connect()
             std::cout << "sending hello..." << std::endl;
 
             static const std::string hello = "hello";
-            std::size_t sent = s.write(hello.c_str(), hello.length());
+            std::size_t sent = 0;
+            if (gather)
+            {
+                coroutines_io::buffer b(3);
+                std::memcpy(b.begin(), "llo", 3);
+                b.set_size(3);
+
+                coroutines_io::buffer_chain chain;
+                chain.append(hello.c_str(), 2);
+                chain.append(std::move(b));
+                sent = s.write_v(chain);
+            }
+            else
+            {
+                sent = s.write(hello.c_str(), hello.length());
+            }
 
             std::cout << "sent " << sent << " bytes" << std::endl;
         }
@@ -107,9 +148,586 @@ void test_connect()
     set_scheduler(nullptr);
 }
 
+void test_connect()
+{
+    connect_and_send(1);
+}
+
+// one epoll per processor
+void test_connect_sharded()
+{
+    connect_and_send(4);
+}
+
+// completion-based, through io_uring
+void test_connect_uring()
+{
+    connect_and_send(1, io_backend::uring);
+}
+
+void test_write_v()
+{
+    connect_and_send(1, io_backend::epoll, true);
+    connect_and_send(1, io_backend::uring, true);
+}
+
+static void write_and_read_file(io_backend backend)
+{
+    scheduler sched(4);
+    io_scheduler io_sched(sched, 1, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::string path = (boost::format("/tmp/coroutines_test_file_%1%") % ::getpid()).str();
+
+    go("test_file", [&path]()
+    {
+        std::string content;
+        for(int i = 0; i < 10000; i++)
+            content += (boost::format("line %1%\n") % i).str();
+
+        {
+            file f;
+            f.open_for_writing(path);
+            TEST_EQUAL(f.write(content.c_str(), content.size()), content.size());
+            TEST_EQUAL(f.pwrite("LINE", 4, 0), 4u);
+            f.datasync();
+        }
+        content[0] = 'L'; content[1] = 'I'; content[2] = 'N'; content[3] = 'E';
+
+        file f;
+        f.open_for_reading(path);
+        f.readahead(0, content.size());
+
+        std::vector<char> buf(content.size() + 100);
+        TEST_EQUAL(f.read(buf.data(), buf.size()), content.size());
+        TEST_EQUAL(std::string(buf.data(), content.size()), content);
+
+        TEST_EQUAL(f.pread(buf.data(), 6, 7), 6u);
+        TEST_EQUAL(std::string(buf.data(), 6), "line 1");
+
+        // position not moved by pread, still at EOF
+        TEST_EQUAL(f.read(buf.data(), 1), 0u);
+    });
+
+    sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+    ::unlink(path.c_str());
+}
+
+// on I/O threads
+void test_file()
+{
+    write_and_read_file(io_backend::epoll);
+}
+
+void test_file_uring()
+{
+    write_and_read_file(io_backend::uring);
+}
+
+// file -> socket with send_file, socket -> file with splice_to
+static void send_and_splice_file(io_backend backend)
+{
+    scheduler sched(4);
+    io_scheduler io_sched(sched, 1, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::string in_path = (boost::format("/tmp/coroutines_test_send_%1%") % ::getpid()).str();
+    std::string out_path = in_path + ".out";
+
+    std::string content;
+    for(int i = 0; i < 100000; i++)
+        content += (boost::format("line %1%\n") % i).str();
+    static const std::size_t OFFSET = 7;
+
+    auto pair = make_channel<int>(1);
+
+    go("test_send_file sender", [&]()
+    {
+        {
+            file f;
+            f.open_for_writing(in_path);
+            f.write(content.c_str(), content.size());
+        }
+        file f;
+        f.open_for_reading(in_path);
+
+        tcp_acceptor acceptor;
+        acceptor.listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 22445));
+        pair.writer.put(0);
+
+        tcp_socket s = acceptor.accept();
+        TEST_EQUAL(s.send_file(f, OFFSET, content.size()), content.size() - OFFSET);
+    });
+
+    go("test_send_file receiver", [&]()
+    {
+        pair.reader.get();
+
+        tcp_socket s;
+        s.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 22445));
+
+        file out;
+        out.open_for_writing(out_path);
+        TEST_EQUAL(s.splice_to(out, content.size()), content.size() - OFFSET); // until EOF
+
+        out.close();
+        out.open_for_reading(out_path);
+        std::vector<char> buf(content.size());
+        std::size_t r = out.read(buf.data(), buf.size());
+        TEST_EQUAL(std::string(buf.data(), r), content.substr(OFFSET));
+    });
+
+    sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+    ::unlink(in_path.c_str());
+    ::unlink(out_path.c_str());
+}
+
+void test_send_file()
+{
+    send_and_splice_file(io_backend::epoll);
+    send_and_splice_file(io_backend::uring);
+}
+
+// dual-stack listener, v4 and v6 clients; happy eyeballs racing a black hole
+void test_ipv6()
+{
+    scheduler sched(4);
+    io_scheduler io_sched(sched);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    typedef boost::asio::ip::tcp::endpoint endpoint;
+    static const unsigned short PORT = 22448;
+    auto pair = make_channel<int>(1);
+
+    go("test_ipv6 acceptor", [&pair]()
+    {
+        tcp_acceptor acceptor;
+        acceptor.listen(endpoint(boost::asio::ip::address_v6::any(), PORT));
+        pair.writer.put(0);
+
+        tcp_socket v6 = acceptor.accept();
+        TEST_EQUAL(v6.remote_endpoint().address().to_string(), "::1");
+
+        tcp_socket v4 = acceptor.accept();
+        TEST_EQUAL(v4.remote_endpoint().address().to_string(), "127.0.0.1"); // not ::ffff:127.0.0.1
+
+        tcp_socket raced = acceptor.accept();
+        TEST_EQUAL(raced.remote_endpoint().address().to_string(), "127.0.0.1");
+    });
+
+    go("test_ipv6 connector", [&pair]()
+    {
+        pair.reader.get();
+
+        tcp_socket v6;
+        v6.connect(endpoint(boost::asio::ip::address_v6::loopback(), PORT));
+
+        tcp_socket v4;
+        v4.connect(endpoint(boost::asio::ip::address_v4::loopback(), PORT));
+
+        // the v6 address never answers, v4 is started after the attempt delay and wins
+        std::vector<endpoint> endpoints = {
+            endpoint(boost::asio::ip::address_v6::from_string("fd00::dead"), PORT),
+            endpoint(boost::asio::ip::address_v4::loopback(), PORT) };
+        tcp_socket raced;
+        auto start = std::chrono::steady_clock::now();
+        raced.connect(endpoints);
+        auto took = std::chrono::steady_clock::now() - start;
+        TEST_EQUAL(raced.remote_endpoint().address().to_string(), "127.0.0.1");
+        TEST_EQUAL(took < std::chrono::seconds(2), true);
+    });
+
+    sched.wait();
+    io_sched.stop();
+    sched.wait();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+}
+
+// SO_REUSEPORT acceptor per shard, connections echoed back; stop() ends the accept loops
+static void listen_and_echo(io_backend backend)
+{
+    static const unsigned SHARDS = 4;
+    static const unsigned CLIENTS = 32;
+    static const unsigned short PORT = 22449;
+
+    scheduler sched(4);
+    io_scheduler io_sched(sched, SHARDS, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::atomic<unsigned> echoed(0);
+    go("test_listener", [&echoed]()
+    {
+        tcp_listener listener;
+        listener.listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), PORT), [](tcp_socket& s)
+        {
+            char c;
+            while(s.read_some(&c, 1) == 1)
+                s.write(&c, 1);
+        }, 1024);
+
+        auto done = make_channel<int>(CLIENTS);
+        for(unsigned i = 0; i < CLIENTS; i++)
+        {
+            go("test_listener client", [&echoed](channel_writer<int>& done)
+            {
+                tcp_socket s;
+                s.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), PORT));
+                char c = 'x';
+                s.write(&c, 1);
+                c = 0;
+                s.read(&c, 1);
+                if (c == 'x')
+                    echoed++;
+                done.put(0);
+            }, done.writer);
+        }
+        for(unsigned i = 0; i < CLIENTS; i++)
+            done.reader.get();
+
+        listener.stop();
+    });
+
+    sched.wait(); // hangs if the loops didn't end
+    TEST_EQUAL(echoed.load(), CLIENTS);
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+}
+
+void test_listener()
+{
+    listen_and_echo(io_backend::epoll);
+    listen_and_echo(io_backend::uring);
+}
+
+// a coroutine parked reading a socket is woken with ECANCELED when another one closes it
+static void close_while_reading(io_backend backend)
+{
+    static const unsigned short PORT = 22452;
+
+    scheduler sched(4);
+    io_scheduler io_sched(sched, 1, backend);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    auto listening = make_channel<int>(1);
+    auto accepted = make_channel<int>(1);
+    auto woken = make_channel<int>(1);
+    std::unique_ptr<tcp_socket> socket;
+    std::atomic<int> error(0);
+
+    go("test_close reader", [&]()
+    {
+        tcp_acceptor acceptor;
+        acceptor.listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), PORT));
+        listening.writer.put(0);
+        socket.reset(new tcp_socket(acceptor.accept()));
+        accepted.writer.put(0);
+
+        char c;
+        try
+        {
+            socket->read_some(&c, 1); // nothing is ever sent
+        }
+        catch(const std::system_error& e)
+        {
+            error = e.code().value();
+        }
+        woken.writer.put(0);
+    });
+
+    go("test_close closer", [&]()
+    {
+        tcp_socket s;
+        listening.reader.get();
+        s.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), PORT));
+        accepted.reader.get();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // until the reader parks
+        socket->close();
+
+        woken.reader.get(); // the peer stays connected meanwhile
+    });
+
+    sched.wait(); // hangs if the reader was lost
+    TEST_EQUAL(error.load(), ECANCELED);
+    socket.reset();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+}
+
+void test_close_while_reading()
+{
+    close_while_reading(io_backend::epoll);
+}
+
+void test_close_while_reading_uring()
+{
+    close_while_reading(io_backend::uring);
+}
+
+// minimal name server: A records from the table, no AAAA, NXDOMAIN for unknown names.
+// 'slow' answers late, 'blackhole' never. Counts the queries, ends on a "quit" datagram
+static void stub_name_server(udp_socket& sock, std::atomic<unsigned>& queries)
+{
+    struct record { const char* name; unsigned char address[4]; std::uint32_t ttl; };
+    static const record RECORDS[] = {
+        { "www.example.test", { 10, 0, 0, 1 }, 60 },
+        { "short.example.test", { 10, 0, 0, 2 }, 1 },
+        { "slow.example.test", { 10, 0, 0, 3 }, 60 },
+    };
+
+    char buf[512];
+    for(;;)
+    {
+        udp_socket::endpoint_type from;
+        std::size_t size = sock.receive_from(buf, sizeof(buf), from);
+        if (std::string(buf, size) == "quit")
+            return;
+        queries++;
+
+        // question: labels from offset 12, then type and class
+        std::string name;
+        std::size_t pos = 12;
+        while(buf[pos])
+        {
+            if (!name.empty())
+                name += '.';
+            name.append(buf + pos + 1, std::size_t(buf[pos]));
+            pos += buf[pos] + 1;
+        }
+        pos += 5;
+        int type = (unsigned char)buf[pos - 3];
+
+        if (name == "blackhole.example.test")
+            continue;
+        if (name == "slow.example.test")
+            coroutines::sleep_for(std::chrono::milliseconds(100));
+
+        std::string reply(buf, pos);
+        reply[2] = char(0x81); // response, recursion desired
+        reply[3] = char(0x83); // recursion available, NXDOMAIN
+        for(const record& r : RECORDS)
+        {
+            if (name != r.name)
+                continue;
+            reply[3] = char(0x80);
+            if (type == 1)
+            {
+                reply[7] = 1; // one answer
+                const char answer[] = {
+                    char(0xc0), 12, 0, 1, 0, 1,
+                    char(r.ttl >> 24), char(r.ttl >> 16), char(r.ttl >> 8), char(r.ttl),
+                    0, 4, char(r.address[0]), char(r.address[1]), char(r.address[2]), char(r.address[3]) };
+                reply.append(answer, sizeof(answer));
+            }
+        }
+        sock.send_to(reply.data(), reply.size(), from);
+    }
+}
+
+static dns_error::status_type resolve_error(dns_resolver& resolver, const std::string& name)
+{
+    try
+    {
+        resolver.resolve(name);
+    }
+    catch(const dns_error& e)
+    {
+        return e.status();
+    }
+    return dns_error::status_type(-1);
+}
+
+void test_dns()
+{
+    static const unsigned short PORT = 22450;
+    static const unsigned FOLLOWERS = 4;
+
+    scheduler sched(4);
+    io_scheduler io_sched(sched);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    std::atomic<unsigned> queries(0);
+    go("test_dns", [&queries]()
+    {
+        boost::asio::ip::udp::endpoint server(boost::asio::ip::address_v4::loopback(), PORT);
+        udp_socket server_socket;
+        server_socket.bind(server);
+        go("test_dns name server", stub_name_server, std::move(server_socket), std::ref(queries));
+
+        dns_config config;
+        config.nameservers.push_back(server);
+        config.search.push_back("example.test");
+        config.timeout = std::chrono::milliseconds(500);
+        config.attempts = 1;
+        config.hosts.emplace("myhost", boost::asio::ip::address_v4::from_string("10.9.9.9"));
+        dns_resolver resolver(get_io_scheduler_check(), config);
+
+        // A and AAAA both asked, then cached
+        std::vector<dns_resolver::address_type> addresses = resolver.resolve("WWW.example.test.");
+        TEST_EQUAL(addresses.size(), 1u);
+        TEST_EQUAL(addresses[0].to_string(), "10.0.0.1");
+        TEST_EQUAL(queries.load(), 2u);
+        TEST_EQUAL(resolver.resolve("www.example.test")[0].to_string(), "10.0.0.1");
+        TEST_EQUAL(resolver.resolve("www")[0].to_string(), "10.0.0.1"); // search list
+        TEST_EQUAL(queries.load(), 2u);
+        TEST_EQUAL(resolver.get_stats().cache_hits, 2u);
+
+        // no queries for these
+        TEST_EQUAL(resolver.resolve("myhost")[0].to_string(), "10.9.9.9");
+        TEST_EQUAL(resolver.resolve("::1")[0].to_string(), "::1");
+        TEST_EQUAL(queries.load(), 2u);
+
+        TEST_EQUAL(resolve_error(resolver, "missing.example.test"), dns_error::not_found);
+        TEST_EQUAL(resolve_error(resolver, "blackhole.example.test"), dns_error::timed_out);
+
+        // one query for all of them
+        unsigned before = queries;
+        auto done = make_channel<std::string>(FOLLOWERS);
+        for(unsigned i = 0; i < FOLLOWERS; i++)
+        {
+            go("test_dns lookup", [&resolver](channel_writer<std::string>& done)
+            {
+                done.put(resolver.resolve("slow.example.test")[0].to_string());
+            }, done.writer);
+        }
+        for(unsigned i = 0; i < FOLLOWERS; i++)
+            TEST_EQUAL(done.reader.get(), "10.0.0.3");
+        TEST_EQUAL(queries - before, 2u);
+        TEST_EQUAL(resolver.get_stats().coalesced, FOLLOWERS - 1);
+
+        // asked again after the TTL
+        resolver.resolve("short.example.test");
+        before = queries;
+        coroutines::sleep_for(std::chrono::milliseconds(1100));
+        TEST_EQUAL(resolver.resolve("short.example.test")[0].to_string(), "10.0.0.2");
+        TEST_EQUAL(queries - before, 2u);
+
+        udp_socket client;
+        client.open(AF_INET);
+        client.send_to("quit", 4, server);
+    });
+
+    sched.wait(); // hangs if the resolver left its receiver running
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+}
+
+// delimiters split between reads, a message larger than the buffer, then the same through the stream buffer
+void test_input_buffer()
+{
+    static const unsigned short PORT = 22451;
+    static const std::size_t LARGE = 100000;
+
+    scheduler sched(4);
+    io_scheduler io_sched(sched);
+    set_scheduler(&sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
+
+    auto listening = make_channel<int>(1);
+    go("test_input_buffer sender", [&listening]()
+    {
+        tcp_acceptor acceptor;
+        acceptor.listen(tcp_acceptor::endpoint_type(boost::asio::ip::address_v4::loopback(), PORT));
+        listening.writer.put(0);
+
+        for(int connection = 0; connection < 2; connection++)
+        {
+            tcp_socket s = acceptor.accept();
+            const std::string pieces[] = { "ab", "c\r", "\nxyz\r\n", std::string(LARGE, 'x') + "\r\n" };
+            for(const std::string& piece : pieces)
+            {
+                s.write(piece.data(), piece.size());
+                coroutines::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    });
+
+    go("test_input_buffer receiver", [&listening]()
+    {
+        listening.reader.get();
+        {
+            tcp_socket s;
+            s.connect(tcp_socket::endpoint_type(boost::asio::ip::address_v4::loopback(), PORT));
+
+            coroutines_io::input_buffer in(16);
+            TEST_EQUAL(in.read_until(s, "\r\n"), 5u);
+            TEST_EQUAL(in.view().substr(0, 5), "abc\r\n");
+            in.consume(5);
+            TEST_EQUAL(in.read_until(s, "\r\n"), 5u);
+            TEST_EQUAL(std::string(in.data(), 3), "xyz");
+            in.consume(5);
+            TEST_EQUAL(in.read_until(s, "\r\n"), LARGE + 2);
+            TEST_EQUAL(in.capacity() >= LARGE + 2, true);
+            in.consume(LARGE + 2);
+            TEST_EQUAL(in.read_until(s, "\r\n"), 0u); // EOF
+        }
+        {
+            tcp_socket s;
+            s.connect(tcp_socket::endpoint_type(boost::asio::ip::address_v4::loopback(), PORT));
+
+            socket_istreambuf buf(s);
+            std::istream stream(&buf);
+            std::string line;
+            std::getline(stream, line);
+            TEST_EQUAL(line, "abc\r");
+            stream.unget();
+            TEST_EQUAL(char(stream.get()), '\n');
+            std::getline(stream, line);
+            TEST_EQUAL(line, "xyz\r");
+            std::string large(LARGE, 0);
+            stream.read(&large[0], LARGE);
+            TEST_EQUAL(std::size_t(stream.gcount()), LARGE);
+            TEST_EQUAL(large, std::string(LARGE, 'x'));
+            std::getline(stream, line);
+            TEST_EQUAL(line, "\r");
+            TEST_EQUAL(stream.get(), std::char_traits<char>::eof());
+        }
+    });
+
+    sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
+    set_scheduler(nullptr);
+}
+
 int main(int , char** )
 {
     RUN_TEST(test_connect);
+    RUN_TEST(test_connect_sharded);
+    RUN_TEST(test_connect_uring);
+    RUN_TEST(test_write_v);
+    RUN_TEST(test_file);
+    RUN_TEST(test_file_uring);
+    RUN_TEST(test_send_file);
+    RUN_TEST(test_ipv6);
+    RUN_TEST(test_listener);
+    RUN_TEST(test_close_while_reading);
+    RUN_TEST(test_close_while_reading_uring);
+    RUN_TEST(test_dns);
+    RUN_TEST(test_input_buffer);
 
     std::cout << "test completed" << std::endl;
 }
@@ -1,6 +1,9 @@
 // (c) 2013 Maciej Gajewski, <maciej.gajewski0@gmail.com>
 
 #include "coroutines/globals.hpp"
+#include "coroutines_io/globals.hpp"
+#include "coroutines_io/io_scheduler.hpp"
+#include "coroutines_io/file.hpp"
 
 #include "parallel.hpp"
 #include "lzma_decompress.hpp"
@@ -11,8 +14,6 @@
 
 #include <signal.h>
 
-#include <stdio.h>
-
 
 using namespace coroutines;
 namespace bfs = boost::filesystem;
@@ -22,43 +23,6 @@ namespace torture {
 static const unsigned BUFFERS = 8;
 static const unsigned BUFFER_SIZE = 100*1024;
 
-class file
-{
-public:
-
-    file(const char* path, const char* mode)
-    {
-        _f = ::fopen(path, mode);
-        if (!_f)
-            throw std::runtime_error("Unable to open file");
-    }
-
-    ~file()
-    {
-        ::fclose(_f);
-    }
-
-    std::size_t read(void* buf, std::size_t max)
-    {
-        block();
-            std::size_t r = ::fread(buf, 1, max, _f);
-        unblock();
-        return r;
-    }
-
-    std::size_t write(void* buf, std::size_t size)
-    {
-        block();
-            std::size_t r = ::fwrite(buf, size, 1, _f);
-        unblock();
-        return r;
-    }
-
-private:
-
-    FILE* _f = nullptr;
-};
-
 void process_file(const bfs::path& in_path, const bfs::path& out_path);
 void write_output(buffer_reader& decompressed, buffer_writer& decompressed_return, const bfs::path& output_file);
 void read_input(buffer_writer& compressed, buffer_reader& compressed_return, const bfs::path& input_file);
@@ -80,6 +44,9 @@ void parallel(const char* in, const char* out)
 
     scheduler sched(4 /*threads*/); // Go: runtime.MAXPROC(4)
     set_scheduler(&sched);
+    io_scheduler io_sched(sched);
+    set_io_scheduler(&io_sched);
+    io_sched.start();
 
     try
     {
@@ -104,6 +71,8 @@ void parallel(const char* in, const char* out)
     }
 
     sched.wait();
+    io_sched.stop();
+    set_io_scheduler(nullptr);
     set_scheduler(nullptr);
 }
 
@@ -134,7 +103,9 @@ void read_input(buffer_writer& compressed, buffer_reader& compressed_return, con
 {
     try
     {
-        file f(input_file.string().c_str(), "rb");
+        file f;
+        f.open_for_reading(input_file.string());
+        f.readahead(0, BUFFERS*BUFFER_SIZE);
 
         unsigned counter = 0;
         for(;;)
@@ -166,7 +137,8 @@ void write_output(buffer_reader& decompressed, buffer_writer& decompressed_retur
     try
     {
         // open file
-        file f(output_file.string().c_str(), "wb");
+        file f;
+        f.open_for_writing(output_file.string());
 
         // fill the queue with allocated buffers
         for(unsigned i = 0; i < BUFFERS; i++)